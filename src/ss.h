@@ -6,8 +6,29 @@
 #include <uv.h>
 #include <gtest/gtest_prod.h>
 #include "ss/encrypt.h"
+#include "ss/calibration.h"
+#include "ss/buffer.h"
+#include "ss/zerocopy.h"
+#include "ss/awaitable.h"
+#include "ss/ratelimit.h"
+#include "ss/socket.h"
+#include "ss/egress.h"
+#include "ss/upstream.h"
+#include "ss/rules.h"
+#include "ss/resolver.h"
+#include "ss/local.h"
+#include "ss/config.h"
+#include "ss/stats.h"
+#include "ss/histogram.h"
+#include "ss/recorder.h"
+#include "ss/profiler.h"
+#include "ss/scheduler.h"
+#include "ss/admission.h"
+#include "ss/header.h"
 #include "ss/handle.h"
 #include "ss/server.h"
+#include "ss/handoff.h"
+#include "ss/relay.h"
 
 #ifndef SHADESOCKS_SS_H_
 #define SHADESOCKS_SS_H_
@@ -0,0 +1,158 @@
+#ifndef SHADESOCKS_SRC_SS_ADMISSION_H_
+#define SHADESOCKS_SRC_SS_ADMISSION_H_
+
+#include <uv.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include "buffer.h"
+#include "stats.h"
+
+namespace shadesocks {
+
+// Limits on what a listener takes on, zero values leave a limit out.
+struct AdmissionOptions {
+  // connections relayed at once by the listener
+  size_t max_connections = 0;
+  // connections relayed at once by all listeners of the loop
+  size_t max_loop_connections = 0;
+  // lookups and connects of the listener in flight at once, a request beyond it is shed
+  size_t max_pending = 0;
+  // milliseconds the loop may run behind before new connections are shed
+  uint64_t max_loop_lag = 0;
+  // bytes of relay buffers in use on the loop before new connections are shed
+  size_t max_buffer_memory = 0;
+  // new connections over a limit wait in the kernel backlog instead of being reset
+  bool pause_accept = false;
+
+  bool Empty() const {
+    return max_connections == 0 && max_loop_connections == 0 && max_pending == 0 &&
+        max_loop_lag == 0 && max_buffer_memory == 0;
+  }
+};
+
+// Admission control of one listener. A new connection over a limit is shed:
+// reset right after the accept so that the client can fail over at once, or
+// with pause_accept left in the backlog until the load has dropped again.
+// Turning work away early keeps the loop serving the connections it has taken
+// on in time, instead of slowing all of them down until every client gives up.
+class Admission final {
+ public:
+  using Resume = void (*)(void* owner);
+
+  //how often the loop lag is sampled and a paused listener looks again
+  static constexpr uint64_t kProbeInterval = 10;
+
+  Admission() = default;
+  Admission(const Admission&) = delete;
+  Admission& operator=(const Admission&) = delete;
+
+  ~Admission() {
+    this->Stop();
+  }
+
+  //the lag is only sampled when it is limited or accepting may be paused
+  void Start(uv_loop_t* loop, const AdmissionOptions& options, Resume resume, void* owner) {
+    this->Stop();
+    this->options = options;
+    this->resume = resume;
+    this->owner = owner;
+    if (options.max_loop_lag == 0 && !options.pause_accept) {
+      return;
+    }
+    this->timer = new uv_timer_t{};
+    uv_timer_init(loop, this->timer);
+    this->timer->data = this;
+    this->probe_due = uv_hrtime() + kProbeInterval * 1000000;
+    uv_timer_start(this->timer, Probe, kProbeInterval, kProbeInterval);
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->timer));
+  }
+
+  //the timer is freed once closed, the listener may be gone by then
+  void Stop() {
+    if (this->timer == nullptr) {
+      return;
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(this->timer), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_timer_t*>(handle);
+    });
+    this->timer = nullptr;
+  }
+
+  // why a new connection would be shed now, ShedReasonCount when it may be taken
+  ShedReason Check() const {
+    auto& options = this->options;
+    if (options.max_connections > 0 && this->connections >= options.max_connections) {
+      return ShedReason::ListenerFull;
+    }
+    if (options.max_loop_connections > 0 && Stats::Local().LiveConnections() >= options.max_loop_connections) {
+      return ShedReason::LoopFull;
+    }
+    if (options.max_loop_lag > 0 && this->lag >= options.max_loop_lag) {
+      return ShedReason::LoopLag;
+    }
+    if (options.max_buffer_memory > 0 &&
+        BufferPool::Local().InUse() * BufferPool::kBufferSize >= options.max_buffer_memory) {
+      return ShedReason::MemoryPressure;
+    }
+    return ShedReason::ShedReasonCount;
+  }
+
+  //connections of the listener from their creation until they are freed
+  void Opened() { this->connections++; }
+  void Closed() { this->connections--; }
+
+  //a lookup or connect starts, false when it has to be shed instead
+  bool BeginPending() {
+    if (this->options.max_pending > 0 && this->pending >= this->options.max_pending) {
+      return false;
+    }
+    this->pending++;
+    return true;
+  }
+  void EndPending() { this->pending--; }
+
+  //the listener stops accepting until a probe finds the load below the limits
+  void Pause() {
+    this->paused = true;
+    this->pauses++;
+  }
+
+  bool Paused() const { return this->paused; }
+  size_t Connections() const { return this->connections; }
+  size_t Pending() const { return this->pending; }
+  //milliseconds, decays by half with every probe which finds the loop on time
+  uint64_t Lag() const { return this->lag; }
+  uint64_t Pauses() const { return this->pauses; }
+
+ private:
+  AdmissionOptions options;
+  Resume resume = nullptr;
+  void* owner = nullptr;
+
+  uv_timer_t* timer = nullptr;
+  //when the next probe should run if the loop kept up, in nanoseconds
+  uint64_t probe_due = 0;
+  uint64_t lag = 0;
+
+  size_t connections = 0;
+  size_t pending = 0;
+  bool paused = false;
+  uint64_t pauses = 0;
+
+  static void Probe(uv_timer_t* timer) {
+    auto admission = reinterpret_cast<Admission*>(timer->data);
+    auto now = uv_hrtime();
+    //the loop was busy for as long as the probe ran late
+    uint64_t late = now > admission->probe_due ? (now - admission->probe_due) / 1000000 : 0;
+    admission->lag = std::max(late, admission->lag / 2);
+    admission->probe_due = now + kProbeInterval * 1000000;
+    if (admission->paused && admission->Check() == ShedReason::ShedReasonCount) {
+      admission->paused = false;
+      admission->resume(admission->owner);
+    }
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_ADMISSION_H_
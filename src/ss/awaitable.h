@@ -0,0 +1,352 @@
+#ifndef SHADESOCKS_SRC_SS_AWAITABLE_H_
+#define SHADESOCKS_SRC_SS_AWAITABLE_H_
+
+// The coroutine relay needs C++20, the rest of the library builds without it.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define SHADESOCKS_COROUTINES 1
+#endif
+
+#ifdef SHADESOCKS_COROUTINES
+#include <uv.h>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <string>
+#include <vector>
+#include "buffer.h"
+
+namespace shadesocks {
+
+// Coroutine frames of the loop thread, recycled by size like the buffers so
+// that a new connection does not go to the heap for them.
+class FramePool final {
+ public:
+  static constexpr size_t kGranularity = 64;
+  static constexpr size_t kClasses = 32;
+
+  static FramePool& Local() {
+    thread_local FramePool pool;
+    return pool;
+  }
+
+  void* Allocate(size_t size) {
+    this->in_use++;
+    this->in_use_bytes += size;
+    auto index = Class(size);
+    if (index >= kClasses) {
+      return ::operator new(size);
+    }
+    auto& free = this->free[index];
+    if (free.empty()) {
+      return ::operator new((index + 1) * kGranularity);
+    }
+    auto frame = free.back();
+    free.pop_back();
+    return frame;
+  }
+
+  void Free(void* frame, size_t size) {
+    this->in_use--;
+    this->in_use_bytes -= size;
+    auto index = Class(size);
+    if (index >= kClasses || this->free[index].size() >= kMaxCached) {
+      ::operator delete(frame);
+      return;
+    }
+    this->free[index].push_back(frame);
+  }
+
+  size_t InUse() const { return this->in_use; }
+  size_t InUseBytes() const { return this->in_use_bytes; }
+
+  size_t Cached() const {
+    size_t cached = 0;
+    for (auto& free : this->free) {
+      cached += free.size();
+    }
+    return cached;
+  }
+
+  FramePool(const FramePool&) = delete;
+  FramePool& operator=(const FramePool&) = delete;
+
+  ~FramePool() {
+    for (auto& free : this->free) {
+      for (auto frame : free) {
+        ::operator delete(frame);
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxCached = 1024;
+
+  std::vector<void*> free[kClasses];
+  size_t in_use = 0;
+  size_t in_use_bytes = 0;
+
+  FramePool() = default;
+
+  static size_t Class(size_t size) {
+    return (size + kGranularity - 1) / kGranularity - 1;
+  }
+};
+
+// A coroutine which starts right away and frees its frame when it returns,
+// nobody waits for it.
+struct Task {
+  struct promise_type {
+    Task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    static void* operator new(size_t size) {
+      return FramePool::Local().Allocate(size);
+    }
+
+    static void operator delete(void* frame, size_t size) {
+      FramePool::Local().Free(frame, size);
+    }
+  };
+};
+
+class ReadAwaiter;
+
+// A tcp handle read and written by coroutines. Only one read waits on it at
+// a time, and that read is resumed with UV_ECANCELED when the handle closes.
+struct CoroStream {
+  uv_tcp_t tcp;
+  ReadAwaiter* reading = nullptr;
+  void* owner = nullptr;
+  //called once the handle is closed
+  void (*closed)(void* owner) = nullptr;
+
+  void Init(uv_loop_t* loop, void* owner, void (*closed)(void*)) {
+    uv_tcp_init(loop, &this->tcp);
+    this->tcp.data = this;
+    this->owner = owner;
+    this->closed = closed;
+  }
+
+  uv_stream_t* stream() { return reinterpret_cast<uv_stream_t*>(&this->tcp); }
+  uv_handle_t* handle() { return reinterpret_cast<uv_handle_t*>(&this->tcp); }
+
+  inline void Close();
+};
+
+// resumes with the bytes read into the chunk, or a negative error
+class ReadAwaiter {
+ public:
+  ReadAwaiter(CoroStream& stream, Chunk& chunk) : stream(stream), chunk(chunk) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    this->stream.reading = this;
+    int err = uv_read_start(this->stream.stream(), AllocBuffer, ReadDone);
+    if (err) {
+      this->stream.reading = nullptr;
+      this->result = err;
+      return false;
+    }
+    return true;
+  }
+
+  ssize_t await_resume() const noexcept { return this->result; }
+
+  void Resume(ssize_t result) {
+    this->stream.reading = nullptr;
+    this->result = result;
+    this->handle.resume();
+  }
+
+ private:
+  CoroStream& stream;
+  Chunk& chunk;
+  std::coroutine_handle<> handle;
+  ssize_t result = 0;
+
+  //the buffer is taken from the pool on demand and leaves room for an iv
+  static void AllocBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    auto& chunk = reinterpret_cast<CoroStream*>(handle->data)->reading->chunk;
+    if (chunk.buffer == nullptr) {
+      chunk.buffer = BufferPool::Local().Acquire();
+    }
+    buf->base = chunk.buffer + BufferPool::kHeadroom;
+    buf->len = BufferPool::kBufferSize - BufferPool::kHeadroom;
+  }
+
+  static void ReadDone(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    if (nread == 0) {
+      return;
+    }
+    uv_read_stop(stream);
+    auto reader = reinterpret_cast<CoroStream*>(stream->data)->reading;
+    if (nread > 0) {
+      reader->chunk.data = buf->base;
+      reader->chunk.length = nread;
+    } else {
+      reader->chunk.Release();
+    }
+    reader->Resume(nread);
+  }
+};
+
+inline void CoroStream::Close() {
+  uv_close(this->handle(), [](uv_handle_t* handle) {
+    auto stream = reinterpret_cast<CoroStream*>(handle->data);
+    if (stream->reading != nullptr) {
+      stream->reading->Resume(UV_ECANCELED);
+    }
+    stream->closed(stream->owner);
+  });
+}
+
+// resumes with 0 or a negative error once the whole buffer is written
+class WriteAwaiter {
+ public:
+  WriteAwaiter(CoroStream& stream, const char* data, size_t length)
+      : stream(stream), buf(uv_buf_init(const_cast<char*>(data), length)) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    this->req.data = this;
+    this->result = uv_write(&this->req, this->stream.stream(), &this->buf, 1, [](uv_write_t* req, int status) {
+      auto writer = reinterpret_cast<WriteAwaiter*>(req->data);
+      writer->result = status;
+      writer->handle.resume();
+    });
+    return this->result == 0;
+  }
+
+  int await_resume() const noexcept { return this->result; }
+
+ private:
+  CoroStream& stream;
+  uv_buf_t buf;
+  uv_write_t req;
+  std::coroutine_handle<> handle;
+  int result = 0;
+};
+
+// resumes with 0 or a negative error once the FIN follows the pending writes
+class ShutdownAwaiter {
+ public:
+  explicit ShutdownAwaiter(CoroStream& stream) : stream(stream) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    this->req.data = this;
+    this->result = uv_shutdown(&this->req, this->stream.stream(), [](uv_shutdown_t* req, int status) {
+      auto shutdown = reinterpret_cast<ShutdownAwaiter*>(req->data);
+      shutdown->result = status;
+      shutdown->handle.resume();
+    });
+    return this->result == 0;
+  }
+
+  int await_resume() const noexcept { return this->result; }
+
+ private:
+  CoroStream& stream;
+  uv_shutdown_t req;
+  std::coroutine_handle<> handle;
+  int result = 0;
+};
+
+// resumes with 0 or a negative error once connected
+class ConnectAwaiter {
+ public:
+  ConnectAwaiter(CoroStream& stream, const sockaddr_in& addr) : stream(stream), addr(addr) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    this->req.data = this;
+    this->result = uv_tcp_connect(&this->req, &this->stream.tcp, reinterpret_cast<const sockaddr*>(&this->addr),
+                                  [](uv_connect_t* req, int status) {
+                                    auto connector = reinterpret_cast<ConnectAwaiter*>(req->data);
+                                    connector->result = status;
+                                    connector->handle.resume();
+                                  });
+    return this->result == 0;
+  }
+
+  int await_resume() const noexcept { return this->result; }
+
+ private:
+  CoroStream& stream;
+  sockaddr_in addr;
+  uv_connect_t req;
+  std::coroutine_handle<> handle;
+  int result = 0;
+};
+
+// resumes with 0 and the first IPv4 address of the host in addr, or a
+// negative error. The request is published in pending while it runs so that
+// it can be cancelled with uv_cancel.
+class ResolveAwaiter {
+ public:
+  ResolveAwaiter(uv_loop_t* loop, std::string host, sockaddr_in& addr, uv_getaddrinfo_t*& pending)
+      : loop(loop), host(std::move(host)), addr(addr), pending(pending) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle = handle;
+    this->req.data = this;
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    this->result = uv_getaddrinfo(this->loop, &this->req, ResolveDone, this->host.c_str(), nullptr, &hints);
+    if (this->result == 0) {
+      this->pending = &this->req;
+    }
+    return this->result == 0;
+  }
+
+  int await_resume() const noexcept { return this->result; }
+
+ private:
+  uv_loop_t* loop;
+  std::string host;
+  sockaddr_in& addr;
+  uv_getaddrinfo_t*& pending;
+  uv_getaddrinfo_t req;
+  std::coroutine_handle<> handle;
+  int result = 0;
+
+  static void ResolveDone(uv_getaddrinfo_t* req, int status, addrinfo* addr_info) {
+    auto resolver = reinterpret_cast<ResolveAwaiter*>(req->data);
+    resolver->pending = nullptr;
+    resolver->result = status;
+    if (status == 0) {
+      auto found = addr_info;
+      while (found != nullptr && found->ai_family != AF_INET) {
+        found = found->ai_next;
+      }
+      if (found == nullptr) {
+        resolver->result = UV_EAI_ADDRFAMILY;
+      } else {
+        auto port = resolver->addr.sin_port;
+        memcpy(&resolver->addr, found->ai_addr, sizeof(sockaddr_in));
+        resolver->addr.sin_port = port;
+      }
+    }
+    uv_freeaddrinfo(addr_info);
+    resolver->handle.resume();
+  }
+};
+
+}  // namespace shadesocks
+#endif  // SHADESOCKS_COROUTINES
+#endif //SHADESOCKS_SRC_SS_AWAITABLE_H_
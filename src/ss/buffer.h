@@ -0,0 +1,79 @@
+#ifndef SHADESOCKS_SRC_SS_BUFFER_H_
+#define SHADESOCKS_SRC_SS_BUFFER_H_
+
+#include <sys/types.h>
+#include <cstddef>
+#include <vector>
+
+namespace shadesocks {
+
+// Fixed size relay buffers shared by all connections of one loop thread.
+// A connection only holds a buffer while a chunk is being read, transformed
+// and written, so idle connections do not pin any memory.
+class BufferPool final {
+ public:
+  static constexpr size_t kBufferSize = 16 * 1024;
+  // reserved in front of every read so the IV can be prepended in place
+  static constexpr size_t kHeadroom = 32;
+
+  static BufferPool& Local() {
+    thread_local BufferPool pool;
+    return pool;
+  }
+
+  char* Acquire() {
+    this->in_use++;
+    if (this->free_list.empty()) {
+      return new char[kBufferSize];
+    }
+    char* buffer = this->free_list.back();
+    this->free_list.pop_back();
+    return buffer;
+  }
+
+  void Release(char* buffer) {
+    if (buffer == nullptr) {
+      return;
+    }
+    this->in_use--;
+    if (this->free_list.size() >= kMaxCached) {
+      delete[] buffer;
+    } else {
+      this->free_list.push_back(buffer);
+    }
+  }
+
+  size_t InUse() const { return this->in_use; }
+  size_t Cached() const { return this->free_list.size(); }
+
+  ~BufferPool() {
+    for (auto buffer : this->free_list) {
+      delete[] buffer;
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxCached = 1024;
+
+  std::vector<char*> free_list;
+  size_t in_use = 0;
+
+  BufferPool() = default;
+};
+
+// a pooled buffer and the part of it which still has to be written
+struct Chunk {
+  char* buffer = nullptr;
+  char* data = nullptr;
+  ssize_t length = 0;
+
+  void Release() {
+    BufferPool::Local().Release(this->buffer);
+    this->buffer = nullptr;
+    this->data = nullptr;
+    this->length = 0;
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_BUFFER_H_
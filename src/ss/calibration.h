@@ -0,0 +1,247 @@
+#ifndef SHADESOCKS_SRC_SS_CALIBRATION_H_
+#define SHADESOCKS_SRC_SS_CALIBRATION_H_
+
+#include <uv.h>
+#include <glog/logging.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "encrypt.h"
+#include "buffer.h"
+
+namespace shadesocks {
+
+// How fast every method of cipher_map encrypts on this host, in MB/s, for a
+// small interactive chunk and a full relay buffer. Which method wins depends
+// on the CPU, AES instructions make the AES modes several times faster than
+// the stream ciphers while hosts without them favour chacha20. The ciphers
+// are run like the relay runs them, in place on a key schedule.
+//
+// Calibrating takes a short while, so the results are kept in a file and a
+// later start only reads them, as long as they were measured on the same CPU.
+class CipherCalibration final {
+ public:
+  static constexpr uint32_t kVersion = 1;
+  static constexpr size_t kSmallChunk = 512;
+  static constexpr size_t kLargeChunk = BufferPool::kBufferSize - BufferPool::kHeadroom;
+  //milliseconds every method runs at every chunk size
+  static constexpr uint64_t kRunTime = 20;
+
+  struct Throughput {
+    double small = 0;
+    double large = 0;
+  };
+
+  // measures every method, run_time milliseconds per method and chunk size
+  void Run(uint64_t run_time = kRunTime) {
+    this->results.clear();
+    for (auto& method : cipher_map) {
+      auto& throughput = this->results[method.first];
+      throughput.small = Measure(method.first, kSmallChunk, run_time);
+      throughput.large = Measure(method.first, kLargeChunk, run_time);
+    }
+    this->fingerprint = HostFingerprint();
+  }
+
+  // reads the results of an earlier run, -ESTALE when they were measured on
+  // another CPU or miss a method, -EINVAL when the file is not readable as such
+  int Load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+      return errno ? -errno : -ENOENT;
+    }
+    std::string magic;
+    uint32_t version = 0;
+    std::string fingerprint;
+    if (!(in >> magic >> version >> fingerprint) || magic != "shadesocks-ciphers" || version != kVersion) {
+      return -EINVAL;
+    }
+    std::map<std::string, Throughput> loaded;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      std::istringstream fields(line);
+      std::string method;
+      Throughput throughput;
+      if (!(fields >> method >> throughput.small >> throughput.large)) {
+        return -EINVAL;
+      }
+      loaded[method] = throughput;
+    }
+    if (fingerprint != HostFingerprint()) {
+      return -ESTALE;
+    }
+    for (auto& cipher : cipher_map) {
+      if (loaded.find(cipher.first) == loaded.end()) {
+        return -ESTALE;
+      }
+    }
+    this->results = std::move(loaded);
+    this->fingerprint = fingerprint;
+    return 0;
+  }
+
+  // written to a temporary file first, a crash leaves the old results
+  int Save(const std::string& path) const {
+    if (this->results.empty()) {
+      return -EINVAL;
+    }
+    auto temporary = path + ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::trunc);
+      if (!out) {
+        return -errno;
+      }
+      out << "shadesocks-ciphers " << kVersion << " " << this->fingerprint << "\n";
+      for (auto& result : this->results) {
+        out << result.first << " " << result.second.small << " " << result.second.large << "\n";
+      }
+      if (!out.flush()) {
+        return -EIO;
+      }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+      int err = -errno;
+      std::remove(temporary.c_str());
+      return err;
+    }
+    return 0;
+  }
+
+  // the results cached at the path, or a new run which is cached there; a
+  // cache which cannot be written is only logged
+  void LoadOrRun(const std::string& path, uint64_t run_time = kRunTime) {
+    int err = this->Load(path);
+    if (err == 0) {
+      LOG(INFO) << "cipher calibration read from " << path;
+      return;
+    }
+    LOG(INFO) << "calibrate the ciphers, the results at " << path << " are unusable: " << uv_strerror(err);
+    this->Run(run_time);
+    err = this->Save(path);
+    if (err) {
+      LOG(WARNING) << "cannot cache the cipher calibration at " << path << ": " << uv_strerror(err);
+    }
+  }
+
+  bool Empty() const { return this->results.empty(); }
+  const std::map<std::string, Throughput>& Results() const { return this->results; }
+
+  // zero for a method which has not been measured
+  Throughput Get(const std::string& method) const {
+    auto found = this->results.find(method);
+    return found == this->results.end() ? Throughput() : found->second;
+  }
+
+  // the acceptable method which relays full buffers fastest, every method
+  // when none are given; the first one when nothing has been measured
+  std::string Fastest(const std::vector<std::string>& acceptable = {}) const {
+    std::vector<std::string> methods = acceptable;
+    if (methods.empty()) {
+      for (auto& cipher : cipher_map) {
+        methods.push_back(cipher.first);
+      }
+    }
+    std::string fastest;
+    double best = -1;
+    for (auto& method : methods) {
+      if (cipher_map.find(method) == cipher_map.end()) {
+        throw InvalidArgument("method name " + method + " is not right");
+      }
+      auto throughput = this->Get(method).large;
+      if (throughput > best) {
+        best = throughput;
+        fastest = method;
+      }
+    }
+    return fastest;
+  }
+
+  // the fastest of several methods a listener may use, logged for the
+  // operator who has to configure the clients with it
+  std::string Choose(const std::vector<std::string>& acceptable) const {
+    auto fastest = this->Fastest(acceptable);
+    LOG(INFO) << "use " << fastest << " of " << acceptable.size() << " acceptable methods, "
+              << uint64_t(this->Get(fastest).large) << " MB/s on this host";
+    return fastest;
+  }
+
+  // logs the results from the fastest method down
+  void Log() const {
+    std::multimap<double, std::string, std::greater<double>> ranked;
+    for (auto& result : this->results) {
+      ranked.emplace(result.second.large, result.first);
+    }
+    for (auto& entry : ranked) {
+      auto throughput = this->Get(entry.second);
+      LOG(INFO) << entry.second << ": " << uint64_t(throughput.large) << " MB/s in " << kLargeChunk
+                << " byte chunks, " << uint64_t(throughput.small) << " MB/s in " << kSmallChunk << " byte chunks";
+    }
+  }
+
+  // identifies the CPU model and its features, so results move with a copied file
+  static std::string HostFingerprint() {
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    std::map<std::string, std::string> fields;
+    while (std::getline(in, line)) {
+      auto colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      auto key = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+      //x86 and arm name their model and feature lines differently
+      if ((key == "model name" || key == "flags" || key == "Features" || key == "CPU implementer" ||
+          key == "CPU part") && fields.find(key) == fields.end()) {
+        fields[key] = line.substr(colon + 1);
+      }
+    }
+    //fnv-1a is the same on every build, unlike std::hash
+    uint64_t hash = 14695981039346656037ull;
+    for (auto& field : fields) {
+      for (auto c : field.first + "=" + field.second + ";") {
+        hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+      }
+    }
+    std::ostringstream out;
+    out << std::hex << hash;
+    return out.str();
+  }
+
+ private:
+  std::map<std::string, Throughput> results;
+  std::string fingerprint;
+
+  static double Measure(const std::string& method, size_t chunk_size, uint64_t run_time) {
+    auto& info = cipher_map.at(method);
+    KeySchedule schedule(method, Util::RandomBlock(info.key_length));
+    auto cipher = schedule.Encryptor(Util::RandomBlock(info.iv_length));
+    std::vector<byte> chunk(chunk_size, 0x5a);
+    //warms up the caches before the clock starts
+    cipher->encrypt(chunk.data(), chunk.size());
+
+    uint64_t bytes = 0;
+    auto start = uv_hrtime();
+    auto deadline = start + run_time * 1000000;
+    uint64_t now;
+    do {
+      for (int i = 0; i < 16; i++) {
+        cipher->encrypt(chunk.data(), chunk.size());
+      }
+      bytes += 16 * chunk_size;
+      now = uv_hrtime();
+    } while (now < deadline);
+    return bytes / ((now - start) / 1e9) / (1024 * 1024);
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_CALIBRATION_H_
@@ -0,0 +1,79 @@
+#ifndef SHADESOCKS_SRC_SS_CONFIG_H_
+#define SHADESOCKS_SRC_SS_CONFIG_H_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include "encrypt.h"
+#include "ratelimit.h"
+#include "socket.h"
+#include "egress.h"
+#include "upstream.h"
+#include "rules.h"
+#include "resolver.h"
+#include "local.h"
+#include "admission.h"
+
+namespace shadesocks {
+
+// Listener wide settings, every ShadeHandle accepted by the listener only
+// keeps a pointer to it.
+struct ServerConfig {
+  std::string method;
+  std::string password;
+  CipherInfo cipher_info;
+  // derived from the password once instead of on every connection
+  SecByteBlock key;
+  // connections create their ciphers from it, shared by copies of the config
+  std::shared_ptr<const KeySchedule> schedule;
+
+  //shared by all connections of the listener
+  RateLimit listener_limit;
+  //applied to every connection on its own, both directions together
+  RateLimit connection_limit;
+
+  //applied to the listener and every accepted socket
+  SocketProfile inbound_profile;
+  //applied to every socket connecting to a destination
+  SocketProfile outbound_profile;
+  //source addresses of the connections to destinations, empty lets the kernel choose
+  EgressPool egress;
+  //requests are forwarded to these servers instead of their destination when set
+  std::shared_ptr<UpstreamPool> upstream;
+  //what to do with every destination, every request is allowed when not set
+  std::shared_ptr<RuleTable> rules;
+  //domains are looked up by it on the loop instead of getaddrinfo on the threadpool when set,
+  //it has to run on the loop of the listener
+  std::shared_ptr<Resolver> resolver;
+  //destinations on this host which are connected over their Unix domain socket,
+  //matched before the lookup; deny rules still apply, they are never forwarded to an upstream
+  LocalDestinations local_destinations;
+  //what the listener takes on before it sheds new connections, nothing is shed by default
+  AdmissionOptions admission;
+  //chunks of at least this many bytes are sent to destinations with MSG_ZEROCOPY,
+  //0 copies every chunk; ZeroCopy::kThreshold is about where it starts to pay off
+  size_t zerocopy_threshold = 0;
+  //accepted connections are relayed by coroutines, which needs a C++20 build;
+  //the listener refuses to start with rate limits, the loop scheduler, upstreams,
+  //the stub resolver, zero-copy sends, local destinations or on a Unix domain socket
+  bool coroutine_relay = false;
+
+  explicit ServerConfig(std::string method = "aes-256-cfb", std::string password = "123456")
+      : method(std::move(method)), password(std::move(password)) {
+    auto found = cipher_map.find(this->method);
+    if (found == cipher_map.end()) {
+      throw InvalidArgument("method name " + this->method + " is not right");
+    }
+    this->cipher_info = found->second;
+    this->key = Util::PasswordToKey(this->password, cipher_info.key_length);
+    this->schedule = std::make_shared<const KeySchedule>(this->method, this->key);
+  }
+
+  static const ServerConfig& Default() {
+    static const ServerConfig config;
+    return config;
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_CONFIG_H_
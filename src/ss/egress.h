@@ -0,0 +1,90 @@
+#ifndef SHADESOCKS_SRC_SS_EGRESS_H_
+#define SHADESOCKS_SRC_SS_EGRESS_H_
+
+#include <uv.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+namespace shadesocks {
+
+// Source addresses for the connections to destinations. Every address has
+// its own range of ephemeral ports, and with IP_BIND_ADDRESS_NO_PORT the
+// port is only chosen at connect time for the whole 4-tuple, so a few
+// addresses multiply the connections one destination can take.
+//
+// The pool is used from the loop thread of the listener only.
+class EgressPool {
+ public:
+  enum Selection {
+    // spreads the connections evenly
+    RoundRobin,
+    // keeps every destination on one source address
+    DestinationHash,
+  };
+
+  Selection selection = Selection::RoundRobin;
+
+  bool Empty() const { return this->addresses.empty(); }
+  size_t Size() const { return this->addresses.size(); }
+
+  void Add(const std::string& ip) {
+    sockaddr_in addr{};
+    if (uv_ip4_addr(ip.c_str(), 0, &addr) != 0) {
+      throw InvalidArgument("bad egress address " + ip);
+    }
+    this->addresses.push_back(addr);
+  }
+
+  // a comma separated list of IPv4 addresses
+  static EgressPool Parse(const std::string& list, Selection selection = Selection::RoundRobin) {
+    EgressPool pool;
+    pool.selection = selection;
+    std::istringstream in(list);
+    for (std::string ip; std::getline(in, ip, ',');) {
+      if (!ip.empty()) {
+        pool.Add(ip);
+      }
+    }
+    return pool;
+  }
+
+  const sockaddr_in& Pick(const sockaddr_in& destination) const {
+    if (this->selection == Selection::DestinationHash) {
+      uint64_t key = uint64_t(destination.sin_addr.s_addr) << 16 | destination.sin_port;
+      //multiplicative hash, the high bits are mixed best
+      return this->addresses[((key * 0x9E3779B97F4A7C15ull) >> 32) % this->addresses.size()];
+    }
+    return this->addresses[this->next++ % this->addresses.size()];
+  }
+
+  // binds the socket to a source address for the destination before it
+  // connects, returns 0 or a negative errno
+  int Bind(int fd, const sockaddr_in& destination) const {
+    int on = 1;
+    //without it the port would be taken at bind time for every destination
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)) != 0 && errno != ENOPROTOOPT) {
+      return -errno;
+    }
+    auto& source = this->Pick(destination);
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&source), sizeof(source)) != 0) {
+      return -errno;
+    }
+    return 0;
+  }
+
+ private:
+  std::vector<sockaddr_in> addresses;
+  mutable size_t next = 0;
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_EGRESS_H_
@@ -2,6 +2,7 @@
 #define SHADESOCKS_SRC_SS_ENCRYPT_H_
 
 #include <glog/logging.h>
+#include <type_traits>
 
 #include <cryptlib.h>
 using CryptoPP::InvalidArgument;
@@ -11,6 +12,7 @@ using CryptoPP::AutoSeededRandomPool;
 
 #include <aes.h>
 using CryptoPP::AES;
+using CryptoPP::BlockCipher;
 using CryptoPP::byte;
 using CryptoPP::SecByteBlock;
 
@@ -20,6 +22,16 @@ using CryptoPP::GCM;
 #include <modes.h>
 using CryptoPP::CFB_Mode;
 using CryptoPP::CTR_Mode;
+using CryptoPP::CFB_Mode_ExternalCipher;
+using CryptoPP::CTR_Mode_ExternalCipher;
+
+#include <chacha.h>
+using CryptoPP::ChaCha;
+using CryptoPP::ChaChaTLS;
+using CryptoPP::XChaCha20;
+
+#include <salsa.h>
+using CryptoPP::Salsa20;
 
 #include "filters.h"
 using CryptoPP::StreamTransformationFilter;
@@ -45,11 +57,14 @@ const std::map<std::string, CipherInfo> cipher_map{
     {"aes-256-cfb", {32, 16}}, {"aes-128-ctr", {16, 16}},
     {"aes-192-ctr", {24, 16}}, {"aes-256-ctr", {32, 16}},
     {"aes-128-gcm", {16, 16}}, {"aes-192-gcm", {24, 16}},
-    {"aes-256-gcm", {32, 16}}};
+    {"aes-256-gcm", {32, 16}},
+    //stream ciphers for hosts without AES instructions
+    {"chacha20", {32, 8}}, {"chacha20-ietf", {32, 12}},
+    {"xchacha20", {32, 24}}, {"salsa20", {32, 8}}};
 
 class Cipher {
  public:
-  virtual void SetKeyWithIV(SecByteBlock& key, SecByteBlock& iv) = 0;
+  virtual void SetKeyWithIV(const SecByteBlock& key, const SecByteBlock& iv) = 0;
   virtual SecByteBlock GetKey() = 0;
   virtual SecByteBlock GetIv() = 0;
 
@@ -59,6 +74,10 @@ class Cipher {
   virtual SecByteBlock decrypt(const std::string&) = 0;
   virtual SecByteBlock decrypt(const SecByteBlock&) = 0;
 
+  // transform the buffer in place, used by the relay to avoid copies
+  virtual void encrypt(byte* data, size_t length) = 0;
+  virtual void decrypt(byte* data, size_t length) = 0;
+
   virtual ~Cipher() {}
 };
 
@@ -71,11 +90,11 @@ class ShadeCipher : public Cipher {
   SecByteBlock iv;
 
  public:
-  ShadeCipher(SecByteBlock& key, SecByteBlock& iv) {
+  ShadeCipher(const SecByteBlock& key, const SecByteBlock& iv) {
     this->SetKeyWithIV(key, iv);
   }
 
-  void SetKeyWithIV(SecByteBlock& key, SecByteBlock& iv) {
+  void SetKeyWithIV(const SecByteBlock& key, const SecByteBlock& iv) {
     this->key = key;
     this->iv = iv;
     this->encryption.SetKeyWithIV(key, key.size(), iv, iv.size());
@@ -104,13 +123,149 @@ class ShadeCipher : public Cipher {
     return output;
   }
 
+  void encrypt(byte* data, size_t length) {
+    this->encryption.ProcessData(data, data, length);
+  }
+  void decrypt(byte* data, size_t length) {
+    this->decryption.ProcessData(data, data, length);
+  }
+
   ~ShadeCipher() {}
 };
 
+// One direction of a stream. It is either keyed on its own, or runs a block
+// cipher mode on a key schedule which is shared and only sets its IV; the
+// schedule then has to outlive the cipher, the mode runs on its expanded key.
+template<typename Transform, bool kEncrypt>
+class OneWayCipher : public Cipher {
+ private:
+  Transform transform;
+  //a copy, the key passed in may belong to a schedule or a temporary
+  SecByteBlock key;
+  SecByteBlock iv;
+
+  static void WrongDirection() {
+    throw InvalidArgument(kEncrypt ? "the cipher only encrypts" : "the cipher only decrypts");
+  }
+
+ public:
+  OneWayCipher(const SecByteBlock& key, const SecByteBlock& iv) : key(key), iv(iv) {
+    this->transform.SetKeyWithIV(key, key.size(), iv, iv.size());
+  }
+
+  OneWayCipher(BlockCipher& schedule, const SecByteBlock& key, const SecByteBlock& iv)
+      : transform(schedule, iv), key(key), iv(iv) {}
+
+  void SetKeyWithIV(const SecByteBlock& key, const SecByteBlock& iv) {
+    throw InvalidArgument("the key of a one way cipher is fixed");
+  }
+  SecByteBlock GetKey() { return this->key; }
+  SecByteBlock GetIv() { return this->iv; }
+
+  SecByteBlock encrypt(const std::string& input) {
+    return this->encrypt(SecByteBlock((byte*) input.data(), input.size()));
+  }
+  SecByteBlock encrypt(const SecByteBlock& input) {
+    SecByteBlock output(input);
+    this->encrypt(output.data(), output.size());
+    return output;
+  }
+
+  SecByteBlock decrypt(const std::string& input) {
+    return this->decrypt(SecByteBlock((byte*) input.data(), input.size()));
+  }
+  SecByteBlock decrypt(const SecByteBlock& input) {
+    SecByteBlock output(input);
+    this->decrypt(output.data(), output.size());
+    return output;
+  }
+
+  void encrypt(byte* data, size_t length) {
+    if (!kEncrypt) {
+      WrongDirection();
+    }
+    this->transform.ProcessData(data, data, length);
+  }
+  void decrypt(byte* data, size_t length) {
+    if (kEncrypt) {
+      WrongDirection();
+    }
+    this->transform.ProcessData(data, data, length);
+  }
+};
+
+// The key of a listener prepared once. The AES modes which only run the
+// forward cipher, cfb and ctr, share one expanded key schedule and each
+// connection only resynchronizes its IV on it. The other methods are keyed
+// per connection, but only in the direction which is used.
+//
+// The schedule is used from the loop thread of the listener only.
+class KeySchedule final {
+ public:
+  KeySchedule(const std::string& method, const SecByteBlock& key) : method(method), key(key) {
+    if (cipher_map.find(method) == cipher_map.end()) {
+      throw InvalidArgument("method name " + method + " is not right");
+    }
+    this->shared = method.find("aes") == 0 &&
+        (method.find("cfb") != std::string::npos || method.find("ctr") != std::string::npos);
+    if (this->shared) {
+      this->aes.SetKey(key, key.size());
+    }
+  }
+
+  KeySchedule(const KeySchedule&) = delete;
+  KeySchedule& operator=(const KeySchedule&) = delete;
+
+  bool Shared() const { return this->shared; }
+
+  std::unique_ptr<Cipher> Encryptor(const SecByteBlock& iv) const {
+    return this->Create<true>(iv);
+  }
+
+  std::unique_ptr<Cipher> Decryptor(const SecByteBlock& iv) const {
+    return this->Create<false>(iv);
+  }
+
+ private:
+  std::string method;
+  SecByteBlock key;
+  bool shared;
+  //the modes only call the const block functions on it
+  mutable AES::Encryption aes;
+
+  template<bool kEncrypt>
+  std::unique_ptr<Cipher> Create(const SecByteBlock& iv) const {
+    if (iv.size() != size_t(cipher_map.at(this->method).iv_length)) {
+      throw InvalidArgument("iv size is not right, expect " +
+          std::to_string(cipher_map.at(this->method).iv_length) +
+          ", actual " + std::to_string(iv.size()));
+    }
+    auto& method = this->method;
+    if (method.find("cfb") != std::string::npos) {
+      using Mode = typename std::conditional<kEncrypt, CFB_Mode_ExternalCipher::Encryption,
+                                             CFB_Mode_ExternalCipher::Decryption>::type;
+      return std::unique_ptr<Cipher>(new OneWayCipher<Mode, kEncrypt>(this->aes, this->key, iv));
+    } else if (method.find("ctr") != std::string::npos) {
+      return std::unique_ptr<Cipher>(
+          new OneWayCipher<CTR_Mode_ExternalCipher::Encryption, kEncrypt>(this->aes, this->key, iv));
+    } else if (method.find("gcm") != std::string::npos) {
+      using Mode = typename std::conditional<kEncrypt, GCM<AES>::Encryption, GCM<AES>::Decryption>::type;
+      return std::unique_ptr<Cipher>(new OneWayCipher<Mode, kEncrypt>(this->key, iv));
+    } else if (method == "chacha20") {
+      return std::unique_ptr<Cipher>(new OneWayCipher<ChaCha::Encryption, kEncrypt>(this->key, iv));
+    } else if (method == "chacha20-ietf") {
+      return std::unique_ptr<Cipher>(new OneWayCipher<ChaChaTLS::Encryption, kEncrypt>(this->key, iv));
+    } else if (method == "xchacha20") {
+      return std::unique_ptr<Cipher>(new OneWayCipher<XChaCha20::Encryption, kEncrypt>(this->key, iv));
+    }
+    return std::unique_ptr<Cipher>(new OneWayCipher<Salsa20::Encryption, kEncrypt>(this->key, iv));
+  }
+};
+
 class Util {
  private:
-  static void checkLengthValid(const std::string& method, SecByteBlock& key,
-                               SecByteBlock& iv) {
+  static void checkLengthValid(const std::string& method, const SecByteBlock& key,
+                               const SecByteBlock& iv) {
     auto found = cipher_map.find(method);
     if (found == cipher_map.end()) {
       throw InvalidArgument("method name " + method + " is not right");
@@ -206,13 +361,21 @@ class Util {
   }
 
   static std::unique_ptr<Cipher> getEncryption(const std::string& method,
-                                               SecByteBlock& key,
-                                               SecByteBlock& iv) {
+                                               const SecByteBlock& key,
+                                               const SecByteBlock& iv) {
     std::unique_ptr<shadesocks::Cipher> encryption;
 
     checkLengthValid(method, key, iv);
 
-    if (method.find("cfb") != std::string::npos) {
+    if (method == "chacha20") {
+      encryption = std::unique_ptr<shadesocks::Cipher>(new shadesocks::ShadeCipher<ChaCha>(key, iv));
+    } else if (method == "chacha20-ietf") {
+      encryption = std::unique_ptr<shadesocks::Cipher>(new shadesocks::ShadeCipher<ChaChaTLS>(key, iv));
+    } else if (method == "xchacha20") {
+      encryption = std::unique_ptr<shadesocks::Cipher>(new shadesocks::ShadeCipher<XChaCha20>(key, iv));
+    } else if (method == "salsa20") {
+      encryption = std::unique_ptr<shadesocks::Cipher>(new shadesocks::ShadeCipher<Salsa20>(key, iv));
+    } else if (method.find("cfb") != std::string::npos) {
       encryption = std::unique_ptr<shadesocks::Cipher>(new shadesocks::ShadeCipher<CFB_Mode<AES>>(key, iv));
     } else if (method.find("ctr") != std::string::npos) {
       encryption = std::unique_ptr<shadesocks::Cipher>(new shadesocks::ShadeCipher<CTR_Mode<AES>>(key, iv));
@@ -12,12 +12,6 @@ class ProxyException : public std::runtime_error {
   explicit ProxyException(const std::string& what) : std::runtime_error(what) {}
 };
 
-enum AddrType {
-  TypeIPv4 = 1,
-  TypeIPv6 = 4,
-  TypeDomain = 3,
-};
-
 enum ProxyState {
   ServerWriting,
   ServerReading,
@@ -27,35 +21,113 @@ enum ProxyState {
   Connecting,
 };
 
+inline const char* ProxyStateName(int state) {
+  switch (state) {
+    case ProxyState::ServerWriting: return "ServerWriting";
+    case ProxyState::ServerReading: return "ServerReading";
+    case ProxyState::ClientWriting: return "ClientWriting";
+    case ProxyState::ClientReading: return "ClientReading";
+    case ProxyState::AddressRequesting: return "AddressRequesting";
+    case ProxyState::Connecting: return "Connecting";
+    default: return "Unknown";
+  }
+}
+
 class ShadeHandle final {
  private:
   FRIEND_TEST(ShadeHandleTest, ReadDataTest);
   FRIEND_TEST(ShadeHandleTest, GetRequestTest);
   FRIEND_TEST(ShadeHandleTest, ConnectTest);
+  FRIEND_TEST(ShadeHandleTest, IdleMemoryTest);
 
+  //state of the client to server direction, including the handshake
   ProxyState proxy_state;
+  //state of the server to client direction, started once connected
+  ProxyState reply_state;
+  bool closing;
+  //the destination is connected and both directions are relayed
+  bool connected;
+  //the end of a direction has been passed on, the connection closes once both have
+  bool request_ended;
+  bool reply_ended;
+  //a lookup or connect is counted by admission control from the header until connected
+  bool pending;
+  //chunks waiting in the loop scheduler
+  uint8_t queued;
+  //handles which still have to call back before the handle is deleted
+  int pending_closes;
+  //identifies the connection in the flight recorder
+  uint32_t id;
 
   uv_stream_t* server_handle;
 
-  uv_tcp_t p_handle_in;
-  uv_tcp_t p_handle_out;
-
-  std::unique_ptr<sockaddr_in> addr_out;
+  //a TCP socket, or a Unix domain socket for a peer on this host
+  union StreamHandle {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  StreamHandle p_handle_in;
+  //only initialized once the kind of the destination is known
+  StreamHandle p_handle_out;
+
+  //in flight lookup, detached from the handle when the connection is closed
+  uv_getaddrinfo_t* p_getaddrinfo;
+  //in flight lookup of the stub resolver, cancelled when the connection is closed
+  ResolveRequest* p_resolve;
+
+  //only created once the connection has been throttled, shared by both
+  //directions and due at the earlier of their resume times, in loop time
+  uv_timer_t* p_timer;
+  uint64_t timer_due;
+  bool request_throttled;
+  bool reply_throttled;
+  uint64_t request_resume;
+  uint64_t reply_resume;
+
+  sockaddr_in addr_out;
   std::string hostname_out;
   uint16_t port_out;
+  //the socket of a destination on this host, owned by the config
+  const std::string* local_path;
+
+  //method, key and password are owned by the listener
+  const ServerConfig* config;
 
+  //only created when the first read ends inside the iv
+  std::unique_ptr<IvParser> iv;
+  //only kept until the destination is connected
+  std::unique_ptr<HeaderParser> header;
+
+  //created lazily, an idle connection holds no cipher
   std::unique_ptr<Cipher> decrypt_cipher;
   std::unique_ptr<Cipher> encrypt_cipher;
-  std::string cipher_method;
-  std::string password;
-
-  //save cipher text
-  SecByteBlock data;
-  ssize_t offset;
 
-  //save plaintext
-  char temp[10000];
-  ssize_t length;
+  //the upstream a chained connection is forwarded to, and its own ciphers
+  struct UpstreamLink {
+    size_t index;
+    uint64_t connect_started;
+    std::unique_ptr<Cipher> encrypt;
+    std::unique_ptr<Cipher> decrypt;
+    //the iv and the header, written before the first payload
+    std::string header;
+    uv_write_t header_write;
+    //only created when the first reply ends inside the iv
+    std::unique_ptr<IvParser> iv;
+  };
+  std::unique_ptr<UpstreamLink> upstream;
+
+  //large chunks are sent to the destination without copying when set, created once connected
+  std::unique_ptr<ZeroCopy> zerocopy;
+
+  //pooled buffers, only held while a chunk is in flight
+  Chunk request;
+  Chunk reply;
+
+  TokenBucket* listener_bucket;
+  TokenBucket bucket;
+
+  //admission control of the listener, if any
+  Admission* admission;
 
   void DoNext() {
     switch (this->proxy_state) {
@@ -86,142 +158,485 @@ class ShadeHandle final {
     }
   }
 
+  //every transition is kept by the flight recorder
+  void SetProxyState(ProxyState state) {
+    FlightRecorder::Local().Record(EventType::ProxyTransition, this->id, this->proxy_state, state);
+    this->proxy_state = state;
+  }
+
+  void SetReplyState(ProxyState state) {
+    FlightRecorder::Local().Record(EventType::ReplyTransition, this->id, this->reply_state, state);
+    this->reply_state = state;
+  }
+
+  //count the failure and tear down this connection only, the loop keeps serving
+  void Fail(ErrorType type, int err) {
+    LOG(WARNING) << ErrorTypeName(type) << " error in state " << this->proxy_state << ": " << uv_strerror(err);
+    FlightRecorder::Local().Record(EventType::FailEvent, this->id, this->proxy_state, this->reply_state, 0, err, type);
+    Stats::Local().CountError(type);
+    this->Close();
+  }
+
+  //charge the bytes read in either direction to every bucket
+  void Consume(size_t bytes) {
+    auto now = uv_hrtime();
+    GlobalBucket().Consume(bytes, now);
+    if (this->listener_bucket != nullptr) {
+      this->listener_bucket->Consume(bytes, now);
+    }
+    this->bucket.Consume(bytes, now);
+  }
+
+  //returns true when reading has to wait for tokens, the timer resumes it
+  bool Throttle(bool& throttled, uint64_t& resume) {
+    auto now = uv_hrtime();
+    uint64_t delay = std::max(GlobalBucket().Delay(now), this->bucket.Delay(now));
+    if (this->listener_bucket != nullptr) {
+      delay = std::max(delay, this->listener_bucket->Delay(now));
+    }
+    if (delay == 0) {
+      return false;
+    }
+
+    if (this->p_timer == nullptr) {
+      this->p_timer = new uv_timer_t{};
+      uv_timer_init(this->server_handle->loop, this->p_timer);
+      this->p_timer->data = this;
+    }
+    throttled = true;
+    resume = uv_now(this->server_handle->loop) + (delay + 999999) / 1000000;
+    this->ArmResume(resume);
+    return true;
+  }
+
+  //a shorter wait of the other direction moves the timer forward, a longer one does not push it back
+  void ArmResume(uint64_t resume) {
+    if (uv_is_active(reinterpret_cast<uv_handle_t*>(this->p_timer)) && this->timer_due <= resume) {
+      return;
+    }
+    auto now = uv_now(this->server_handle->loop);
+    this->timer_due = resume;
+    uv_timer_start(this->p_timer, ResumeDone, resume > now ? resume - now : 0, 0);
+  }
+
+  //resumes the directions whose wait is over, the other one keeps waiting for its own
+  static void ResumeDone(uv_timer_t* timer) {
+    ProfileScope scope(CallbackType::TimerCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(timer->data);
+    auto now = uv_now(timer->loop);
+    if (shade_handle->request_throttled && shade_handle->request_resume <= now) {
+      shade_handle->request_throttled = false;
+      shade_handle->ReadClient();
+    }
+    if (!shade_handle->closing && shade_handle->reply_throttled && shade_handle->reply_resume <= now) {
+      shade_handle->reply_throttled = false;
+      shade_handle->ReadServer();
+    }
+    if (shade_handle->closing) {
+      return;
+    }
+    if (shade_handle->request_throttled) {
+      shade_handle->ArmResume(shade_handle->request_resume);
+    }
+    if (shade_handle->reply_throttled) {
+      shade_handle->ArmResume(shade_handle->reply_resume);
+    }
+  }
+
   static void ConnectDone(uv_connect_t* req, int status) {
+    ProfileScope scope(CallbackType::ConnectCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
+    delete req;
+    if (shade_handle->closing) {
+      return;
+    }
+    auto upstream = shade_handle->upstream.get();
+    if (upstream != nullptr) {
+      shade_handle->config->upstream->Report(upstream->index, status == 0, uv_hrtime() - upstream->connect_started);
+    }
     if (status < 0) {
-      throw UvException(status);
+      shade_handle->Fail(ErrorType::ConnectError, status);
+      return;
     }
-    auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
-    DLOG(INFO) << "connected to " << shade_handle->hostname_out << ":" << ntohs(shade_handle->addr_out->sin_port);
+    shade_handle->Connected();
+  }
 
-    auto length = shade_handle->length;
+  void Connected() {
+    this->connected = true;
+    this->EndPending();
+    DLOG(INFO) << "connected to " << this->hostname_out << ":" << ntohs(this->addr_out.sin_port);
+    std::string().swap(this->hostname_out);
+    if (this->upstream != nullptr && !this->StartUpstream()) {
+      return;
+    }
+    this->header.reset();
+    if (this->config->zerocopy_threshold > 0 && this->local_path == nullptr) {
+      this->EnableZeroCopy();
+    }
+
+    //both directions are relayed independently from now on
+    this->SetReplyState(ProxyState::ServerReading);
+    this->ReadServer();
+    if (this->closing) {
+      return;
+    }
+
+    auto length = this->request.length;
     if (length == 0) {
       DLOG(INFO) << "the current data is empty, so wait next data";
-      shade_handle->proxy_state = ProxyState::ClientReading;
+      this->SetProxyState(ProxyState::ClientReading);
     } else {
-      DLOG(INFO) << "the current data length is " << shade_handle->length << ", so write data to server";
-      shade_handle->proxy_state = ProxyState::ServerWriting;
-      shade_handle->DoNext();
+      DLOG(INFO) << "the current data length is " << length << ", so write data to server";
+      this->SetProxyState(ProxyState::ServerWriting);
     }
+    this->DoNext();
+  }
 
-    delete req;
+  //picks the upstream, returns true when a warm connection to it was taken
+  bool TakeUpstream() {
+    auto& pool = *this->config->upstream;
+    auto index = pool.Pick();
+    this->upstream->index = index;
+    this->addr_out = pool.At(index).addr;
+    int fd = pool.Take(index);
+    if (fd < 0) {
+      this->upstream->connect_started = uv_hrtime();
+      return false;
+    }
+    int err = uv_tcp_open(&this->p_handle_out.tcp, fd);
+    if (err) {
+      ::close(fd);
+      this->Fail(ErrorType::ConnectError, err);
+      return true;
+    }
+    auto& profile = this->config->outbound_profile;
+    if (!profile.Empty()) {
+      profile.Apply(&this->p_handle_out.tcp);
+    }
+    this->Connected();
+    return true;
+  }
+
+  //the header goes to the upstream ahead of the payload, both under its own key;
+  //returns false when it could not be queued and the connection failed
+  bool StartUpstream() {
+    auto& request = this->request;
+    auto& upstream = *this->upstream;
+    auto& server = this->config->upstream->At(upstream.index);
+    auto iv = Util::RandomBlock(server.cipher_info.iv_length);
+    upstream.encrypt = server.schedule->Encryptor(iv);
+    auto header = this->header->Bytes();
+    upstream.header.assign(reinterpret_cast<const char*>(iv.data()), iv.size());
+    upstream.header.append(header.data(), header.size());
+    upstream.encrypt->encrypt((byte*) &upstream.header[iv.size()], header.size());
+    if (request.length > 0) {
+      upstream.encrypt->encrypt((byte*) request.data, request.length);
+    }
+    //writes to a stream go out in order, the payload follows it
+    auto buf = uv_buf_init(&upstream.header[0], upstream.header.size());
+    int err = uv_write(&upstream.header_write, this->handle_out<uv_stream_t>(), &buf, 1, nullptr);
+    if (err) {
+      this->Fail(ErrorType::WriteError, err);
+      return false;
+    }
+    return true;
+  }
+
+  //decrypts a chunk of the upstream, returns false when nothing is left to forward
+  bool DecryptUpstream() {
+    auto& reply = this->reply;
+    auto& upstream = *this->upstream;
+    if (upstream.decrypt == nullptr) {
+      auto& server = this->config->upstream->At(upstream.index);
+      auto iv_length = size_t(server.cipher_info.iv_length);
+      auto iv_data = (const byte*) reply.data;
+      //an iv split over reads is put together first, like the one of the client
+      if (upstream.iv != nullptr || size_t(reply.length) < iv_length) {
+        if (upstream.iv == nullptr) {
+          upstream.iv = std::make_unique<IvParser>(iv_length);
+        }
+        auto taken = upstream.iv->Feed(reply.data, reply.length);
+        reply.data += taken;
+        reply.length -= taken;
+        iv_data = upstream.iv->Data();
+      } else {
+        reply.data += iv_length;
+        reply.length -= iv_length;
+      }
+      if (upstream.iv == nullptr || upstream.iv->Done()) {
+        upstream.decrypt = server.schedule->Decryptor(SecByteBlock(iv_data, iv_length));
+        upstream.iv.reset();
+      }
+    }
+    if (reply.length > 0) {
+      upstream.decrypt->decrypt((byte*) reply.data, reply.length);
+    }
+    if (reply.length == 0) {
+      reply.Release();
+      this->SetReplyState(ProxyState::ServerReading);
+      this->ReadServer();
+      return false;
+    }
+    return true;
+  }
+
+  int OpenOutbound() {
+    return OpenOutbound(&this->p_handle_out.tcp, *this->config, this->addr_out);
+  }
+
+  void InitOutbound() {
+    auto loop = this->server_handle->loop;
+    if (this->local_path != nullptr) {
+      uv_pipe_init(loop, &this->p_handle_out.pipe, 0);
+    } else {
+      uv_tcp_init(loop, &this->p_handle_out.tcp);
+    }
+    this->p_handle_out.tcp.data = this;
+  }
+
+  bool OutboundOpen() {
+    return this->handle_out<uv_handle_t>()->type != UV_UNKNOWN_HANDLE;
   }
 
   void Connect() {
-    DLOG(INFO) << "start to connect to " << this->hostname_out << ":" << ntohs(this->addr_out->sin_port);
+    this->InitOutbound();
+    if (this->local_path != nullptr) {
+      DLOG(INFO) << "start to connect to " << *this->local_path;
+      auto p_connect = new uv_connect_t{};
+      p_connect->data = this;
+      uv_pipe_connect(p_connect, &this->p_handle_out.pipe, this->local_path->c_str(), ConnectDone);
+      return;
+    }
+    if (this->upstream != nullptr && this->TakeUpstream()) {
+      return;
+    }
+    DLOG(INFO) << "start to connect to " << this->hostname_out << ":" << ntohs(this->addr_out.sin_port);
+    int err = this->OpenOutbound();
+    if (err) {
+      this->Fail(ErrorType::ConnectError, err);
+      return;
+    }
     auto p_connect = new uv_connect_t{};
     p_connect->data = this;
-    int err = uv_tcp_connect(p_connect, &this->p_handle_out, reinterpret_cast<sockaddr*>(addr_out.get()), ConnectDone);
+    err = uv_tcp_connect(p_connect, &this->p_handle_out.tcp, reinterpret_cast<sockaddr*>(&addr_out), ConnectDone);
     if (err) {
-      throw UvException(err);
+      delete p_connect;
+      this->Fail(ErrorType::ConnectError, err);
     }
   }
 
-  void CopyToTemp() {
-    this->length = data.size() - offset;
-    memcpy(temp, data.data() + offset, length);
+  //matches the destination before it is looked up, returns false when the
+  //request has been denied or forwarded to an upstream instead
+  bool ApplyRules(int addr_type) {
+    auto action = RuleAction::Allow;
+    if (this->config->rules != nullptr) {
+      auto rules = this->config->rules->Current();
+      bool matched = addr_type == AddrType::TypeIPv4 ? rules->Match(this->addr_out.sin_addr, action)
+                                                     : rules->MatchHost(this->hostname_out, action);
+      if (!matched) {
+        action = rules->default_action;
+      }
+    }
+    if (action == RuleAction::Deny) {
+      this->Fail(ErrorType::DeniedError, UV_EACCES);
+      return false;
+    }
+    if (this->config->upstream == nullptr || action == RuleAction::Direct || this->local_path != nullptr) {
+      return true;
+    }
+    //a forwarded request keeps the header, the upstream resolves it
+    this->upstream = std::make_unique<UpstreamLink>();
+    this->SetProxyState(ProxyState::Connecting);
+    this->Connect();
+    return false;
   }
 
-  void GetRequest() {
-    auto addr_type = data[0] & 0xf;
-    this->offset += 1;
-    std::string char_addr;
-    this->hostname_out.clear();
-    auto req = new uv_getaddrinfo_t{};
-    req->data = this;
+  //the address a domain resolved to is matched against the prefixes as well,
+  //the forms of IPv4 literals the lookup takes are more than a rule can list;
+  //returns false when the request has been denied
+  bool ApplyAddressRules() {
+    auto action = RuleAction::Allow;
+    if (this->config->rules != nullptr && this->config->rules->Current()->Match(this->addr_out.sin_addr, action) &&
+        action == RuleAction::Deny) {
+      this->Fail(ErrorType::DeniedError, UV_EACCES);
+      return false;
+    }
+    return true;
+  }
 
-    switch (addr_type) {
-      case AddrType::TypeIPv4: {
-        char_addr.resize(4);
-        for (; offset < 4 + 1; offset++) {
-          char_addr[offset - 1] = data[offset];
-          this->hostname_out.append(std::to_string(int(data[offset])));
-          if (offset != 4) {
-            this->hostname_out.append(".");
-          }
-        }
-        addr_out = std::make_unique<sockaddr_in>();
-        addr_out->sin_family = AF_INET;
-        memcpy(&addr_out->sin_addr,
-               &char_addr[0],
-               sizeof(addr_out->sin_addr));
-
-        this->port_out = 0;
-        this->port_out = data[offset++] << 8;
-        this->port_out |= data[offset++];
-        addr_out->sin_port = htons(this->port_out);
-
-        this->length = this->data.size() - this->offset;
-        this->proxy_state = ProxyState::Connecting;
-        if (this->length) {
-          uv_read_stop(this->handle_in<uv_stream_t>());
-          this->CopyToTemp();
-          this->Connect();
-        }
-        break;
-      }
-      case AddrType::TypeIPv6: {
-        throw UvException("doesn't support IPv6 now");
-      }
-      case AddrType::TypeDomain: {
-        char length = data[1];
-        this->offset += 1;
-        char_addr.resize(length);
-        for (; offset < length + 2; offset++) {
-          char_addr[offset - 2] = data[offset];
-        }
+  void EndPending() {
+    if (this->pending) {
+      this->pending = false;
+      this->admission->EndPending();
+    }
+  }
+
+  //the payload after the header is kept in the buffer until the connection is ready
+  void KeepPending(ssize_t offset) {
+    this->request.data += offset;
+    this->request.length -= offset;
+    if (this->request.length == 0) {
+      this->request.Release();
+    }
+  }
 
-        addrinfo hints{};
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_protocol = IPPROTO_TCP;
+  //parses the header as far as it has arrived, the client is read on until it is complete
+  void GetRequest() {
+    if (this->header == nullptr) {
+      this->header = std::make_unique<HeaderParser>();
+    }
+    auto& header = *this->header;
+    auto taken = header.Feed(this->request.data, this->request.length);
+    if (taken < 0) {
+      this->Fail(ErrorType::ProtocolError, int(taken));
+      return;
+    }
+    this->KeepPending(taken);
+    if (!header.Done()) {
+      this->SetProxyState(ProxyState::ClientReading);
+      return;
+    }
 
-        this->hostname_out = char_addr;
+    //the client is paused until the destination is connected
+    uv_read_stop(this->handle_in<uv_stream_t>());
+    this->port_out = header.Port();
 
-        addr_out = std::make_unique<sockaddr_in>();
+    //turning the request away is cheaper now than a lookup and connect which arrive too late
+    if (this->admission != nullptr) {
+      if (!this->admission->BeginPending()) {
+        Stats::Local().CountShed(ShedReason::PendingFull);
+        this->Close();
+        return;
+      }
+      this->pending = true;
+    }
 
-        this->port_out = 0;
-        this->port_out = data[offset++] << 8;
-        this->port_out |= data[offset++];
+    if (header.Type() == AddrType::TypeIPv4) {
+      this->addr_out = header.Address();
+      char ip[INET_ADDRSTRLEN];
+      uv_ip4_name(&this->addr_out, ip, sizeof(ip));
+      this->hostname_out = ip;
+      this->local_path = this->config->local_destinations.Find(this->hostname_out, this->port_out);
+      if (!this->ApplyRules(AddrType::TypeIPv4)) {
+        return;
+      }
+      this->SetProxyState(ProxyState::Connecting);
+      this->Connect();
+      return;
+    }
 
-        this->length = this->data.size() - this->offset;
-        if (this->length) {
-          uv_read_stop(this->handle_in<uv_stream_t>());
-          this->CopyToTemp();
-        }
+    this->hostname_out = std::string(header.Host());
+    this->addr_out = sockaddr_in{};
+    this->local_path = this->config->local_destinations.Find(this->hostname_out, this->port_out);
+    if (!this->ApplyRules(AddrType::TypeDomain)) {
+      return;
+    }
+    //a local destination needs no lookup
+    if (this->local_path != nullptr) {
+      this->SetProxyState(ProxyState::Connecting);
+      this->Connect();
+      return;
+    }
 
-        DLOG(INFO) << "start to look up the address";
-        this->proxy_state = ProxyState::AddressRequesting;
-        uv_getaddrinfo(this->server_handle->loop, req, GetRequestDone, char_addr.data(), nullptr, &hints);
-        break;
+    DLOG(INFO) << "start to look up the address";
+    this->SetProxyState(ProxyState::AddressRequesting);
+    if (this->config->resolver != nullptr) {
+      auto resolve = new ResolveRequest{};
+      resolve->data = this;
+      int err = this->config->resolver->Resolve(resolve, this->hostname_out, ResolveDone);
+      if (err) {
+        delete resolve;
+        this->Fail(ErrorType::ResolveError, err);
+        return;
       }
-      default:throw UvException("unknown request");
+      this->p_resolve = resolve;
+      return;
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    auto req = new uv_getaddrinfo_t{};
+    req->data = this;
+    int err = uv_getaddrinfo(this->server_handle->loop, req, GetRequestDone, this->hostname_out.c_str(), nullptr, &hints);
+    if (err) {
+      delete req;
+      this->Fail(ErrorType::ResolveError, err);
+      return;
     }
+    this->p_getaddrinfo = req;
+  }
 
+  //sending without copying is best effort, like the socket profiles
+  void EnableZeroCopy() {
+    int err = ZeroCopy::Enable(&this->p_handle_out.tcp);
+    if (err) {
+      DLOG(WARNING) << "cannot send with MSG_ZEROCOPY: " << uv_strerror(err);
+      return;
+    }
+    this->zerocopy = std::make_unique<ZeroCopy>(&this->p_handle_out.tcp);
+  }
+
+  //returns false when the chunk, or what is left of it, still has to be written
+  //the normal way; nothing may be queued before it then
+  bool SendZeroCopy() {
+    auto length = this->request.length;
+    auto sent = this->zerocopy->Send(this->request);
+    //a full socket or a lack of option memory leaves it to the copy
+    if (sent == UV_EAGAIN || sent == UV_ENOBUFS) {
+      return false;
+    }
+    if (sent < 0) {
+      this->Fail(ErrorType::WriteError, int(sent));
+      return true;
+    }
+    Stats::Local().ZeroCopySent(sent);
+    if (sent < length) {
+      return false;
+    }
+    FlightRecorder::Local().Record(EventType::ServerWritten, this->id, this->proxy_state,
+                                   this->proxy_state, length, 0);
+    this->SetProxyState(ProxyState::ClientReading);
+    this->DoNext();
+    return true;
   }
 
   //send client data to server
   void WriteServer() {
-    DLOG(INFO) << "start to write data to server, length: " << this->length;
+    DLOG(INFO) << "start to write data to server, length: " << this->request.length;
+    if (this->zerocopy != nullptr && size_t(this->request.length) >= this->config->zerocopy_threshold &&
+        uv_stream_get_write_queue_size(this->handle_out<uv_stream_t>()) == 0 && this->SendZeroCopy()) {
+      return;
+    }
 
     auto p_write = new uv_write_t{};
     p_write->data = this;
 
     uv_buf_t buf;
-    buf.len = this->length;
-    buf.base = this->temp;
-
-    uv_write(p_write,
-             this->handle_out<uv_stream_t>(),
-             &buf,
-             1,
-             WriteServerDone);
+    buf.len = this->request.length;
+    buf.base = this->request.data;
+
+    int err = uv_write(p_write,
+                       this->handle_out<uv_stream_t>(),
+                       &buf,
+                       1,
+                       WriteServerDone);
+    if (err) {
+      delete p_write;
+      this->Fail(ErrorType::WriteError, err);
+    }
   }
 
   void ReadServer() {
-    this->p_handle_out.data = this;
+    if (this->Throttle(this->reply_throttled, this->reply_resume)) {
+      DLOG(INFO) << "reading from server is throttled";
+      return;
+    }
     DLOG(INFO) << "start to read from server";
-    uv_read_start(this->handle_out<uv_stream_t>(), AllocBuffer, ReadServerDone);
+    int err = uv_read_start(this->handle_out<uv_stream_t>(), AllocBuffer, ReadServerDone);
+    if (err) {
+      this->Fail(ErrorType::ReadError, err);
+    }
   }
 
   //send server data to client
@@ -230,20 +645,30 @@ class ShadeHandle final {
     p_write->data = this;
 
     uv_buf_t buf;
-    buf.len = this->length;
-    buf.base = this->temp;
-
-    uv_write(p_write,
-             this->handle_in<uv_stream_t>(),
-             &buf,
-             1,
-             WriteClientDone);
+    buf.len = this->reply.length;
+    buf.base = this->reply.data;
+
+    int err = uv_write(p_write,
+                       this->handle_in<uv_stream_t>(),
+                       &buf,
+                       1,
+                       WriteClientDone);
+    if (err) {
+      delete p_write;
+      this->Fail(ErrorType::WriteError, err);
+    }
   }
 
   void ReadClient() {
+    if (this->Throttle(this->request_throttled, this->request_resume)) {
+      DLOG(INFO) << "reading from client is throttled";
+      return;
+    }
     DLOG(INFO) << "start read data from client";
-    this->p_handle_in.data = this;
-    uv_read_start(this->handle_in<uv_stream_t>(), AllocBuffer, ReadClientDone);
+    int err = uv_read_start(this->handle_in<uv_stream_t>(), AllocBuffer, ReadClientDone);
+    if (err) {
+      this->Fail(ErrorType::ReadError, err);
+    }
   }
 
   //call back method for read from client handle
@@ -251,85 +676,85 @@ class ShadeHandle final {
   static void ReadClientDone(uv_stream_t* stream,
                              ssize_t nread,
                              const uv_buf_t* buf) {
-    //check if ShadeHandle created
+    ProfileScope scope(CallbackType::ClientReadCallback);
     auto shade_handle = reinterpret_cast<ShadeHandle*>(stream->data);
-    if (shade_handle == nullptr) {
-      throw UvException("cannot read data from handle");
-    }
-
-    //check if current state is right
-    //the server might waiting for the request
-    if (nread >= 0 && shade_handle->proxy_state != ProxyState::ClientReading
-        && shade_handle->proxy_state != ProxyState::AddressRequesting
-        && shade_handle->proxy_state != ProxyState::Connecting) {
-      LOG(ERROR) << "current state is in: " << shade_handle->proxy_state;
-      throw ProxyException("expect current state ClientReading or Requesting or Connecting");
-    }
-
-    shade_handle->offset = 0;
+    auto& request = shade_handle->request;
 
     DLOG(INFO) << "read buffer from client, nread is: " << nread;
+    FlightRecorder::Local().Record(EventType::ClientRead, shade_handle->id, shade_handle->proxy_state,
+                                   shade_handle->proxy_state, std::max<ssize_t>(nread, 0), std::min<ssize_t>(nread, 0));
     if (nread > 0) {
-      SecByteBlock bytes((byte*) buf->base, nread);
       DLOG(INFO) << "Got data from client, length:  " << nread;
+      shade_handle->Consume(nread);
+      request.data = buf->base;
+      request.length = nread;
 
       //if it's first time getting data from client, create cipher and parse server address
       if (shade_handle->decrypt_cipher == nullptr) {
 
         clock_t t1 = clock();
 
-        auto found = cipher_map.find(shade_handle->cipher_method);
-        if (found == cipher_map.cend()) {
-          throw ProxyException("unsupported encrypt method");
+        auto config = shade_handle->config;
+        auto iv_length = size_t(config->cipher_info.iv_length);
+        auto iv_data = (const byte*) request.data;
+        //an iv split over reads is put together first, like the header
+        if (shade_handle->iv != nullptr || size_t(request.length) < iv_length) {
+          if (shade_handle->iv == nullptr) {
+            shade_handle->iv = std::make_unique<IvParser>(iv_length);
+          }
+          auto taken = shade_handle->iv->Feed(request.data, request.length);
+          request.data += taken;
+          request.length -= taken;
+          if (!shade_handle->iv->Done()) {
+            request.Release();
+            return;
+          }
+          iv_data = shade_handle->iv->Data();
+        } else {
+          request.data += iv_length;
+          request.length -= iv_length;
         }
-        auto cipher_info = found->second;
-        auto iv = SecByteBlock((byte*) buf->base, cipher_info.iv_length);
-        auto key = Util::PasswordToKey(shade_handle->password, cipher_info.key_length);
-        shade_handle->decrypt_cipher = Util::getEncryption(shade_handle->cipher_method, key, iv);
-        DLOG(INFO) << "decrypt cipher created, method: " << shade_handle->cipher_method << ", key: "
-                   << Util::HexToString(key)
+        auto iv = SecByteBlock(iv_data, iv_length);
+        shade_handle->iv.reset();
+        shade_handle->decrypt_cipher = config->schedule->Decryptor(iv);
+        DLOG(INFO) << "decrypt cipher created, method: " << config->method << ", key: "
+                   << Util::HexToString(config->key)
                    << ", iv: " << Util::HexToString(iv);
 
-        SecByteBlock encrypt_data((byte*) buf->base + cipher_info.iv_length, nread - cipher_info.iv_length);
-        shade_handle->data = shade_handle->decrypt_cipher->decrypt(encrypt_data);
+        shade_handle->decrypt_cipher->decrypt((byte*) request.data, request.length);
 
         clock_t t2 = clock();
         DLOG(INFO) << "decrypt data use " << (t2 - t1) * 1.0f / CLOCKS_PER_SEC * 1000 << "ms";
 
-        shade_handle->proxy_state = ProxyState::AddressRequesting;
+        shade_handle->SetProxyState(ProxyState::AddressRequesting);
+        shade_handle->DoNext();
+      } else if (shade_handle->header != nullptr && !shade_handle->header->Done()) {
+        //the rest of a header which did not fit into the first read
+        shade_handle->decrypt_cipher->decrypt((byte*) request.data, request.length);
+        shade_handle->SetProxyState(ProxyState::AddressRequesting);
         shade_handle->DoNext();
       } else {
-        clock_t t1 = clock();
-
-        SecByteBlock encrypt_data((byte*) buf->base, nread);
-        shade_handle->data = shade_handle->decrypt_cipher->decrypt(encrypt_data);
-
-        clock_t t2 = clock();
-        DLOG(INFO) << "decrypt data use " << (t2 - t1) * 1.0f / CLOCKS_PER_SEC * 1000 << "ms";
-
         uv_read_stop(stream);
-
-        shade_handle->CopyToTemp();
-        if (shade_handle->proxy_state == ProxyState::ClientReading) {
-          DLOG(INFO) << "current status is ClientReading, so do next";
-          shade_handle->proxy_state = ProxyState::ServerWriting;
-          shade_handle->DoNext();
-        }
+        shade_handle->Schedule(false, request.length);
       }
 
     } else if (nread < 0) {
+      request.Release();
       if (nread != UV_EOF) {
-        LOG(ERROR) << "Read error: " << uv_err_name(nread);
-        throw UvException(nread);
-      } else {
+        shade_handle->Fail(ErrorType::ReadError, nread);
+      } else if (shade_handle->iv != nullptr || (shade_handle->header != nullptr && !shade_handle->header->Done())) {
+        //the client is done before its header
+        shade_handle->Fail(ErrorType::ProtocolError, UV_EPROTO);
+      } else if (!shade_handle->connected) {
         DLOG(INFO) << "close connection for client sent an EOF";
-        uv_close(shade_handle->handle_in<uv_handle_t>(), [](uv_handle_t* handle) {
-          uv_close(reinterpret_cast<ShadeHandle*>(handle->data)->handle_out<uv_handle_t>(),
-                   [](uv_handle_t* handle) {
-                     delete (ShadeHandle*) handle->data;
-                   });
-        });
+        shade_handle->Close();
+      } else {
+        DLOG(INFO) << "client sent an EOF, pass it on to the server";
+        uv_read_stop(stream);
+        shade_handle->Shutdown(false);
       }
+    } else {
+      request.Release();
     }
 
   }
@@ -337,181 +762,410 @@ class ShadeHandle final {
   static void GetRequestDone(uv_getaddrinfo_t* req,
                              int status,
                              struct addrinfo* addr_info) {
+    ProfileScope scope(CallbackType::LookupCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
+    delete req;
+
+    //the connection has been closed while resolving
+    if (shade_handle == nullptr) {
+      uv_freeaddrinfo(addr_info);
+      return;
+    }
+    shade_handle->p_getaddrinfo = nullptr;
+
     if (status < 0) {
-      throw UvException(status);
+      uv_freeaddrinfo(addr_info);
+      shade_handle->Fail(ErrorType::ResolveError, status);
+      return;
     }
 
-    auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
-    if (shade_handle == nullptr) {
-      throw UvException("cannot read data from handle");
+    //only IPv4 destinations are supported now
+    auto found = addr_info;
+    while (found != nullptr && found->ai_family != AF_INET) {
+      found = found->ai_next;
     }
+    if (found == nullptr) {
+      uv_freeaddrinfo(addr_info);
+      shade_handle->Fail(ErrorType::ResolveError, UV_EAI_ADDRFAMILY);
+      return;
+    }
+
+    memcpy(&shade_handle->addr_out, found->ai_addr, sizeof(sockaddr_in));
+    shade_handle->addr_out.sin_port = htons(shade_handle->port_out);
 
-    //check if current state is right
-    if (shade_handle->proxy_state != ProxyState::AddressRequesting) {
-      LOG(ERROR) << "current state is in: " << shade_handle->proxy_state;
-      throw ProxyException("expect current state AddressRequesting");
+    uv_freeaddrinfo(addr_info);
+    DLOG(INFO) << "got ip address";
+    if (!shade_handle->ApplyAddressRules()) {
+      return;
     }
 
-    memcpy(shade_handle->addr_out.get(), addr_info->ai_addr, sizeof(sockaddr_in));
-    shade_handle->addr_out->sin_port = htons(shade_handle->port_out);
+    shade_handle->SetProxyState(ProxyState::Connecting);
+    shade_handle->DoNext();
+  }
 
-    freeaddrinfo(addr_info);
+  static void ResolveDone(ResolveRequest* req, int status) {
+    ProfileScope scope(CallbackType::LookupCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
+    shade_handle->p_resolve = nullptr;
+    if (status < 0) {
+      delete req;
+      shade_handle->Fail(ErrorType::ResolveError, status);
+      return;
+    }
+    //only IPv4 destinations are supported now
+    if (req->ipv4.empty()) {
+      delete req;
+      shade_handle->Fail(ErrorType::ResolveError, UV_EAI_ADDRFAMILY);
+      return;
+    }
+
+    shade_handle->addr_out = sockaddr_in{};
+    shade_handle->addr_out.sin_family = AF_INET;
+    shade_handle->addr_out.sin_addr = req->ipv4.front();
+    shade_handle->addr_out.sin_port = htons(shade_handle->port_out);
+    delete req;
     DLOG(INFO) << "got ip address";
+    if (!shade_handle->ApplyAddressRules()) {
+      return;
+    }
 
-    shade_handle->proxy_state = ProxyState::Connecting;
+    shade_handle->SetProxyState(ProxyState::Connecting);
     shade_handle->DoNext();
   }
 
   static void WriteClientDone(uv_write_t* req, int status) {
-    //check if ShadeHandle created
+    ProfileScope scope(CallbackType::ClientWriteCallback);
     auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
-    if (shade_handle == nullptr) {
-      throw UvException("cannot read data from handle");
+    delete req;
+    if (shade_handle->closing) {
+      return;
     }
 
-    DLOG(INFO) << "data has been wrote to client, length: " << shade_handle->length;
+    DLOG(INFO) << "data has been wrote to client, length: " << shade_handle->reply.length;
+    FlightRecorder::Local().Record(EventType::ClientWritten, shade_handle->id, shade_handle->reply_state,
+                                   shade_handle->reply_state, shade_handle->reply.length, status);
+    shade_handle->reply.Release();
 
-    //check if current state is right
-    if (shade_handle->proxy_state != ProxyState::ClientWriting) {
-      LOG(ERROR) << "current state is in: " << shade_handle->proxy_state;
-      throw ProxyException("expect current state ServerWriting");
-    }
     if (status < 0) {
-      LOG(ERROR) << "error in write data to client";
-      throw UvException(status);
+      shade_handle->Fail(ErrorType::WriteError, status);
+      return;
     }
 
-    shade_handle->proxy_state = ProxyState::ClientReading;
-    shade_handle->DoNext();
-    delete req;
+    shade_handle->SetReplyState(ProxyState::ServerReading);
+    shade_handle->ReadServer();
   }
 
-  //copy data to this->data
+  //encrypt server data in place, the iv is prepended into the headroom
   static void ReadServerDone(uv_stream_t* stream,
                              ssize_t nread,
                              const uv_buf_t* buf) {
+    ProfileScope scope(CallbackType::ServerReadCallback);
     DLOG(INFO) << "read buffer from server, nread is: " << nread;
 
     auto shade_handle = reinterpret_cast<ShadeHandle*>(stream->data);
-    if (shade_handle == nullptr) {
-      throw UvException("cannot read data from handle");
-    }
-    //check if current state is right
-    if (nread >= 0 && shade_handle->proxy_state != ProxyState::ServerReading) {
-      LOG(ERROR) << "current state is in: " << shade_handle->proxy_state;
-      throw ProxyException("expect current state ServerReading");
-    }
-    shade_handle->offset = 0;
+    auto& reply = shade_handle->reply;
+    FlightRecorder::Local().Record(EventType::ServerRead, shade_handle->id, shade_handle->reply_state,
+                                   shade_handle->reply_state, std::max<ssize_t>(nread, 0), std::min<ssize_t>(nread, 0));
 
     if (nread > 0) {
-
-      SecByteBlock bytes((byte*) buf->base, nread);
       DLOG(INFO) << "Got server data, length: " << nread;
+      shade_handle->Consume(nread);
+      reply.data = buf->base;
+      reply.length = nread;
+
+      uv_read_stop(stream);
+      shade_handle->Schedule(true, reply.length);
+    } else if (nread < 0) {
+      reply.Release();
+      if (nread != UV_EOF) {
+        shade_handle->Fail(ErrorType::ReadError, nread);
+      } else if (shade_handle->upstream != nullptr && shade_handle->upstream->iv != nullptr) {
+        //the upstream is done before its iv
+        shade_handle->Fail(ErrorType::ProtocolError, UV_EPROTO);
+      } else {
+        DLOG(INFO) << "server sent an EOF, pass it on to the client";
+        uv_read_stop(stream);
+        shade_handle->Shutdown(true);
+      }
+    } else {
+      reply.Release();
+    }
+  }
 
-      clock_t t1 = clock();
+  //decrypt a client chunk and forward it to the server
+  void ProcessRequest() {
+    clock_t t1 = clock();
 
-      if (shade_handle->encrypt_cipher == nullptr) {
-        //encrypt data
-        auto cipher_info = cipher_map.at(shade_handle->cipher_method);
-        auto iv = Util::RandomBlock(cipher_info.iv_length);
-        auto key = Util::PasswordToKey(shade_handle->password, cipher_info.key_length);
-        shade_handle->encrypt_cipher = Util::getEncryption(shade_handle->cipher_method, key, iv);
+    this->decrypt_cipher->decrypt((byte*) this->request.data, this->request.length);
+    if (this->upstream != nullptr) {
+      this->upstream->encrypt->encrypt((byte*) this->request.data, this->request.length);
+    }
 
-        DLOG(INFO) << "encrypt cipher created, method: " << shade_handle->cipher_method << ", key: "
-                   << Util::HexToString(key)
-                   << ", iv: " << Util::HexToString(iv);
+    clock_t t2 = clock();
+    DLOG(INFO) << "decrypt data use " << (t2 - t1) * 1.0f / CLOCKS_PER_SEC * 1000 << "ms";
 
-        SecByteBlock decrypt_data((byte*) buf->base, nread);
+    DLOG(INFO) << "current status is ClientReading, so do next";
+    this->SetProxyState(ProxyState::ServerWriting);
+    this->DoNext();
+  }
 
-        shade_handle->data = shade_handle->encrypt_cipher->encrypt(decrypt_data);
-        shade_handle->length = iv.size() + nread;
+  //encrypt a server chunk and forward it to the client
+  void ProcessReply() {
+    auto& reply = this->reply;
+    clock_t t1 = clock();
 
-        memcpy(shade_handle->temp, iv.data(), iv.size());
-        memcpy(shade_handle->temp + iv.size(), shade_handle->data.data(), shade_handle->data.size());
-      } else {
-        SecByteBlock decrypt_data((byte*) buf->base, nread);
-        shade_handle->data = shade_handle->encrypt_cipher->encrypt(decrypt_data);
-        shade_handle->length = nread;
+    if (this->upstream != nullptr && !this->DecryptUpstream()) {
+      return;
+    }
+    if (this->encrypt_cipher == nullptr) {
+      //encrypt data
+      auto config = this->config;
+      auto iv = Util::RandomBlock(config->cipher_info.iv_length);
+      this->encrypt_cipher = config->schedule->Encryptor(iv);
+
+      DLOG(INFO) << "encrypt cipher created, method: " << config->method << ", key: "
+                 << Util::HexToString(config->key)
+                 << ", iv: " << Util::HexToString(iv);
+
+      this->encrypt_cipher->encrypt((byte*) reply.data, reply.length);
+      reply.data -= iv.size();
+      reply.length += iv.size();
+      memcpy(reply.data, iv.data(), iv.size());
+    } else {
+      this->encrypt_cipher->encrypt((byte*) reply.data, reply.length);
+    }
 
-        memcpy(shade_handle->temp, shade_handle->data.data(), shade_handle->data.size());
-      }
+    DLOG(INFO) << "send data to client, length: " << reply.length;
 
-      DLOG(INFO) << "send data to client, length: " << shade_handle->length;
+    clock_t t2 = clock();
 
-      clock_t t2 = clock();
+    DLOG(INFO) << "encrypt data use " << (t2 - t1) * 1.0f / CLOCKS_PER_SEC * 1000 << "ms";
 
-      DLOG(INFO) << "encrypt data use " << (t2 - t1) * 1.0f / CLOCKS_PER_SEC * 1000 << "ms";
+    this->SetReplyState(ProxyState::ClientWriting);
+    this->WriteClient();
+  }
 
-      uv_read_stop(stream);
+  static void RunTask(void* owner, int reply_side) {
+    ProfileScope scope(CallbackType::TaskCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(owner);
+    shade_handle->queued--;
+    if (reply_side) {
+      shade_handle->ProcessReply();
+    } else {
+      shade_handle->ProcessRequest();
+    }
+  }
 
-      shade_handle->proxy_state = ProxyState::ClientWriting;
-      shade_handle->DoNext();
-    } else if (nread < 0) {
-      if (nread != UV_EOF) {
-        LOG(ERROR) << "Read error: " << uv_err_name(nread);
-        throw UvException(nread);
-      } else {
-        DLOG(INFO) << "got an EOF";
-      }
+  //hand the chunk to the loop scheduler if there is one, otherwise run it now
+  void Schedule(bool reply_side, size_t cost) {
+    auto& scheduler = Scheduler::Local();
+    if (scheduler.Active(this->server_handle->loop)) {
+      this->queued++;
+      scheduler.Push(this, RunTask, reply_side, cost);
+    } else if (reply_side) {
+      this->ProcessReply();
+    } else {
+      this->ProcessRequest();
     }
   }
 
   static void WriteServerDone(uv_write_t* req, int status) {
-    //check if ShadeHandle created
+    ProfileScope scope(CallbackType::ServerWriteCallback);
     auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
-    if (shade_handle == nullptr) {
-      throw UvException("cannot read data from handle");
+    delete req;
+    if (shade_handle->closing) {
+      return;
     }
 
-    DLOG(INFO) << "data has been wrote to server, length: " << shade_handle->length;
+    DLOG(INFO) << "data has been wrote to server, length: " << shade_handle->request.length;
+    FlightRecorder::Local().Record(EventType::ServerWritten, shade_handle->id, shade_handle->proxy_state,
+                                   shade_handle->proxy_state, shade_handle->request.length, status);
+    shade_handle->request.Release();
 
-    //check if current state is right
-    if (shade_handle->proxy_state != ProxyState::ServerWriting) {
-      LOG(ERROR) << "current state is in: " << shade_handle->proxy_state;
-      throw ProxyException("expect current state ServerWriting");
-    }
-    if (status >= 0) {
-      shade_handle->proxy_state = ProxyState::ServerReading;
-      shade_handle->DoNext();
-    } else {
-      LOG(ERROR) << "write to server error";
-      throw UvException(status);
+    if (status < 0) {
+      shade_handle->Fail(ErrorType::WriteError, status);
+      return;
     }
-    delete req;
+    shade_handle->SetProxyState(ProxyState::ClientReading);
+    shade_handle->DoNext();
   }
 
+  //the buffer is taken from the pool on demand and leaves room for the iv
   static void AllocBuffer(uv_handle_t* handle,
                           size_t suggested_size,
                           uv_buf_t* buf) {
     auto shade_handle = reinterpret_cast<ShadeHandle*>(handle->data);
-    if (shade_handle == nullptr) {
-      throw UvException("cannot read data from handle");
+    auto& chunk = handle == shade_handle->handle_in<uv_handle_t>() ? shade_handle->request : shade_handle->reply;
+    if (chunk.buffer == nullptr) {
+      chunk.buffer = BufferPool::Local().Acquire();
+    }
+    buf->base = chunk.buffer + BufferPool::kHeadroom;
+    buf->len = BufferPool::kBufferSize - BufferPool::kHeadroom;
+  }
+
+  //sends a FIN after the pending writes of one direction, which has ended
+  void Shutdown(bool reply_side) {
+    auto req = new uv_shutdown_t{};
+    req->data = this;
+    auto stream = reply_side ? this->handle_in<uv_stream_t>() : this->handle_out<uv_stream_t>();
+    int err = uv_shutdown(req, stream, ShutdownDone);
+    if (err) {
+      delete req;
+      DLOG(INFO) << "cannot pass the EOF on: " << uv_strerror(err);
+      this->Close();
+    }
+  }
+
+  static void ShutdownDone(uv_shutdown_t* req, int status) {
+    ProfileScope scope(CallbackType::ShutdownCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(req->data);
+    bool reply_side = req->handle == shade_handle->handle_in<uv_stream_t>();
+    delete req;
+    if (shade_handle->closing) {
+      return;
+    }
+    FlightRecorder::Local().Record(EventType::ShutdownEvent, shade_handle->id, shade_handle->proxy_state,
+                                   shade_handle->reply_state, 0, status, reply_side);
+    //the peer is gone already, there is nothing left to relay
+    if (status < 0) {
+      shade_handle->Close();
+      return;
+    }
+    (reply_side ? shade_handle->reply_ended : shade_handle->request_ended) = true;
+    if (shade_handle->request_ended && shade_handle->reply_ended) {
+      shade_handle->Close();
+    }
+  }
+
+  static void CloseDone(uv_handle_t* handle) {
+    ProfileScope scope(CallbackType::CloseCallback);
+    auto shade_handle = reinterpret_cast<ShadeHandle*>(handle->data);
+    if (--shade_handle->pending_closes == 0) {
+      delete shade_handle;
     }
-    buf->base = shade_handle->temp;
-    buf->len = sizeof(shade_handle->temp);
   }
 
  public:
-  explicit ShadeHandle(uv_stream_t* server, std::string method = "aes-256-cfb", std::string password = "123456")
-      : cipher_method(std::move(method)), password(std::move(password)) {
-    uv_tcp_init(server->loop, &this->p_handle_in);
-    uv_tcp_init(server->loop, &this->p_handle_out);
+  explicit ShadeHandle(uv_stream_t* server,
+                       const ServerConfig& config = ServerConfig::Default(),
+                       TokenBucket* listener_bucket = nullptr,
+                       Admission* admission = nullptr)
+      : proxy_state(ProxyState::ClientReading), reply_state(ProxyState::ServerReading),
+        closing(false), connected(false), request_ended(false), reply_ended(false), pending(false), queued(0), pending_closes(0), id(FlightRecorder::Local().NextId()),
+        p_handle_in(), p_handle_out(), p_getaddrinfo(nullptr), p_resolve(nullptr), p_timer(nullptr),
+        timer_due(0), request_throttled(false), reply_throttled(false), request_resume(0), reply_resume(0), local_path(nullptr), config(&config),
+        listener_bucket(listener_bucket), bucket(config.connection_limit), admission(admission) {
+    //clients of a listener on a Unix domain socket connect over one too
+    if (server->type == UV_NAMED_PIPE) {
+      uv_pipe_init(server->loop, &this->p_handle_in.pipe, 0);
+    } else {
+      uv_tcp_init(server->loop, &this->p_handle_in.tcp);
+    }
+    this->p_handle_in.tcp.data = this;
     this->server_handle = server;
+    Stats::Local().Opened();
+    if (admission != nullptr) {
+      admission->Opened();
+    }
   }
 
   ~ShadeHandle() {
+    this->request.Release();
+    this->reply.Release();
+    delete this->p_timer;
+    Stats::Local().Closed();
+    if (this->admission != nullptr) {
+      this->admission->Closed();
+    }
     DLOG(INFO) << "ShadeHandle has been deleted";
   }
 
+  //the socket is created up front when it has to be tuned or bound before the handshake
+  static int OpenOutbound(uv_tcp_t* tcp, const ServerConfig& config, const sockaddr_in& destination) {
+    auto& profile = config.outbound_profile;
+    auto& egress = config.egress;
+    if (profile.Empty() && egress.Empty()) {
+      return 0;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -errno;
+    }
+    int err = egress.Empty() ? 0 : egress.Bind(fd, destination);
+    if (err == 0) {
+      err = uv_tcp_open(tcp, fd);
+    }
+    if (err) {
+      ::close(fd);
+      return err;
+    }
+    if (!profile.Empty()) {
+      err = profile.Apply(tcp);
+      if (err) {
+        DLOG(WARNING) << "cannot apply the outbound socket profile: " << uv_strerror(err);
+      }
+    }
+    return 0;
+  }
+
+  //a failed accept only drops this connection
   void Accept(uv_stream_t* server) {
     int err = uv_accept(server, this->handle_in<uv_stream_t>());
+    FlightRecorder::Local().Record(EventType::AcceptEvent, this->id, 0, 0, 0, err);
     if (err) {
-      throw UvException(err);
+      this->Fail(ErrorType::AcceptError, err);
+      return;
+    }
+    //tuning is best effort, the connection is served anyway
+    auto& profile = this->config->inbound_profile;
+    if (!profile.Empty() && this->handle_in<uv_handle_t>()->type == UV_TCP) {
+      err = profile.Apply(&this->p_handle_in.tcp);
+      if (err) {
+        DLOG(WARNING) << "cannot apply the inbound socket profile: " << uv_strerror(err);
+      }
     }
-    this->proxy_state = ProxyState::ClientReading;
+    this->SetProxyState(ProxyState::ClientReading);
     this->DoNext();
   }
 
+  //close both sides, the handle deletes itself once libuv is done with them
+  //pending writes and connects are called back with UV_ECANCELED before that
+  void Close() {
+    if (this->closing) {
+      return;
+    }
+    this->closing = true;
+    FlightRecorder::Local().Record(EventType::CloseEvent, this->id, this->proxy_state, this->reply_state);
+    if (this->queued > 0) {
+      Scheduler::Local().Cancel(this);
+    }
+    this->EndPending();
+    if (this->p_getaddrinfo != nullptr) {
+      this->p_getaddrinfo->data = nullptr;
+      uv_cancel(reinterpret_cast<uv_req_t*>(this->p_getaddrinfo));
+      this->p_getaddrinfo = nullptr;
+    }
+    if (this->p_resolve != nullptr) {
+      this->config->resolver->Cancel(this->p_resolve);
+      delete this->p_resolve;
+      this->p_resolve = nullptr;
+    }
+    this->pending_closes = 1;
+    uv_close(this->handle_in<uv_handle_t>(), CloseDone);
+    if (this->zerocopy != nullptr) {
+      //the socket stays open until the kernel is done with the pinned buffers
+      this->pending_closes++;
+      this->zerocopy->Linger(CloseDone);
+    } else if (this->OutboundOpen()) {
+      this->pending_closes++;
+      uv_close(this->handle_out<uv_handle_t>(), CloseDone);
+    }
+    if (this->p_timer != nullptr) {
+      this->pending_closes++;
+      uv_close(reinterpret_cast<uv_handle_t*>(this->p_timer), CloseDone);
+    }
+  }
+
   template<typename U>
   U* handle_in() {
     return reinterpret_cast<U*>(&this->p_handle_in);
@@ -522,6 +1176,5 @@ class ShadeHandle final {
     return reinterpret_cast<U*>(&this->p_handle_out);
   }
 };
-
 }
 #endif //SHADESOCKS_SRC_SS_HANDLE_H_
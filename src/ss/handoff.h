@@ -0,0 +1,364 @@
+#ifndef SHADESOCKS_SRC_SS_HANDOFF_H_
+#define SHADESOCKS_SRC_SS_HANDOFF_H_
+
+#include <uv.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "server.h"
+
+namespace shadesocks {
+
+// Restarts without dropping connections. The running process offers its
+// listening sockets on a Unix socket; a successor started with the new build
+// or config takes them over with HandoffClient, listens on them right away
+// and tells the predecessor that it is ready. Only then the predecessor stops
+// accepting and drains the connections it has accepted, up to a deadline.
+// Both processes share the sockets meanwhile, so a connection in the backlog
+// is accepted by one of them and no handshake is lost.
+//
+// Every listening socket is sent as one "L" byte with the handle attached,
+// over a libuv IPC pipe; a "." ends the list and the successor answers "R"
+// once it listens. The server has to be kept until drained has been called.
+class HandoffServer final {
+ public:
+  // called once the handed over listeners have no connection left or the
+  // deadline has passed, with the number of connections still open
+  using Drained = std::function<void(size_t remaining)>;
+
+  //how often a draining process counts its connections
+  static constexpr uint64_t kDrainInterval = 100;
+
+  explicit HandoffServer(std::vector<std::shared_ptr<TCPHandle>> listeners, uint64_t drain_timeout = 30 * 1000)
+      : listeners(std::move(listeners)), drain_timeout(drain_timeout) {}
+
+  HandoffServer(const HandoffServer&) = delete;
+  HandoffServer& operator=(const HandoffServer&) = delete;
+
+  ~HandoffServer() {
+    this->Close();
+  }
+
+  // only the user running the process may connect, a stale socket file of an
+  // earlier process at the path is replaced
+  void Start(uv_loop_t* loop, const std::string& path, Drained drained) {
+    this->Close();
+    this->drained = std::move(drained);
+    this->path = path;
+    this->server = new uv_pipe_t{};
+    uv_pipe_init(loop, this->server, 0);
+    this->server->data = this;
+    unlink(path.c_str());
+    int err = uv_pipe_bind(this->server, path.c_str());
+    if (err == 0) {
+      err = chmod(path.c_str(), S_IRUSR | S_IWUSR) ? -errno : 0;
+    }
+    if (err == 0) {
+      err = uv_listen(reinterpret_cast<uv_stream_t*>(this->server), 1, Connected);
+    }
+    if (err) {
+      this->Close();
+      throw UvException(err);
+    }
+    //the listeners keep the loop running, not the offer
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->server));
+    LOG(INFO) << "offer the listening sockets on " << path;
+  }
+
+  //withdraws the offer, a draining process keeps draining
+  void Close() {
+    if (this->peer != nullptr) {
+      ClosePipe(this->peer);
+      this->peer = nullptr;
+    }
+    if (this->server != nullptr) {
+      ClosePipe(this->server);
+      this->server = nullptr;
+      //the path belongs to the successor once handed over
+      if (!this->handed_off) {
+        unlink(this->path.c_str());
+      }
+    }
+  }
+
+  bool HandedOff() const { return this->handed_off; }
+
+  //connections of the handed over listeners which are still relayed, by
+  //callbacks or by coroutines alike
+  size_t Remaining() const {
+    size_t remaining = 0;
+    for (auto& listener : this->listeners) {
+      remaining += listener->admission.Connections();
+    }
+    return remaining;
+  }
+
+ private:
+  std::vector<std::shared_ptr<TCPHandle>> listeners;
+  uint64_t drain_timeout;
+  Drained drained;
+  std::string path;
+
+  //freed once closed, like every handle here
+  uv_pipe_t* server = nullptr;
+  //the successor taking over, only one at a time
+  uv_pipe_t* peer = nullptr;
+  bool handed_off = false;
+  uint64_t drain_deadline = 0;
+
+  static void ClosePipe(uv_pipe_t* pipe) {
+    pipe->data = nullptr;
+    uv_close(reinterpret_cast<uv_handle_t*>(pipe), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_pipe_t*>(handle);
+    });
+  }
+
+  static void WriteDone(uv_write_t* req, int status) {
+    if (status < 0 && status != UV_ECANCELED) {
+      LOG(WARNING) << "cannot hand over the listening sockets: " << uv_strerror(status);
+    }
+    delete req;
+  }
+
+  static void Connected(uv_stream_t* stream, int status) {
+    auto handoff = reinterpret_cast<HandoffServer*>(stream->data);
+    if (status < 0 || handoff == nullptr) {
+      return;
+    }
+    auto peer = new uv_pipe_t{};
+    uv_pipe_init(stream->loop, peer, 1);
+    peer->data = handoff;
+    if (uv_accept(stream, reinterpret_cast<uv_stream_t*>(peer)) != 0 || handoff->peer != nullptr) {
+      ClosePipe(peer);
+      return;
+    }
+    handoff->peer = peer;
+
+    static char listener_mark[] = "L";
+    static char end_mark[] = ".";
+    auto out = reinterpret_cast<uv_stream_t*>(peer);
+    int err = 0;
+    for (auto& listener : handoff->listeners) {
+      auto buf = uv_buf_init(listener_mark, 1);
+      auto req = new uv_write_t{};
+      err = uv_write2(req, out, &buf, 1, reinterpret_cast<uv_stream_t*>(&listener->resource), WriteDone);
+      if (err) {
+        delete req;
+        break;
+      }
+    }
+    if (err == 0) {
+      auto buf = uv_buf_init(end_mark, 1);
+      auto req = new uv_write_t{};
+      err = uv_write(req, out, &buf, 1, WriteDone);
+      if (err) {
+        delete req;
+      }
+    }
+    if (err == 0) {
+      err = uv_read_start(out, [](uv_handle_t*, size_t, uv_buf_t* buf) {
+        static char slab[16];
+        *buf = uv_buf_init(slab, sizeof(slab));
+      }, ReadDone);
+    }
+    if (err) {
+      LOG(WARNING) << "cannot hand over the listening sockets: " << uv_strerror(err);
+      ClosePipe(peer);
+      handoff->peer = nullptr;
+    }
+  }
+
+  static void ReadDone(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    auto handoff = reinterpret_cast<HandoffServer*>(stream->data);
+    if (handoff == nullptr || nread == 0) {
+      return;
+    }
+    if (nread > 0 && memchr(buf->base, 'R', nread) != nullptr) {
+      handoff->HandOver();
+      return;
+    }
+    if (nread < 0) {
+      //the successor is gone before it was ready, accepting goes on here
+      LOG(WARNING) << "the successor left before taking over: " << uv_strerror(nread);
+      ClosePipe(handoff->peer);
+      handoff->peer = nullptr;
+    }
+  }
+
+  void HandOver() {
+    LOG(INFO) << "the successor accepts now, drain " << this->Remaining() << " connections";
+    this->handed_off = true;
+    for (auto& listener : this->listeners) {
+      listener->stop();
+    }
+    auto loop = this->server->loop;
+    this->Close();
+
+    this->drain_deadline = uv_now(loop) + this->drain_timeout;
+    auto timer = new uv_timer_t{};
+    uv_timer_init(loop, timer);
+    timer->data = this;
+    uv_timer_start(timer, [](uv_timer_t* timer) {
+      auto handoff = reinterpret_cast<HandoffServer*>(timer->data);
+      auto remaining = handoff->Remaining();
+      if (remaining > 0 && uv_now(timer->loop) < handoff->drain_deadline) {
+        return;
+      }
+      uv_close(reinterpret_cast<uv_handle_t*>(timer), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_timer_t*>(handle);
+      });
+      //the server may be deleted by the callback
+      if (handoff->drained) {
+        handoff->drained(remaining);
+      }
+    }, 0, kDrainInterval);
+  }
+};
+
+// The successor side of a restart, see HandoffServer.
+class HandoffClient final {
+ public:
+  // called with 0 once the listeners have been received, UV_ENOENT or
+  // UV_ECONNREFUSED mean that nothing runs at the path and the process starts
+  // on its own
+  using Received = std::function<void(int status)>;
+
+  HandoffClient() = default;
+  HandoffClient(const HandoffClient&) = delete;
+  HandoffClient& operator=(const HandoffClient&) = delete;
+
+  ~HandoffClient() {
+    this->Close();
+  }
+
+  void Start(uv_loop_t* loop, const std::string& path, Received received) {
+    this->Close();
+    this->received = std::move(received);
+    this->listeners.clear();
+    this->pipe = new uv_pipe_t{};
+    uv_pipe_init(loop, this->pipe, 1);
+    this->pipe->data = this;
+    auto req = new uv_connect_t{};
+    uv_pipe_connect(req, this->pipe, path.c_str(), ConnectDone);
+  }
+
+  // the sockets of the predecessor, they still have to be configured and
+  // listened on
+  const std::vector<std::shared_ptr<TCPHandle>>& Listeners() const { return this->listeners; }
+
+  // tells the predecessor that the listeners accept here now
+  void Ready() {
+    if (this->pipe == nullptr) {
+      return;
+    }
+    static char ready_mark[] = "R";
+    auto buf = uv_buf_init(ready_mark, 1);
+    auto req = new uv_write_t{};
+    req->data = this->pipe;
+    this->pipe->data = nullptr;
+    this->pipe = nullptr;
+    //the pipe is closed once the answer is out
+    int err = uv_write(req, reinterpret_cast<uv_stream_t*>(req->data), &buf, 1, [](uv_write_t* req, int status) {
+      ClosePipe(reinterpret_cast<uv_pipe_t*>(req->data));
+      delete req;
+    });
+    if (err) {
+      ClosePipe(reinterpret_cast<uv_pipe_t*>(req->data));
+      delete req;
+    }
+  }
+
+  void Close() {
+    if (this->pipe != nullptr) {
+      ClosePipe(this->pipe);
+      this->pipe = nullptr;
+    }
+  }
+
+ private:
+  Received received;
+  uv_pipe_t* pipe = nullptr;
+  std::vector<std::shared_ptr<TCPHandle>> listeners;
+
+  static void ClosePipe(uv_pipe_t* pipe) {
+    pipe->data = nullptr;
+    uv_close(reinterpret_cast<uv_handle_t*>(pipe), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_pipe_t*>(handle);
+    });
+  }
+
+  void Finish(int status) {
+    if (status < 0) {
+      this->listeners.clear();
+      this->Close();
+    } else {
+      uv_read_stop(reinterpret_cast<uv_stream_t*>(this->pipe));
+    }
+    //the client may be deleted by the callback
+    auto received = std::move(this->received);
+    received(status);
+  }
+
+  static void ConnectDone(uv_connect_t* req, int status) {
+    auto client = reinterpret_cast<HandoffClient*>(req->handle->data);
+    delete req;
+    if (client == nullptr) {
+      return;
+    }
+    if (status == 0) {
+      status = uv_read_start(reinterpret_cast<uv_stream_t*>(client->pipe), [](uv_handle_t*, size_t, uv_buf_t* buf) {
+        static char slab[64];
+        *buf = uv_buf_init(slab, sizeof(slab));
+      }, ReadDone);
+    }
+    if (status < 0) {
+      client->Finish(status);
+    }
+  }
+
+  static void ReadDone(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    auto client = reinterpret_cast<HandoffClient*>(stream->data);
+    if (client == nullptr || nread == 0) {
+      return;
+    }
+    if (nread < 0) {
+      client->Finish(nread == UV_EOF ? UV_EPROTO : int(nread));
+      return;
+    }
+    auto pipe = reinterpret_cast<uv_pipe_t*>(stream);
+    for (ssize_t i = 0; i < nread; i++) {
+      if (buf->base[i] == '.') {
+        client->Finish(0);
+        return;
+      }
+      //every mark comes with its socket
+      auto type = uv_pipe_pending_count(pipe) > 0 ? uv_pipe_pending_type(pipe) : UV_UNKNOWN_HANDLE;
+      if (buf->base[i] != 'L' || (type != UV_TCP && type != UV_NAMED_PIPE)) {
+        client->Finish(UV_EPROTO);
+        return;
+      }
+      auto listener = std::shared_ptr<TCPHandle>(new TCPHandle{});
+      if (type == UV_NAMED_PIPE) {
+        uv_pipe_init(stream->loop, &listener->pipe, 0);
+      } else {
+        uv_tcp_init(stream->loop, &listener->resource);
+      }
+      int err = uv_accept(stream, reinterpret_cast<uv_stream_t*>(&listener->resource));
+      if (err) {
+        client->Finish(err);
+        return;
+      }
+      listener->update_address();
+      client->listeners.push_back(std::move(listener));
+    }
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_HANDOFF_H_
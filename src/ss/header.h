@@ -0,0 +1,151 @@
+#ifndef SHADESOCKS_SRC_SS_HEADER_H_
+#define SHADESOCKS_SRC_SS_HEADER_H_
+
+#include <uv.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace shadesocks {
+
+enum AddrType {
+  TypeIPv4 = 1,
+  TypeIPv6 = 4,
+  TypeDomain = 3,
+};
+
+// Collects the IV in front of the first chunk of a stream when it is split
+// over reads. A read which holds the whole IV needs no parser, it is used
+// from the buffer directly.
+class IvParser final {
+ public:
+  //xchacha20 has the longest
+  static constexpr size_t kMaxLength = 24;
+
+  explicit IvParser(size_t length) : length(std::min(length, kMaxLength)) {}
+
+  // takes the IV bytes at the start of data and returns how many were taken,
+  // once Done the rest of data belongs to the stream
+  size_t Feed(const char* data, size_t length) {
+    auto count = std::min(this->length - this->filled, length);
+    memcpy(this->iv + this->filled, data, count);
+    this->filled += count;
+    return count;
+  }
+
+  bool Done() const { return this->filled == this->length; }
+  size_t Filled() const { return this->filled; }
+  size_t Length() const { return this->length; }
+  // only complete once Done
+  const uint8_t* Data() const { return this->iv; }
+
+ private:
+  uint8_t iv[kMaxLength];
+  size_t length;
+  size_t filled = 0;
+};
+
+// Parses the address header of a request, [type, address, port], as it
+// arrives over any number of reads. Only the header itself is copied, at most
+// kMaxLength bytes; whatever follows it in a read is left where it is as the
+// payload to forward.
+class HeaderParser final {
+ public:
+  //the type, the length and the longest domain, then the port
+  static constexpr size_t kMaxLength = 1 + 1 + 255 + 2;
+
+  // takes the header bytes at the start of data and returns how many were
+  // taken, or a negative error; once Done the rest of data is payload
+  ssize_t Feed(const char* data, size_t length) {
+    size_t taken = 0;
+    while (!this->done && taken < length) {
+      auto count = std::min(this->needed - this->filled, length - taken);
+      memcpy(this->header + this->filled, data + taken, count);
+      this->filled += count;
+      taken += count;
+      if (this->filled == this->needed) {
+        int err = this->Advance();
+        if (err) {
+          return err;
+        }
+      }
+    }
+    return ssize_t(taken);
+  }
+
+  bool Done() const { return this->done; }
+
+  void Reset() {
+    this->filled = 0;
+    this->needed = 1;
+    this->done = false;
+  }
+
+  //only valid once Done
+  int Type() const { return this->header[0] & 0xf; }
+
+  uint16_t Port() const {
+    return uint16_t(this->header[this->needed - 2] << 8 | this->header[this->needed - 1]);
+  }
+
+  // the destination of an IPv4 header, port included
+  sockaddr_in Address() const {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr, this->header + 1, 4);
+    addr.sin_port = htons(this->Port());
+    return addr;
+  }
+
+  // the domain of a domain header, it lives as long as the parser
+  std::string_view Host() const {
+    return std::string_view(reinterpret_cast<const char*>(this->header) + 2, this->header[1]);
+  }
+
+  // the whole header as it was received
+  std::string_view Bytes() const {
+    return std::string_view(reinterpret_cast<const char*>(this->header), this->filled);
+  }
+
+ private:
+  uint8_t header[kMaxLength];
+  size_t filled = 0;
+  //the length of the header as far as it is known
+  size_t needed = 1;
+  bool done = false;
+
+  //finds out how much of the header is still missing
+  int Advance() {
+    if (this->filled == 1) {
+      switch (this->Type()) {
+        case AddrType::TypeIPv4:
+          this->needed = 1 + 4 + 2;
+          return 0;
+        case AddrType::TypeDomain:
+          this->needed = 2;
+          return 0;
+        //IPv6 is not supported now
+        default:
+          return UV_EAFNOSUPPORT;
+      }
+    }
+    if (this->Type() == AddrType::TypeDomain && this->filled == 2) {
+      if (this->header[1] == 0) {
+        return UV_EPROTO;
+      }
+      this->needed = 2 + this->header[1] + 2;
+      return 0;
+    }
+    //a name with a zero byte would be cut short by the lookup
+    if (this->Type() == AddrType::TypeDomain && memchr(this->header + 2, 0, this->header[1]) != nullptr) {
+      return UV_EPROTO;
+    }
+    this->done = true;
+    return 0;
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_HEADER_H_
@@ -0,0 +1,112 @@
+#ifndef SHADESOCKS_SRC_SS_HISTOGRAM_H_
+#define SHADESOCKS_SRC_SS_HISTOGRAM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace shadesocks {
+
+// HDR histogram: values are kept with a fixed number of significant decimal
+// digits over the whole range, so the tail is as exact as the median while
+// memory stays bounded. Values above the highest trackable one are clamped.
+class Histogram final {
+ public:
+  explicit Histogram(uint64_t highest = 60ull * 1000 * 1000 * 1000, int digits = 3) {
+    this->sub_bits = 1;
+    uint64_t largest_single = 2 * uint64_t(std::pow(10, digits));
+    while ((uint64_t(1) << this->sub_bits) < largest_single) {
+      this->sub_bits++;
+    }
+    this->highest = std::max(highest, uint64_t(1) << this->sub_bits);
+    this->counts.resize(this->Index(this->highest) + 1);
+  }
+
+  void Record(uint64_t value, uint64_t count = 1) {
+    value = std::min(value, this->highest);
+    this->counts[this->Index(value)] += count;
+    this->total += count;
+    this->min = std::min(this->min, value);
+    this->max = std::max(this->max, value);
+    this->sum += double(value) * count;
+  }
+
+  //both have to be created with the same range and precision
+  void Merge(const Histogram& other) {
+    for (size_t i = 0; i < other.counts.size() && i < this->counts.size(); i++) {
+      this->counts[i] += other.counts[i];
+    }
+    this->total += other.total;
+    this->min = std::min(this->min, other.min);
+    this->max = std::max(this->max, other.max);
+    this->sum += other.sum;
+  }
+
+  void Reset() {
+    std::fill(this->counts.begin(), this->counts.end(), 0);
+    this->total = 0;
+    this->min = UINT64_MAX;
+    this->max = 0;
+    this->sum = 0;
+  }
+
+  // the highest value equivalent to the one below which the fraction of samples fall
+  uint64_t Percentile(double fraction) const {
+    if (this->total == 0) {
+      return 0;
+    }
+    auto rank = uint64_t(std::ceil(std::min(std::max(fraction, 0.0), 1.0) * this->total));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < this->counts.size(); i++) {
+      seen += this->counts[i];
+      if (seen >= rank) {
+        return std::min(this->Highest(i), this->max);
+      }
+    }
+    return this->max;
+  }
+
+  uint64_t Count() const { return this->total; }
+  uint64_t Min() const { return this->total == 0 ? 0 : this->min; }
+  uint64_t Max() const { return this->max; }
+  double Mean() const { return this->total == 0 ? 0 : this->sum / this->total; }
+
+ private:
+  //values below 2^sub_bits are counted exactly, each power of two above
+  //is split into half as many linear sub buckets
+  int sub_bits;
+  uint64_t highest;
+  std::vector<uint64_t> counts;
+
+  uint64_t total = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  double sum = 0;
+
+  size_t Index(uint64_t value) const {
+    uint64_t sub_count = uint64_t(1) << this->sub_bits;
+    if (value < sub_count) {
+      return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - this->sub_bits + 1;
+    uint64_t half = sub_count >> 1;
+    return sub_count + (shift - 1) * half + ((value >> shift) - half);
+  }
+
+  uint64_t Highest(size_t index) const {
+    uint64_t sub_count = uint64_t(1) << this->sub_bits;
+    if (index < sub_count) {
+      return index;
+    }
+    uint64_t half = sub_count >> 1;
+    int shift = int((index - sub_count) / half) + 1;
+    uint64_t sub = (index - sub_count) % half + half;
+    return ((sub + 1) << shift) - 1;
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_HISTOGRAM_H_
@@ -0,0 +1,50 @@
+#ifndef SHADESOCKS_SRC_SS_LOCAL_H_
+#define SHADESOCKS_SRC_SS_LOCAL_H_
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace shadesocks {
+
+// Destinations which run on this host and listen on a Unix domain socket.
+// A request for one of them is relayed over the socket instead of TCP, which
+// skips the lookup, the loopback TCP stack and its per-segment costs. Hosts
+// are matched as the client sent them, a domain or a dotted IPv4 address.
+class LocalDestinations {
+ public:
+  bool Empty() const { return this->paths.empty(); }
+  size_t Size() const { return this->paths.size(); }
+
+  void Add(const std::string& host, uint16_t port, std::string path) {
+    this->paths[Key(host, port)] = std::move(path);
+  }
+
+  // the path of the socket, nullptr when the destination is not local
+  const std::string* Find(const std::string& host, uint16_t port) const {
+    if (this->paths.empty()) {
+      return nullptr;
+    }
+    auto found = this->paths.find(Key(host, port));
+    return found == this->paths.end() ? nullptr : &found->second;
+  }
+
+ private:
+  //host:port, domains are case insensitive
+  std::unordered_map<std::string, std::string> paths;
+
+  static std::string Key(const std::string& host, uint16_t port) {
+    std::string key;
+    key.reserve(host.size() + 6);
+    for (auto c : host) {
+      key.push_back(char(tolower(static_cast<unsigned char>(c))));
+    }
+    key.push_back(':');
+    key.append(std::to_string(port));
+    return key;
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_LOCAL_H_
@@ -0,0 +1,292 @@
+#ifndef SHADESOCKS_SRC_SS_PROFILER_H_
+#define SHADESOCKS_SRC_SS_PROFILER_H_
+
+#include <uv.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include "histogram.h"
+
+namespace shadesocks {
+
+// what the loop thread ran a callback for
+enum CallbackType {
+  AcceptCallback,
+  ClientReadCallback,
+  ServerReadCallback,
+  ClientWriteCallback,
+  ServerWriteCallback,
+  LookupCallback,
+  ConnectCallback,
+  // crypto and write of a chunk run by the loop scheduler
+  TaskCallback,
+  ShutdownCallback,
+  CloseCallback,
+  // the rate limit resuming a connection
+  TimerCallback,
+  CallbackTypeCount,
+};
+
+inline const char* CallbackTypeName(CallbackType type) {
+  switch (type) {
+    case AcceptCallback: return "accept";
+    case ClientReadCallback: return "client read";
+    case ServerReadCallback: return "server read";
+    case ClientWriteCallback: return "client write";
+    case ServerWriteCallback: return "server write";
+    case LookupCallback: return "lookup";
+    case ConnectCallback: return "connect";
+    case TaskCallback: return "task";
+    case ShutdownCallback: return "shutdown";
+    case CloseCallback: return "close";
+    case TimerCallback: return "timer";
+    default: return "unknown";
+  }
+}
+
+struct ProfilerOptions {
+  // milliseconds between two samples of the loop lag
+  uint64_t lag_interval = 100;
+  // milliseconds between two summaries logged, 0 leaves them out
+  uint64_t summary_interval = 0;
+};
+
+// Where the time of the loop thread goes. The callbacks of the relay are
+// timed by type, a prepare hook right before the poll and a check hook right
+// after it split every iteration into the time blocked in the poll, the I/O
+// callbacks and the rest, and a timer samples how late the loop runs.
+// Disabled, the cost is a thread local flag tested per callback.
+class LoopProfiler final {
+ public:
+  struct Callbacks {
+    uint64_t count = 0;
+    // nanoseconds
+    uint64_t total = 0;
+    uint64_t max = 0;
+  };
+
+  static LoopProfiler& Local() {
+    thread_local LoopProfiler profiler;
+    return profiler;
+  }
+
+  //the hooks do not keep the loop alive
+  void Start(uv_loop_t* loop, ProfilerOptions options = ProfilerOptions()) {
+    this->Stop();
+    this->Reset();
+    this->loop = loop;
+    this->options = options;
+    this->prepared_at = 0;
+    this->checked_at = 0;
+    this->summary_due = 0;
+    uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+    this->idle_mark = uv_metrics_idle_time(loop);
+
+    this->prepare = new uv_prepare_t{};
+    uv_prepare_init(loop, this->prepare);
+    this->prepare->data = this;
+    uv_prepare_start(this->prepare, PrepareDone);
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->prepare));
+
+    this->check = new uv_check_t{};
+    uv_check_init(loop, this->check);
+    this->check->data = this;
+    uv_check_start(this->check, CheckDone);
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->check));
+
+    this->timer = new uv_timer_t{};
+    uv_timer_init(loop, this->timer);
+    this->timer->data = this;
+    this->sample_due = uv_hrtime() + options.lag_interval * 1000000;
+    uv_timer_start(this->timer, TimerDone, options.lag_interval, options.lag_interval);
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->timer));
+    this->enabled = true;
+  }
+
+  //the hooks are freed once closed, what has been measured is kept
+  void Stop() {
+    if (this->loop == nullptr) {
+      return;
+    }
+    this->enabled = false;
+    for (auto handle : {reinterpret_cast<uv_handle_t*>(this->prepare), reinterpret_cast<uv_handle_t*>(this->check),
+                        reinterpret_cast<uv_handle_t*>(this->timer)}) {
+      uv_close(handle, [](uv_handle_t* handle) {
+        switch (handle->type) {
+          case UV_PREPARE: delete reinterpret_cast<uv_prepare_t*>(handle); break;
+          case UV_CHECK: delete reinterpret_cast<uv_check_t*>(handle); break;
+          default: delete reinterpret_cast<uv_timer_t*>(handle); break;
+        }
+      });
+    }
+    this->prepare = nullptr;
+    this->check = nullptr;
+    this->timer = nullptr;
+    this->loop = nullptr;
+  }
+
+  bool Enabled() const { return this->enabled; }
+
+  void Record(CallbackType type, uint64_t nanoseconds) {
+    auto& callbacks = this->callbacks[type];
+    callbacks.count++;
+    callbacks.total += nanoseconds;
+    callbacks.max = std::max(callbacks.max, nanoseconds);
+    this->events++;
+  }
+
+  const Callbacks& Callback(CallbackType type) const { return this->callbacks[type]; }
+
+  uint64_t Iterations() const { return this->iterations; }
+  // microseconds an iteration ran without being blocked in the poll
+  const Histogram& IterationTime() const { return this->iteration_time; }
+  // callbacks timed per iteration
+  const Histogram& EventsPerIteration() const { return this->events_per_iteration; }
+  // microseconds the lag timer ran late
+  const Histogram& LoopLag() const { return this->loop_lag; }
+
+  //nanoseconds blocked in the poll, spent in I/O callbacks and spent elsewhere in the loop
+  uint64_t IdleTime() const { return this->idle_time; }
+  uint64_t PollTime() const { return this->poll_time; }
+  uint64_t OtherTime() const { return this->other_time; }
+
+  void Reset() {
+    this->callbacks = {};
+    this->iterations = 0;
+    this->iteration_time.Reset();
+    this->events_per_iteration.Reset();
+    this->loop_lag.Reset();
+    this->idle_time = 0;
+    this->poll_time = 0;
+    this->other_time = 0;
+    this->events = 0;
+  }
+
+  std::string Summary() const {
+    std::ostringstream out;
+    uint64_t busy = this->poll_time + this->other_time;
+    uint64_t total = busy + this->idle_time;
+    out << this->iterations << " iterations, busy " << (total ? busy * 100 / total : 0) << "%"
+        << ", iteration p50/p99/max " << this->iteration_time.Percentile(0.5) << "/"
+        << this->iteration_time.Percentile(0.99) << "/" << this->iteration_time.Max() << "us"
+        << ", events p50/max " << this->events_per_iteration.Percentile(0.5) << "/"
+        << this->events_per_iteration.Max()
+        << ", lag p99/max " << this->loop_lag.Percentile(0.99) << "/" << this->loop_lag.Max() << "us";
+    for (int i = 0; i < CallbackTypeCount; i++) {
+      auto& callbacks = this->callbacks[i];
+      if (callbacks.count == 0) {
+        continue;
+      }
+      out << ", " << CallbackTypeName(CallbackType(i)) << " " << callbacks.count << "x "
+          << callbacks.total / callbacks.count / 1000 << "us avg " << callbacks.max / 1000 << "us max";
+    }
+    return out.str();
+  }
+
+ private:
+  bool enabled = false;
+  uv_loop_t* loop = nullptr;
+  ProfilerOptions options;
+  //freed once closed, like the other hooks on the loop
+  uv_prepare_t* prepare = nullptr;
+  uv_check_t* check = nullptr;
+  uv_timer_t* timer = nullptr;
+
+  std::array<Callbacks, CallbackTypeCount> callbacks{};
+  uint64_t iterations = 0;
+  Histogram iteration_time{10ull * 1000 * 1000, 2};
+  Histogram events_per_iteration{1000 * 1000, 2};
+  Histogram loop_lag{10ull * 1000 * 1000, 2};
+  uint64_t idle_time = 0;
+  uint64_t poll_time = 0;
+  uint64_t other_time = 0;
+
+  //in nanoseconds, set by the hooks of the current iteration
+  uint64_t prepared_at = 0;
+  uint64_t checked_at = 0;
+  uint64_t idle_mark = 0;
+  uint64_t events = 0;
+  uint64_t sample_due = 0;
+  uint64_t summary_due = 0;
+
+  LoopProfiler() = default;
+
+  //ends the iteration before and starts the poll
+  static void PrepareDone(uv_prepare_t* prepare) {
+    auto profiler = reinterpret_cast<LoopProfiler*>(prepare->data);
+    auto now = uv_hrtime();
+    if (profiler->checked_at != 0) {
+      profiler->other_time += now - profiler->checked_at;
+      profiler->iterations++;
+      profiler->events_per_iteration.Record(profiler->events);
+    }
+    profiler->events = 0;
+    profiler->prepared_at = now;
+  }
+
+  //the poll has returned and its callbacks have run
+  static void CheckDone(uv_check_t* check) {
+    auto profiler = reinterpret_cast<LoopProfiler*>(check->data);
+    auto now = uv_hrtime();
+    auto idle = uv_metrics_idle_time(check->loop);
+    auto blocked = idle - profiler->idle_mark;
+    profiler->idle_mark = idle;
+    profiler->idle_time += blocked;
+    if (profiler->prepared_at != 0) {
+      auto polled = now - profiler->prepared_at;
+      profiler->poll_time += polled > blocked ? polled - blocked : 0;
+      if (profiler->checked_at != 0) {
+        auto iteration = now - profiler->checked_at;
+        profiler->iteration_time.Record((iteration > blocked ? iteration - blocked : 0) / 1000);
+      }
+    }
+    profiler->checked_at = now;
+  }
+
+  static void TimerDone(uv_timer_t* timer) {
+    auto profiler = reinterpret_cast<LoopProfiler*>(timer->data);
+    auto now = uv_hrtime();
+    auto interval = profiler->options.lag_interval * 1000000;
+    profiler->loop_lag.Record(now > profiler->sample_due ? (now - profiler->sample_due) / 1000 : 0);
+    profiler->sample_due = now + interval;
+
+    auto summary_interval = profiler->options.summary_interval * 1000000;
+    if (summary_interval == 0) {
+      return;
+    }
+    if (profiler->summary_due == 0) {
+      profiler->summary_due = now + summary_interval;
+    } else if (now >= profiler->summary_due) {
+      //every summary covers the interval since the one before
+      LOG(INFO) << "loop profile: " << profiler->Summary();
+      profiler->Reset();
+      profiler->summary_due = now + summary_interval;
+    }
+  }
+};
+
+// times the callback it is declared in while the profiler of the thread is enabled
+class ProfileScope final {
+ public:
+  explicit ProfileScope(CallbackType type)
+      : type(type), start(LoopProfiler::Local().Enabled() ? uv_hrtime() : 0) {}
+
+  ~ProfileScope() {
+    if (this->start != 0) {
+      LoopProfiler::Local().Record(this->type, uv_hrtime() - this->start);
+    }
+  }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+
+ private:
+  CallbackType type;
+  uint64_t start;
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_PROFILER_H_
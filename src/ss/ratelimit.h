@@ -0,0 +1,78 @@
+#ifndef SHADESOCKS_SRC_SS_RATELIMIT_H_
+#define SHADESOCKS_SRC_SS_RATELIMIT_H_
+
+#include <uv.h>
+#include <algorithm>
+#include <cstdint>
+#include "buffer.h"
+
+namespace shadesocks {
+
+struct RateLimit {
+  // bytes per second, 0 means unlimited
+  uint64_t rate = 0;
+  // bytes which may pass at once after being idle
+  uint64_t burst = 0;
+};
+
+// Bytes are charged after they have been read, so the bucket may go into debt
+// by one chunk. Reads stay paused until the debt is paid back, which keeps the
+// long run rate exact while every chunk costs O(1).
+class TokenBucket final {
+ public:
+  explicit TokenBucket(RateLimit limit = RateLimit()) {
+    this->Reset(limit);
+  }
+
+  void Reset(RateLimit limit) {
+    //a burst below one read would only add timer latency
+    this->rate = limit.rate;
+    this->burst = std::max<uint64_t>(limit.burst, BufferPool::kBufferSize);
+    this->tokens = this->burst;
+    this->last = uv_hrtime();
+  }
+
+  bool Unlimited() const { return this->rate == 0; }
+
+  void Consume(size_t bytes, uint64_t now) {
+    if (this->Unlimited()) {
+      return;
+    }
+    this->Refill(now);
+    this->tokens -= bytes;
+  }
+
+  // nanoseconds until the bucket is out of debt
+  uint64_t Delay(uint64_t now) {
+    if (this->Unlimited()) {
+      return 0;
+    }
+    this->Refill(now);
+    if (this->tokens >= 0) {
+      return 0;
+    }
+    return uint64_t(-this->tokens * 1e9 / this->rate) + 1;
+  }
+
+ private:
+  uint64_t rate;
+  uint64_t burst;
+  double tokens;
+  uint64_t last;
+
+  void Refill(uint64_t now) {
+    if (now > this->last) {
+      this->tokens = std::min<double>(this->burst, this->tokens + (now - this->last) * 1e-9 * this->rate);
+      this->last = now;
+    }
+  }
+};
+
+// shared by every connection of the loop running on this thread
+inline TokenBucket& GlobalBucket() {
+  thread_local TokenBucket bucket;
+  return bucket;
+}
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_RATELIMIT_H_
@@ -0,0 +1,256 @@
+#ifndef SHADESOCKS_SRC_SS_RECORDER_H_
+#define SHADESOCKS_SRC_SS_RECORDER_H_
+
+#include <uv.h>
+#include <glog/logging.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace shadesocks {
+
+enum EventType : uint8_t {
+  AcceptEvent,
+  // from and to are the ProxyState of the client to server direction
+  ProxyTransition,
+  // the same for the server to client direction
+  ReplyTransition,
+  ClientRead,
+  ServerRead,
+  ClientWritten,
+  ServerWritten,
+  // detail is the ErrorType
+  FailEvent,
+  CloseEvent,
+  // detail is 1 for the FIN passed on to the client, 0 for the one to the server
+  ShutdownEvent,
+  EventTypeCount
+};
+
+inline const char* EventTypeName(uint8_t type) {
+  switch (type) {
+    case EventType::AcceptEvent: return "accept";
+    case EventType::ProxyTransition: return "proxy";
+    case EventType::ReplyTransition: return "reply";
+    case EventType::ClientRead: return "client read";
+    case EventType::ServerRead: return "server read";
+    case EventType::ClientWritten: return "client written";
+    case EventType::ServerWritten: return "server written";
+    case EventType::FailEvent: return "fail";
+    case EventType::CloseEvent: return "close";
+    case EventType::ShutdownEvent: return "shutdown";
+    default: return "unknown";
+  }
+}
+
+// 24 bytes, written to the dump as they are in memory
+struct Event {
+  // uv_hrtime in nanoseconds
+  uint64_t time;
+  uint32_t connection;
+  uint8_t type;
+  uint8_t from;
+  uint8_t to;
+  uint8_t detail;
+  int32_t bytes;
+  int32_t error;
+};
+static_assert(sizeof(Event) == 24, "events are dumped as they are");
+
+struct RecordingHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t count;
+  // uv_hrtime when the dump was written
+  uint64_t dumped_at;
+};
+
+// Always on record of what the connections of one loop thread did last.
+// Events go into a fixed ring which overwrites the oldest ones, recording
+// is a few stores without locks or allocation. The ring is dumped to a file
+// on SIGUSR1 once DumpOnSignal is called, or through Dump.
+class FlightRecorder final {
+ public:
+  static constexpr size_t kCapacity = 16 * 1024;
+  static constexpr uint32_t kVersion = 1;
+
+  static FlightRecorder& Local() {
+    thread_local FlightRecorder recorder;
+    return recorder;
+  }
+
+  uint32_t NextId() { return ++this->last_id; }
+
+  void set_enabled(bool enabled) { this->enabled = enabled; }
+  bool get_enabled() const { return this->enabled; }
+
+  void Record(EventType type, uint32_t connection, uint8_t from = 0, uint8_t to = 0,
+              int64_t bytes = 0, int error = 0, uint8_t detail = 0) {
+    if (!this->enabled) {
+      return;
+    }
+    uint64_t position = this->head.load(std::memory_order_relaxed);
+    auto& event = this->events[position & (kCapacity - 1)];
+    event.time = uv_hrtime();
+    event.connection = connection;
+    event.type = type;
+    event.from = from;
+    event.to = to;
+    event.detail = detail;
+    event.bytes = int32_t(bytes);
+    event.error = error;
+    this->head.store(position + 1, std::memory_order_release);
+  }
+
+  // the recorded events, oldest first
+  std::vector<Event> Snapshot() const {
+    uint64_t end = this->head.load(std::memory_order_acquire);
+    uint64_t begin = end > kCapacity ? end - kCapacity : 0;
+    std::vector<Event> snapshot;
+    snapshot.reserve(end - begin);
+    for (uint64_t i = begin; i < end; i++) {
+      snapshot.push_back(this->events[i & (kCapacity - 1)]);
+    }
+    //drop what has been overwritten while copying
+    uint64_t after = this->head.load(std::memory_order_acquire);
+    if (after > begin + kCapacity - 1) {
+      size_t torn = std::min<uint64_t>(after - (begin + kCapacity - 1), snapshot.size());
+      snapshot.erase(snapshot.begin(), snapshot.begin() + torn);
+    }
+    return snapshot;
+  }
+
+  void Clear() {
+    this->head.store(0, std::memory_order_release);
+  }
+
+  // returns 0 or a negative errno
+  int Dump(const std::string& path) const {
+    auto snapshot = this->Snapshot();
+    RecordingHeader header{{'S', 'S', 'F', 'R'}, kVersion, sizeof(Event), uint32_t(snapshot.size()), uv_hrtime()};
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return -errno;
+    }
+    int err = WriteAll(fd, &header, sizeof(header));
+    if (err == 0) {
+      err = WriteAll(fd, snapshot.data(), snapshot.size() * sizeof(Event));
+    }
+    ::close(fd);
+    return err;
+  }
+
+  // every signal dumps to path.<n>, the signal handle does not keep the loop alive
+  int DumpOnSignal(uv_loop_t* loop, const std::string& path, int signum = SIGUSR1) {
+    this->StopSignal();
+    this->dump_path = path;
+    int err = uv_signal_init(loop, &this->signal);
+    if (err) {
+      return err;
+    }
+    this->signal.data = this;
+    this->watching = true;
+    err = uv_signal_start(&this->signal, SignalDone, signum);
+    uv_unref(reinterpret_cast<uv_handle_t*>(&this->signal));
+    return err;
+  }
+
+  void StopSignal() {
+    if (this->watching) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->signal), nullptr);
+      this->watching = false;
+    }
+  }
+
+  uint32_t Dumps() const { return this->dumps; }
+
+  // reads a dump written by Dump, returns 0 or a negative errno
+  static int Load(const std::string& path, RecordingHeader& header, std::vector<Event>& events) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -errno;
+    }
+    int err = ReadAll(fd, &header, sizeof(header));
+    if (err == 0 && (memcmp(header.magic, "SSFR", 4) != 0 || header.version != kVersion ||
+        header.event_size != sizeof(Event))) {
+      err = -EINVAL;
+    }
+    if (err == 0) {
+      events.resize(header.count);
+      err = ReadAll(fd, events.data(), events.size() * sizeof(Event));
+    }
+    ::close(fd);
+    return err;
+  }
+
+ private:
+  Event events[kCapacity];
+  std::atomic<uint64_t> head{0};
+  uint32_t last_id = 0;
+  bool enabled = true;
+
+  uv_signal_t signal;
+  bool watching = false;
+  std::string dump_path;
+  uint32_t dumps = 0;
+
+  FlightRecorder() = default;
+
+  static void SignalDone(uv_signal_t* signal, int signum) {
+    auto recorder = reinterpret_cast<FlightRecorder*>(signal->data);
+    auto path = recorder->dump_path + "." + std::to_string(recorder->dumps++);
+    int err = recorder->Dump(path);
+    if (err) {
+      LOG(WARNING) << "cannot dump the flight recorder to " << path << ": " << uv_strerror(err);
+    } else {
+      LOG(INFO) << "flight recorder dumped to " << path;
+    }
+  }
+
+  static int WriteAll(int fd, const void* data, size_t size) {
+    auto bytes = reinterpret_cast<const char*>(data);
+    while (size > 0) {
+      ssize_t written = ::write(fd, bytes, size);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written < 0) {
+        return -errno;
+      }
+      bytes += written;
+      size -= written;
+    }
+    return 0;
+  }
+
+  static int ReadAll(int fd, void* data, size_t size) {
+    auto bytes = reinterpret_cast<char*>(data);
+    while (size > 0) {
+      ssize_t got = ::read(fd, bytes, size);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got < 0) {
+        return -errno;
+      }
+      if (got == 0) {
+        return -EINVAL;
+      }
+      bytes += got;
+      size -= got;
+    }
+    return 0;
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_RECORDER_H_
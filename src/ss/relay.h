@@ -0,0 +1,367 @@
+#ifndef SHADESOCKS_SRC_SS_RELAY_H_
+#define SHADESOCKS_SRC_SS_RELAY_H_
+
+#ifdef SHADESOCKS_COROUTINES
+namespace shadesocks {
+
+// The relay of ShadeHandle written as coroutines, one for the handshake
+// which then starts one for each direction. Every step resumes the
+// coroutine waiting for it directly, no state is kept outside the frames,
+// which come from the FramePool. The frame of the handshake, with the
+// lookup and the connect, is freed once the connection is established.
+//
+// Rate limits, the loop scheduler, upstreams, the stub resolver, zero-copy
+// sends and local destinations are only applied by ShadeHandle so far, a
+// listener refuses to start with them. Without upstreams every rule action
+// besides deny is an allow, like for ShadeHandle.
+class CoroRelay final {
+ public:
+  static void Accept(uv_stream_t* server, const ServerConfig& config, Admission* admission) {
+    auto relay = new CoroRelay(server->loop, config, admission);
+    relay->Run(server);
+  }
+
+  CoroRelay(const CoroRelay&) = delete;
+  CoroRelay& operator=(const CoroRelay&) = delete;
+
+ private:
+  const ServerConfig* config;
+  //admission control of the listener, if any
+  Admission* admission;
+  //identifies the connection in the flight recorder
+  uint32_t id;
+  bool closing = false;
+  //coroutines which have not returned yet
+  int running = 0;
+  int pending_closes = 0;
+  //directions whose end has been passed on
+  int ended = 0;
+
+  CoroStream in;
+  CoroStream out;
+  //in flight lookup, cancelled when the connection is closed
+  uv_getaddrinfo_t* resolving = nullptr;
+
+  std::unique_ptr<Cipher> decrypt_cipher;
+  std::unique_ptr<Cipher> encrypt_cipher;
+  Chunk request;
+  Chunk reply;
+
+  // keeps the relay alive while a coroutine runs
+  struct Running {
+    CoroRelay* relay;
+
+    explicit Running(CoroRelay* relay) : relay(relay) { relay->running++; }
+
+    ~Running() {
+      this->relay->running--;
+      this->relay->Release();
+    }
+  };
+
+  // a lookup and connect counted against the pending limit of the listener
+  struct Pending {
+    Admission* admission;
+
+    ~Pending() {
+      if (this->admission != nullptr) {
+        this->admission->EndPending();
+      }
+    }
+  };
+
+  CoroRelay(uv_loop_t* loop, const ServerConfig& config, Admission* admission)
+      : config(&config), admission(admission), id(FlightRecorder::Local().NextId()) {
+    this->in.Init(loop, this, CloseDone);
+    this->out.Init(loop, this, CloseDone);
+    Stats::Local().Opened();
+    if (admission != nullptr) {
+      admission->Opened();
+    }
+  }
+
+  ~CoroRelay() {
+    this->request.Release();
+    this->reply.Release();
+    Stats::Local().Closed();
+    if (this->admission != nullptr) {
+      this->admission->Closed();
+    }
+  }
+
+  Task Run(uv_stream_t* server) {
+    Running running(this);
+    int err = uv_accept(server, this->in.stream());
+    FlightRecorder::Local().Record(EventType::AcceptEvent, this->id, 0, 0, 0, err);
+    if (err) {
+      this->Fail(ErrorType::AcceptError, err);
+      co_return;
+    }
+    auto& profile = this->config->inbound_profile;
+    if (!profile.Empty()) {
+      profile.Apply(&this->in.tcp);
+    }
+
+    //the stream starts with the iv, which may take more than one read like the header
+    auto& request = this->request;
+    IvParser iv(this->config->cipher_info.iv_length);
+    ssize_t nread;
+    while (true) {
+      nread = co_await Loop::Read(this->in, request);
+      //the client is done in the middle of the iv
+      if (nread == UV_EOF && !this->closing && iv.Filled() > 0) {
+        this->Fail(ErrorType::ProtocolError, UV_EPROTO);
+        co_return;
+      }
+      if (!this->Received(EventType::ClientRead, nread)) {
+        co_return;
+      }
+      auto taken = iv.Feed(request.data, request.length);
+      request.data += taken;
+      request.length -= taken;
+      if (iv.Done()) {
+        break;
+      }
+      request.Release();
+    }
+    this->decrypt_cipher = this->config->schedule->Decryptor(SecByteBlock(iv.Data(), iv.Length()));
+    this->decrypt_cipher->decrypt((byte*) request.data, request.length);
+
+    //the header may take more than one read
+    HeaderParser header;
+    while (true) {
+      auto taken = header.Feed(request.data, request.length);
+      if (taken < 0) {
+        this->Fail(ErrorType::ProtocolError, int(taken));
+        co_return;
+      }
+      request.data += taken;
+      request.length -= taken;
+      if (header.Done()) {
+        break;
+      }
+      request.Release();
+      nread = co_await Loop::Read(this->in, request);
+      //the client is done before its header
+      if (nread == UV_EOF && !this->closing) {
+        this->Fail(ErrorType::ProtocolError, UV_EPROTO);
+        co_return;
+      }
+      if (!this->Received(EventType::ClientRead, nread)) {
+        co_return;
+      }
+      this->decrypt_cipher->decrypt((byte*) request.data, request.length);
+    }
+    if (request.length == 0) {
+      request.Release();
+    }
+
+    //turning the request away is cheaper now than a lookup and connect which arrive too late
+    if (this->admission != nullptr && !this->admission->BeginPending()) {
+      Stats::Local().CountShed(ShedReason::PendingFull);
+      this->Close();
+      co_return;
+    }
+    //ends once the frame of the handshake is freed
+    Pending pending{this->admission};
+
+    sockaddr_in addr = header.Address();
+    std::string host;
+    if (header.Type() == AddrType::TypeDomain) {
+      host = std::string(header.Host());
+      addr = sockaddr_in{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(header.Port());
+    }
+    if (!this->Allowed(header.Type(), addr, host)) {
+      co_return;
+    }
+
+    if (!host.empty()) {
+      err = co_await Loop::Resolve(this->out, host, addr, this->resolving);
+      if (this->closing) {
+        co_return;
+      }
+      if (err) {
+        this->Fail(ErrorType::ResolveError, err);
+        co_return;
+      }
+      if (!this->Allowed(AddrType::TypeIPv4, addr, "", false)) {
+        co_return;
+      }
+    }
+    err = ShadeHandle::OpenOutbound(&this->out.tcp, *this->config, addr);
+    if (err == 0) {
+      err = co_await Loop::Connect(this->out, addr);
+    }
+    if (this->closing) {
+      co_return;
+    }
+    if (err) {
+      this->Fail(ErrorType::ConnectError, err);
+      co_return;
+    }
+
+    //both directions are relayed independently from now on
+    this->Reply();
+    this->Forward();
+  }
+
+  //the payload after the header is written first
+  Task Forward() {
+    Running running(this);
+    auto& request = this->request;
+    while (true) {
+      if (request.length > 0) {
+        int err = co_await Loop::Write(this->out, request.data, request.length);
+        if (!this->Sent(EventType::ServerWritten, request, err)) {
+          co_return;
+        }
+      }
+      request.Release();
+      auto nread = co_await Loop::Read(this->in, request);
+      if (nread == UV_EOF && !this->closing) {
+        this->Ended(false, co_await Loop::Shutdown(this->out));
+        co_return;
+      }
+      if (!this->Received(EventType::ClientRead, nread)) {
+        co_return;
+      }
+      this->decrypt_cipher->decrypt((byte*) request.data, request.length);
+    }
+  }
+
+  Task Reply() {
+    Running running(this);
+    auto& reply = this->reply;
+    while (true) {
+      auto nread = co_await Loop::Read(this->out, reply);
+      //the client may still send after the server is done
+      if (nread == UV_EOF && !this->closing) {
+        this->Ended(true, co_await Loop::Shutdown(this->in));
+        co_return;
+      }
+      if (!this->Received(EventType::ServerRead, nread)) {
+        co_return;
+      }
+      if (this->encrypt_cipher == nullptr) {
+        auto iv = Util::RandomBlock(this->config->cipher_info.iv_length);
+        this->encrypt_cipher = this->config->schedule->Encryptor(iv);
+        this->encrypt_cipher->encrypt((byte*) reply.data, reply.length);
+        reply.data -= iv.size();
+        reply.length += iv.size();
+        memcpy(reply.data, iv.data(), iv.size());
+      } else {
+        this->encrypt_cipher->encrypt((byte*) reply.data, reply.length);
+      }
+      int err = co_await Loop::Write(this->in, reply.data, reply.length);
+      if (!this->Sent(EventType::ClientWritten, reply, err)) {
+        co_return;
+      }
+      reply.Release();
+    }
+  }
+
+  //the FIN of one direction has been passed on, the relay closes once both are
+  void Ended(bool reply_side, int status) {
+    FlightRecorder::Local().Record(EventType::ShutdownEvent, this->id, 0, 0, 0, status, reply_side);
+    if (this->closing) {
+      return;
+    }
+    if (status < 0 || ++this->ended == 2) {
+      this->Close();
+    }
+  }
+
+  //returns false when the direction has to stop
+  bool Received(EventType type, ssize_t nread) {
+    FlightRecorder::Local().Record(type, this->id, 0, 0, std::max<ssize_t>(nread, 0), std::min<ssize_t>(nread, 0));
+    if (this->closing) {
+      return false;
+    }
+    if (nread == UV_EOF) {
+      this->Close();
+      return false;
+    }
+    if (nread < 0) {
+      this->Fail(ErrorType::ReadError, int(nread));
+      return false;
+    }
+    return true;
+  }
+
+  bool Sent(EventType type, const Chunk& chunk, int status) {
+    FlightRecorder::Local().Record(type, this->id, 0, 0, chunk.length, status);
+    if (this->closing) {
+      return false;
+    }
+    if (status < 0) {
+      this->Fail(ErrorType::WriteError, status);
+      return false;
+    }
+    return true;
+  }
+
+  //the rules of the listener for the destination, only denying is supported;
+  //the address a domain resolved to is checked without the default action
+  bool Allowed(int addr_type, const sockaddr_in& addr, const std::string& host, bool by_default = true) {
+    if (this->config->rules == nullptr) {
+      return true;
+    }
+    auto rules = this->config->rules->Current();
+    auto action = by_default ? rules->default_action : RuleAction::Allow;
+    if (addr_type == AddrType::TypeIPv4) {
+      rules->Match(addr.sin_addr, action);
+    } else {
+      rules->MatchHost(host, action);
+    }
+    if (action == RuleAction::Deny) {
+      this->Fail(ErrorType::DeniedError, UV_EACCES);
+      return false;
+    }
+    return true;
+  }
+
+  void Fail(ErrorType type, int err) {
+    LOG(WARNING) << ErrorTypeName(type) << " error: " << uv_strerror(err);
+    FlightRecorder::Local().Record(EventType::FailEvent, this->id, 0, 0, 0, err, type);
+    Stats::Local().CountError(type);
+    this->Close();
+  }
+
+  //suspended reads, writes and connects are resumed with an error before the handles are gone
+  void Close() {
+    if (this->closing) {
+      return;
+    }
+    this->closing = true;
+    FlightRecorder::Local().Record(EventType::CloseEvent, this->id);
+    if (this->resolving != nullptr) {
+      uv_cancel(reinterpret_cast<uv_req_t*>(this->resolving));
+    }
+    this->pending_closes = 2;
+    this->in.Close();
+    this->out.Close();
+  }
+
+  static void CloseDone(void* owner) {
+    auto relay = reinterpret_cast<CoroRelay*>(owner);
+    relay->pending_closes--;
+    relay->Release();
+  }
+
+  //deletes the relay once its coroutines and handles are done
+  void Release() {
+    if (this->closing && this->running == 0 && this->pending_closes == 0) {
+      delete this;
+    }
+  }
+};
+
+inline void AcceptCoroutine(uv_stream_t* server, const ServerConfig& config, Admission* admission) {
+  CoroRelay::Accept(server, config, admission);
+}
+
+}  // namespace shadesocks
+#endif  // SHADESOCKS_COROUTINES
+#endif //SHADESOCKS_SRC_SS_RELAY_H_
@@ -0,0 +1,603 @@
+#ifndef SHADESOCKS_SRC_SS_RESOLVER_H_
+#define SHADESOCKS_SRC_SS_RESOLVER_H_
+
+#include <uv.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "encrypt.h"
+
+namespace shadesocks {
+
+struct ResolverOptions {
+  // DNS servers, tried in turns for every retransmit
+  std::vector<sockaddr_in> servers;
+  // milliseconds until the first retransmit, doubled for every further one
+  uint64_t timeout = 1000;
+  // sends of a query until it fails
+  int attempts = 3;
+  // AAAA is asked for in parallel with A and the lookup waits for both; off
+  // by default as the relay connects over IPv4 only
+  bool ipv6 = false;
+  // names answered without a query, lower case
+  std::unordered_map<std::string, in_addr> hosts;
+
+  void AddServer(const std::string& ip, int port = 53) {
+    sockaddr_in addr{};
+    if (uv_ip4_addr(ip.c_str(), port, &addr) != 0) {
+      throw InvalidArgument("bad DNS server " + ip);
+    }
+    this->servers.push_back(addr);
+  }
+
+  // the IPv4 name servers of /etc/resolv.conf and the IPv4 names of /etc/hosts
+  static ResolverOptions System(const std::string& resolv_conf = "/etc/resolv.conf",
+                                const std::string& hosts_file = "/etc/hosts") {
+    ResolverOptions options;
+    std::ifstream resolv(resolv_conf);
+    std::string line;
+    while (std::getline(resolv, line)) {
+      std::istringstream fields(line);
+      std::string key;
+      std::string ip;
+      sockaddr_in addr{};
+      if (fields >> key >> ip && key == "nameserver" && uv_ip4_addr(ip.c_str(), 53, &addr) == 0) {
+        options.servers.push_back(addr);
+      }
+    }
+    //like the C library when nothing is configured
+    if (options.servers.empty()) {
+      options.AddServer("127.0.0.1");
+    }
+
+    std::ifstream hosts(hosts_file);
+    while (std::getline(hosts, line)) {
+      line.resize(std::min(line.find('#'), line.size()));
+      std::istringstream fields(line);
+      std::string ip;
+      in_addr addr{};
+      if (!(fields >> ip) || uv_inet_pton(AF_INET, ip.c_str(), &addr) != 0) {
+        continue;
+      }
+      for (std::string name; fields >> name;) {
+        options.hosts.emplace(Lower(name), addr);
+      }
+    }
+    return options;
+  }
+
+  static std::string Lower(std::string name) {
+    for (auto& c : name) {
+      c = char(tolower(static_cast<unsigned char>(c)));
+    }
+    return name;
+  }
+};
+
+struct ResolveRequest;
+using ResolveCallback = void (*)(ResolveRequest* req, int status);
+
+// One lookup, owned by the caller until its callback or Cancel.
+struct ResolveRequest {
+  void* data = nullptr;
+  std::vector<in_addr> ipv4;
+  std::vector<in6_addr> ipv6;
+
+  // used by the resolver
+  ResolveCallback callback = nullptr;
+  int status = 0;
+  int pending = 0;
+  uint16_t ids[2] = {0, 0};
+};
+
+// A DNS stub resolver on the loop thread, instead of getaddrinfo on the
+// threadpool. Every query goes over one UDP socket, any number of them in
+// flight at once and told apart by their id and question, and is
+// retransmitted to the next server until it is answered. A truncated answer
+// is asked for again over TCP.
+class Resolver final {
+ public:
+  static constexpr uint16_t kTypeA = 1;
+  static constexpr uint16_t kTypeAAAA = 28;
+
+  Resolver(uv_loop_t* loop, ResolverOptions options) : options(std::move(options)), random(std::random_device()()) {
+    this->loop = loop;
+    this->timer = new uv_timer_t{};
+    uv_timer_init(loop, this->timer);
+    this->timer->data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->timer));
+
+    this->udp = new uv_udp_t{};
+    uv_udp_init(loop, this->udp);
+    this->udp->data = this;
+    sockaddr_in any{};
+    uv_ip4_addr("0.0.0.0", 0, &any);
+    int err = uv_udp_bind(this->udp, reinterpret_cast<const sockaddr*>(&any), 0);
+    if (err == 0) {
+      err = uv_udp_recv_start(this->udp, AllocBuffer, ReceiveDone);
+    }
+    if (err) {
+      this->Close();
+      throw std::runtime_error(uv_strerror(err));
+    }
+    //only the timer keeps the loop alive, while queries are in flight
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->udp));
+  }
+
+  Resolver(const Resolver&) = delete;
+  Resolver& operator=(const Resolver&) = delete;
+
+  ~Resolver() {
+    this->Close();
+  }
+
+  // starts the lookup, the callback is called later with 0 and at least one
+  // address in the request, or with a negative error
+  int Resolve(ResolveRequest* req, const std::string& host, ResolveCallback callback) {
+    if (this->loop == nullptr) {
+      return UV_EINVAL;
+    }
+    req->callback = callback;
+    req->ipv4.clear();
+    req->ipv6.clear();
+
+    //answered on the next loop iteration
+    auto name = ResolverOptions::Lower(host);
+    auto found = this->options.hosts.find(name);
+    in_addr literal{};
+    if (found != this->options.hosts.end() || uv_inet_pton(AF_INET, name.c_str(), &literal) == 0) {
+      req->ipv4.push_back(found != this->options.hosts.end() ? found->second : literal);
+      req->status = 0;
+      req->pending = 0;
+      this->ready.push_back(req);
+      this->Arm();
+      return 0;
+    }
+
+    std::string question;
+    if (!EncodeName(name, question) || this->options.servers.empty()) {
+      return UV_EINVAL;
+    }
+    req->status = UV_EAI_NONAME;
+    req->pending = 0;
+    this->Start(req, question, kTypeA);
+    if (this->options.ipv6) {
+      this->Start(req, question, kTypeAAAA);
+    }
+    return 0;
+  }
+
+  // the callback of the request is not called anymore
+  void Cancel(ResolveRequest* req) {
+    for (int i = 0; i < req->pending; i++) {
+      auto found = this->queries.find(req->ids[i]);
+      if (found != this->queries.end() && found->second.req == req) {
+        this->Drop(found);
+      }
+    }
+    req->pending = 0;
+    this->ready.erase(std::remove(this->ready.begin(), this->ready.end(), req), this->ready.end());
+    this->Arm();
+  }
+
+  // closes the sockets, lookups in flight are not called back; the handles
+  // outlive the resolver until libuv is done with them
+  void Close() {
+    if (this->loop == nullptr) {
+      return;
+    }
+    while (!this->queries.empty()) {
+      this->Drop(this->queries.begin());
+    }
+    this->ready.clear();
+    uv_close(reinterpret_cast<uv_handle_t*>(this->timer), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_timer_t*>(handle);
+    });
+    uv_close(reinterpret_cast<uv_handle_t*>(this->udp), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_udp_t*>(handle);
+    });
+    this->loop = nullptr;
+  }
+
+  size_t InFlight() const { return this->queries.size(); }
+  uint64_t Sent() const { return this->sent; }
+  uint64_t Retransmits() const { return this->retransmits; }
+  uint64_t TcpFallbacks() const { return this->tcp_fallbacks; }
+
+  // the question section of a name, false when it is not a valid name
+  static bool EncodeName(const std::string& host, std::string& out) {
+    auto name = host;
+    if (!name.empty() && name.back() == '.') {
+      name.pop_back();
+    }
+    if (name.empty() || name.size() > 253) {
+      return false;
+    }
+    size_t begin = 0;
+    while (true) {
+      auto dot = name.find('.', begin);
+      auto end = dot == std::string::npos ? name.size() : dot;
+      if (end == begin || end - begin > 63) {
+        return false;
+      }
+      out.push_back(char(end - begin));
+      out.append(name, begin, end - begin);
+      if (dot == std::string::npos) {
+        break;
+      }
+      begin = dot + 1;
+    }
+    out.push_back(0);
+    return true;
+  }
+
+  // the addresses of the answers, 0 or a negative error; the header and
+  // the question have been checked by the caller
+  static int ParseAnswers(const uint8_t* data, size_t length, std::vector<in_addr>& ipv4,
+                          std::vector<in6_addr>& ipv6, bool& truncated) {
+    if (length < 12) {
+      return UV_EPROTO;
+    }
+    uint16_t flags = data[2] << 8 | data[3];
+    if (!(flags & 0x8000)) {
+      return UV_EPROTO;
+    }
+    truncated = flags & 0x0200;
+    switch (flags & 0xf) {
+      case 0: break;
+      case 3: return UV_EAI_NONAME;
+      default: return UV_EAI_FAIL;
+    }
+    size_t questions = data[4] << 8 | data[5];
+    size_t answers = data[6] << 8 | data[7];
+    size_t position = 12;
+    for (size_t i = 0; i < questions; i++) {
+      if (!SkipName(data, length, position) || position + 4 > length) {
+        return UV_EPROTO;
+      }
+      position += 4;
+    }
+    for (size_t i = 0; i < answers; i++) {
+      if (!SkipName(data, length, position) || position + 10 > length) {
+        return UV_EPROTO;
+      }
+      uint16_t type = data[position] << 8 | data[position + 1];
+      size_t record_length = data[position + 8] << 8 | data[position + 9];
+      position += 10;
+      if (position + record_length > length) {
+        return UV_EPROTO;
+      }
+      if (type == kTypeA && record_length == 4) {
+        in_addr addr{};
+        memcpy(&addr, data + position, 4);
+        ipv4.push_back(addr);
+      } else if (type == kTypeAAAA && record_length == 16) {
+        in6_addr addr{};
+        memcpy(&addr, data + position, 16);
+        ipv6.push_back(addr);
+      }
+      position += record_length;
+    }
+    return 0;
+  }
+
+  // moves past a name, which may end in a pointer to another one
+  static bool SkipName(const uint8_t* data, size_t length, size_t& position) {
+    while (position < length) {
+      auto label = data[position];
+      if (label == 0) {
+        position++;
+        return true;
+      }
+      if ((label & 0xc0) == 0xc0) {
+        position += 2;
+        return position <= length;
+      }
+      if (label & 0xc0) {
+        return false;
+      }
+      position += 1 + label;
+    }
+    return false;
+  }
+
+ private:
+  // a retry over TCP of a truncated answer
+  struct TcpQuery {
+    uv_tcp_t tcp;
+    uv_connect_t connect;
+    uv_write_t write;
+    Resolver* resolver;
+    uint16_t id;
+    std::string out;
+    std::string in;
+  };
+
+  struct Query {
+    ResolveRequest* req;
+    uint16_t type;
+    std::string packet;
+    int attempt;
+    size_t server;
+    uint64_t deadline;
+    TcpQuery* tcp;
+  };
+
+  ResolverOptions options;
+  uv_loop_t* loop;
+  uv_udp_t* udp;
+  uv_timer_t* timer;
+  std::mt19937 random;
+
+  std::unordered_map<uint16_t, Query> queries;
+  //queries by the time they are retransmitted
+  std::set<std::pair<uint64_t, uint16_t>> deadlines;
+  //answered without a query, called back from the timer
+  std::vector<ResolveRequest*> ready;
+  size_t next_server = 0;
+  char buffer[2048];
+
+  uint64_t sent = 0;
+  uint64_t retransmits = 0;
+  uint64_t tcp_fallbacks = 0;
+
+  void Start(ResolveRequest* req, const std::string& question, uint16_t type) {
+    uint16_t id;
+    do {
+      id = uint16_t(this->random());
+    } while (this->queries.count(id) != 0);
+
+    std::string packet(12, '\0');
+    packet[0] = char(id >> 8);
+    packet[1] = char(id);
+    //recursion desired
+    packet[2] = 0x01;
+    //one question
+    packet[5] = 1;
+    packet += question;
+    packet.push_back(char(type >> 8));
+    packet.push_back(char(type));
+    packet.push_back(0);
+    packet.push_back(1);
+
+    auto& query = this->queries[id];
+    query = Query{req, type, std::move(packet), 0, this->next_server++ % this->options.servers.size(), 0, nullptr};
+    req->ids[req->pending++] = id;
+    this->Send(id, query);
+  }
+
+  //a failed send is retransmitted like a lost one
+  void Send(uint16_t id, Query& query) {
+    auto buf = uv_buf_init(&query.packet[0], query.packet.size());
+    auto& server = this->options.servers[query.server];
+    uv_udp_try_send(this->udp, &buf, 1, reinterpret_cast<const sockaddr*>(&server));
+    this->sent++;
+    query.deadline = uv_now(this->loop) + (this->options.timeout << query.attempt);
+    this->deadlines.emplace(query.deadline, id);
+    this->Arm();
+  }
+
+  void Arm() {
+    if (this->loop == nullptr) {
+      return;
+    }
+    auto handle = reinterpret_cast<uv_handle_t*>(this->timer);
+    if (!this->ready.empty()) {
+      uv_timer_start(this->timer, TimerDone, 0, 0);
+    } else if (!this->deadlines.empty()) {
+      auto now = uv_now(this->loop);
+      auto deadline = this->deadlines.begin()->first;
+      uv_timer_start(this->timer, TimerDone, deadline > now ? deadline - now : 0, 0);
+    } else {
+      uv_timer_stop(this->timer);
+      uv_unref(handle);
+      return;
+    }
+    uv_ref(handle);
+  }
+
+  //removes the query without calling back
+  void Drop(std::unordered_map<uint16_t, Query>::iterator found) {
+    auto& query = found->second;
+    this->deadlines.erase({query.deadline, found->first});
+    this->CloseTcp(query);
+    this->queries.erase(found);
+  }
+
+  void Finish(uint16_t id, int status) {
+    auto found = this->queries.find(id);
+    auto req = found->second.req;
+    this->Drop(found);
+    if (status != 0 && req->ipv4.empty() && req->ipv6.empty()) {
+      req->status = status;
+    }
+    if (--req->pending > 0) {
+      //the other query has to find the id at the front
+      req->ids[0] = req->ids[0] == id ? req->ids[1] : req->ids[0];
+      this->Arm();
+      return;
+    }
+    if (!req->ipv4.empty() || !req->ipv6.empty()) {
+      req->status = 0;
+    } else if (req->status == 0) {
+      req->status = UV_EAI_NONAME;
+    }
+    this->Arm();
+    req->callback(req, req->status);
+  }
+
+  void Answer(const uint8_t* data, size_t length, const sockaddr* from, bool over_tcp) {
+    if (length < 12) {
+      return;
+    }
+    uint16_t id = data[0] << 8 | data[1];
+    auto found = this->queries.find(id);
+    if (found == this->queries.end()) {
+      return;
+    }
+    auto& query = found->second;
+    //only the server asked can answer, with the question asked
+    if (!over_tcp) {
+      auto& server = this->options.servers[query.server];
+      auto source = reinterpret_cast<const sockaddr_in*>(from);
+      if (from == nullptr || from->sa_family != AF_INET || source->sin_port != server.sin_port ||
+          source->sin_addr.s_addr != server.sin_addr.s_addr) {
+        return;
+      }
+    }
+    size_t question = query.packet.size() - 12;
+    if (length < 12 + question || memcmp(data + 12, query.packet.data() + 12, question) != 0) {
+      return;
+    }
+
+    std::vector<in_addr> ipv4;
+    std::vector<in6_addr> ipv6;
+    bool truncated = false;
+    int status = ParseAnswers(data, length, ipv4, ipv6, truncated);
+    if (status == 0 && truncated && !over_tcp) {
+      this->StartTcp(id, query);
+      return;
+    }
+    auto req = query.req;
+    req->ipv4.insert(req->ipv4.end(), ipv4.begin(), ipv4.end());
+    req->ipv6.insert(req->ipv6.end(), ipv6.begin(), ipv6.end());
+    this->Finish(id, status);
+  }
+
+  void StartTcp(uint16_t id, Query& query) {
+    this->tcp_fallbacks++;
+    this->CloseTcp(query);
+    auto tcp = new TcpQuery{};
+    tcp->resolver = this;
+    tcp->id = id;
+    tcp->out.push_back(char(query.packet.size() >> 8));
+    tcp->out.push_back(char(query.packet.size()));
+    tcp->out += query.packet;
+    uv_tcp_init(this->loop, &tcp->tcp);
+    tcp->tcp.data = tcp;
+    tcp->connect.data = tcp;
+    tcp->write.data = tcp;
+    query.tcp = tcp;
+    auto& server = this->options.servers[query.server];
+    if (uv_tcp_connect(&tcp->connect, &tcp->tcp, reinterpret_cast<const sockaddr*>(&server), TcpConnectDone) != 0) {
+      this->CloseTcp(query);
+    }
+  }
+
+  void CloseTcp(Query& query) {
+    if (query.tcp == nullptr) {
+      return;
+    }
+    query.tcp->resolver = nullptr;
+    uv_close(reinterpret_cast<uv_handle_t*>(&query.tcp->tcp), [](uv_handle_t* handle) {
+      delete reinterpret_cast<TcpQuery*>(handle->data);
+    });
+    query.tcp = nullptr;
+  }
+
+  // the query of a TCP retry, nullptr once the retry has been given up
+  static Query* Owner(TcpQuery* tcp) {
+    if (tcp->resolver == nullptr) {
+      return nullptr;
+    }
+    auto found = tcp->resolver->queries.find(tcp->id);
+    return found == tcp->resolver->queries.end() || found->second.tcp != tcp ? nullptr : &found->second;
+  }
+
+  //a broken TCP retry is left to the retransmit timer
+  static void TcpConnectDone(uv_connect_t* req, int status) {
+    auto tcp = reinterpret_cast<TcpQuery*>(req->data);
+    auto query = Owner(tcp);
+    if (query == nullptr) {
+      return;
+    }
+    if (status < 0) {
+      tcp->resolver->CloseTcp(*query);
+      return;
+    }
+    auto buf = uv_buf_init(&tcp->out[0], tcp->out.size());
+    uv_write(&tcp->write, reinterpret_cast<uv_stream_t*>(&tcp->tcp), &buf, 1, nullptr);
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&tcp->tcp),
+                  [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+                    auto tcp = reinterpret_cast<TcpQuery*>(handle->data);
+                    *buf = uv_buf_init(tcp->resolver->buffer, sizeof(tcp->resolver->buffer));
+                  },
+                  TcpReadDone);
+  }
+
+  static void TcpReadDone(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    auto tcp = reinterpret_cast<TcpQuery*>(stream->data);
+    auto query = Owner(tcp);
+    if (query == nullptr || nread == 0) {
+      return;
+    }
+    auto resolver = tcp->resolver;
+    if (nread < 0) {
+      resolver->CloseTcp(*query);
+      return;
+    }
+    tcp->in.append(buf->base, nread);
+    if (tcp->in.size() < 2) {
+      return;
+    }
+    size_t length = uint8_t(tcp->in[0]) << 8 | uint8_t(tcp->in[1]);
+    if (tcp->in.size() < 2 + length) {
+      return;
+    }
+    auto answer = std::move(tcp->in);
+    resolver->Answer(reinterpret_cast<const uint8_t*>(answer.data()) + 2, length, nullptr, true);
+  }
+
+  static void AllocBuffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    auto resolver = reinterpret_cast<Resolver*>(handle->data);
+    *buf = uv_buf_init(resolver->buffer, sizeof(resolver->buffer));
+  }
+
+  static void ReceiveDone(uv_udp_t* udp, ssize_t nread, const uv_buf_t* buf, const sockaddr* from, unsigned flags) {
+    if (nread <= 0 || (flags & UV_UDP_PARTIAL)) {
+      return;
+    }
+    auto resolver = reinterpret_cast<Resolver*>(udp->data);
+    resolver->Answer(reinterpret_cast<const uint8_t*>(buf->base), nread, from, false);
+  }
+
+  static void TimerDone(uv_timer_t* timer) {
+    auto resolver = reinterpret_cast<Resolver*>(timer->data);
+    while (!resolver->ready.empty()) {
+      auto req = resolver->ready.front();
+      resolver->ready.erase(resolver->ready.begin());
+      req->callback(req, req->status);
+    }
+    while (resolver->loop != nullptr && !resolver->deadlines.empty() &&
+           resolver->deadlines.begin()->first <= uv_now(resolver->loop)) {
+      auto id = resolver->deadlines.begin()->second;
+      resolver->deadlines.erase(resolver->deadlines.begin());
+      auto& query = resolver->queries[id];
+      resolver->CloseTcp(query);
+      if (++query.attempt >= resolver->options.attempts) {
+        //Finish looks the deadline up again, which is gone already
+        query.deadline = 0;
+        resolver->Finish(id, UV_EAI_AGAIN);
+        continue;
+      }
+      resolver->retransmits++;
+      query.server = (query.server + 1) % resolver->options.servers.size();
+      resolver->Send(id, query);
+    }
+    resolver->Arm();
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_RESOLVER_H_
@@ -0,0 +1,402 @@
+#ifndef SHADESOCKS_SRC_SS_RULES_H_
+#define SHADESOCKS_SRC_SS_RULES_H_
+
+#include <uv.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace shadesocks {
+
+enum RuleAction : int8_t {
+  // relayed as the listener is configured, through the upstreams if it has any
+  Allow,
+  // the connection is closed
+  Deny,
+  // connected to the destination even if the listener has upstreams
+  Direct,
+  // forwarded to the upstreams, connected directly if the listener has none
+  Upstream,
+};
+
+inline const char* RuleActionName(RuleAction action) {
+  switch (action) {
+    case RuleAction::Allow: return "allow";
+    case RuleAction::Deny: return "deny";
+    case RuleAction::Direct: return "direct";
+    case RuleAction::Upstream: return "upstream";
+    default: return "unknown";
+  }
+}
+
+// Longest prefix match over unsigned keys, IPv4 addresses as uint32_t and
+// IPv6 addresses as unsigned __int128. Chains of nodes without a rule are
+// compressed into one, so the tree has less than two nodes per prefix, and
+// the nodes live in one vector.
+template<typename Key>
+class PrefixTree final {
+ public:
+  static constexpr int kBits = sizeof(Key) * 8;
+
+  PrefixTree() : nodes(1) {}
+
+  void Add(Key prefix, int length, RuleAction action) {
+    prefix = Mask(prefix, length);
+    uint32_t current = 0;
+    while (true) {
+      if (this->nodes[current].length == length) {
+        this->nodes[current].action = action;
+        return;
+      }
+      int bit = Bit(prefix, this->nodes[current].length);
+      uint32_t child = this->nodes[current].children[bit];
+      if (child == 0) {
+        this->nodes[current].children[bit] = this->Push(prefix, length, action);
+        return;
+      }
+      auto& found = this->nodes[child];
+      int common = std::min({CommonLength(prefix, found.prefix), length, int(found.length)});
+      if (common == found.length) {
+        current = child;
+        continue;
+      }
+      //the new prefix or a branch between the two goes above the child
+      uint32_t above;
+      if (common == length) {
+        above = this->Push(prefix, length, action);
+      } else {
+        above = this->Push(Mask(prefix, common), common, kNone);
+        this->nodes[above].children[Bit(prefix, common)] = this->Push(prefix, length, action);
+      }
+      this->nodes[above].children[Bit(this->nodes[child].prefix, common)] = child;
+      this->nodes[current].children[bit] = above;
+      return;
+    }
+  }
+
+  // the action of the longest prefix containing the key
+  bool Match(Key key, RuleAction& action) const {
+    bool matched = false;
+    uint32_t current = 0;
+    while (true) {
+      auto& node = this->nodes[current];
+      if (Mask(key, node.length) != node.prefix) {
+        break;
+      }
+      if (node.action != kNone) {
+        action = RuleAction(node.action);
+        matched = true;
+      }
+      if (node.length == kBits) {
+        break;
+      }
+      current = node.children[Bit(key, node.length)];
+      if (current == 0) {
+        break;
+      }
+    }
+    return matched;
+  }
+
+  size_t Nodes() const { return this->nodes.size(); }
+
+ private:
+  static constexpr int8_t kNone = -1;
+
+  struct Node {
+    Key prefix = 0;
+    uint32_t children[2] = {0, 0};
+    uint8_t length = 0;
+    int8_t action = kNone;
+  };
+
+  std::vector<Node> nodes;
+
+  uint32_t Push(Key prefix, int length, int8_t action) {
+    Node node;
+    node.prefix = prefix;
+    node.length = uint8_t(length);
+    node.action = action;
+    this->nodes.push_back(node);
+    return uint32_t(this->nodes.size() - 1);
+  }
+
+  static Key Mask(Key key, int length) {
+    return length == 0 ? 0 : key & (~Key(0) << (kBits - length));
+  }
+
+  static int Bit(Key key, int position) {
+    return int(key >> (kBits - 1 - position)) & 1;
+  }
+
+  //the number of leading bits the keys have in common
+  static int CommonLength(uint32_t first, uint32_t second) {
+    uint32_t diff = first ^ second;
+    return diff == 0 ? 32 : __builtin_clz(diff);
+  }
+
+  static int CommonLength(unsigned __int128 first, unsigned __int128 second) {
+    auto diff = first ^ second;
+    auto high = uint64_t(diff >> 64);
+    auto low = uint64_t(diff);
+    if (high != 0) {
+      return __builtin_clzll(high);
+    }
+    return low == 0 ? 128 : 64 + __builtin_clzll(low);
+  }
+};
+
+// Domain suffixes, stored as a trie of their labels from the right, so that
+// example.com matches example.com and every name below it but not
+// badexample.com. Labels are interned and an edge is one hash lookup.
+class DomainTrie final {
+ public:
+  DomainTrie() : actions(1, kNone) {}
+
+  void Add(const std::string& suffix, RuleAction action) {
+    uint32_t current = 0;
+    ForEachLabel(suffix, [&](const std::string& label) {
+      auto interned = this->labels.emplace(label, uint32_t(this->labels.size())).first->second;
+      auto edge = this->edges.emplace(EdgeKey(current, interned), uint32_t(this->actions.size()));
+      if (edge.second) {
+        this->actions.push_back(kNone);
+      }
+      current = edge.first->second;
+      return true;
+    });
+    this->actions[current] = action;
+  }
+
+  // the action of the longest suffix of the name
+  bool Match(const std::string& name, RuleAction& action) const {
+    bool matched = false;
+    uint32_t current = 0;
+    ForEachLabel(name, [&](const std::string& label) {
+      auto interned = this->labels.find(label);
+      if (interned == this->labels.end()) {
+        return false;
+      }
+      auto edge = this->edges.find(EdgeKey(current, interned->second));
+      if (edge == this->edges.end()) {
+        return false;
+      }
+      current = edge->second;
+      if (this->actions[current] != kNone) {
+        action = RuleAction(this->actions[current]);
+        matched = true;
+      }
+      return true;
+    });
+    return matched;
+  }
+
+  size_t Nodes() const { return this->actions.size(); }
+
+ private:
+  static constexpr int8_t kNone = -1;
+
+  std::unordered_map<std::string, uint32_t> labels;
+  std::unordered_map<uint64_t, uint32_t> edges;
+  std::vector<int8_t> actions;
+
+  static uint64_t EdgeKey(uint32_t node, uint32_t label) {
+    return uint64_t(node) << 32 | label;
+  }
+
+  // lower cased labels from the right until the visitor returns false
+  template<typename Visitor>
+  static void ForEachLabel(const std::string& name, Visitor visit) {
+    size_t end = name.size();
+    if (end > 0 && name[end - 1] == '.') {
+      end--;
+    }
+    std::string label;
+    while (end > 0) {
+      auto dot = name.rfind('.', end - 1);
+      size_t begin = dot == std::string::npos ? 0 : dot + 1;
+      label.assign(name, begin, end - begin);
+      for (auto& c : label) {
+        c = char(tolower(static_cast<unsigned char>(c)));
+      }
+      if (!visit(label) || begin == 0) {
+        return;
+      }
+      end = begin - 1;
+    }
+  }
+};
+
+// A compiled set of rules, immutable once it is shared with the listeners.
+// The file has one rule per line, an action and a CIDR, an address or a
+// domain suffix, plus an optional default for everything else:
+//
+//   # comment
+//   deny 10.0.0.0/8
+//   direct 2001:db8::/32
+//   upstream example.com
+//   default allow
+class RuleSet final {
+ public:
+  RuleAction default_action = RuleAction::Allow;
+
+  void Add(RuleAction action, const std::string& pattern) {
+    auto slash = pattern.find('/');
+    auto address = pattern.substr(0, slash);
+    int length = -1;
+    if (slash != std::string::npos) {
+      length = ParseLength(pattern.substr(slash + 1));
+    }
+    in_addr v4{};
+    in6_addr v6{};
+    if (uv_inet_pton(AF_INET, address.c_str(), &v4) == 0) {
+      length = length < 0 ? 32 : length;
+      if (length > 32) {
+        throw InvalidArgument("bad prefix length in " + pattern);
+      }
+      this->ipv4.Add(ntohl(v4.s_addr), length, action);
+    } else if (uv_inet_pton(AF_INET6, address.c_str(), &v6) == 0) {
+      length = length < 0 ? 128 : length;
+      if (length > 128) {
+        throw InvalidArgument("bad prefix length in " + pattern);
+      }
+      this->ipv6.Add(Key6(v6), length, action);
+    } else if (slash == std::string::npos && !address.empty()) {
+      this->domains.Add(address, action);
+    } else {
+      throw InvalidArgument("bad rule " + pattern);
+    }
+    this->rules++;
+  }
+
+  bool Match(const in_addr& addr, RuleAction& action) const {
+    return this->ipv4.Match(ntohl(addr.s_addr), action);
+  }
+
+  bool Match(const in6_addr& addr, RuleAction& action) const {
+    return this->ipv6.Match(Key6(addr), action);
+  }
+
+  bool Match(const std::string& domain, RuleAction& action) const {
+    return this->domains.Match(domain, action);
+  }
+
+  // a host as the client sent it, an IP literal is matched against the
+  // prefixes since the lookup would only hand it back as the address
+  bool MatchHost(const std::string& host, RuleAction& action) const {
+    in_addr v4{};
+    in6_addr v6{};
+    if (uv_inet_pton(AF_INET, host.c_str(), &v4) == 0) {
+      return this->Match(v4, action);
+    }
+    if (uv_inet_pton(AF_INET6, host.c_str(), &v6) == 0) {
+      return this->Match(v6, action);
+    }
+    return this->Match(host, action);
+  }
+
+  size_t Size() const { return this->rules; }
+
+  static RuleAction ParseAction(const std::string& name) {
+    for (auto action : {RuleAction::Allow, RuleAction::Deny, RuleAction::Direct, RuleAction::Upstream}) {
+      if (name == RuleActionName(action)) {
+        return action;
+      }
+    }
+    throw InvalidArgument("unknown rule action " + name);
+  }
+
+  static RuleSet Parse(std::istream& in) {
+    RuleSet rules;
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++) {
+      auto comment = line.find('#');
+      if (comment != std::string::npos) {
+        line.resize(comment);
+      }
+      std::istringstream fields(line);
+      std::string action;
+      std::string pattern;
+      std::string rest;
+      if (!(fields >> action)) {
+        continue;
+      }
+      if (!(fields >> pattern) || (fields >> rest)) {
+        throw InvalidArgument("bad rule on line " + std::to_string(number));
+      }
+      try {
+        if (action == "default") {
+          rules.default_action = ParseAction(pattern);
+        } else {
+          rules.Add(ParseAction(action), pattern);
+        }
+      } catch (const InvalidArgument& e) {
+        throw InvalidArgument(std::string(e.what()) + " on line " + std::to_string(number));
+      }
+    }
+    return rules;
+  }
+
+  static RuleSet Load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+      throw InvalidArgument("cannot open rules " + path);
+    }
+    return Parse(in);
+  }
+
+ private:
+  PrefixTree<uint32_t> ipv4;
+  PrefixTree<unsigned __int128> ipv6;
+  DomainTrie domains;
+  size_t rules = 0;
+
+  static unsigned __int128 Key6(const in6_addr& addr) {
+    unsigned __int128 key = 0;
+    for (auto part : addr.s6_addr) {
+      key = key << 8 | part;
+    }
+    return key;
+  }
+
+  static int ParseLength(const std::string& text) {
+    if (text.empty() || text.size() > 3 || text.find_first_not_of("0123456789") != std::string::npos) {
+      throw InvalidArgument("bad prefix length " + text);
+    }
+    return std::stoi(text);
+  }
+};
+
+// The rules in use by listeners, replaced at runtime without stopping them.
+// Every connection matches against the set which was current when it read
+// its request, a set being replaced is freed with its last connection.
+class RuleTable final {
+ public:
+  explicit RuleTable(RuleSet rules = RuleSet()) : rules(std::make_shared<const RuleSet>(std::move(rules))) {}
+
+  std::shared_ptr<const RuleSet> Current() const {
+    return std::atomic_load(&this->rules);
+  }
+
+  void Swap(RuleSet rules) {
+    std::atomic_store(&this->rules, std::make_shared<const RuleSet>(std::move(rules)));
+  }
+
+  // compiles the file first, the current rules are kept if it is broken
+  void Load(const std::string& path) {
+    this->Swap(RuleSet::Load(path));
+  }
+
+ private:
+  std::shared_ptr<const RuleSet> rules;
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_RULES_H_
@@ -0,0 +1,159 @@
+#ifndef SHADESOCKS_SRC_SS_SCHEDULER_H_
+#define SHADESOCKS_SRC_SS_SCHEDULER_H_
+
+#include <uv.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+namespace shadesocks {
+
+struct SchedulerOptions {
+  // bytes transformed per loop iteration over all connections
+  size_t budget = 256 * 1024;
+  // chunks up to this size are treated as interactive and run first
+  size_t interactive_size = 2 * 1024;
+};
+
+// Defers the crypto and write of each received chunk to the check phase of
+// the loop, where chunks are run round robin in arrival order until the
+// iteration budget is spent. The rest is carried over to the next iteration
+// ahead of newer chunks, and small chunks of interactive flows bypass bulk
+// ones. Every connection has at most one chunk in flight per direction, so
+// no connection can run more than two chunks per iteration.
+//
+// An owner which is closed while queued has to cancel its tasks.
+class Scheduler final {
+ public:
+  using Run = void (*)(void* owner, int tag);
+
+  static Scheduler& Local() {
+    thread_local Scheduler scheduler;
+    return scheduler;
+  }
+
+  void Start(uv_loop_t* loop, SchedulerOptions options = SchedulerOptions()) {
+    this->Stop();
+    this->loop = loop;
+    this->options = options;
+    //new handles every time, the ones of an earlier start may still be closing
+    this->check = new uv_check_t{};
+    this->idle = new uv_idle_t{};
+    uv_check_init(loop, this->check);
+    uv_idle_init(loop, this->idle);
+    this->check->data = this;
+    uv_check_start(this->check, CheckDone);
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->check));
+  }
+
+  //runs what is still queued and detaches from the loop, the handles are
+  //freed once closed
+  void Stop() {
+    if (this->loop == nullptr) {
+      return;
+    }
+    this->options.budget = SIZE_MAX;
+    this->RunQueued();
+    uv_close(reinterpret_cast<uv_handle_t*>(this->check), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_check_t*>(handle);
+    });
+    uv_close(reinterpret_cast<uv_handle_t*>(this->idle), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_idle_t*>(handle);
+    });
+    this->check = nullptr;
+    this->idle = nullptr;
+    this->loop = nullptr;
+  }
+
+  bool Active(uv_loop_t* loop) const {
+    return this->loop != nullptr && this->loop == loop;
+  }
+
+  void Push(void* owner, Run run, int tag, size_t cost) {
+    auto& queue = cost <= this->options.interactive_size ? this->interactive : this->bulk;
+    queue.push_back(Task{owner, run, tag, cost, false});
+  }
+
+  void Cancel(void* owner) {
+    for (auto queue : {&this->interactive, &this->bulk}) {
+      for (auto it = queue->begin(); it != queue->end();) {
+        it = it->owner == owner ? queue->erase(it) : it + 1;
+      }
+    }
+  }
+
+  size_t Queued() const { return this->interactive.size() + this->bulk.size(); }
+  // chunks which were due in an iteration but left to a later one, each
+  // counted once however many iterations it waited
+  uint64_t Deferred() const { return this->deferred; }
+
+ private:
+  struct Task {
+    void* owner;
+    Run run;
+    int tag;
+    size_t cost;
+    //already counted as deferred
+    bool deferred;
+  };
+
+  uv_loop_t* loop = nullptr;
+  uv_check_t* check = nullptr;
+  uv_idle_t* idle = nullptr;
+  SchedulerOptions options;
+
+  std::deque<Task> interactive;
+  std::deque<Task> bulk;
+  //tasks carried over to a later iteration
+  uint64_t deferred = 0;
+
+  Scheduler() = default;
+
+  static void CheckDone(uv_check_t* check) {
+    reinterpret_cast<Scheduler*>(check->data)->RunQueued();
+  }
+
+  void RunQueued() {
+    size_t spent = 0;
+    //only what is queued now runs, tasks pushed meanwhile wait for the next round
+    size_t interactive_count = this->interactive.size();
+    size_t bulk_count = this->bulk.size();
+    //a task may cancel others of its owner, so the queues are checked as well
+    while (interactive_count > 0 && !this->interactive.empty() && spent < this->options.budget) {
+      auto task = this->interactive.front();
+      this->interactive.pop_front();
+      interactive_count--;
+      spent += task.cost;
+      task.run(task.owner, task.tag);
+    }
+    while (bulk_count > 0 && !this->bulk.empty() && spent < this->options.budget) {
+      auto task = this->bulk.front();
+      this->bulk.pop_front();
+      bulk_count--;
+      spent += task.cost;
+      task.run(task.owner, task.tag);
+    }
+
+    //the tasks left of the snapshot were due, the ones counted in an earlier
+    //iteration are ahead of them
+    for (auto left : {std::make_pair(&this->interactive, interactive_count), std::make_pair(&this->bulk, bulk_count)}) {
+      auto& queue = *left.first;
+      for (size_t i = std::min(left.second, queue.size()); i > 0 && !queue[i - 1].deferred; i--) {
+        queue[i - 1].deferred = true;
+        this->deferred++;
+      }
+    }
+
+    //keep the loop from blocking in poll while work is left
+    if (this->Queued() > 0) {
+      uv_idle_start(this->idle, [](uv_idle_t*) {});
+    } else {
+      uv_idle_stop(this->idle);
+    }
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_SCHEDULER_H_
@@ -2,28 +2,173 @@
 #define SHADESOCKS_SRC_SS_SERVER_H__
 #include <uv.h>
 #include <glog/logging.h>
+#include <unistd.h>
 #include <memory>
 #include <utility>
 #include <vector>
 #include <iostream>
 #include "encrypt.h"
+#include "config.h"
 
 namespace shadesocks {
 
 class Loop;
+class HandoffServer;
+class HandoffClient;
+
+#ifdef SHADESOCKS_COROUTINES
+//defined with the coroutine relay, which needs the awaitables of Loop
+inline void AcceptCoroutine(uv_stream_t* server, const ServerConfig& config, Admission* admission);
+#endif
 
 class TCPHandle {
   friend class Loop;
+  //pass the listening socket between processes
+  friend class HandoffServer;
+  friend class HandoffClient;
 
  private:
-  uv_tcp_t resource;
+  //a Unix domain socket when created by Loop::create_unix_handle
+  union {
+    uv_tcp_t resource;
+    uv_pipe_t pipe;
+  };
 
   std::string hostname;
   int port;
 
-  explicit TCPHandle() : resource() {}
+  //shared by every connection accepted on this listener
+  ServerConfig config;
+  TokenBucket bucket;
+  Admission admission;
+  //released when stopped, other listeners may share the pool
+  bool holds_upstream = false;
+
+  explicit TCPHandle() : pipe() {}
+
+  bool is_unix() const {
+    return this->resource.type == UV_NAMED_PIPE;
+  }
+
+  static void OnConnection(uv_stream_t* server, int status) {
+    ProfileScope scope(CallbackType::AcceptCallback);
+    if (status < 0) {
+      LOG(WARNING) << "accept error: " << uv_strerror(status);
+      Stats::Local().CountError(ErrorType::AcceptError);
+      return;
+    }
+    auto tcp_handle = reinterpret_cast<TCPHandle*>(server->data);
+    auto reason = tcp_handle->admission.Check();
+    if (reason == ShedReason::ShedReasonCount) {
+      tcp_handle->Admit(server);
+      return;
+    }
+    //not accepting leaves the connection in the backlog, libuv stops watching the listener until it is
+    if (tcp_handle->config.admission.pause_accept) {
+      tcp_handle->admission.Pause();
+      return;
+    }
+    DLOG(INFO) << "shed a connection, " << ShedReasonName(reason);
+    Stats::Local().CountShed(reason);
+    Reset(server);
+  }
+
+  void Admit(uv_stream_t* server) {
+#ifdef SHADESOCKS_COROUTINES
+    if (this->config.coroutine_relay) {
+      AcceptCoroutine(server, this->config, &this->admission);
+      return;
+    }
+#endif
+    auto shade_handle = new ShadeHandle(server, this->config, &this->bucket, &this->admission);
+    shade_handle->Accept(server);
+  }
+
+  //the address the socket is bound to, which may have been chosen by the kernel
+  void update_address() {
+    if (this->is_unix()) {
+      char path[256];
+      size_t length = sizeof(path);
+      int err = uv_pipe_getsockname(&this->pipe, path, &length);
+      if (err) {
+        throw UvException(err);
+      }
+      this->hostname.assign(path, length);
+      this->port = 0;
+      return;
+    }
+    sockaddr_in bound{};
+    int length = sizeof(bound);
+    int err = uv_tcp_getsockname(&this->resource, (struct sockaddr*) &bound, &length);
+    if (err) {
+      throw UvException(err);
+    }
+    char ip[INET_ADDRSTRLEN];
+    uv_ip4_name(&bound, ip, sizeof(ip));
+    this->hostname = ip;
+    this->port = ntohs(bound.sin_port);
+  }
+
+  //the coroutine relay leaves some settings out, a listener does not ignore them silently
+  void check_coroutine_relay() const {
+    auto& config = this->config;
+    const char* unsupported = nullptr;
+    if (this->is_unix()) {
+      unsupported = "Unix domain socket listeners";
+    } else if (config.listener_limit.rate > 0 || config.connection_limit.rate > 0) {
+      unsupported = "rate limits";
+    } else if (config.upstream != nullptr) {
+      unsupported = "upstreams";
+    } else if (config.resolver != nullptr) {
+      unsupported = "the stub resolver";
+    } else if (!config.local_destinations.Empty()) {
+      unsupported = "local destinations";
+    } else if (config.zerocopy_threshold > 0) {
+      unsupported = "zero-copy sends";
+    } else if (Scheduler::Local().Active(this->resource.loop)) {
+      unsupported = "the loop scheduler";
+    }
+    if (unsupported != nullptr) {
+      throw InvalidArgument(std::string("the coroutine relay does not support ") + unsupported);
+    }
+  }
+
+  //takes a shed connection off the backlog and resets it, the client gives up at once
+  static void Reset(uv_stream_t* server) {
+    if (server->type == UV_NAMED_PIPE) {
+      auto pipe = new uv_pipe_t{};
+      uv_pipe_init(server->loop, pipe, 0);
+      uv_accept(server, reinterpret_cast<uv_stream_t*>(pipe));
+      //a Unix domain socket has no reset, the client sees the end at once anyway
+      uv_close(reinterpret_cast<uv_handle_t*>(pipe), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_pipe_t*>(handle);
+      });
+      return;
+    }
+    auto tcp = new uv_tcp_t{};
+    uv_tcp_init(server->loop, tcp);
+    auto done = [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_tcp_t*>(handle);
+    };
+    if (uv_accept(server, reinterpret_cast<uv_stream_t*>(tcp)) != 0 || uv_tcp_close_reset(tcp, done) != 0) {
+      uv_close(reinterpret_cast<uv_handle_t*>(tcp), done);
+    }
+  }
 
  public:
+  //has to be called before listen, accepted connections keep a pointer to it
+  void set_config(ServerConfig config) {
+    this->config = std::move(config);
+  }
+
+  const ServerConfig& get_config() const {
+    return this->config;
+  }
+
+  int get_port() const {
+    return this->port;
+  }
+
   void bind(const std::string hostname = "0.0.0.0", const int port = 1080, unsigned int flags = 0) {
     sockaddr_in addr{};
     uv_ip4_addr(hostname.c_str(), port, &addr);
@@ -35,25 +180,85 @@ class TCPHandle {
     if (err != 0) {
       throw UvException(err);
     }
-    LOG(INFO) << "bind hostname: " << hostname << ", port: " << port;
+    //port 0 lets the kernel choose one
+    if (port == 0) {
+      this->update_address();
+    }
+    LOG(INFO) << "bind hostname: " << hostname << ", port: " << this->port;
+  }
+
+  //binds a handle of Loop::create_unix_handle, a socket file left at the path
+  //by an earlier process is replaced
+  void bind_path(const std::string& path) {
+    if (!this->is_unix()) {
+      throw UvException("only a Unix domain socket handle binds to a path");
+    }
+    this->hostname = path;
+    this->port = 0;
+    unlink(path.c_str());
+    int err = uv_pipe_bind(&this->pipe, path.c_str());
+    if (err != 0) {
+      throw UvException(err);
+    }
+    LOG(INFO) << "bind path: " << path;
+  }
+
+  const Admission& get_admission() const {
+    return this->admission;
   }
 
   void listen(int backlog = 128) {
-    uv_connection_cb on_connection = [](uv_stream_t* server, int status) {
-      if (status < 0) {
-        throw UvException(status);
-      }
-      auto shade_handle = new ShadeHandle(server);
-      shade_handle->Accept(server);
-    };
+#ifndef SHADESOCKS_COROUTINES
+    if (this->config.coroutine_relay) {
+      throw InvalidArgument("the coroutine relay needs a C++20 build");
+    }
+#endif
+    if (this->config.coroutine_relay) {
+      this->check_coroutine_relay();
+    }
+    this->resource.data = this;
+    this->bucket.Reset(this->config.listener_limit);
+
+    //buffer sizes have to be on the listener to be used for the window scale
+    uv_os_fd_t fd;
+    int err = uv_fileno(reinterpret_cast<uv_handle_t*>(&this->resource), &fd);
+    if (err == 0) {
+      err = this->config.inbound_profile.ApplyBuffers(fd);
+    }
+    if (err) {
+      throw UvException(err);
+    }
 
-    int err = uv_listen(reinterpret_cast<uv_stream_t*>(&this->resource), backlog, on_connection);
+    err = uv_listen(reinterpret_cast<uv_stream_t*>(&this->resource), backlog, OnConnection);
     if (err) {
       throw UvException(err);
     }
+    //a paused listener takes the connection waiting in the backlog once the load has dropped
+    this->admission.Start(this->resource.loop, this->config.admission, [](void* owner) {
+      auto tcp_handle = reinterpret_cast<TCPHandle*>(owner);
+      tcp_handle->Admit(reinterpret_cast<uv_stream_t*>(&tcp_handle->resource));
+    }, this);
+    if (this->config.upstream != nullptr) {
+      this->config.upstream->Start(this->resource.loop);
+      this->holds_upstream = true;
+    }
     LOG(INFO) << "start to listen on: " + hostname + ", port: " << port;
   }
 
+  //stops accepting, connections already accepted are relayed on; the handle
+  //has to be kept until the loop has closed it
+  void stop() {
+    this->admission.Stop();
+    if (this->holds_upstream) {
+      this->holds_upstream = false;
+      this->config.upstream->Release();
+    }
+    if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&this->resource))) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->resource), nullptr);
+    }
+    LOG(INFO) << "stop listening on: " + hostname + ", port: " << port;
+  }
+
 };
 
 class Loop final : public std::enable_shared_from_this<Loop> {
@@ -116,6 +321,43 @@ class Loop final : public std::enable_shared_from_this<Loop> {
     return uv_loop_alive(loop.get()) != 0;
   }
 
+  //times the callbacks and iterations of the loop until disabled, see LoopProfiler
+  void enable_profiling(ProfilerOptions options = ProfilerOptions()) {
+    LoopProfiler::Local().Start(this->get(), options);
+  }
+
+  void disable_profiling() {
+    LoopProfiler::Local().Stop();
+  }
+
+  const LoopProfiler& get_profiler() const {
+    return LoopProfiler::Local();
+  }
+
+#ifdef SHADESOCKS_COROUTINES
+  //awaitables for coroutines on the loop, see awaitable.h
+  static ReadAwaiter Read(CoroStream& stream, Chunk& chunk) {
+    return ReadAwaiter(stream, chunk);
+  }
+
+  static WriteAwaiter Write(CoroStream& stream, const char* data, size_t length) {
+    return WriteAwaiter(stream, data, length);
+  }
+
+  static ShutdownAwaiter Shutdown(CoroStream& stream) {
+    return ShutdownAwaiter(stream);
+  }
+
+  static ConnectAwaiter Connect(CoroStream& stream, const sockaddr_in& addr) {
+    return ConnectAwaiter(stream, addr);
+  }
+
+  static ResolveAwaiter Resolve(CoroStream& stream, std::string host, sockaddr_in& addr,
+                                uv_getaddrinfo_t*& pending) {
+    return ResolveAwaiter(stream.tcp.loop, std::move(host), addr, pending);
+  }
+#endif
+
   std::shared_ptr<TCPHandle> create_tcp_handle() {
     if (this->loop == nullptr) {
       throw UvException("cannot create handle without loop");
@@ -127,6 +369,18 @@ class Loop final : public std::enable_shared_from_this<Loop> {
     return handle_ptr;
   }
 
+  //a listener on a Unix domain socket for clients on the same host, see TCPHandle::bind_path
+  std::shared_ptr<TCPHandle> create_unix_handle() {
+    if (this->loop == nullptr) {
+      throw UvException("cannot create handle without loop");
+    }
+
+    auto handle_ptr = std::shared_ptr<TCPHandle>(new TCPHandle{});
+    uv_pipe_init(this->get(), &handle_ptr->pipe, 0);
+
+    return handle_ptr;
+  }
+
   ~Loop() noexcept {
     if (this->loop) {
       try {
@@ -0,0 +1,137 @@
+#ifndef SHADESOCKS_SRC_SS_SOCKET_H_
+#define SHADESOCKS_SRC_SS_SOCKET_H_
+
+#include <uv.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <string>
+
+namespace shadesocks {
+
+// Options applied to a TCP socket, zero values keep the kernel defaults.
+struct SocketProfile {
+  bool nodelay = false;
+  // keepalive is enabled when the idle time is set, all in seconds
+  unsigned int keepalive_idle = 0;
+  unsigned int keepalive_interval = 0;
+  unsigned int keepalive_count = 0;
+  int receive_buffer = 0;
+  int send_buffer = 0;
+  // bytes not yet sent that make the socket writable again
+  int notsent_lowat = 0;
+  // milliseconds unacknowledged data may stay in flight before the connection is dropped
+  unsigned int user_timeout = 0;
+  int tos = 0;
+  std::string congestion;
+
+  bool Empty() const {
+    return !nodelay && keepalive_idle == 0 && receive_buffer == 0 && send_buffer == 0 &&
+        notsent_lowat == 0 && user_timeout == 0 && tos == 0 && congestion.empty();
+  }
+
+  // low latency for request/response traffic
+  static SocketProfile Interactive() {
+    SocketProfile profile;
+    profile.nodelay = true;
+    profile.keepalive_idle = 60;
+    profile.keepalive_interval = 10;
+    profile.keepalive_count = 6;
+    profile.notsent_lowat = 16 * 1024;
+    profile.user_timeout = 30 * 1000;
+    profile.tos = IPTOS_LOWDELAY;
+    return profile;
+  }
+
+  // large windows for transfers
+  static SocketProfile Bulk() {
+    SocketProfile profile;
+    profile.keepalive_idle = 60;
+    profile.keepalive_interval = 10;
+    profile.keepalive_count = 6;
+    profile.receive_buffer = 4 * 1024 * 1024;
+    profile.send_buffer = 4 * 1024 * 1024;
+    profile.tos = IPTOS_THROUGHPUT;
+    return profile;
+  }
+
+  static SocketProfile Preset(const std::string& name) {
+    if (name == "interactive") {
+      return Interactive();
+    } else if (name == "bulk") {
+      return Bulk();
+    } else if (name == "default") {
+      return SocketProfile();
+    }
+    throw InvalidArgument("unknown socket profile " + name);
+  }
+
+  // only the buffer sizes, they have to be set before the handshake to
+  // affect window scaling and are inherited by accepted sockets
+  int ApplyBuffers(int fd) const {
+    int err = 0;
+    if (receive_buffer > 0) {
+      err = Set(fd, SOL_SOCKET, SO_RCVBUF, receive_buffer, err);
+    }
+    if (send_buffer > 0) {
+      err = Set(fd, SOL_SOCKET, SO_SNDBUF, send_buffer, err);
+    }
+    return err;
+  }
+
+  // returns the first error, the remaining options are still applied
+  int Apply(uv_tcp_t* handle) const {
+    uv_os_fd_t fd;
+    int err = uv_fileno(reinterpret_cast<uv_handle_t*>(handle), &fd);
+    if (err) {
+      return err;
+    }
+    err = this->ApplyBuffers(fd);
+    if (nodelay) {
+      int ret = uv_tcp_nodelay(handle, 1);
+      err = err ? err : ret;
+    }
+    if (keepalive_idle > 0) {
+      int ret = uv_tcp_keepalive(handle, 1, keepalive_idle);
+      err = err ? err : ret;
+      if (keepalive_interval > 0) {
+        err = Set(fd, IPPROTO_TCP, TCP_KEEPINTVL, keepalive_interval, err);
+      }
+      if (keepalive_count > 0) {
+        err = Set(fd, IPPROTO_TCP, TCP_KEEPCNT, keepalive_count, err);
+      }
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (notsent_lowat > 0) {
+      err = Set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notsent_lowat, err);
+    }
+#endif
+#ifdef TCP_USER_TIMEOUT
+    if (user_timeout > 0) {
+      err = Set(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, user_timeout, err);
+    }
+#endif
+    if (tos > 0) {
+      err = Set(fd, IPPROTO_IP, IP_TOS, tos, err);
+    }
+#ifdef TCP_CONGESTION
+    if (!congestion.empty()) {
+      int ret = setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion.data(), congestion.size());
+      err = err ? err : (ret ? -errno : 0);
+    }
+#endif
+    return err;
+  }
+
+ private:
+  static int Set(int fd, int level, int name, int value, int err) {
+    int ret = setsockopt(fd, level, name, &value, sizeof(value));
+    return err ? err : (ret ? -errno : 0);
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_SOCKET_H_
@@ -0,0 +1,119 @@
+#ifndef SHADESOCKS_SRC_SS_STATS_H_
+#define SHADESOCKS_SRC_SS_STATS_H_
+
+#include <array>
+#include <cstdint>
+
+namespace shadesocks {
+
+enum ErrorType {
+  AcceptError,
+  ReadError,
+  WriteError,
+  ProtocolError,
+  ResolveError,
+  ConnectError,
+  // closed by a deny rule
+  DeniedError,
+  ErrorTypeCount,
+};
+
+// why a connection was turned away by admission control
+enum ShedReason {
+  // the listener relays as many connections as it may
+  ListenerFull,
+  // the loop relays as many connections as it may over all listeners
+  LoopFull,
+  // too many lookups and connects are in flight
+  PendingFull,
+  LoopLag,
+  MemoryPressure,
+  ShedReasonCount,
+};
+
+// Counters of the loop running on the current thread.
+class Stats final {
+ public:
+  static Stats& Local() {
+    thread_local Stats stats;
+    return stats;
+  }
+
+  void CountError(ErrorType type) { this->errors[type]++; }
+  uint64_t Errors(ErrorType type) const { return this->errors[type]; }
+
+  uint64_t TotalErrors() const {
+    uint64_t total = 0;
+    for (auto count : this->errors) {
+      total += count;
+    }
+    return total;
+  }
+
+  void CountShed(ShedReason reason) { this->shed[reason]++; }
+  uint64_t Shed(ShedReason reason) const { return this->shed[reason]; }
+
+  uint64_t TotalShed() const {
+    uint64_t total = 0;
+    for (auto count : this->shed) {
+      total += count;
+    }
+    return total;
+  }
+
+  //connections of either relay from their creation until they are freed
+  void Opened() {
+    this->opened_connections++;
+    this->live_connections++;
+  }
+  void Closed() { this->live_connections--; }
+  uint64_t OpenedConnections() const { return this->opened_connections; }
+  uint64_t LiveConnections() const { return this->live_connections; }
+
+  //bytes sent to destinations with MSG_ZEROCOPY
+  void ZeroCopySent(uint64_t bytes) { this->zerocopy_bytes += bytes; }
+  uint64_t ZeroCopyBytes() const { return this->zerocopy_bytes; }
+
+  //the gauge keeps counting the connections which are still open
+  void Reset() {
+    auto live = this->live_connections;
+    *this = Stats();
+    this->live_connections = live;
+  }
+
+ private:
+  std::array<uint64_t, ErrorTypeCount> errors{};
+  std::array<uint64_t, ShedReasonCount> shed{};
+  uint64_t opened_connections = 0;
+  uint64_t live_connections = 0;
+  uint64_t zerocopy_bytes = 0;
+
+  Stats() = default;
+};
+
+inline const char* ErrorTypeName(ErrorType type) {
+  switch (type) {
+    case AcceptError: return "accept";
+    case ReadError: return "read";
+    case WriteError: return "write";
+    case ProtocolError: return "protocol";
+    case ResolveError: return "resolve";
+    case ConnectError: return "connect";
+    case DeniedError: return "denied";
+    default: return "unknown";
+  }
+}
+
+inline const char* ShedReasonName(ShedReason reason) {
+  switch (reason) {
+    case ListenerFull: return "listener full";
+    case LoopFull: return "loop full";
+    case PendingFull: return "pending full";
+    case LoopLag: return "loop lag";
+    case MemoryPressure: return "memory";
+    default: return "unknown";
+  }
+}
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_STATS_H_
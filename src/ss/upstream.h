@@ -0,0 +1,295 @@
+#ifndef SHADESOCKS_SRC_SS_UPSTREAM_H_
+#define SHADESOCKS_SRC_SS_UPSTREAM_H_
+
+#include <uv.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include "encrypt.h"
+
+namespace shadesocks {
+
+struct UpstreamOptions {
+  // connected sockets kept ready for every healthy upstream
+  size_t warm = 2;
+  // milliseconds between two connect probes of every upstream
+  uint64_t health_interval = 1000;
+  // weight of the newest sample in the moving averages
+  double alpha = 0.2;
+  // failed connects in a row until an upstream is skipped
+  int max_failures = 3;
+};
+
+// Other shadesocks servers the requests are forwarded to instead of their
+// destination. Every connect, to relay or to probe, updates a moving
+// average of the connect time and of the failures of the upstream, and new
+// connections go to the healthy upstream with the lowest score. A few
+// connections to every upstream are kept open so a request does not have
+// to wait for the handshake.
+//
+// The pool is used from the loop thread of its listeners only.
+class UpstreamPool final {
+ public:
+  struct Server {
+    sockaddr_in addr;
+    std::string method;
+    CipherInfo cipher_info;
+    SecByteBlock key;
+    std::shared_ptr<const KeySchedule> schedule;
+
+    //nanoseconds, zero until the first connect
+    double rtt = 0;
+    //share of the recent connects which failed
+    double failures = 0;
+    int consecutive_failures = 0;
+    bool healthy = true;
+  };
+
+  explicit UpstreamPool(UpstreamOptions options = UpstreamOptions()) : options(options) {}
+
+  UpstreamPool(const UpstreamPool&) = delete;
+  UpstreamPool& operator=(const UpstreamPool&) = delete;
+
+  ~UpstreamPool() {
+    this->Stop();
+  }
+
+  void Add(const std::string& ip, int port, const std::string& method, const std::string& password) {
+    Server server;
+    if (uv_ip4_addr(ip.c_str(), port, &server.addr) != 0) {
+      throw InvalidArgument("bad upstream address " + ip);
+    }
+    auto found = cipher_map.find(method);
+    if (found == cipher_map.end()) {
+      throw InvalidArgument("method name " + method + " is not right");
+    }
+    server.method = method;
+    server.cipher_info = found->second;
+    server.key = Util::PasswordToKey(password, server.cipher_info.key_length);
+    server.schedule = std::make_shared<const KeySchedule>(method, server.key);
+    this->servers.push_back(std::move(server));
+    this->idle.emplace_back();
+    this->warming.push_back(0);
+  }
+
+  size_t Size() const { return this->servers.size(); }
+  const Server& At(size_t index) const { return this->servers[index]; }
+  size_t Idle(size_t index) const { return this->idle[index].size(); }
+  uint64_t Taken() const { return this->taken; }
+  uint64_t Probes() const { return this->probes; }
+
+  //probes every upstream right away and then periodically, and warms connections;
+  //every listener using the pool starts it and releases it once stopped
+  void Start(uv_loop_t* loop) {
+    this->users++;
+    if (this->loop != nullptr) {
+      return;
+    }
+    this->loop = loop;
+    this->timer = new uv_timer_t{};
+    uv_timer_init(loop, this->timer);
+    this->timer->data = this;
+    uv_timer_start(this->timer, HealthDone, 0, this->options.health_interval);
+    uv_unref(reinterpret_cast<uv_handle_t*>(this->timer));
+  }
+
+  //the warm connections keep the loop running, the last listener to go stops the pool
+  void Release() {
+    if (this->users > 0 && --this->users == 0) {
+      this->Stop();
+    }
+  }
+
+  //closes the timer, the probes and the warm connections; they are freed
+  //once closed, the pool may be gone by then
+  void Stop() {
+    this->users = 0;
+    if (this->loop == nullptr) {
+      return;
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(this->timer), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_timer_t*>(handle);
+    });
+    this->timer = nullptr;
+    while (!this->links.empty()) {
+      this->CloseLink(this->links.back());
+    }
+    this->loop = nullptr;
+  }
+
+  // the healthy upstream with the lowest score, ties are taken in turns
+  size_t Pick() const {
+    size_t best = 0;
+    double best_score = std::numeric_limits<double>::infinity();
+    bool best_healthy = false;
+    size_t start = this->next++;
+    for (size_t i = 0; i < this->servers.size(); i++) {
+      size_t index = (start + i) % this->servers.size();
+      auto& server = this->servers[index];
+      //the floor keeps an upstream which never connected from scoring zero
+      double score = (server.rtt + 1e6) * (1 + 4 * server.failures);
+      if ((server.healthy && !best_healthy) || (server.healthy == best_healthy && score < best_score)) {
+        best = index;
+        best_score = score;
+        best_healthy = server.healthy;
+      }
+    }
+    return best;
+  }
+
+  // a connected socket to the upstream owned by the caller, or -1
+  int Take(size_t index) {
+    if (this->idle[index].empty()) {
+      return -1;
+    }
+    auto link = this->idle[index].back();
+    //the socket outlives the handle, it must not stay in the epoll set
+    uv_read_stop(reinterpret_cast<uv_stream_t*>(&link->tcp));
+    uv_os_fd_t fd;
+    int err = uv_fileno(reinterpret_cast<uv_handle_t*>(&link->tcp), &fd);
+    fd = err ? -1 : ::dup(fd);
+    this->CloseLink(link);
+    this->Refill(index);
+    if (fd >= 0) {
+      this->taken++;
+    }
+    return fd;
+  }
+
+  void Report(size_t index, bool ok, uint64_t rtt) {
+    auto& server = this->servers[index];
+    auto alpha = this->options.alpha;
+    server.failures = (1 - alpha) * server.failures + (ok ? 0 : alpha);
+    if (ok) {
+      server.rtt = server.rtt == 0 ? rtt : (1 - alpha) * server.rtt + alpha * rtt;
+      server.consecutive_failures = 0;
+      server.healthy = true;
+    } else if (++server.consecutive_failures >= this->options.max_failures) {
+      server.healthy = false;
+    }
+  }
+
+ private:
+  //a probe or a warm connection
+  struct Link {
+    uv_tcp_t tcp;
+    uv_connect_t connect;
+    UpstreamPool* pool;
+    size_t index;
+    uint64_t started;
+    bool warm;
+  };
+
+  UpstreamOptions options;
+  std::vector<Server> servers;
+  std::vector<std::vector<Link*>> idle;
+  std::vector<size_t> warming;
+  std::vector<Link*> links;
+
+  uv_loop_t* loop = nullptr;
+  uv_timer_t* timer = nullptr;
+  size_t users = 0;
+  mutable size_t next = 0;
+  uint64_t taken = 0;
+  uint64_t probes = 0;
+
+  static void HealthDone(uv_timer_t* timer) {
+    auto pool = reinterpret_cast<UpstreamPool*>(timer->data);
+    for (size_t index = 0; index < pool->servers.size(); index++) {
+      pool->Open(index, false);
+      pool->Refill(index);
+    }
+  }
+
+  void Refill(size_t index) {
+    if (this->loop == nullptr || !this->servers[index].healthy) {
+      return;
+    }
+    //a connect which fails right away leaves the count as it was, the next probe tries again
+    while (this->idle[index].size() + this->warming[index] < this->options.warm) {
+      if (this->Open(index, true) != 0) {
+        return;
+      }
+    }
+  }
+
+  // 0 once the connect is under way, or the error it failed with right away
+  int Open(size_t index, bool warm) {
+    auto link = new Link{};
+    link->pool = this;
+    link->index = index;
+    link->warm = warm;
+    link->started = uv_hrtime();
+    uv_tcp_init(this->loop, &link->tcp);
+    link->tcp.data = link;
+    link->connect.data = link;
+    this->links.push_back(link);
+    if (warm) {
+      this->warming[index]++;
+    }
+    int err = uv_tcp_connect(&link->connect, &link->tcp, reinterpret_cast<const sockaddr*>(&this->servers[index].addr),
+                             ConnectDone);
+    if (err) {
+      this->Report(index, false, 0);
+      if (!warm) {
+        this->probes++;
+      }
+      this->CloseLink(link);
+    }
+    return err;
+  }
+
+  void CloseLink(Link* link) {
+    auto& idle = this->idle[link->index];
+    auto found = std::find(idle.begin(), idle.end(), link);
+    if (found != idle.end()) {
+      idle.erase(found);
+    } else if (link->warm && this->warming[link->index] > 0) {
+      this->warming[link->index]--;
+    }
+    this->links.erase(std::find(this->links.begin(), this->links.end(), link));
+    uv_close(reinterpret_cast<uv_handle_t*>(&link->tcp), [](uv_handle_t* handle) {
+      delete reinterpret_cast<Link*>(handle->data);
+    });
+  }
+
+  static void ConnectDone(uv_connect_t* req, int status) {
+    if (status == UV_ECANCELED) {
+      return;
+    }
+    auto link = reinterpret_cast<Link*>(req->data);
+    auto pool = link->pool;
+    pool->Report(link->index, status == 0, uv_hrtime() - link->started);
+    if (!link->warm) {
+      pool->probes++;
+    }
+    if (status < 0 || !link->warm) {
+      pool->CloseLink(link);
+      return;
+    }
+    pool->warming[link->index]--;
+    pool->idle[link->index].push_back(link);
+    //an idle connection only reads to notice that the upstream closed it
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&link->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    if (nread == 0) {
+                      return;
+                    }
+                    auto link = reinterpret_cast<Link*>(stream->data);
+                    auto pool = link->pool;
+                    auto index = link->index;
+                    pool->CloseLink(link);
+                    pool->Refill(index);
+                  });
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_UPSTREAM_H_
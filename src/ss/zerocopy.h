@@ -0,0 +1,281 @@
+#ifndef SHADESOCKS_SRC_SS_ZEROCOPY_H_
+#define SHADESOCKS_SRC_SS_ZEROCOPY_H_
+
+#include <uv.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#include "buffer.h"
+
+namespace shadesocks {
+
+// MSG_ZEROCOPY sends of pooled buffers on one socket. The kernel keeps
+// referencing the pages of such a send until it reports the completion on the
+// error queue of the socket, so a sent buffer is pinned until then and only
+// goes back to the pool once it is reaped. Completions wake the loop up with
+// EPOLLERR until they are read, so they are reaped in the check phase of every
+// iteration while buffers are pinned. The socket itself is only closed once
+// nothing is pinned any more, see Linger.
+class ZeroCopy final {
+ public:
+  //pinning the pages and reading the completion costs more than copying below it
+  static constexpr size_t kThreshold = 10 * 1024;
+  //how often a closed connection looks for its last completions
+  static constexpr uint64_t kLingerInterval = 10;
+  //an orphaned socket is kept as long as tcp_fin_timeout keeps one by default
+  static constexpr uint64_t kLingerLimit = 60 * 1000;
+  //milliseconds the buffers of a reset socket stay out of the pool
+  static constexpr uint64_t kResetQuarantine = 1000;
+
+  //the socket has to be open and enabled
+  explicit ZeroCopy(uv_tcp_t* handle) : handle(handle), fd(-1) {
+    uv_fileno(reinterpret_cast<uv_handle_t*>(handle), &this->fd);
+  }
+  ZeroCopy(const ZeroCopy&) = delete;
+  ZeroCopy& operator=(const ZeroCopy&) = delete;
+
+  ~ZeroCopy() {
+    this->StopReaper();
+    this->ReleaseAll();
+  }
+
+  // fails with UV_ENOTSUP or UV_ENOPROTOOPT where the kernel cannot do it
+  static int Enable(uv_tcp_t* handle) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    uv_os_fd_t fd;
+    int err = uv_fileno(reinterpret_cast<uv_handle_t*>(handle), &fd);
+    if (err) {
+      return err;
+    }
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) ? -errno : 0;
+#else
+    return UV_ENOTSUP;
+#endif
+  }
+
+  // sends as much of the chunk as the socket takes now without blocking; once
+  // anything is sent the buffer belongs to the pinned ones and the chunk keeps
+  // only a copy of what is left, the rest goes out the normal way
+  ssize_t Send(Chunk& chunk) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    ssize_t sent = send(this->fd, chunk.data, chunk.length, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+      return -errno;
+    }
+    this->pinned.push_back(Pin{this->next_id++, chunk.buffer});
+    this->sent_bytes += sent;
+    this->StartReaper();
+    if (sent == chunk.length) {
+      chunk = Chunk();
+      return sent;
+    }
+    auto rest = BufferPool::Local().Acquire();
+    memcpy(rest + BufferPool::kHeadroom, chunk.data + sent, chunk.length - sent);
+    chunk.length -= sent;
+    chunk.buffer = rest;
+    chunk.data = rest + BufferPool::kHeadroom;
+    return sent;
+#else
+    return UV_ENOTSUP;
+#endif
+  }
+
+  // reads the completions which have arrived and gives their buffers back,
+  // returns a negative error when the error queue cannot be read
+  int Reap() {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    while (!this->pinned.empty()) {
+      char control[CMSG_SPACE(sizeof(sock_extended_err)) + 64];
+      msghdr msg{};
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (recvmsg(this->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+      }
+      for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        bool recverr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+        if (!recverr) {
+          continue;
+        }
+        auto err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cmsg));
+        if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+          continue;
+        }
+        //the range of sends completed, inclusive
+        this->Complete(err->ee_info, err->ee_data, err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+      }
+    }
+#endif
+    return 0;
+  }
+
+  //buffers the kernel may still read from
+  bool Pending() const { return !this->pinned.empty(); }
+  size_t PinnedCount() const { return this->pinned.size(); }
+
+  uint64_t SentBytes() const { return this->sent_bytes; }
+  // completed sends, and those for which the kernel copied the pages after all
+  uint64_t Completed() const { return this->completed; }
+  uint64_t Copied() const { return this->copied; }
+
+  // gives every buffer back, only safe once the kernel cannot read them any more
+  void ReleaseAll() {
+    for (auto& pin : this->pinned) {
+      BufferPool::Local().Release(pin.buffer);
+    }
+    this->pinned.clear();
+  }
+
+  // closes the socket of a closed connection once the kernel is done with the
+  // pinned buffers, polling the error queue, or resets it after kLingerLimit
+  // which drops the pages still queued; done is called like by uv_close
+  void Linger(uv_close_cb done) {
+    auto handle = this->handle;
+    uv_read_stop(reinterpret_cast<uv_stream_t*>(handle));
+    this->StopReaper();
+    if (this->Reap() < 0 || !this->Pending()) {
+      this->CloseSocket(done);
+      return;
+    }
+    this->linger_done = done;
+    this->linger_deadline = uv_now(handle->loop) + kLingerLimit;
+    this->linger_timer = new uv_timer_t{};
+    uv_timer_init(handle->loop, this->linger_timer);
+    this->linger_timer->data = this;
+    uv_timer_start(this->linger_timer, LingerTick, kLingerInterval, kLingerInterval);
+  }
+
+  // closes the socket right away, it is reset when buffers are still pinned;
+  // done is called like by uv_close
+  void CloseSocket(uv_close_cb done) {
+    auto handle = this->handle;
+    if (!this->Pending()) {
+      uv_close(reinterpret_cast<uv_handle_t*>(handle), done);
+      return;
+    }
+    //closing with a zero linger time resets the connection and purges its send
+    //and retransmit queues, which drops the references of the socket to the
+    //pages. Clones of segments handed to a qdisc or a driver before the reset
+    //may still be read for a moment though, and the error queue is gone with
+    //the socket, so the buffers are only given back after kResetQuarantine
+    linger option{1, 0};
+    setsockopt(this->fd, SOL_SOCKET, SO_LINGER, &option, sizeof(option));
+    uv_close(reinterpret_cast<uv_handle_t*>(handle), done);
+    Quarantine(handle->loop, std::move(this->pinned));
+    this->pinned.clear();
+  }
+
+ private:
+  struct Pin {
+    uint32_t id;
+    char* buffer;
+  };
+
+  uv_tcp_t* handle;
+  uv_os_fd_t fd;
+  //reaps completions after every poll while buffers are pinned, freed on its own once closed
+  uv_check_t* reaper = nullptr;
+  //in the order sent, completions mostly arrive in that order too
+  std::vector<Pin> pinned;
+  //the kernel numbers every send which took data from 0 on
+  uint32_t next_id = 0;
+  uint64_t sent_bytes = 0;
+  uint64_t completed = 0;
+  uint64_t copied = 0;
+
+  //only set while a closed connection waits for its completions
+  uv_close_cb linger_done = nullptr;
+  uint64_t linger_deadline = 0;
+  uv_timer_t* linger_timer = nullptr;
+
+  struct Quarantined {
+    uv_timer_t timer;
+    std::vector<Pin> pinned;
+  };
+
+  //the timer does not keep the loop alive, the buffers are freed with the pool then
+  static void Quarantine(uv_loop_t* loop, std::vector<Pin> pinned) {
+    auto quarantined = new Quarantined{};
+    quarantined->pinned = std::move(pinned);
+    uv_timer_init(loop, &quarantined->timer);
+    quarantined->timer.data = quarantined;
+    uv_timer_start(&quarantined->timer, [](uv_timer_t* timer) {
+      auto quarantined = reinterpret_cast<Quarantined*>(timer->data);
+      for (auto& pin : quarantined->pinned) {
+        BufferPool::Local().Release(pin.buffer);
+      }
+      uv_close(reinterpret_cast<uv_handle_t*>(timer), [](uv_handle_t* handle) {
+        delete reinterpret_cast<Quarantined*>(handle->data);
+      });
+    }, kResetQuarantine, 0);
+    uv_unref(reinterpret_cast<uv_handle_t*>(&quarantined->timer));
+  }
+
+  static void LingerTick(uv_timer_t* timer) {
+    auto zerocopy = reinterpret_cast<ZeroCopy*>(timer->data);
+    bool failed = zerocopy->Reap() < 0;
+    if (!failed && zerocopy->Pending() && uv_now(timer->loop) < zerocopy->linger_deadline) {
+      return;
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(timer), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_timer_t*>(handle);
+    });
+    zerocopy->linger_timer = nullptr;
+    //the socket and with it the zerocopy state may be freed by the callback
+    zerocopy->CloseSocket(zerocopy->linger_done);
+  }
+
+  void StartReaper() {
+    if (this->reaper == nullptr) {
+      this->reaper = new uv_check_t{};
+      uv_check_init(this->handle->loop, this->reaper);
+      this->reaper->data = this;
+      uv_unref(reinterpret_cast<uv_handle_t*>(this->reaper));
+    }
+    if (!uv_is_active(reinterpret_cast<uv_handle_t*>(this->reaper))) {
+      uv_check_start(this->reaper, [](uv_check_t* check) {
+        auto zerocopy = reinterpret_cast<ZeroCopy*>(check->data);
+        zerocopy->Reap();
+        if (!zerocopy->Pending()) {
+          uv_check_stop(check);
+        }
+      });
+    }
+  }
+
+  void StopReaper() {
+    if (this->reaper == nullptr) {
+      return;
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(this->reaper), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_check_t*>(handle);
+    });
+    this->reaper = nullptr;
+  }
+
+  void Complete(uint32_t low, uint32_t high, bool was_copied) {
+    auto count = uint32_t(high - low);
+    size_t kept = 0;
+    for (auto& pin : this->pinned) {
+      if (uint32_t(pin.id - low) <= count) {
+        BufferPool::Local().Release(pin.buffer);
+        this->completed++;
+        this->copied += was_copied ? 1 : 0;
+      } else {
+        this->pinned[kept++] = pin;
+      }
+    }
+    this->pinned.resize(kept);
+  }
+};
+
+}  // namespace shadesocks
+#endif //SHADESOCKS_SRC_SS_ZEROCOPY_H_
@@ -0,0 +1,283 @@
+#include <sys/resource.h>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+TEST(AdmissionOptionsTest, Check) {
+  Admission admission;
+  ASSERT_TRUE(AdmissionOptions().Empty());
+  AdmissionOptions options;
+  options.max_connections = 2;
+  options.max_loop_connections = Stats::Local().LiveConnections() + 3;
+  options.max_pending = 1;
+  options.max_buffer_memory = (BufferPool::Local().InUse() + 2) * BufferPool::kBufferSize;
+  admission.Start(Loop::getDefault()->get(), options, nullptr, nullptr);
+
+  EXPECT_EQ(admission.Check(), ShedReason::ShedReasonCount);
+  admission.Opened();
+  admission.Opened();
+  EXPECT_EQ(admission.Check(), ShedReason::ListenerFull);
+  admission.Closed();
+
+  //connections of other listeners count for the loop
+  for (int i = 0; i < 3; i++) {
+    Stats::Local().Opened();
+  }
+  EXPECT_EQ(admission.Check(), ShedReason::LoopFull);
+  for (int i = 0; i < 3; i++) {
+    Stats::Local().Closed();
+  }
+
+  auto first = BufferPool::Local().Acquire();
+  auto second = BufferPool::Local().Acquire();
+  EXPECT_EQ(admission.Check(), ShedReason::MemoryPressure);
+  BufferPool::Local().Release(first);
+  BufferPool::Local().Release(second);
+  EXPECT_EQ(admission.Check(), ShedReason::ShedReasonCount);
+
+  EXPECT_TRUE(admission.BeginPending());
+  EXPECT_FALSE(admission.BeginPending());
+  admission.EndPending();
+  EXPECT_TRUE(admission.BeginPending());
+}
+
+TEST(AdmissionOptionsTest, MeasuresLag) {
+  auto loop = Loop::getDefault();
+  Admission admission;
+  AdmissionOptions options;
+  options.max_loop_lag = 50;
+  admission.Start(loop->get(), options, nullptr, nullptr);
+  loopback::RunUntil(loop->get(), [] { return false; }, 50);
+  EXPECT_EQ(admission.Check(), ShedReason::ShedReasonCount);
+
+  //a callback which blocks the loop holds up the probe
+  uv_timer_t blocker;
+  uv_timer_init(loop->get(), &blocker);
+  uv_timer_start(&blocker, [](uv_timer_t*) { usleep(100 * 1000); }, 0, 0);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return admission.Lag() >= 50; }));
+  EXPECT_EQ(admission.Check(), ShedReason::LoopLag);
+  //and the lag decays once the loop keeps up again
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return admission.Lag() < 50; }));
+  uv_close(reinterpret_cast<uv_handle_t*>(&blocker), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+class AdmissionTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Loop> loop = Loop::getDefault();
+
+  TCPHandle& Listen(const AdmissionOptions& options, std::shared_ptr<Resolver> resolver = nullptr) {
+    ServerConfig config;
+    config.admission = options;
+    config.resolver = std::move(resolver);
+    return *loopback::Listen(this->loop, config, 1024);
+  }
+
+  static std::string Request(const TCPHandle& listener, const std::string& header, const std::string& payload) {
+    return loopback::EncodeRequest(listener.get_config(), header + payload);
+  }
+
+  static bool Echoed(const TCPHandle& listener, const loopback::Client& client, size_t length) {
+    return client.received.size() >= listener.get_config().cipher_info.iv_length + length;
+  }
+
+  void Drain() {
+    loopback::RunUntil(this->loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+  }
+};
+
+
+TEST_F(AdmissionTest, ResetsOverConnectionLimit) {
+  loopback::EchoServer target(loop->get());
+  AdmissionOptions options;
+  options.max_connections = 2;
+  auto& listener = Listen(options);
+  auto header = loopback::IPv4Header("127.0.0.1", target.port);
+  auto shed = Stats::Local().Shed(ShedReason::ListenerFull);
+
+  loopback::Client first(loop->get(), listener.get_port(), Request(listener, header, "one"));
+  loopback::Client second(loop->get(), listener.get_port(), Request(listener, header, "two"));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return Echoed(listener, first, 3) && Echoed(listener, second, 3); }));
+  EXPECT_EQ(listener.get_admission().Connections(), 2);
+
+  //the third one is reset right away instead of waiting
+  loopback::Client third(loop->get(), listener.get_port(), Request(listener, header, "three"));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return third.closed; }));
+  EXPECT_EQ(third.read_error, UV_ECONNRESET);
+  EXPECT_EQ(Stats::Local().Shed(ShedReason::ListenerFull), shed + 1);
+
+  //there is room again once one has left
+  first.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return listener.get_admission().Connections() == 1; }));
+  loopback::Client fourth(loop->get(), listener.get_port(), Request(listener, header, "four"));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return Echoed(listener, fourth, 4); }));
+  EXPECT_EQ(loopback::DecodeResponse(listener.get_config(), fourth.received), "four");
+
+  second.Close();
+  fourth.Close();
+  loopback::RunUntil(loop->get(), [&] { return first.closed && second.closed && fourth.closed; });
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  Drain();
+}
+
+TEST_F(AdmissionTest, PausesAccepting) {
+  loopback::EchoServer target(loop->get());
+  AdmissionOptions options;
+  options.max_connections = 1;
+  options.pause_accept = true;
+  auto& listener = Listen(options);
+  auto header = loopback::IPv4Header("127.0.0.1", target.port);
+  auto shed = Stats::Local().TotalShed();
+
+  loopback::Client first(loop->get(), listener.get_port(), Request(listener, header, "one"));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return Echoed(listener, first, 3); }));
+
+  //the second one waits in the backlog, it is neither served nor reset
+  loopback::Client second(loop->get(), listener.get_port(), Request(listener, header, "two"));
+  loopback::RunUntil(loop->get(), [] { return false; }, 100);
+  EXPECT_TRUE(listener.get_admission().Paused());
+  EXPECT_TRUE(second.received.empty());
+  EXPECT_FALSE(second.closed);
+
+  first.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return Echoed(listener, second, 3); }));
+  EXPECT_EQ(loopback::DecodeResponse(listener.get_config(), second.received), "two");
+  EXPECT_FALSE(listener.get_admission().Paused());
+  EXPECT_EQ(listener.get_admission().Pauses(), 1);
+  EXPECT_EQ(Stats::Local().TotalShed(), shed);
+
+  second.Close();
+  loopback::RunUntil(loop->get(), [&] { return first.closed && second.closed; });
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  Drain();
+}
+
+TEST_F(AdmissionTest, ShedsOverPendingLimit) {
+  //a name server which never answers keeps the lookups pending
+  uv_udp_t silent;
+  uv_udp_init(loop->get(), &silent);
+  sockaddr_in addr{};
+  uv_ip4_addr("127.0.0.1", 0, &addr);
+  uv_udp_bind(&silent, (const sockaddr*) &addr, 0);
+  int length = sizeof(addr);
+  uv_udp_getsockname(&silent, (sockaddr*) &addr, &length);
+  ResolverOptions resolver_options;
+  resolver_options.AddServer("127.0.0.1", ntohs(addr.sin_port));
+  resolver_options.timeout = 10000;
+  auto resolver = std::make_shared<Resolver>(loop->get(), resolver_options);
+
+  AdmissionOptions options;
+  options.max_pending = 1;
+  auto& listener = Listen(options, resolver);
+  auto header = loopback::DomainHeader("slow.test", 80);
+  auto shed = Stats::Local().Shed(ShedReason::PendingFull);
+  auto errors = Stats::Local().TotalErrors();
+
+  loopback::Client waiting(loop->get(), listener.get_port(), Request(listener, header, ""));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return listener.get_admission().Pending() == 1; }));
+  loopback::Client shed_client(loop->get(), listener.get_port(), Request(listener, header, ""));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return shed_client.closed; }));
+  EXPECT_EQ(Stats::Local().Shed(ShedReason::PendingFull), shed + 1);
+  EXPECT_EQ(Stats::Local().TotalErrors(), errors);
+  EXPECT_FALSE(waiting.closed);
+
+  //a connection closed while its lookup is pending frees its place
+  waiting.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return listener.get_admission().Pending() == 0; }));
+
+  resolver->Close();
+  uv_close(reinterpret_cast<uv_handle_t*>(&silent), nullptr);
+  Drain();
+}
+
+// offers waves of more and more concurrent requests with a client deadline,
+// goodput is the bytes of the requests answered in time per second
+TEST_F(AdmissionTest, GoodputBeyondSaturation) {
+  const size_t limit = 32;
+  const std::vector<size_t> offered = {limit, 4 * limit, 16 * limit};
+  const size_t size = 64 * 1024;
+  //client, accepted, outbound and target side of every connection
+  rlim_t needed = 4 * offered.back() + 1024;
+  rlimit fds{};
+  getrlimit(RLIMIT_NOFILE, &fds);
+  if (fds.rlim_max != RLIM_INFINITY && fds.rlim_max < needed) {
+    GTEST_SKIP() << "needs " << needed << " file descriptors, the limit is " << fds.rlim_max;
+  }
+  fds.rlim_cur = std::max(fds.rlim_cur, needed);
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &fds), 0);
+
+  loopback::EchoServer target(loop->get());
+  auto header = loopback::IPv4Header("127.0.0.1", target.port);
+  auto& open = Listen(AdmissionOptions());
+  AdmissionOptions options;
+  options.max_connections = limit;
+  auto& guarded = Listen(options);
+
+  //returns the goodput in MB/s
+  auto wave = [&](TCPHandle& listener, size_t count, uint64_t deadline, uint64_t* elapsed) {
+    auto request = Request(listener, header, std::string(size, 'g'));
+    std::vector<std::unique_ptr<loopback::Client>> clients;
+    std::vector<uint64_t> done(count, 0);
+    auto start = uv_hrtime();
+    for (size_t i = 0; i < count; i++) {
+      clients.push_back(std::make_unique<loopback::Client>(loop->get(), listener.get_port(), request));
+    }
+    EXPECT_TRUE(loopback::RunUntil(loop->get(), [&] {
+      bool finished = true;
+      for (size_t i = 0; i < count; i++) {
+        if (done[i] == 0 && Echoed(listener, *clients[i], size)) {
+          done[i] = uv_hrtime();
+        }
+        finished = finished && (done[i] != 0 || clients[i]->closed);
+      }
+      return finished;
+    }, 60000));
+    *elapsed = uv_hrtime() - start;
+    size_t in_time = 0;
+    for (auto at : done) {
+      in_time += at != 0 && at - start <= deadline;
+    }
+    for (auto& client : clients) {
+      client->Close();
+    }
+    loopback::RunUntil(loop->get(), [&] {
+      for (auto& client : clients) {
+        if (!client->closed) {
+          return false;
+        }
+      }
+      return listener.get_admission().Connections() == 0 && BufferPool::Local().InUse() == 0;
+    }, 10000);
+    return in_time * size / (*elapsed / 1e9) / 1024 / 1024;
+  };
+
+  //clients give up a few times later than an unsaturated wave takes
+  uint64_t elapsed = 0;
+  wave(guarded, limit, UINT64_MAX, &elapsed);
+  uint64_t deadline = 4 * elapsed + 20 * 1000000;
+
+  std::vector<double> goodput;
+  for (auto count : offered) {
+    auto shedding = wave(guarded, count, deadline, &elapsed);
+    goodput.push_back(shedding);
+    auto unguarded = wave(open, count, deadline, &elapsed);
+    LOG(INFO) << count << " concurrent requests, " << deadline / 1000000 << "ms deadline: " << shedding
+              << " MB/s with admission control, " << unguarded << " MB/s without";
+  }
+  LOG(INFO) << Stats::Local().Shed(ShedReason::ListenerFull) << " connections shed";
+  //beyond the limit goodput stays about where it was at the limit
+  EXPECT_GT(goodput.back(), goodput.front() / 4);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  Drain();
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
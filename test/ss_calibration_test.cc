@@ -0,0 +1,124 @@
+#include <fstream>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+class CalibrationTest : public ::testing::Test {
+ protected:
+  // a cache with made up results, every method at the given MB/s unless overridden
+  static void WriteCache(const std::string& path, const std::string& fingerprint,
+                         const std::map<std::string, double>& throughputs, double others = 100) {
+    std::ofstream out(path, std::ios::trunc);
+    out << "shadesocks-ciphers " << CipherCalibration::kVersion << " " << fingerprint << "\n";
+    for (auto& cipher : cipher_map) {
+      auto found = throughputs.find(cipher.first);
+      auto throughput = found == throughputs.end() ? others : found->second;
+      out << cipher.first << " " << throughput / 2 << " " << throughput << "\n";
+    }
+  }
+};
+
+TEST_F(CalibrationTest, MeasuresEveryMethod) {
+  CipherCalibration calibration;
+  ASSERT_TRUE(calibration.Empty());
+  calibration.Run(2);
+  ASSERT_EQ(calibration.Results().size(), cipher_map.size());
+  for (auto& result : calibration.Results()) {
+    EXPECT_GT(result.second.small, 0) << result.first;
+    EXPECT_GT(result.second.large, 0) << result.first;
+  }
+  auto fastest = calibration.Fastest();
+  for (auto& cipher : cipher_map) {
+    EXPECT_GE(calibration.Get(fastest).large, calibration.Get(cipher.first).large);
+  }
+  calibration.Log();
+}
+
+TEST_F(CalibrationTest, SavesAndLoads) {
+  auto path = testing::TempDir() + "calibration_saved";
+  CipherCalibration calibration;
+  //nothing measured is nothing to save
+  EXPECT_EQ(calibration.Save(path), -EINVAL);
+  calibration.Run(1);
+  ASSERT_EQ(calibration.Save(path), 0);
+
+  CipherCalibration loaded;
+  ASSERT_EQ(loaded.Load(path), 0);
+  ASSERT_EQ(loaded.Results().size(), cipher_map.size());
+  for (auto& result : calibration.Results()) {
+    EXPECT_NEAR(loaded.Get(result.first).large, result.second.large, result.second.large * 1e-3);
+  }
+  EXPECT_EQ(loaded.Fastest(), calibration.Fastest());
+  std::remove(path.c_str());
+}
+
+TEST_F(CalibrationTest, RejectsUnusableCaches) {
+  auto path = testing::TempDir() + "calibration_unusable";
+  CipherCalibration calibration;
+  std::remove(path.c_str());
+  EXPECT_EQ(calibration.Load(path), -ENOENT);
+
+  std::ofstream(path, std::ios::trunc) << "not a calibration\n";
+  EXPECT_EQ(calibration.Load(path), -EINVAL);
+
+  //measured on another CPU
+  WriteCache(path, "0", {});
+  EXPECT_EQ(calibration.Load(path), -ESTALE);
+
+  //a line cut short
+  WriteCache(path, CipherCalibration::HostFingerprint(), {});
+  std::ofstream(path, std::ios::app) << "truncated";
+  EXPECT_EQ(calibration.Load(path), -EINVAL);
+  //written before a method was added
+  {
+    std::ofstream out(path, std::ios::trunc);
+    out << "shadesocks-ciphers " << CipherCalibration::kVersion << " " << CipherCalibration::HostFingerprint() << "\n";
+    out << "aes-128-ctr 1 2\n";
+  }
+  EXPECT_EQ(calibration.Load(path), -ESTALE);
+  EXPECT_TRUE(calibration.Empty());
+  std::remove(path.c_str());
+}
+
+TEST_F(CalibrationTest, LoadOrRunUsesTheCache) {
+  auto path = testing::TempDir() + "calibration_cached";
+  WriteCache(path, CipherCalibration::HostFingerprint(), {{"salsa20", 12345}});
+  CipherCalibration calibration;
+  calibration.LoadOrRun(path, 1);
+  EXPECT_EQ(calibration.Get("salsa20").large, 12345);
+
+  //a stale cache is measured again and replaced
+  WriteCache(path, "0", {{"salsa20", 12345}});
+  calibration.LoadOrRun(path, 1);
+  EXPECT_NE(calibration.Get("salsa20").large, 12345);
+  CipherCalibration reloaded;
+  EXPECT_EQ(reloaded.Load(path), 0);
+  std::remove(path.c_str());
+}
+
+TEST_F(CalibrationTest, ChoosesFastestAcceptable) {
+  auto path = testing::TempDir() + "calibration_choose";
+  WriteCache(path, CipherCalibration::HostFingerprint(),
+             {{"aes-256-gcm", 900}, {"chacha20-ietf", 600}, {"aes-128-ctr", 3000}});
+  CipherCalibration calibration;
+  ASSERT_EQ(calibration.Load(path), 0);
+
+  EXPECT_EQ(calibration.Fastest(), "aes-128-ctr");
+  EXPECT_EQ(calibration.Choose({"chacha20-ietf", "aes-256-gcm"}), "aes-256-gcm");
+  EXPECT_EQ(calibration.Fastest({"chacha20-ietf", "salsa20"}), "salsa20");
+  EXPECT_THROW(calibration.Fastest({"aes-256-gcm", "rc4"}), InvalidArgument);
+  //the choice is a method a listener can be configured with
+  ServerConfig config(calibration.Choose({"chacha20-ietf", "aes-256-gcm"}));
+  EXPECT_EQ(config.method, "aes-256-gcm");
+  std::remove(path.c_str());
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -1,4 +1,118 @@
-#include "ss_test.h"
+#include <dirent.h>
+#include <malloc.h>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+static size_t OpenFds() {
+  size_t count = 0;
+  auto dir = opendir("/proc/self/fd");
+  while (dir != nullptr && readdir(dir) != nullptr) {
+    count++;
+  }
+  if (dir != nullptr) {
+    closedir(dir);
+  }
+  return count;
+}
+
+class HalfCloseTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::shared_ptr<TCPHandle> listener;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    listener = loop->create_tcp_handle();
+    listener->bind("127.0.0.1", 0);
+    listener->listen(1024);
+  }
+
+  static std::string Request(int port, const std::string& payload) {
+    return loopback::EncodeRequest(listener->get_config(), loopback::IPv4Header("127.0.0.1", port) + payload);
+  }
+
+  static bool Drained(uint64_t live) {
+    return loopback::RunUntil(loop->get(), [&] {
+      return Stats::Local().LiveConnections() == live && BufferPool::Local().InUse() == 0;
+    });
+  }
+};
+
+std::shared_ptr<Loop> HalfCloseTest::loop;
+std::shared_ptr<TCPHandle> HalfCloseTest::listener;
+
+TEST_F(HalfCloseTest, ServerClosesFirst) {
+  loopback::ReplyServer target(loop->get(), "bye");
+  auto live = Stats::Local().LiveConnections();
+  loopback::Client client(loop->get(), listener->get_port(), Request(target.port, ""));
+  //the end of the server reaches the client
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+  EXPECT_EQ(client.read_error, UV_EOF);
+  EXPECT_EQ(loopback::DecodeResponse(listener->get_config(), client.received), "bye");
+  EXPECT_TRUE(Drained(live));
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+}
+
+TEST_F(HalfCloseTest, ClientClosesFirst) {
+  loopback::ReplyServer target(loop->get(), "");
+  auto live = Stats::Local().LiveConnections();
+  //the server only answers once it saw the end of the client
+  loopback::Client client(loop->get(), listener->get_port(), Request(target.port, "hello"), false, true);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+  EXPECT_EQ(client.read_error, UV_EOF);
+  EXPECT_EQ(loopback::DecodeResponse(listener->get_config(), client.received), "5");
+  EXPECT_TRUE(Drained(live));
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+}
+
+// many short connections in both orders of closing leave nothing behind
+TEST_F(HalfCloseTest, ReturnsToBaseline) {
+  const int connections = 2000;
+  const int batch = 100;
+  loopback::ReplyServer greeter(loop->get(), "bye");
+  loopback::ReplyServer counter(loop->get(), "");
+
+  auto run = [&](int count) {
+    for (int done = 0; done < count; done += batch) {
+      std::vector<std::unique_ptr<loopback::Client>> clients;
+      for (int i = 0; i < batch; i++) {
+        //the greeter does not read, a payload to it could be reset
+        bool client_first = i % 2 == 0;
+        auto request = client_first ? Request(counter.port, "ping") : Request(greeter.port, "");
+        clients.push_back(std::make_unique<loopback::Client>(loop->get(), listener->get_port(), request,
+                                                             false, client_first));
+      }
+      ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+        for (auto& client : clients) {
+          if (!client->closed) {
+            return false;
+          }
+        }
+        return true;
+      }, 10000));
+    }
+  };
+
+  //the pools fill up during the first round
+  auto live = Stats::Local().LiveConnections();
+  run(batch);
+  ASSERT_TRUE(Drained(live));
+  auto fds = OpenFds();
+  auto memory = mallinfo2().uordblks;
+  auto opened = Stats::Local().OpenedConnections();
+
+  run(connections);
+  ASSERT_TRUE(Drained(live));
+  EXPECT_EQ(Stats::Local().OpenedConnections(), opened + connections);
+  EXPECT_EQ(OpenFds(), fds);
+  auto grown = ssize_t(mallinfo2().uordblks) - ssize_t(memory);
+  LOG(INFO) << "heap after " << connections << " connections: " << grown << " bytes more";
+  EXPECT_LT(grown, 256 * 1024);
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+}
+
+}
 
 int main(int argc, char** argv) {
   FLAGS_colorlogtostderr = 1;
@@ -6,4 +120,4 @@ int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   google::InitGoogleLogging(argv[0]);
   return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}
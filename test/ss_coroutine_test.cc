@@ -0,0 +1,267 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+TEST(FramePoolTest, Recycles) {
+  auto& pool = FramePool::Local();
+  auto in_use = pool.InUse();
+  auto frame = pool.Allocate(100);
+  EXPECT_EQ(pool.InUse(), in_use + 1);
+  pool.Free(frame, 100);
+  //a frame of the same size class comes back
+  EXPECT_EQ(pool.Allocate(120), frame);
+  pool.Free(frame, 120);
+  EXPECT_EQ(pool.InUse(), in_use);
+  EXPECT_GE(pool.Cached(), 1);
+
+  //large frames are not cached
+  auto large = pool.Allocate(FramePool::kGranularity * FramePool::kClasses + 1);
+  auto cached = pool.Cached();
+  pool.Free(large, FramePool::kGranularity * FramePool::kClasses + 1);
+  EXPECT_EQ(pool.Cached(), cached);
+}
+
+// listeners relaying with coroutines or with callbacks, in front of an echo server
+class CoroutineTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::unique_ptr<loopback::EchoServer> target;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    target = std::make_unique<loopback::EchoServer>(loop->get());
+  }
+
+  static std::shared_ptr<TCPHandle> Listen(bool coroutine_relay, ServerConfig config = ServerConfig()) {
+    config.coroutine_relay = coroutine_relay;
+    return loopback::Listen(loop, std::move(config), 1024);
+  }
+
+  // the plain response, empty when the connection was closed
+  static std::string Relay(const std::shared_ptr<TCPHandle>& listener, const std::string& header,
+                           const std::string& payload) {
+    auto& config = listener->get_config();
+    loopback::Client client(loop->get(), listener->get_port(), loopback::EncodeRequest(config, header + payload));
+    loopback::RunUntil(loop->get(), [&] {
+      return client.closed || client.received.size() >= config.cipher_info.iv_length + payload.size();
+    }, 10000);
+    client.Close();
+    loopback::RunUntil(loop->get(), [&] { return client.closed; });
+    return loopback::DecodeResponse(config, client.received);
+  }
+
+  static bool Drained() {
+    return loopback::RunUntil(loop->get(), [] {
+      return BufferPool::Local().InUse() == 0 && FramePool::Local().InUse() == 0;
+    });
+  }
+};
+
+std::shared_ptr<Loop> CoroutineTest::loop;
+std::unique_ptr<loopback::EchoServer> CoroutineTest::target;
+
+TEST_F(CoroutineTest, Relays) {
+  for (auto method : {"aes-256-cfb", "chacha20-ietf"}) {
+    auto listener = Listen(true, ServerConfig(method));
+    auto header = loopback::IPv4Header("127.0.0.1", target->port);
+    EXPECT_EQ(Relay(listener, header, "hello"), "hello") << method;
+    EXPECT_EQ(Relay(listener, loopback::DomainHeader("localhost", target->port), "world"), "world") << method;
+
+    std::string bulk(1024 * 1024, 0);
+    for (size_t i = 0; i < bulk.size(); i++) {
+      bulk[i] = char(i * 7 + i / 253);
+    }
+    EXPECT_EQ(Relay(listener, header, bulk), bulk) << method;
+  }
+  //the frames go back to the pool with the connections
+  EXPECT_TRUE(Drained());
+}
+
+TEST_F(CoroutineTest, Errors) {
+  std::istringstream in("deny 10.0.0.0/8\n");
+  ServerConfig config;
+  config.rules = std::make_shared<RuleTable>(RuleSet::Parse(in));
+  auto listener = Listen(true, config);
+  auto& stats = Stats::Local();
+
+  auto connect_errors = stats.Errors(ErrorType::ConnectError);
+  EXPECT_EQ(Relay(listener, loopback::IPv4Header("127.0.0.1", loopback::ClosedPort(loop->get())), "x"), "");
+  EXPECT_EQ(stats.Errors(ErrorType::ConnectError), connect_errors + 1);
+
+  auto denied = stats.Errors(ErrorType::DeniedError);
+  EXPECT_EQ(Relay(listener, loopback::IPv4Header("10.1.2.3", 80), "x"), "");
+  EXPECT_EQ(stats.Errors(ErrorType::DeniedError), denied + 1);
+
+  auto protocol_errors = stats.Errors(ErrorType::ProtocolError);
+  //done in the middle of the iv
+  loopback::Client short_iv(loop->get(), listener->get_port(), "abc", false, true);
+  loopback::RunUntil(loop->get(), [&] { return short_iv.closed; });
+  EXPECT_EQ(stats.Errors(ErrorType::ProtocolError), protocol_errors + 1);
+
+  //a client leaving in the middle of the handshake
+  loopback::Client reset(loop->get(), listener->get_port(), "", true);
+  loopback::RunUntil(loop->get(), [&] { return reset.closed; });
+  EXPECT_TRUE(Drained());
+}
+
+TEST_F(CoroutineTest, RefusesUnsupportedSettings) {
+  std::vector<ServerConfig> configs(6);
+  configs[0].connection_limit.rate = 1024 * 1024;
+  configs[1].upstream = std::make_shared<UpstreamPool>();
+  configs[2].resolver = std::make_shared<Resolver>(loop->get(), ResolverOptions());
+  configs[3].local_destinations.Add("backend.local", 80, "/tmp/backend");
+  configs[4].zerocopy_threshold = ZeroCopy::kThreshold;
+  for (auto& config : configs) {
+    config.coroutine_relay = true;
+    auto listener = loop->create_tcp_handle();
+    listener->set_config(config);
+    listener->bind("127.0.0.1", 0);
+    loopback::Listeners().push_back(listener);
+    if (&config == &configs.back()) {
+      //the loop scheduler is not a setting of the listener, but is refused as well
+      Scheduler::Local().Start(loop->get());
+      EXPECT_THROW(listener->listen(), InvalidArgument);
+      Scheduler::Local().Stop();
+    } else {
+      EXPECT_THROW(listener->listen(), InvalidArgument);
+    }
+    listener->stop();
+  }
+}
+
+TEST_F(CoroutineTest, AdmissionLimits) {
+  ServerConfig config;
+  config.admission.max_connections = 2;
+  auto listener = Listen(true, config);
+  auto payload = loopback::EncodeRequest(listener->get_config(), loopback::IPv4Header("127.0.0.1", target->port) + "x");
+  auto shed = Stats::Local().Shed(ShedReason::ListenerFull);
+
+  std::vector<std::unique_ptr<loopback::Client>> clients;
+  for (int i = 0; i < 3; i++) {
+    clients.push_back(std::make_unique<loopback::Client>(loop->get(), listener->get_port(), payload));
+  }
+  //the third one is over the limit, the two relayed count until they are closed
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return clients[2]->closed; }));
+  EXPECT_EQ(Stats::Local().Shed(ShedReason::ListenerFull), shed + 1);
+  EXPECT_EQ(listener->get_admission().Connections(), 2u);
+  for (auto& client : clients) {
+    client->Close();
+  }
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return listener->get_admission().Connections() == 0; }));
+  EXPECT_TRUE(Drained());
+}
+
+// a handed over listener is drained of the connections relayed by coroutines too
+TEST_F(CoroutineTest, HandoffWaitsForCoroutines) {
+  auto path = "/tmp/ss_coroutine_handoff." + std::to_string(getpid());
+  auto old_listener = Listen(true);
+  auto& config = old_listener->get_config();
+
+  loopback::Client idle(loop->get(), old_listener->get_port(),
+                        loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target->port)));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return old_listener->get_admission().Connections() == 1; }));
+
+  bool drained = false;
+  size_t remaining = 1;
+  HandoffServer predecessor({old_listener}, 10000);
+  predecessor.Start(loop->get(), path, [&](size_t left) {
+    drained = true;
+    remaining = left;
+  });
+  HandoffClient successor;
+  successor.Start(loop->get(), path, [&](int result) {
+    ASSERT_EQ(result, 0);
+    loopback::Listeners().push_back(successor.Listeners().front());
+    successor.Listeners().front()->set_config(config);
+    successor.Listeners().front()->listen();
+    successor.Ready();
+  });
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return predecessor.HandedOff(); }));
+  //the relay coroutine keeps the drain waiting like a callback relay would
+  loopback::RunUntil(loop->get(), [] { return false; }, 200);
+  EXPECT_FALSE(drained);
+  EXPECT_EQ(predecessor.Remaining(), 1u);
+
+  idle.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return drained; }));
+  EXPECT_EQ(remaining, 0u);
+  successor.Listeners().front()->stop();
+  EXPECT_TRUE(Drained());
+}
+
+// the same bulk transfers and the same idle connections through both relays,
+// the coroutines have to keep up with the callbacks on both counts
+TEST_F(CoroutineTest, AgainstCallbacks) {
+  const size_t bulk_size = 32 * 1024 * 1024;
+  const int rounds = 3;
+  const size_t connections = 500;
+  std::string bulk(bulk_size, 'b');
+  auto header = loopback::IPv4Header("127.0.0.1", target->port);
+  //MB/s and bytes per idle connection, callbacks first
+  double throughput[2] = {};
+  size_t memory[2] = {};
+
+  for (bool coroutine_relay : {false, true}) {
+    auto name = coroutine_relay ? "coroutines" : "callbacks";
+    auto listener = Listen(coroutine_relay);
+    //the best of a few rounds, a single one is at the mercy of the scheduler
+    for (int round = 0; round < rounds; round++) {
+      auto start = uv_hrtime();
+      EXPECT_EQ(Relay(listener, header, bulk).size(), bulk_size) << name;
+      auto elapsed = (uv_hrtime() - start) / 1e9;
+      throughput[coroutine_relay] = std::max(throughput[coroutine_relay], bulk_size / elapsed / 1024 / 1024);
+    }
+
+    //connections waiting in both directions after one round trip
+    auto frames = FramePool::Local().InUseBytes();
+    auto payload = loopback::EncodeRequest(listener->get_config(), header + "x");
+    std::vector<std::unique_ptr<loopback::Client>> clients;
+    for (size_t i = 0; i < connections; i++) {
+      clients.push_back(std::make_unique<loopback::Client>(loop->get(), listener->get_port(), payload));
+    }
+    size_t iv_length = listener->get_config().cipher_info.iv_length;
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+      for (auto& client : clients) {
+        if (client->received.size() < iv_length + 1) {
+          return false;
+        }
+      }
+      return true;
+    }, 10000)) << name;
+    //idle connections hold no buffer either way
+    EXPECT_EQ(BufferPool::Local().InUse(), 0) << name;
+    EXPECT_EQ(listener->get_admission().Connections(), connections) << name;
+    memory[coroutine_relay] = coroutine_relay
+        ? sizeof(CoroRelay) + (FramePool::Local().InUseBytes() - frames) / connections
+        : sizeof(ShadeHandle);
+
+    for (auto& client : clients) {
+      client->Close();
+    }
+    loopback::RunUntil(loop->get(), [&] {
+      for (auto& client : clients) {
+        if (!client->closed) {
+          return false;
+        }
+      }
+      return true;
+    });
+  }
+  LOG(INFO) << "callbacks: " << throughput[0] << "MB/s, " << memory[0] << " bytes per idle connection; "
+            << "coroutines: " << throughput[1] << "MB/s, " << memory[1] << " bytes per idle connection";
+  //besides the ciphers, which are the same
+  EXPECT_LE(memory[1], memory[0]);
+  //loopback throughput varies by a few percent from run to run
+  EXPECT_GE(throughput[1], throughput[0] * 0.9);
+  EXPECT_TRUE(Drained());
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,498 @@
+#include <chrono>
+#include <set>
+#include <thread>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+// answers A queries from its table over UDP and over TCP on the same port,
+// AAAA queries of known names get an empty answer
+class FakeDns final {
+ public:
+  std::unordered_map<std::string, std::string> records;
+  //answered with the truncated flag over UDP
+  std::set<std::string> truncated;
+  //UDP queries left unanswered before the next one is
+  int drop = 0;
+  //AAAA queries are never answered, like behind a filtering firewall
+  bool silent_aaaa = false;
+  uint64_t udp_queries = 0;
+  uint64_t tcp_queries = 0;
+  int port;
+
+  explicit FakeDns(uv_loop_t* loop) {
+    uv_udp_init(loop, &this->udp);
+    this->udp.data = this;
+    sockaddr_in addr{};
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_udp_bind(&this->udp, (const sockaddr*) &addr, 0);
+    int length = sizeof(addr);
+    uv_udp_getsockname(&this->udp, (sockaddr*) &addr, &length);
+    this->port = ntohs(addr.sin_port);
+    uv_udp_recv_start(&this->udp,
+                      [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+                        auto dns = reinterpret_cast<FakeDns*>(handle->data);
+                        *buf = uv_buf_init(dns->buffer, sizeof(dns->buffer));
+                      },
+                      [](uv_udp_t* udp, ssize_t nread, const uv_buf_t* buf, const sockaddr* from, unsigned flags) {
+                        auto dns = reinterpret_cast<FakeDns*>(udp->data);
+                        if (nread <= 0 || from == nullptr) {
+                          return;
+                        }
+                        dns->udp_queries++;
+                        if (dns->drop > 0) {
+                          dns->drop--;
+                          return;
+                        }
+                        auto answer = dns->Answer(std::string(buf->base, nread), false);
+                        if (answer.empty()) {
+                          return;
+                        }
+                        auto out = uv_buf_init(&answer[0], answer.size());
+                        uv_udp_try_send(udp, &out, 1, from);
+                      });
+
+    uv_tcp_init(loop, &this->tcp);
+    this->tcp.data = this;
+    uv_tcp_bind(&this->tcp, (const sockaddr*) &addr, 0);
+    uv_listen(reinterpret_cast<uv_stream_t*>(&this->tcp), 128, [](uv_stream_t* server, int status) {
+      auto peer = new Peer{};
+      peer->dns = reinterpret_cast<FakeDns*>(server->data);
+      uv_tcp_init(server->loop, &peer->tcp);
+      peer->tcp.data = peer;
+      if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&peer->tcp)) != 0) {
+        peer->Close();
+        return;
+      }
+      uv_read_start(reinterpret_cast<uv_stream_t*>(&peer->tcp),
+                    [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+                      auto peer = reinterpret_cast<Peer*>(handle->data);
+                      *buf = uv_buf_init(peer->dns->buffer, sizeof(peer->dns->buffer));
+                    },
+                    [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                      auto peer = reinterpret_cast<Peer*>(stream->data);
+                      if (nread < 0) {
+                        peer->Close();
+                        return;
+                      }
+                      peer->in.append(buf->base, nread);
+                      if (peer->in.size() < 2 || peer->in.size() < 2 + size_t(uint8_t(peer->in[0]) << 8 | uint8_t(peer->in[1]))) {
+                        return;
+                      }
+                      peer->dns->tcp_queries++;
+                      auto answer = peer->dns->Answer(peer->in.substr(2), true);
+                      peer->in.clear();
+                      if (answer.empty()) {
+                        return;
+                      }
+                      peer->out.push_back(char(answer.size() >> 8));
+                      peer->out.push_back(char(answer.size()));
+                      peer->out += answer;
+                      auto out = uv_buf_init(&peer->out[0], peer->out.size());
+                      uv_write(&peer->write, stream, &out, 1, nullptr);
+                    });
+    });
+  }
+
+  ResolverOptions Options() const {
+    ResolverOptions options;
+    options.AddServer("127.0.0.1", this->port);
+    options.timeout = 100;
+    return options;
+  }
+
+ private:
+  struct Peer {
+    uv_tcp_t tcp;
+    uv_write_t write;
+    FakeDns* dns;
+    std::string in;
+    std::string out;
+
+    void Close() {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->tcp), [](uv_handle_t* handle) {
+        delete reinterpret_cast<Peer*>(handle->data);
+      });
+    }
+  };
+
+  uv_udp_t udp;
+  uv_tcp_t tcp;
+  char buffer[2048];
+
+  // the response to the query, empty when it is not answered
+  std::string Answer(const std::string& query, bool over_tcp) {
+    //the question is taken over as it is
+    size_t position = 12;
+    std::string name;
+    while (position < query.size() && query[position] != 0) {
+      size_t length = uint8_t(query[position]);
+      name += (name.empty() ? "" : ".") + query.substr(position + 1, length);
+      position += 1 + length;
+    }
+    position += 1;
+    uint16_t type = uint8_t(query[position]) << 8 | uint8_t(query[position + 1]);
+    if (type == Resolver::kTypeAAAA && this->silent_aaaa) {
+      return "";
+    }
+    std::string answer = query.substr(0, position + 4);
+    //a response with recursion available
+    answer[2] = char(0x81);
+    answer[3] = char(0x80);
+
+    auto found = this->records.find(name);
+    if (found == this->records.end()) {
+      answer[3] |= 3;
+      return answer;
+    }
+    if (!over_tcp && this->truncated.count(name) != 0) {
+      answer[2] |= 0x02;
+      return answer;
+    }
+    if (type != Resolver::kTypeA) {
+      return answer;
+    }
+    answer[7] = 1;
+    //a pointer to the name of the question, class IN, a ttl of 60
+    answer += std::string("\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04", 12);
+    in_addr addr{};
+    uv_inet_pton(AF_INET, found->second.c_str(), &addr);
+    answer.append(reinterpret_cast<const char*>(&addr), 4);
+    return answer;
+  }
+};
+
+// a lookup with its result, the request stays alive as long as the lookup
+struct Lookup {
+  ResolveRequest req;
+  int status = 1;
+
+  Lookup() {
+    this->req.data = this;
+  }
+
+  bool Done() const { return this->status != 1; }
+
+  std::string Address() const {
+    char ip[INET_ADDRSTRLEN] = "";
+    if (!this->req.ipv4.empty()) {
+      uv_inet_ntop(AF_INET, &this->req.ipv4.front(), ip, sizeof(ip));
+    }
+    return ip;
+  }
+
+  int Start(Resolver& resolver, const std::string& host) {
+    return resolver.Resolve(&this->req, host, [](ResolveRequest* req, int status) {
+      auto lookup = reinterpret_cast<Lookup*>(req->data);
+      lookup->status = status;
+    });
+  }
+};
+
+class ResolverTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::unique_ptr<FakeDns> dns;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    dns = std::make_unique<FakeDns>(loop->get());
+    dns->records["echo.test"] = "127.0.0.1";
+    dns->records["large.test"] = "127.0.0.2";
+    dns->truncated.insert("large.test");
+  }
+
+  static std::string Resolve(Resolver& resolver, const std::string& host, int& status) {
+    Lookup lookup;
+    status = lookup.Start(resolver, host);
+    if (status == 0) {
+      if (!loopback::RunUntil(loop->get(), [&] { return lookup.Done(); }, 5000)) {
+        resolver.Cancel(&lookup.req);
+      }
+      status = lookup.status;
+    }
+    return lookup.Address();
+  }
+};
+
+std::shared_ptr<Loop> ResolverTest::loop;
+std::unique_ptr<FakeDns> ResolverTest::dns;
+
+TEST(ResolverMessageTest, EncodeName) {
+  std::string out;
+  EXPECT_TRUE(Resolver::EncodeName("www.example.com.", out));
+  EXPECT_EQ(out, std::string("\x03www\x07" "example\x03" "com\x00", 17));
+  out.clear();
+  EXPECT_FALSE(Resolver::EncodeName("a..b", out));
+  out.clear();
+  EXPECT_FALSE(Resolver::EncodeName(std::string(64, 'a') + ".com", out));
+  out.clear();
+  EXPECT_FALSE(Resolver::EncodeName("", out));
+}
+
+TEST(ResolverMessageTest, ParseAnswers) {
+  //one question, a CNAME and an A record pointing into the message, then an AAAA record
+  std::string message("\x12\x34\x81\x80\x00\x01\x00\x03\x00\x00\x00\x00", 12);
+  message += std::string("\x01" "a\x04test\x00\x00\x01\x00\x01", 12);
+  message += std::string("\xc0\x0c\x00\x05\x00\x01\x00\x00\x00\x3c\x00\x04\x01" "b\xc0\x0e", 16);
+  message += std::string("\xc0\x24\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04\x0a\x00\x00\x01", 16);
+  message += std::string("\xc0\x24\x00\x1c\x00\x01\x00\x00\x00\x3c\x00\x10", 12) + std::string(15, '\0') + "\x01";
+  std::vector<in_addr> ipv4;
+  std::vector<in6_addr> ipv6;
+  bool truncated = true;
+  auto data = reinterpret_cast<const uint8_t*>(message.data());
+  EXPECT_EQ(Resolver::ParseAnswers(data, message.size(), ipv4, ipv6, truncated), 0);
+  EXPECT_FALSE(truncated);
+  ASSERT_EQ(ipv4.size(), 1);
+  EXPECT_EQ(ntohl(ipv4[0].s_addr), 0x0a000001);
+  ASSERT_EQ(ipv6.size(), 1);
+  EXPECT_EQ(ipv6[0].s6_addr[15], 1);
+
+  //cut records and error codes
+  ipv4.clear();
+  EXPECT_EQ(Resolver::ParseAnswers(data, message.size() - 1, ipv4, ipv6, truncated), UV_EPROTO);
+  message[3] = char(0x83);
+  EXPECT_EQ(Resolver::ParseAnswers(data, message.size(), ipv4, ipv6, truncated), UV_EAI_NONAME);
+  message[3] = char(0x82);
+  EXPECT_EQ(Resolver::ParseAnswers(data, message.size(), ipv4, ipv6, truncated), UV_EAI_FAIL);
+}
+
+TEST_F(ResolverTest, Resolves) {
+  auto options = dns->Options();
+  options.ipv6 = true;
+  options.hosts["pinned.test"] = in_addr{htonl(0x0a000002)};
+  Resolver resolver(loop->get(), options);
+  int status;
+  EXPECT_EQ(Resolve(resolver, "echo.test", status), "127.0.0.1");
+  EXPECT_EQ(status, 0);
+  EXPECT_EQ(Resolve(resolver, "ECHO.test.", status), "127.0.0.1");
+  EXPECT_EQ(Resolve(resolver, "missing.test", status), "");
+  EXPECT_EQ(status, UV_EAI_NONAME);
+  Resolve(resolver, "bad..name", status);
+  EXPECT_EQ(status, UV_EINVAL);
+
+  //answered without a query
+  auto sent = resolver.Sent();
+  EXPECT_EQ(Resolve(resolver, "pinned.test", status), "10.0.0.2");
+  EXPECT_EQ(Resolve(resolver, "10.1.2.3", status), "10.1.2.3");
+  EXPECT_EQ(resolver.Sent(), sent);
+
+  //all in flight at once on the same socket
+  std::vector<std::unique_ptr<Lookup>> lookups;
+  for (int i = 0; i < 500; i++) {
+    lookups.push_back(std::make_unique<Lookup>());
+    ASSERT_EQ(lookups.back()->Start(resolver, i % 2 ? "echo.test" : "large.test"), 0);
+  }
+  EXPECT_EQ(resolver.InFlight(), 1000);
+  loopback::RunUntil(loop->get(), [&] { return resolver.InFlight() == 0; }, 5000);
+  for (size_t i = 0; i < lookups.size(); i++) {
+    EXPECT_EQ(lookups[i]->status, 0);
+    EXPECT_EQ(lookups[i]->Address(), i % 2 ? "127.0.0.1" : "127.0.0.2");
+  }
+}
+
+TEST_F(ResolverTest, Retransmits) {
+  //the first server never answers, the second one drops the first query
+  ResolverOptions options;
+  options.AddServer("127.0.0.1", loopback::ClosedPort(loop->get()));
+  options.AddServer("127.0.0.1", dns->port);
+  options.timeout = 50;
+  options.attempts = 4;
+  options.ipv6 = false;
+  Resolver resolver(loop->get(), options);
+  int status;
+  dns->drop = 1;
+  EXPECT_EQ(Resolve(resolver, "echo.test", status), "127.0.0.1");
+  EXPECT_EQ(Resolve(resolver, "echo.test", status), "127.0.0.1");
+  EXPECT_GE(resolver.Retransmits(), 2);
+  EXPECT_EQ(dns->drop, 0);
+
+  //no answer at all
+  ResolverOptions dead;
+  dead.AddServer("127.0.0.1", loopback::ClosedPort(loop->get()));
+  dead.timeout = 20;
+  dead.attempts = 2;
+  Resolver silent(loop->get(), dead);
+  EXPECT_EQ(Resolve(silent, "echo.test", status), "");
+  EXPECT_EQ(status, UV_EAI_AGAIN);
+  EXPECT_EQ(silent.InFlight(), 0);
+
+  //a cancelled lookup is not called back
+  Lookup cancelled;
+  ASSERT_EQ(cancelled.Start(silent, "echo.test"), 0);
+  silent.Cancel(&cancelled.req);
+  EXPECT_EQ(silent.InFlight(), 0);
+  loopback::RunUntil(loop->get(), [] { return false; }, 100);
+  EXPECT_FALSE(cancelled.Done());
+}
+
+TEST_F(ResolverTest, DoesNotWaitForIpv6) {
+  //by default only A is asked for, a lost AAAA answer would hold the lookup through every retransmit
+  dns->silent_aaaa = true;
+  auto options = dns->Options();
+  options.timeout = 1000;
+  Resolver resolver(loop->get(), options);
+  uv_update_time(loop->get());
+  auto start = uv_now(loop->get());
+  int status;
+  EXPECT_EQ(Resolve(resolver, "echo.test", status), "127.0.0.1");
+  EXPECT_EQ(status, 0);
+  EXPECT_LT(uv_now(loop->get()) - start, options.timeout);
+  EXPECT_EQ(resolver.Sent(), 1u);
+  EXPECT_EQ(resolver.Retransmits(), 0u);
+  dns->silent_aaaa = false;
+}
+
+TEST_F(ResolverTest, FallsBackToTcp) {
+  auto options = dns->Options();
+  options.ipv6 = false;
+  Resolver resolver(loop->get(), options);
+  auto tcp_queries = dns->tcp_queries;
+  int status;
+  EXPECT_EQ(Resolve(resolver, "large.test", status), "127.0.0.2");
+  EXPECT_EQ(status, 0);
+  EXPECT_EQ(resolver.TcpFallbacks(), 1);
+  EXPECT_EQ(dns->tcp_queries, tcp_queries + 1);
+}
+
+TEST_F(ResolverTest, Relays) {
+  loopback::EchoServer target(loop->get());
+  ServerConfig config;
+  config.resolver = std::make_shared<Resolver>(loop->get(), dns->Options());
+  auto listener = loopback::Listen(loop, config, 1024);
+  auto& stats = Stats::Local();
+
+  auto payload = loopback::EncodeRequest(listener->get_config(), loopback::DomainHeader("echo.test", target.port) + "hello");
+  loopback::Client client(loop->get(), listener->get_port(), payload);
+  loopback::RunUntil(loop->get(), [&] { return client.received.size() >= size_t(config.cipher_info.iv_length) + 5; });
+  EXPECT_EQ(loopback::DecodeResponse(config, client.received), "hello");
+  client.Close();
+
+  auto resolve_errors = stats.Errors(ErrorType::ResolveError);
+  payload = loopback::EncodeRequest(listener->get_config(), loopback::DomainHeader("missing.test", target.port) + "x");
+  loopback::Client missing(loop->get(), listener->get_port(), payload);
+  loopback::RunUntil(loop->get(), [&] { return missing.closed; });
+  EXPECT_EQ(stats.Errors(ErrorType::ResolveError), resolve_errors + 1);
+
+  //closed while the lookup is in flight
+  dns->drop = 2;
+  payload = loopback::EncodeRequest(listener->get_config(), loopback::DomainHeader("echo.test", target.port) + "x");
+  loopback::Client leaving(loop->get(), listener->get_port(), payload);
+  loopback::RunUntil(loop->get(), [&] { return listener->get_config().resolver->InFlight() > 0; });
+  leaving.Close();
+  loopback::RunUntil(loop->get(), [&] { return leaving.closed && client.closed; });
+  EXPECT_EQ(listener->get_config().resolver->InFlight(), 0);
+  dns->drop = 0;
+}
+
+// keeps the threadpool busy with blocking jobs, the way file access or
+// other getaddrinfo calls would
+struct Contention {
+  uv_loop_t* loop;
+  bool running = true;
+  int jobs = 0;
+
+  void Queue() {
+    auto req = new uv_work_t{};
+    req->data = this;
+    this->jobs++;
+    uv_queue_work(this->loop, req, [](uv_work_t*) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }, [](uv_work_t* req, int status) {
+      auto contention = reinterpret_cast<Contention*>(req->data);
+      delete req;
+      contention->jobs--;
+      if (contention->running) {
+        contention->Queue();
+      }
+    });
+  }
+};
+
+// a fixed number of lookups with a fixed number in flight, through either resolver
+struct Benchmark {
+  uv_loop_t* loop;
+  Resolver* stub;
+  int lookups;
+  int started = 0;
+  int finished = 0;
+  int failed = 0;
+  Histogram latency;
+
+  Benchmark(uv_loop_t* loop, Resolver* stub, int lookups) : loop(loop), stub(stub), lookups(lookups) {}
+
+  struct Pending {
+    Benchmark* benchmark;
+    uint64_t started;
+    uv_getaddrinfo_t getaddrinfo;
+    ResolveRequest resolve;
+  };
+
+  void StartNext() {
+    if (this->started == this->lookups) {
+      return;
+    }
+    this->started++;
+    auto pending = new Pending{this, uv_hrtime()};
+    pending->getaddrinfo.data = pending;
+    pending->resolve.data = pending;
+    if (this->stub != nullptr) {
+      this->stub->Resolve(&pending->resolve, "echo.test", [](ResolveRequest* req, int status) {
+        Done(reinterpret_cast<Pending*>(req->data), status);
+      });
+    } else {
+      uv_getaddrinfo(this->loop, &pending->getaddrinfo, [](uv_getaddrinfo_t* req, int status, addrinfo* addr_info) {
+        uv_freeaddrinfo(addr_info);
+        Done(reinterpret_cast<Pending*>(req->data), status);
+      }, "localhost", nullptr, nullptr);
+    }
+  }
+
+  static void Done(Pending* pending, int status) {
+    auto benchmark = pending->benchmark;
+    benchmark->latency.Record((uv_hrtime() - pending->started) / 1000);
+    benchmark->finished++;
+    benchmark->failed += status != 0;
+    delete pending;
+    benchmark->StartNext();
+  }
+};
+
+TEST_F(ResolverTest, UnderContention) {
+  const int lookups = 2000;
+  const int concurrency = 64;
+  Resolver resolver(loop->get(), dns->Options());
+  Contention contention{loop->get()};
+  for (int i = 0; i < 16; i++) {
+    contention.Queue();
+  }
+
+  for (bool stub : {true, false}) {
+    auto name = stub ? "stub resolver" : "getaddrinfo";
+    Benchmark benchmark(loop->get(), stub ? &resolver : nullptr, lookups);
+    auto start = uv_hrtime();
+    for (int i = 0; i < concurrency; i++) {
+      benchmark.StartNext();
+    }
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return benchmark.finished == lookups; }, 60000)) << name;
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+    auto& latency = benchmark.latency;
+    LOG(INFO) << name << ": " << lookups / elapsed << " lookups/s, p50 " << latency.Percentile(0.5)
+              << "us, p99 " << latency.Percentile(0.99) << "us, p999 " << latency.Percentile(0.999) << "us";
+    if (stub) {
+      EXPECT_EQ(benchmark.failed, 0);
+    }
+  }
+
+  contention.running = false;
+  loopback::RunUntil(loop->get(), [&] { return contention.jobs == 0; }, 5000);
+}
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
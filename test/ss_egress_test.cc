@@ -0,0 +1,242 @@
+#include <sys/resource.h>
+#include <fstream>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+TEST(EgressPoolTest, Parse) {
+  auto pool = EgressPool::Parse("127.0.0.2,127.0.0.3,");
+  ASSERT_EQ(pool.Size(), 2);
+  ASSERT_TRUE(EgressPool::Parse("").Empty());
+  ASSERT_THROW(EgressPool::Parse("127.0.0.2,localhost"), InvalidArgument);
+}
+
+TEST(EgressPoolTest, Pick) {
+  auto pool = EgressPool::Parse("127.0.0.2,127.0.0.3,127.0.0.4");
+  sockaddr_in first{};
+  sockaddr_in second{};
+  uv_ip4_addr("10.0.0.1", 443, &first);
+  uv_ip4_addr("10.0.0.2", 443, &second);
+
+  //round robin goes through every address whatever the destination
+  std::vector<uint32_t> picked;
+  for (int i = 0; i < 6; i++) {
+    picked.push_back(pool.Pick(i % 2 ? first : second).sin_addr.s_addr);
+  }
+  EXPECT_EQ(picked[0], picked[3]);
+  EXPECT_NE(picked[0], picked[1]);
+  EXPECT_NE(picked[1], picked[2]);
+
+  //a hash keeps one destination on one address
+  pool.selection = EgressPool::Selection::DestinationHash;
+  auto address = pool.Pick(first).sin_addr.s_addr;
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(pool.Pick(first).sin_addr.s_addr, address);
+  }
+}
+
+// connects through a listener from a given source address, see how many
+// connections are relayed to the target
+class EgressTest : public ::testing::Test {
+ protected:
+  struct BoundClient {
+    uv_tcp_t tcp;
+    uv_connect_t connect;
+    uv_write_t write;
+    EgressTest* test;
+    std::string payload;
+    size_t received = 0;
+    bool done = false;
+  };
+
+  std::shared_ptr<Loop> loop = Loop::getDefault();
+  std::vector<std::unique_ptr<BoundClient>> clients;
+  size_t relayed = 0;
+  size_t failed = 0;
+  size_t closed = 0;
+
+  void Open(int port, const std::string& source, const std::string& payload) {
+    auto client = std::make_unique<BoundClient>();
+    client->test = this;
+    client->payload = payload;
+    uv_tcp_init_ex(loop->get(), &client->tcp, AF_INET);
+    client->tcp.data = client.get();
+    client->connect.data = client.get();
+
+    //many clients have to share the listener, so they take ports like the pool does
+    uv_os_fd_t fd;
+    uv_fileno(reinterpret_cast<uv_handle_t*>(&client->tcp), &fd);
+    int on = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    sockaddr_in addr{};
+    uv_ip4_addr(source.c_str(), 0, &addr);
+    uv_tcp_bind(&client->tcp, (const sockaddr*) &addr, 0);
+
+    uv_ip4_addr("127.0.0.1", port, &addr);
+    if (uv_tcp_connect(&client->connect, &client->tcp, (const sockaddr*) &addr, ConnectDone) != 0) {
+      this->Finish(client.get(), false);
+    }
+    clients.push_back(std::move(client));
+  }
+
+  void Finish(BoundClient* client, bool ok) {
+    if (client->done) {
+      return;
+    }
+    client->done = true;
+    (ok ? this->relayed : this->failed)++;
+  }
+
+  void CloseAll() {
+    for (auto& client : clients) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&client->tcp), [](uv_handle_t* handle) {
+        reinterpret_cast<BoundClient*>(handle->data)->test->closed++;
+      });
+    }
+    loopback::RunUntil(loop->get(), [&] { return closed == clients.size(); }, 60000);
+    clients.clear();
+    closed = 0;
+  }
+
+  static void ConnectDone(uv_connect_t* req, int status) {
+    auto client = reinterpret_cast<BoundClient*>(req->data);
+    if (status < 0) {
+      client->test->Finish(client, false);
+      return;
+    }
+    auto buf = uv_buf_init(&client->payload[0], client->payload.size());
+    uv_write(&client->write, reinterpret_cast<uv_stream_t*>(&client->tcp), &buf, 1, nullptr);
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&client->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    auto client = reinterpret_cast<BoundClient*>(stream->data);
+                    if (nread < 0) {
+                      uv_read_stop(stream);
+                      client->test->Finish(client, false);
+                    } else if (nread > 0) {
+                      //the iv of the server and the echoed byte
+                      client->received += nread;
+                      if (client->received >= 17) {
+                        client->test->Finish(client, true);
+                      }
+                    }
+                  });
+  }
+
+  //the number of ports connect can choose from for one destination
+  static size_t EphemeralPorts() {
+    std::ifstream in("/proc/sys/net/ipv4/ip_local_port_range");
+    size_t low = 0;
+    size_t high = 0;
+    in >> low >> high;
+    return high >= low && low > 0 ? high - low + 1 : 0;
+  }
+};
+
+TEST_F(EgressTest, BindsSourceAddress) {
+  struct Target {
+    uv_tcp_t tcp;
+    std::vector<std::string> peers;
+  } target;
+  uv_tcp_init(loop->get(), &target.tcp);
+  target.tcp.data = &target;
+  sockaddr_in addr{};
+  uv_ip4_addr("127.0.0.1", 0, &addr);
+  uv_tcp_bind(&target.tcp, (const sockaddr*) &addr, 0);
+  int length = sizeof(addr);
+  uv_tcp_getsockname(&target.tcp, (sockaddr*) &addr, &length);
+  int target_port = ntohs(addr.sin_port);
+  uv_listen(reinterpret_cast<uv_stream_t*>(&target.tcp), 128, [](uv_stream_t* server, int status) {
+    auto peer = new uv_tcp_t{};
+    uv_tcp_init(server->loop, peer);
+    if (uv_accept(server, reinterpret_cast<uv_stream_t*>(peer)) == 0) {
+      sockaddr_in addr{};
+      int length = sizeof(addr);
+      uv_tcp_getpeername(peer, (sockaddr*) &addr, &length);
+      char ip[INET_ADDRSTRLEN];
+      uv_ip4_name(&addr, ip, sizeof(ip));
+      reinterpret_cast<Target*>(server->data)->peers.push_back(ip);
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(peer), [](uv_handle_t* handle) {
+      delete reinterpret_cast<uv_tcp_t*>(handle);
+    });
+  });
+
+  ServerConfig config;
+  config.egress = EgressPool::Parse("127.0.0.2,127.0.0.3");
+  auto listener = loopback::Listen(loop, config);
+
+  auto payload = loopback::EncodeRequest(listener->get_config(), loopback::IPv4Header("127.0.0.1", target_port) + "x");
+  for (int i = 0; i < 4; i++) {
+    Open(listener->get_port(), "127.0.0.1", payload);
+  }
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return target.peers.size() == 4; }));
+  //the target may accept in another order than the connects were started
+  std::sort(target.peers.begin(), target.peers.end());
+  EXPECT_EQ(target.peers, std::vector<std::string>({"127.0.0.2", "127.0.0.2", "127.0.0.3", "127.0.0.3"}));
+
+  CloseAll();
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+}
+
+// keeps more connections to one destination open than it has ephemeral
+// ports, which only works with more than one source address
+TEST_F(EgressTest, SustainsMoreConnectionsThanPorts) {
+  auto ports = EphemeralPorts();
+  if (ports == 0) {
+    GTEST_SKIP() << "cannot read the ephemeral port range";
+  }
+  size_t connections = ports + ports / 4;
+  //client, accepted, outbound and target side of every connection
+  rlim_t needed = 4 * connections + 1024;
+  rlimit limit{};
+  getrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+    GTEST_SKIP() << "needs " << needed << " file descriptors, the limit is " << limit.rlim_max;
+  }
+  limit.rlim_cur = needed;
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+
+  loopback::EchoServer target(loop->get());
+  std::vector<size_t> failures;
+  int round = 0;
+  for (auto sources : {"", "127.0.0.2,127.0.0.3,127.0.0.4,127.0.0.5"}) {
+    ServerConfig config;
+    config.egress = EgressPool::Parse(sources);
+    auto listener = loopback::Listen(loop, config, 4096);
+
+    auto connect_errors = Stats::Local().Errors(ErrorType::ConnectError);
+    auto payload = loopback::EncodeRequest(listener->get_config(), loopback::IPv4Header("127.0.0.1", target.port) + "x");
+    relayed = failed = 0;
+    //clients of every round come from their own addresses so no TIME_WAIT is in the way
+    for (size_t i = 0; i < connections; i++) {
+      Open(listener->get_port(), "127.0." + std::to_string(10 + round) + "." + std::to_string(2 + i % 8), payload);
+    }
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return relayed + failed == connections; }, 120000));
+    LOG(INFO) << (*sources ? "with" : "without") << " egress pool: " << relayed << " of " << connections
+              << " connections relayed, " << Stats::Local().Errors(ErrorType::ConnectError) - connect_errors
+              << " connect errors";
+    failures.push_back(failed);
+    CloseAll();
+    round++;
+  }
+  EXPECT_GT(failures[0], 0);
+  EXPECT_EQ(failures[1], 0);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; }, 60000);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -118,6 +118,128 @@ TEST(EncryptTest, HandleAES) {
   test_encrypt(method);
 }
 
+TEST(EncryptTest, HandleStreamCiphers) {
+  for (auto method : {"chacha20", "chacha20-ietf", "xchacha20", "salsa20"}) {
+    LOG(INFO) << "start to test method " << method;
+    test_encrypt(method);
+  }
+}
+
+void test_vector(const std::string& method, const std::string& key, const std::string& iv,
+                 const std::string& plain, const std::string& expected) {
+  auto key_block = shadesocks::Util::StringToHex(key);
+  auto iv_block = shadesocks::Util::StringToHex(iv);
+  auto cipher = shadesocks::Util::getEncryption(method, key_block, iv_block);
+  auto actual = shadesocks::Util::HexToString(cipher->encrypt(shadesocks::Util::StringToHex(plain)));
+  EXPECT_STRCASEEQ(actual.data(), expected.data()) << method;
+}
+
+TEST(EncryptTest, HandleStreamCipherVectors) {
+  const std::string zero_key(64, '0');
+  const std::string zero_block(128, '0');
+  const std::string key = "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F";
+  const std::string plain = "48656C6C6F2120486F772061726520796F752E";
+
+  //RFC 8439 A.1 #1, the key stream of the zero key and nonce
+  test_vector("chacha20-ietf", zero_key, std::string(24, '0'), zero_block,
+              "76B8E0ADA0F13D90405D6AE55386BD28BDD219B8A08DED1AA836EFCC8B770DC7"
+              "DA41597C5157488D7724E03FB8D84A376A43B8F41518A11CC387B669B2EE6586");
+  test_vector("chacha20", zero_key, std::string(16, '0'), zero_block,
+              "76B8E0ADA0F13D90405D6AE55386BD28BDD219B8A08DED1AA836EFCC8B770DC7"
+              "DA41597C5157488D7724E03FB8D84A376A43B8F41518A11CC387B669B2EE6586");
+  //eSTREAM Salsa20 256 bit zero key and iv
+  test_vector("salsa20", zero_key, std::string(16, '0'), zero_block,
+              "9A97F65B9B4C721B960A672145FCA8D4E32E67F9111EA979CE9C4826806AEEE6"
+              "3DE9C0DA2BD7F91EBCB2639BF989C6251B29BF38D39A9BDCE7C55F4B2AC12A39");
+
+  //the iv is 00 01 02 ... up to its length
+  test_vector("chacha20", key, "0001020304050607", plain, "BFFDCDE59EB4C621ED677F9A166E970C1022B3");
+  test_vector("chacha20-ietf", key, "000102030405060708090A0B", plain, "585F9D7DAEAA74D55653AFD10F05E2E3FAA4F5");
+  test_vector("xchacha20", key, "000102030405060708090A0B0C0D0E0F1011121314151617", plain,
+              "AD5F0DA29E70C85C6E715D8248BAE057FFDE0E");
+  test_vector("salsa20", key, "0001020304050607", plain, "66C8633377760986B90593C85A81748E40AE6A");
+}
+
+// in place throughput of every method at the relay chunk size, over a few MB
+// to keep the test quick; CipherCalibration measures the methods for real
+TEST(EncryptTest, HandleThroughput) {
+  const size_t chunk = 16 * 1024;
+  const size_t total = 4 * 1024 * 1024;
+  std::string plain(total, 0x5a);
+
+  for (auto& method : shadesocks::cipher_map) {
+    auto key = shadesocks::Util::RandomBlock(method.second.key_length);
+    auto iv = shadesocks::Util::RandomBlock(method.second.iv_length);
+    auto cipher = shadesocks::Util::getEncryption(method.first, key, iv);
+    SecByteBlock data((byte*) plain.data(), plain.size());
+    auto start = clock();
+    for (size_t done = 0; done < total; done += chunk) {
+      cipher->encrypt(data.data() + done, chunk);
+    }
+    double elapsed = double(clock() - start) / CLOCKS_PER_SEC;
+    LOG(INFO) << method.first << ": " << total / elapsed / 1024 / 1024 << " MB/s";
+    //chunks encrypted in place make the same stream as one pass
+    EXPECT_TRUE(data == shadesocks::Util::getEncryption(method.first, key, iv)->encrypt(plain)) << method.first;
+  }
+}
+
+// the ciphers of a key schedule produce the same stream as a full cipher
+TEST(EncryptTest, HandleKeySchedule) {
+  std::string plain(40000, 'k');
+  for (auto& method : shadesocks::cipher_map) {
+    auto key = shadesocks::Util::RandomBlock(method.second.key_length);
+    auto iv = shadesocks::Util::RandomBlock(method.second.iv_length);
+    shadesocks::KeySchedule schedule(method.first, key);
+
+    auto expected = shadesocks::Util::getEncryption(method.first, key, iv)->encrypt(plain);
+    auto encryptor = schedule.Encryptor(iv);
+    SecByteBlock actual((byte*) plain.data(), plain.size());
+    //the stream continues over chunks of any size
+    encryptor->encrypt(actual.data(), 1000);
+    encryptor->encrypt(actual.data() + 1000, actual.size() - 1000);
+    EXPECT_TRUE(actual == expected) << method.first;
+
+    auto decryptor = schedule.Decryptor(iv);
+    decryptor->decrypt(actual.data(), actual.size());
+    EXPECT_EQ(std::string((char*) actual.data(), actual.size()), plain) << method.first;
+
+    EXPECT_THROW(encryptor->decrypt(actual.data(), actual.size()), InvalidArgument);
+    EXPECT_THROW(decryptor->encrypt(actual.data(), actual.size()), InvalidArgument);
+    EXPECT_THROW(schedule.Encryptor(SecByteBlock(3)), InvalidArgument);
+  }
+}
+
+// what a connection spends on its ciphers, both ways built per connection
+// against one direction each from the listener's key schedule
+TEST(EncryptTest, HandleHandshakeCost) {
+  const int connections = 100000;
+  for (auto& method : shadesocks::cipher_map) {
+    auto key = shadesocks::Util::RandomBlock(method.second.key_length);
+    auto iv = shadesocks::Util::RandomBlock(method.second.iv_length);
+    shadesocks::KeySchedule schedule(method.first, key);
+
+    auto start = clock();
+    for (int i = 0; i < connections; i++) {
+      auto decrypt = shadesocks::Util::getEncryption(method.first, key, iv);
+      auto encrypt = shadesocks::Util::getEncryption(method.first, key, iv);
+    }
+    double full = double(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int i = 0; i < connections; i++) {
+      auto decrypt = schedule.Decryptor(iv);
+      auto encrypt = schedule.Encryptor(iv);
+    }
+    double prepared = double(clock() - start) / CLOCKS_PER_SEC;
+
+    LOG(INFO) << method.first << ": " << full / connections * 1e9 << "ns per connection, "
+              << prepared / connections * 1e9 << "ns with the key schedule";
+    if (schedule.Shared()) {
+      EXPECT_LT(prepared, full) << method.first;
+    }
+  }
+}
+
 int main(int argc, char** argv) {
   FLAGS_colorlogtostderr = 1;
   FLAGS_stderrthreshold = 0;
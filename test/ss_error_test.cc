@@ -0,0 +1,123 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+class ErrorTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::shared_ptr<TCPHandle> listener;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    listener = loop->create_tcp_handle();
+    listener->bind("127.0.0.1", 0);
+    listener->listen();
+  }
+
+  void SetUp() override {
+    Stats::Local().Reset();
+  }
+
+  // sends the payload and waits until the server dropped the connection
+  void ExpectDropped(const std::string& payload, ErrorType type, bool reset = false) {
+    loopback::Client client(loop->get(), listener->get_port(), payload, reset);
+    auto done = [&] {
+      return client.closed && Stats::Local().Errors(type) == 1 && BufferPool::Local().InUse() == 0;
+    };
+    if (!reset) {
+      ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+    }
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), done));
+    EXPECT_EQ(Stats::Local().TotalErrors(), 1);
+    LOG(INFO) << ErrorTypeName(type) << " errors: " << Stats::Local().Errors(type);
+  }
+};
+
+std::shared_ptr<Loop> ErrorTest::loop;
+std::shared_ptr<TCPHandle> ErrorTest::listener;
+
+TEST_F(ErrorTest, UnknownAddressType) {
+  auto config = listener->get_config();
+  ExpectDropped(loopback::EncodeRequest(config, std::string("\x07\x01\x02", 3)), ErrorType::ProtocolError);
+}
+
+TEST_F(ErrorTest, TruncatedHeader) {
+  auto config = listener->get_config();
+  auto header = loopback::IPv4Header("127.0.0.1", 80).substr(0, 3);
+  loopback::Client client(loop->get(), listener->get_port(), loopback::EncodeRequest(config, header));
+  //the rest of the header may still come
+  loopback::RunUntil(loop->get(), [] { return false; }, 50);
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+  //until the client is done
+  client.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+    return client.closed && Stats::Local().Errors(ErrorType::ProtocolError) == 1 && BufferPool::Local().InUse() == 0;
+  }));
+  EXPECT_EQ(Stats::Local().TotalErrors(), 1);
+}
+
+TEST_F(ErrorTest, ShortFirstPacket) {
+  loopback::Client client(loop->get(), listener->get_port(), "short");
+  //the rest of the iv may still come
+  loopback::RunUntil(loop->get(), [] { return false; }, 50);
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+  //until the client is done
+  client.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+    return client.closed && Stats::Local().Errors(ErrorType::ProtocolError) == 1 && BufferPool::Local().InUse() == 0;
+  }));
+  EXPECT_EQ(Stats::Local().TotalErrors(), 1);
+}
+
+TEST_F(ErrorTest, ConnectRefused) {
+  auto config = listener->get_config();
+  auto port = loopback::ClosedPort(loop->get());
+  ExpectDropped(loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", port)), ErrorType::ConnectError);
+}
+
+TEST_F(ErrorTest, EmptyDomain) {
+  auto config = listener->get_config();
+  ExpectDropped(loopback::EncodeRequest(config, loopback::DomainHeader("", 80)), ErrorType::ProtocolError);
+}
+
+TEST_F(ErrorTest, ResolveFailure) {
+  auto config = listener->get_config();
+  //an empty label is refused by the lookup itself
+  ExpectDropped(loopback::EncodeRequest(config, loopback::DomainHeader("a..b", 80)), ErrorType::ResolveError);
+}
+
+TEST_F(ErrorTest, ClientReset) {
+  ExpectDropped("", ErrorType::ReadError, true);
+}
+
+TEST_F(ErrorTest, KeepServingAfterFailures) {
+  auto config = listener->get_config();
+  loopback::EchoServer target(loop->get());
+
+  //done in the middle of the iv
+  loopback::Client bad(loop->get(), listener->get_port(), "short", false, true);
+  std::string plain = "Hello! How are you.";
+  loopback::Client good(loop->get(), listener->get_port(),
+                        loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + plain));
+
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+    return bad.closed && good.received.size() >= config.cipher_info.iv_length + plain.size();
+  }));
+  EXPECT_EQ(loopback::DecodeResponse(config, good.received), plain);
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::ProtocolError), 1);
+
+  good.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return good.closed && BufferPool::Local().InUse() == 0; }));
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -1,4 +1,5 @@
 #include "ss_test.h"
+#include <malloc.h>
 
 namespace shadesocks {
 TEST(ShadeHandleTest, ReadDataTest) {
@@ -12,7 +13,8 @@ TEST(ShadeHandleTest, ReadDataTest) {
       "7396C95A33DFFA3042FF661FF0B85155268EF14E148EBFD1638AF66436717BC2ECF34B8044259EB5A5D5B2A0A47F9F5DFA6F242600C589034C2153C47C8E681BE67EA51796FFA7055D7636634222D7AD6417EF7250F1EAD171CFBEDBC2D474206DCA0A83A0446FFFBEB8262773073DF5D89C0A2A462C6F4A50EBB23FEC308AC64387CD7CE6066908512277E5E573C762171F631B375CAF0C59315F15E867");
 
   uv_buf_t buf;
-  buf.base = shade_handle.temp;
+  shade_handle.request.buffer = BufferPool::Local().Acquire();
+  buf.base = shade_handle.request.buffer + BufferPool::kHeadroom;
   buf.len = block.size();
 
   for (int i = 0; i < block.size(); i++) {
@@ -33,14 +35,14 @@ TEST(ShadeHandleTest, GetRequestTest) {
   LOG(INFO) << "start to check domain";
   auto block = Util::StringToHex(
       "031D636F6E6E6563746976697479636865636B2E677374617469632E636F6D0050");
-  shade_handle.data = block;
-  shade_handle.offset = 0;
+  shade_handle.request.data = reinterpret_cast<char*>(block.data());
+  shade_handle.request.length = block.size();
 
   char hostname[NI_MAXHOST];
   shade_handle.GetRequest();
-  auto addr = std::move(shade_handle.addr_out);
-  inet_ntop(addr->sin_family, &addr->sin_addr, hostname, NI_MAXHOST);
-  auto port = ntohs(addr->sin_port);
+  auto addr = shade_handle.addr_out;
+  inet_ntop(addr.sin_family, &addr.sin_addr, hostname, NI_MAXHOST);
+  auto port = shade_handle.port_out;
 
   LOG(INFO) << "ip is: " << hostname;
   LOG(INFO) << "hostname is: " << shade_handle.hostname_out;
@@ -49,26 +51,60 @@ TEST(ShadeHandleTest, GetRequestTest) {
   ASSERT_STRCASEEQ(shade_handle.hostname_out.data(), "connectivitycheck.gstatic.com");
 
   LOG(INFO) << "start to check IPv4";
+  //a handle parses only one header
+  ShadeHandle ipv4_handle(stream);
   block = Util::StringToHex(
       "01CBD02B580050");
-  shade_handle.data = block;
-  shade_handle.offset = 0;
+  ipv4_handle.request.data = reinterpret_cast<char*>(block.data());
+  ipv4_handle.request.length = block.size();
 
-  shade_handle.GetRequest();
-  addr = std::move(shade_handle.addr_out);
-  inet_ntop(addr->sin_family, &addr->sin_addr, hostname, NI_MAXHOST);
-  port = ntohs(addr->sin_port);
+  ipv4_handle.GetRequest();
+  addr = ipv4_handle.addr_out;
+  inet_ntop(addr.sin_family, &addr.sin_addr, hostname, NI_MAXHOST);
+  port = ntohs(addr.sin_port);
 
   LOG(INFO) << "ip is: " << hostname;
-  LOG(INFO) << "hostname is: " << shade_handle.hostname_out;
+  LOG(INFO) << "hostname is: " << ipv4_handle.hostname_out;
   LOG(INFO) << "port is: " << port;
   ASSERT_EQ(port, 80);
   ASSERT_STRCASEEQ(hostname, "203.208.43.88");
-  ASSERT_STRCASEEQ(shade_handle.hostname_out.data(), "203.208.43.88");
+  ASSERT_STRCASEEQ(ipv4_handle.hostname_out.data(), "203.208.43.88");
 
   delete stream;
 }
 
+TEST(ShadeHandleTest, IdleMemoryTest) {
+  const int connections = 100000;
+
+  uv_loop_t loop;
+  uv_loop_init(&loop);
+  uv_tcp_t server;
+  uv_tcp_init(&loop, &server);
+  ServerConfig config;
+
+  std::vector<ShadeHandle*> handles;
+  handles.reserve(connections);
+
+  auto before = mallinfo2().uordblks;
+  for (int i = 0; i < connections; i++) {
+    handles.push_back(new ShadeHandle(reinterpret_cast<uv_stream_t*>(&server), config));
+  }
+  auto after = mallinfo2().uordblks;
+
+  auto per_connection = (after - before) / connections;
+  LOG(INFO) << "sizeof(ShadeHandle): " << sizeof(ShadeHandle);
+  LOG(INFO) << "bytes per idle connection at " << connections << " connections: " << per_connection;
+  EXPECT_LT(per_connection, 1024);
+  EXPECT_EQ(BufferPool::Local().InUse(), 0);
+
+  for (auto handle : handles) {
+    handle->Close();
+  }
+  uv_close(reinterpret_cast<uv_handle_t*>(&server), nullptr);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  EXPECT_EQ(uv_loop_close(&loop), 0);
+}
+
 }
 
 int main(int argc, char** argv) {
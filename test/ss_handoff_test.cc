@@ -0,0 +1,185 @@
+#include <list>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+// the predecessor and the successor share one loop here, the sockets still
+// travel over the Unix socket like between two processes
+class HandoffTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Loop> loop = Loop::getDefault();
+  std::string path = "/tmp/ss_handoff_test." + std::to_string(getpid());
+};
+
+// starts a client every millisecond which sends a few bytes and waits for the
+// destination to count them
+class Load final {
+ public:
+  int port;
+  std::string request;
+  size_t total;
+  std::list<loopback::Client> clients;
+  uv_timer_t timer;
+
+  Load(uv_loop_t* loop, int port, std::string request, size_t total)
+      : port(port), request(std::move(request)), total(total) {
+    uv_timer_init(loop, &this->timer);
+    this->timer.data = this;
+    uv_timer_start(&this->timer, [](uv_timer_t* timer) {
+      auto load = reinterpret_cast<Load*>(timer->data);
+      load->clients.emplace_back(timer->loop, load->port, load->request, false, true);
+      if (load->clients.size() == load->total) {
+        uv_close(reinterpret_cast<uv_handle_t*>(timer), nullptr);
+      }
+    }, 0, 1);
+  }
+
+  ~Load() {
+    if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&this->timer))) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->timer), nullptr);
+      uv_run(this->timer.loop, UV_RUN_NOWAIT);
+    }
+  }
+
+  bool Done() const {
+    return this->clients.size() == this->total &&
+        std::all_of(this->clients.begin(), this->clients.end(), [](const loopback::Client& client) {
+          return client.closed;
+        });
+  }
+
+  size_t Failed(const ServerConfig& config, const std::string& expected) const {
+    return std::count_if(this->clients.begin(), this->clients.end(), [&](const loopback::Client& client) {
+      return loopback::DecodeResponse(config, client.received) != expected;
+    });
+  }
+};
+
+TEST_F(HandoffTest, RestartUnderLoad) {
+  loopback::ReplyServer target(loop->get(), "");
+  auto old_listener = loopback::Listen(loop, ServerConfig());
+  auto& config = old_listener->get_config();
+  auto port = old_listener->get_port();
+  Stats::Local().Reset();
+
+  bool drained = false;
+  size_t remaining = 1;
+  HandoffServer predecessor({old_listener}, 5000);
+  predecessor.Start(loop->get(), path, [&](size_t left) {
+    drained = true;
+    remaining = left;
+  });
+
+  Load load(loop->get(), port, loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + "hello"), 600);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return load.clients.size() >= 200; }));
+
+  //the successor takes the sockets over while connections keep coming in
+  int status = 1;
+  HandoffClient successor;
+  std::shared_ptr<TCPHandle> new_listener;
+  successor.Start(loop->get(), path, [&](int result) {
+    status = result;
+    if (result == 0) {
+      new_listener = successor.Listeners().front();
+      loopback::Listeners().push_back(new_listener);
+      new_listener->set_config(config);
+      new_listener->listen();
+      successor.Ready();
+    }
+  });
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return drained; }, 10000));
+  EXPECT_EQ(status, 0);
+  ASSERT_EQ(successor.Listeners().size(), 1);
+  EXPECT_EQ(new_listener->get_port(), port);
+  EXPECT_TRUE(predecessor.HandedOff());
+  EXPECT_EQ(remaining, 0);
+  EXPECT_EQ(old_listener->get_admission().Connections(), 0);
+
+  //every connection was relayed by one of the two, none was refused or reset
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return load.Done(); }, 10000));
+  EXPECT_EQ(load.Failed(config, "5"), 0);
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+  new_listener->stop();
+}
+
+TEST_F(HandoffTest, DrainsUntilDeadline) {
+  loopback::ReplyServer target(loop->get(), "");
+  auto old_listener = loopback::Listen(loop, ServerConfig());
+  auto& config = old_listener->get_config();
+
+  //never sends its end, the destination keeps waiting
+  loopback::Client idle(loop->get(), old_listener->get_port(),
+                        loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port)));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return old_listener->get_admission().Connections() == 1; }));
+
+  bool drained = false;
+  size_t remaining = 0;
+  HandoffServer predecessor({old_listener}, 300);
+  predecessor.Start(loop->get(), path, [&](size_t left) {
+    drained = true;
+    remaining = left;
+  });
+  HandoffClient successor;
+  successor.Start(loop->get(), path, [&](int result) {
+    ASSERT_EQ(result, 0);
+    loopback::Listeners().push_back(successor.Listeners().front());
+    successor.Listeners().front()->set_config(config);
+    successor.Listeners().front()->listen();
+    successor.Ready();
+  });
+  auto start = uv_now(loop->get());
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return drained; }));
+  EXPECT_GE(uv_now(loop->get()) - start, 300);
+  EXPECT_EQ(remaining, 1);
+
+  //the caller decides what happens to the connections left
+  idle.Close();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return old_listener->get_admission().Connections() == 0; }));
+  successor.Listeners().front()->stop();
+}
+
+TEST_F(HandoffTest, StartsAloneWithoutPredecessor) {
+  int status = 1;
+  HandoffClient successor;
+  successor.Start(loop->get(), path, [&](int result) { status = result; });
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return status != 1; }));
+  EXPECT_TRUE(status == UV_ENOENT || status == UV_ECONNREFUSED);
+  EXPECT_TRUE(successor.Listeners().empty());
+}
+
+TEST_F(HandoffTest, KeepsAcceptingWhenSuccessorLeaves) {
+  loopback::ReplyServer target(loop->get(), "");
+  auto listener = loopback::Listen(loop, ServerConfig());
+  auto& config = listener->get_config();
+  HandoffServer predecessor({listener});
+  predecessor.Start(loop->get(), path, [](size_t) {});
+
+  //receives the sockets but never gets ready
+  bool received = false;
+  {
+    HandoffClient successor;
+    successor.Start(loop->get(), path, [&](int result) { received = result == 0; });
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return received; }));
+  }
+  //lets the predecessor read the end of the pipe
+  loopback::RunUntil(loop->get(), [] { return false; }, 50);
+  EXPECT_FALSE(predecessor.HandedOff());
+
+  loopback::Client client(loop->get(), listener->get_port(),
+                          loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + "hi"),
+                          false, true);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+  EXPECT_EQ(loopback::DecodeResponse(config, client.received), "2");
+  predecessor.Close();
+  listener->stop();
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,201 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+// feeds the request in pieces of the given size, returns the payload handed back
+static std::string FeedInPieces(HeaderParser& parser, const std::string& request, size_t piece) {
+  std::string payload;
+  for (size_t offset = 0; offset < request.size(); offset += piece) {
+    auto length = std::min(piece, request.size() - offset);
+    auto taken = parser.Feed(request.data() + offset, length);
+    EXPECT_GE(taken, 0);
+    if (taken < 0) {
+      return "";
+    }
+    //the payload is a view of the same read, nothing of it is copied
+    if (parser.Done()) {
+      payload.append(request.data() + offset + taken, length - taken);
+    } else {
+      EXPECT_EQ(size_t(taken), length);
+    }
+  }
+  return payload;
+}
+
+TEST(HeaderParserTest, IPv4) {
+  HeaderParser parser;
+  auto request = loopback::IPv4Header("203.208.43.88", 8080) + "payload";
+  EXPECT_EQ(parser.Feed(request.data(), request.size()), 7);
+  ASSERT_TRUE(parser.Done());
+  EXPECT_EQ(parser.Type(), AddrType::TypeIPv4);
+  EXPECT_EQ(parser.Port(), 8080);
+  auto addr = parser.Address();
+  char ip[INET_ADDRSTRLEN];
+  uv_ip4_name(&addr, ip, sizeof(ip));
+  EXPECT_STREQ(ip, "203.208.43.88");
+  EXPECT_EQ(ntohs(addr.sin_port), 8080);
+  EXPECT_EQ(parser.Bytes(), request.substr(0, 7));
+  //nothing more is taken once done
+  EXPECT_EQ(parser.Feed(request.data() + 7, request.size() - 7), 0);
+}
+
+TEST(HeaderParserTest, Domain) {
+  HeaderParser parser;
+  std::string domain(255, 'a');
+  auto request = loopback::DomainHeader(domain, 443) + "x";
+  EXPECT_EQ(parser.Feed(request.data(), request.size()), ssize_t(HeaderParser::kMaxLength));
+  ASSERT_TRUE(parser.Done());
+  EXPECT_EQ(parser.Type(), AddrType::TypeDomain);
+  EXPECT_EQ(parser.Host(), domain);
+  EXPECT_EQ(parser.Port(), 443);
+}
+
+TEST(HeaderParserTest, Fragmented) {
+  for (auto& header : {loopback::IPv4Header("10.1.2.3", 80), loopback::DomainHeader("example.com", 65535)}) {
+    auto request = header + "payload";
+    //byte by byte and at every split point
+    for (size_t piece = 1; piece <= request.size(); piece++) {
+      HeaderParser parser;
+      EXPECT_EQ(FeedInPieces(parser, request, piece), "payload") << piece;
+      ASSERT_TRUE(parser.Done());
+      EXPECT_EQ(parser.Bytes(), header);
+    }
+    for (size_t split = 0; split <= request.size(); split++) {
+      HeaderParser parser;
+      auto taken = parser.Feed(request.data(), split);
+      ASSERT_GE(taken, 0);
+      auto rest = parser.Feed(request.data() + split, request.size() - split);
+      ASSERT_GE(rest, 0);
+      EXPECT_TRUE(parser.Done());
+      EXPECT_EQ(size_t(taken + rest), header.size()) << split;
+    }
+  }
+  HeaderParser parser;
+  auto request = loopback::DomainHeader("example.com", 80);
+  EXPECT_EQ(parser.Feed(request.data(), 2), 2);
+  EXPECT_FALSE(parser.Done());
+  EXPECT_EQ(parser.Feed(request.data() + 2, 0), 0);
+  EXPECT_FALSE(parser.Done());
+}
+
+TEST(HeaderParserTest, Invalid) {
+  HeaderParser parser;
+  EXPECT_EQ(parser.Feed("\x03\x00", 2), UV_EPROTO);
+  parser.Reset();
+  EXPECT_EQ(parser.Feed("\x04", 1), UV_EAFNOSUPPORT);
+  parser.Reset();
+  EXPECT_EQ(parser.Feed("\x07", 1), UV_EAFNOSUPPORT);
+  parser.Reset();
+  std::string zero("\x03\x03" "a\x00" "b\x00\x50", 7);
+  EXPECT_EQ(parser.Feed(zero.data(), zero.size()), UV_EPROTO);
+  //the flag bits above the type are left out, like before
+  parser.Reset();
+  auto request = loopback::IPv4Header("127.0.0.1", 80);
+  request[0] |= 0x10;
+  EXPECT_EQ(parser.Feed(request.data(), request.size()), 7);
+  EXPECT_TRUE(parser.Done());
+}
+
+TEST(IvParserTest, Fragmented) {
+  std::string iv = "0123456789abcdefghijklmn";
+  for (size_t length : {8, 12, 16, 24}) {
+    IvParser parser(length);
+    EXPECT_EQ(parser.Feed(iv.data(), 3), 3u);
+    EXPECT_FALSE(parser.Done());
+    //what follows the iv is left to the stream
+    EXPECT_EQ(parser.Feed(iv.data() + 3, iv.size()), length - 3);
+    ASSERT_TRUE(parser.Done());
+    EXPECT_EQ(std::string((const char*) parser.Data(), length), iv.substr(0, length));
+    EXPECT_EQ(parser.Feed(iv.data(), 1), 0u);
+  }
+}
+
+TEST(HeaderParserTest, ParsesPerSecond) {
+  const int rounds = 2000000;
+  std::vector<std::string> requests = {
+      loopback::IPv4Header("10.1.2.3", 80) + std::string(1024, 'p'),
+      loopback::DomainHeader("connectivitycheck.gstatic.com", 443) + std::string(1024, 'p'),
+  };
+  HeaderParser parser;
+  size_t payload = 0;
+  auto start = uv_hrtime();
+  for (int i = 0; i < rounds; i++) {
+    auto& request = requests[i % requests.size()];
+    parser.Reset();
+    auto taken = parser.Feed(request.data(), request.size());
+    payload += request.size() - taken;
+  }
+  auto elapsed = (uv_hrtime() - start) / 1e9;
+  EXPECT_EQ(payload, size_t(rounds) * 1024);
+  LOG(INFO) << "whole headers: " << rounds / elapsed / 1e6 << "M parses/s";
+
+  start = uv_hrtime();
+  for (int i = 0; i < rounds / 16; i++) {
+    parser.Reset();
+    FeedInPieces(parser, requests[1].substr(0, 40), 1);
+  }
+  elapsed = (uv_hrtime() - start) / 1e9;
+  LOG(INFO) << "byte by byte: " << rounds / 16 / elapsed / 1e6 << "M parses/s";
+}
+
+// a request whose iv and header arrive in separate reads through a listener
+TEST(HeaderParserTest, RelaysFragmentedHeader) {
+  auto loop = Loop::getDefault();
+  loopback::EchoServer target(loop->get());
+  auto listener = loopback::Listen(loop, ServerConfig(), 1024);
+  auto& config = listener->get_config();
+
+  for (auto& header : {loopback::IPv4Header("127.0.0.1", target.port), loopback::DomainHeader("localhost", target.port)}) {
+    auto request = loopback::EncodeRequest(config, header + "hello");
+    //the iv and one byte of the header first, then the rest byte by byte
+    auto first = config.cipher_info.iv_length + 1;
+    loopback::Client client(loop->get(), listener->get_port(), request.substr(0, first));
+    loopback::RunUntil(loop->get(), [] { return false; }, 20);
+    for (size_t i = first; i < request.size(); i++) {
+      auto buf = uv_buf_init(&request[i], 1);
+      ASSERT_EQ(uv_try_write(reinterpret_cast<uv_stream_t*>(&client.tcp), &buf, 1), 1);
+      loopback::RunUntil(loop->get(), [] { return false; }, 2);
+    }
+    loopback::RunUntil(loop->get(), [&] { return client.received.size() >= size_t(config.cipher_info.iv_length) + 5; });
+    EXPECT_EQ(loopback::DecodeResponse(config, client.received), "hello");
+    client.Close();
+    loopback::RunUntil(loop->get(), [&] { return client.closed; });
+  }
+}
+
+// a request whose iv is split over reads, as a segment boundary may split it
+TEST(HeaderParserTest, RelaysFragmentedIv) {
+  auto loop = Loop::getDefault();
+  loopback::EchoServer target(loop->get());
+  auto listener = loopback::Listen(loop, ServerConfig(), 1024);
+  auto& config = listener->get_config();
+  auto iv_length = size_t(config.cipher_info.iv_length);
+  auto protocol_errors = Stats::Local().Errors(ErrorType::ProtocolError);
+
+  auto request = loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + "hello");
+  //a few bytes of the iv, then the rest of it byte by byte, then the header and payload
+  loopback::Client client(loop->get(), listener->get_port(), request.substr(0, 3));
+  loopback::RunUntil(loop->get(), [] { return false; }, 20);
+  for (size_t i = 3; i < iv_length; i++) {
+    auto buf = uv_buf_init(&request[i], 1);
+    ASSERT_EQ(uv_try_write(reinterpret_cast<uv_stream_t*>(&client.tcp), &buf, 1), 1);
+    loopback::RunUntil(loop->get(), [] { return false; }, 2);
+  }
+  auto buf = uv_buf_init(&request[iv_length], request.size() - iv_length);
+  ASSERT_EQ(uv_try_write(reinterpret_cast<uv_stream_t*>(&client.tcp), &buf, 1), int(request.size() - iv_length));
+  loopback::RunUntil(loop->get(), [&] { return client.received.size() >= iv_length + 5; });
+  EXPECT_EQ(loopback::DecodeResponse(config, client.received), "hello");
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::ProtocolError), protocol_errors);
+  client.Close();
+  loopback::RunUntil(loop->get(), [&] { return client.closed; });
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
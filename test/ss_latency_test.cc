@@ -0,0 +1,191 @@
+#include <cstdlib>
+#include "ss_replay.h"
+
+namespace shadesocks {
+
+TEST(HistogramTest, ExactBelowSubBuckets) {
+  Histogram histogram;
+  for (uint64_t value = 1; value <= 1000; value++) {
+    histogram.Record(value);
+  }
+  EXPECT_EQ(histogram.Count(), 1000);
+  EXPECT_EQ(histogram.Min(), 1);
+  EXPECT_EQ(histogram.Max(), 1000);
+  EXPECT_EQ(histogram.Percentile(0.5), 500);
+  EXPECT_EQ(histogram.Percentile(0.99), 990);
+  EXPECT_EQ(histogram.Percentile(0.999), 999);
+  EXPECT_EQ(histogram.Percentile(1.0), 1000);
+  EXPECT_DOUBLE_EQ(histogram.Mean(), 500.5);
+}
+
+TEST(HistogramTest, RelativePrecision) {
+  Histogram histogram;
+  for (uint64_t value : {12345ull, 987654321ull, 5000000000ull}) {
+    histogram.Reset();
+    histogram.Record(value);
+    histogram.Record(1);
+    auto found = histogram.Percentile(1.0);
+    EXPECT_GE(found, value);
+    EXPECT_LE(double(found - value) / value, 0.001) << value;
+  }
+
+  //a long tail is kept apart from the bulk of the samples
+  histogram.Reset();
+  for (int i = 0; i < 9990; i++) {
+    histogram.Record(100 * 1000);
+  }
+  for (int i = 0; i < 10; i++) {
+    histogram.Record(80 * 1000 * 1000);
+  }
+  EXPECT_LE(histogram.Percentile(0.99), 100 * 1000 + 100);
+  EXPECT_GE(histogram.Percentile(0.9995), 80 * 1000 * 1000);
+}
+
+TEST(HistogramTest, MergeAndClamp) {
+  Histogram first(1000 * 1000);
+  Histogram second(1000 * 1000);
+  first.Record(10);
+  second.Record(20, 3);
+  second.Record(50 * 1000 * 1000);
+  first.Merge(second);
+  EXPECT_EQ(first.Count(), 5);
+  EXPECT_EQ(first.Min(), 10);
+  EXPECT_EQ(first.Percentile(0.5), 20);
+  EXPECT_EQ(first.Max(), 1000 * 1000);
+}
+
+TEST(TraceTest, Parse) {
+  std::istringstream in("# open type exchanges\n"
+                        "\n"
+                        "0 ip 100:2000\n"
+                        "15 domain 64:128@20 512:65536\n");
+  auto trace = replay::ParseTrace(in);
+  ASSERT_EQ(trace.size(), 2);
+  EXPECT_FALSE(trace[0].domain);
+  ASSERT_EQ(trace[0].exchanges.size(), 1);
+  EXPECT_EQ(trace[0].exchanges[0].request, 100);
+  EXPECT_EQ(trace[0].exchanges[0].response, 2000);
+  EXPECT_EQ(trace[1].open, 15);
+  EXPECT_TRUE(trace[1].domain);
+  ASSERT_EQ(trace[1].exchanges.size(), 2);
+  EXPECT_EQ(trace[1].exchanges[0].think, 20);
+  EXPECT_EQ(trace[1].exchanges[1].response, 65536);
+
+  for (auto line : {"x ip 1:1", "0 tcp 1:1", "0 ip", "0 ip 12-40", "0 ip 1:1#5"}) {
+    std::istringstream bad(line);
+    EXPECT_THROW(replay::ParseTrace(bad), std::invalid_argument) << line;
+  }
+}
+
+// Replays SHADESOCKS_TRACE, or a synthetic trace, against every configuration
+// below. The results are appended to SHADESOCKS_LATENCY_OUT when set, and
+// compared with the results of an earlier build in SHADESOCKS_LATENCY_BASELINE.
+class LatencyTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::unique_ptr<replay::Target> target;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    target = std::make_unique<replay::Target>(loop->get());
+  }
+
+  static replay::Trace LoadTrace() {
+    auto path = std::getenv("SHADESOCKS_TRACE");
+    if (path == nullptr) {
+      return replay::SyntheticTrace(200);
+    }
+    std::ifstream in(path);
+    if (!in) {
+      throw std::invalid_argument(std::string("cannot open trace ") + path);
+    }
+    return replay::ParseTrace(in);
+  }
+};
+
+std::shared_ptr<Loop> LatencyTest::loop;
+std::unique_ptr<replay::Target> LatencyTest::target;
+
+TEST_F(LatencyTest, ReplayTrace) {
+  auto trace = LoadTrace();
+  size_t exchanges = 0;
+  for (auto& connection : trace) {
+    exchanges += connection.exchanges.size();
+  }
+
+  ServerConfig interactive("aes-256-cfb");
+  interactive.inbound_profile = SocketProfile::Interactive();
+  interactive.outbound_profile = SocketProfile::Interactive();
+  std::vector<std::pair<std::string, ServerConfig>> configs{
+      {"aes-256-cfb", ServerConfig("aes-256-cfb")},
+      {"chacha20-ietf", ServerConfig("chacha20-ietf")},
+      {"aes-256-cfb interactive", interactive},
+  };
+
+  std::map<std::pair<std::string, std::string>, std::pair<uint64_t, uint64_t>> baseline;
+  if (auto path = std::getenv("SHADESOCKS_LATENCY_BASELINE")) {
+    std::ifstream in(path);
+    baseline = replay::ReadResults(in);
+  }
+  std::ofstream out;
+  if (auto path = std::getenv("SHADESOCKS_LATENCY_OUT")) {
+    out.open(path, std::ios::app);
+  }
+
+  for (auto& config : configs) {
+    auto listener = loopback::Listen(loop, config.second);
+    auto results = replay::Replay(loop->get(), listener->get_port(), listener->get_config(), trace, *target);
+    EXPECT_EQ(results.failed, 0) << config.first;
+    EXPECT_EQ(results.completed, trace.size()) << config.first;
+    EXPECT_EQ(results.phases[replay::Phase::RoundTrip].Count(), exchanges) << config.first;
+
+    for (int i = 0; i < replay::PhaseCount; i++) {
+      auto phase = replay::Phase(i);
+      auto& histogram = results.phases[phase];
+      LOG(INFO) << config.first << " " << replay::PhaseName(phase) << ": count " << histogram.Count()
+                << ", p50 " << histogram.Percentile(0.50) / 1000 << "us"
+                << ", p99 " << histogram.Percentile(0.99) / 1000 << "us"
+                << ", p999 " << histogram.Percentile(0.999) / 1000 << "us"
+                << ", max " << histogram.Max() / 1000 << "us";
+      auto found = baseline.find({config.first, replay::PhaseName(phase)});
+      if (found != baseline.end() && found->second.first > 0) {
+        LOG(INFO) << config.first << " " << replay::PhaseName(phase) << ": p99 "
+                  << (double(histogram.Percentile(0.99)) / found->second.first - 1) * 100 << "%, p999 "
+                  << (double(histogram.Percentile(0.999)) / found->second.second - 1) * 100
+                  << "% against the baseline";
+      }
+    }
+    if (out.is_open()) {
+      replay::WriteResults(out, config.first, results);
+    }
+  }
+  loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+}
+
+// short connections opened at once, each with one small round trip
+TEST_F(LatencyTest, ConnectionsPerSecond) {
+  const size_t connections = 1000;
+  replay::Trace trace(connections, replay::TraceConnection{0, false, {replay::Exchange{64, 64, 0}}});
+
+  for (auto method : {"aes-256-cfb", "aes-128-ctr", "aes-256-gcm", "chacha20-ietf"}) {
+    auto listener = loopback::Listen(loop, ServerConfig(method));
+    auto start = uv_hrtime();
+    auto results = replay::Replay(loop->get(), listener->get_port(), listener->get_config(), trace, *target);
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+    EXPECT_EQ(results.completed, connections) << method;
+
+    auto& first_byte = results.phases[replay::Phase::FirstByte];
+    LOG(INFO) << method << ": " << connections / elapsed << " connections per second, first byte p50 "
+              << first_byte.Percentile(0.5) / 1000 << "us, p99 " << first_byte.Percentile(0.99) / 1000 << "us";
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,491 @@
+#ifndef SHADESOCKS_TEST_SS_LOOPBACK_H_
+#define SHADESOCKS_TEST_SS_LOOPBACK_H_
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ss_test.h"
+
+// Helpers to drive a listener over 127.0.0.1 from inside one loop.
+namespace shadesocks {
+namespace loopback {
+
+// runs the loop until done returns true, returns false on timeout
+inline bool RunUntil(uv_loop_t* loop, const std::function<bool()>& done, uint64_t timeout_ms = 2000) {
+  struct Waiter {
+    uv_timer_t timer;
+    const std::function<bool()>* done;
+    uint64_t deadline;
+    bool finished;
+  } waiter{};
+  waiter.done = &done;
+  waiter.deadline = uv_now(loop) + timeout_ms;
+  waiter.timer.data = &waiter;
+
+  uv_timer_init(loop, &waiter.timer);
+  uv_timer_start(&waiter.timer, [](uv_timer_t* timer) {
+    auto waiter = reinterpret_cast<Waiter*>(timer->data);
+    waiter->finished = (*waiter->done)();
+    if (waiter->finished || uv_now(timer->loop) >= waiter->deadline) {
+      uv_stop(timer->loop);
+    }
+  }, 0, 1);
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&waiter.timer), nullptr);
+  uv_run(loop, UV_RUN_NOWAIT);
+  return waiter.finished;
+}
+
+// a port nothing listens on
+inline int ClosedPort(uv_loop_t* loop) {
+  uv_tcp_t tcp;
+  uv_tcp_init(loop, &tcp);
+  sockaddr_in addr{};
+  uv_ip4_addr("127.0.0.1", 0, &addr);
+  uv_tcp_bind(&tcp, (const sockaddr*) &addr, 0);
+  int length = sizeof(addr);
+  uv_tcp_getsockname(&tcp, (sockaddr*) &addr, &length);
+  uv_close(reinterpret_cast<uv_handle_t*>(&tcp), nullptr);
+  uv_run(loop, UV_RUN_NOWAIT);
+  return ntohs(addr.sin_port);
+}
+
+// listens on a port of 127.0.0.1 chosen by the kernel, or on a Unix domain
+// socket when a path is given; tcp and pipe share their memory, only the one
+// in use is initialized; returns the port, 0 for a path
+inline int Bind(uv_loop_t* loop, uv_tcp_t* tcp, uv_pipe_t* pipe, const std::string& path) {
+  if (!path.empty()) {
+    uv_pipe_init(loop, pipe, 0);
+    unlink(path.c_str());
+    uv_pipe_bind(pipe, path.c_str());
+    return 0;
+  }
+  uv_tcp_init(loop, tcp);
+  sockaddr_in addr{};
+  uv_ip4_addr("127.0.0.1", 0, &addr);
+  uv_tcp_bind(tcp, (const sockaddr*) &addr, 0);
+  int length = sizeof(addr);
+  uv_tcp_getsockname(tcp, (sockaddr*) &addr, &length);
+  return ntohs(addr.sin_port);
+}
+
+// connects to the port of 127.0.0.1, or to the Unix domain socket when a path is given
+inline void Dial(uv_loop_t* loop, uv_tcp_t* tcp, uv_pipe_t* pipe, uv_connect_t* req, int port,
+                 const std::string& path, uv_connect_cb done) {
+  if (!path.empty()) {
+    uv_pipe_init(loop, pipe, 0);
+    uv_pipe_connect(req, pipe, path.c_str(), done);
+    return;
+  }
+  uv_tcp_init(loop, tcp);
+  sockaddr_in addr{};
+  uv_ip4_addr("127.0.0.1", port, &addr);
+  uv_tcp_connect(req, tcp, (const sockaddr*) &addr, done);
+}
+
+// a peer accepted by a server of either kind
+union Peer {
+  uv_tcp_t tcp;
+  uv_pipe_t pipe;
+};
+
+inline Peer* Accept(uv_stream_t* server) {
+  auto peer = new Peer{};
+  if (server->type == UV_NAMED_PIPE) {
+    uv_pipe_init(server->loop, &peer->pipe, 0);
+  } else {
+    uv_tcp_init(server->loop, &peer->tcp);
+  }
+  if (uv_accept(server, reinterpret_cast<uv_stream_t*>(peer)) != 0) {
+    uv_close(reinterpret_cast<uv_handle_t*>(peer), [](uv_handle_t* handle) { delete reinterpret_cast<Peer*>(handle); });
+    return nullptr;
+  }
+  return peer;
+}
+
+inline std::string IPv4Header(const std::string& ip, int port) {
+  sockaddr_in addr{};
+  uv_ip4_addr(ip.c_str(), port, &addr);
+  std::string header(1, char(AddrType::TypeIPv4));
+  header.append(reinterpret_cast<const char*>(&addr.sin_addr), 4);
+  header.push_back(char(port >> 8));
+  header.push_back(char(port & 0xff));
+  return header;
+}
+
+inline std::string DomainHeader(const std::string& domain, int port) {
+  std::string header(1, char(AddrType::TypeDomain));
+  header.push_back(char(domain.size()));
+  header.append(domain);
+  header.push_back(char(port >> 8));
+  header.push_back(char(port & 0xff));
+  return header;
+}
+
+// the iv followed by the encrypted request, like a client sends it
+inline std::string EncodeRequest(const ServerConfig& config, const std::string& plain) {
+  auto iv = Util::RandomBlock(config.cipher_info.iv_length);
+  auto cipher = Util::getEncryption(config.method, config.key, iv);
+  auto encrypted = cipher->encrypt(plain);
+  return std::string(reinterpret_cast<char*>(iv.data()), iv.size()) +
+      std::string(reinterpret_cast<char*>(encrypted.data()), encrypted.size());
+}
+
+// the iv sent by the server is the first bytes of the response
+inline std::string DecodeResponse(const ServerConfig& config, const std::string& response) {
+  size_t iv_length = config.cipher_info.iv_length;
+  if (response.size() < iv_length) {
+    return "";
+  }
+  SecByteBlock iv((byte*) response.data(), iv_length);
+  auto cipher = Util::getEncryption(config.method, config.key, iv);
+  auto plain = cipher->decrypt(response.substr(iv_length));
+  return std::string(reinterpret_cast<char*>(plain.data()), plain.size());
+}
+
+// every listener started by Listen; accepted connections point into their
+// listener, so the listeners stay until the process exits
+inline std::vector<std::shared_ptr<TCPHandle>>& Listeners() {
+  static std::vector<std::shared_ptr<TCPHandle>> listeners;
+  return listeners;
+}
+
+// a listener on a port of 127.0.0.1 chosen by the kernel, kept in Listeners()
+inline std::shared_ptr<TCPHandle> Listen(const std::shared_ptr<Loop>& loop, ServerConfig config, int backlog = 128) {
+  auto listener = loop->create_tcp_handle();
+  listener->set_config(std::move(config));
+  listener->bind("127.0.0.1", 0);
+  listener->listen(backlog);
+  Listeners().push_back(listener);
+  return listener;
+}
+
+// connects, sends the payload and collects everything until the server closes
+class Client final {
+ public:
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  uv_connect_t connect;
+  uv_write_t write;
+  uv_shutdown_t shutdown;
+
+  std::string payload;
+  std::string received;
+  // reset the connection right after it is established
+  bool reset;
+  // send a FIN after the payload and keep reading
+  bool half_close;
+  bool closed;
+  int read_error;
+
+  Client(uv_loop_t* loop, int port, std::string payload, bool reset = false, bool half_close = false)
+      : Client(loop, port, "", std::move(payload), reset, half_close) {}
+
+  // over the Unix domain socket at the path instead
+  Client(uv_loop_t* loop, const std::string& path, std::string payload, bool reset = false, bool half_close = false)
+      : Client(loop, 0, path, std::move(payload), reset, half_close) {}
+
+  void Close() {
+    if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&this->tcp))) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->tcp), CloseDone);
+    }
+  }
+
+ private:
+  Client(uv_loop_t* loop, int port, const std::string& path, std::string payload, bool reset, bool half_close)
+      : tcp(), payload(std::move(payload)), reset(reset), half_close(half_close), closed(false), read_error(0) {
+    this->connect.data = this;
+    this->write.data = this;
+    Dial(loop, &this->tcp, &this->pipe, &this->connect, port, path, ConnectDone);
+    this->tcp.data = this;
+  }
+
+  static void CloseDone(uv_handle_t* handle) {
+    reinterpret_cast<Client*>(handle->data)->closed = true;
+  }
+
+  static void ConnectDone(uv_connect_t* req, int status) {
+    auto client = reinterpret_cast<Client*>(req->data);
+    if (status < 0) {
+      client->read_error = status;
+      uv_close(reinterpret_cast<uv_handle_t*>(&client->tcp), CloseDone);
+      return;
+    }
+    if (client->reset) {
+      if (client->tcp.type == UV_TCP) {
+        uv_tcp_close_reset(&client->tcp, CloseDone);
+      } else {
+        uv_close(reinterpret_cast<uv_handle_t*>(&client->tcp), CloseDone);
+      }
+      return;
+    }
+    if (!client->payload.empty()) {
+      auto buf = uv_buf_init(&client->payload[0], client->payload.size());
+      uv_write(&client->write, reinterpret_cast<uv_stream_t*>(&client->tcp), &buf, 1, nullptr);
+    }
+    if (client->half_close) {
+      uv_shutdown(&client->shutdown, reinterpret_cast<uv_stream_t*>(&client->tcp), nullptr);
+    }
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&client->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    auto client = reinterpret_cast<Client*>(stream->data);
+                    if (nread > 0) {
+                      client->received.append(buf->base, nread);
+                    } else if (nread < 0) {
+                      client->read_error = nread;
+                      uv_close(reinterpret_cast<uv_handle_t*>(stream), CloseDone);
+                    }
+                  });
+  }
+};
+
+// sends small requests one after another over one connection and records
+// the time until the echoed response is complete
+class PingClient final {
+ public:
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  uv_connect_t connect;
+  uv_write_t write;
+
+  std::vector<uint64_t> latencies;
+  bool closed;
+
+  // the path of a Unix domain socket is dialed instead of the port when given
+  PingClient(uv_loop_t* loop, int port, const ServerConfig& config, const std::string& header,
+             size_t size, int rounds, const std::string& path = "")
+      : tcp(), closed(false), config(config), header(header), size(size), rounds(rounds),
+        received(0), expected(0), sent_at(0) {
+    this->connect.data = this;
+    Dial(loop, &this->tcp, &this->pipe, &this->connect, port, path, ConnectDone);
+    this->tcp.data = this;
+  }
+
+  void Close() {
+    if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&this->tcp))) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->tcp), [](uv_handle_t* handle) {
+        reinterpret_cast<PingClient*>(handle->data)->closed = true;
+      });
+    }
+  }
+
+ private:
+  const ServerConfig& config;
+  std::string header;
+  size_t size;
+  int rounds;
+
+  std::unique_ptr<Cipher> cipher;
+  std::string out;
+  size_t received;
+  size_t expected;
+  uint64_t sent_at;
+
+  void Send() {
+    std::string plain(this->size, 'p');
+    if (this->cipher == nullptr) {
+      auto iv = Util::RandomBlock(this->config.cipher_info.iv_length);
+      this->cipher = Util::getEncryption(this->config.method, this->config.key, iv);
+      auto encrypted = this->cipher->encrypt(this->header + plain);
+      this->out = std::string(reinterpret_cast<char*>(iv.data()), iv.size()) +
+          std::string(reinterpret_cast<char*>(encrypted.data()), encrypted.size());
+      //the first response starts with the iv of the server
+      this->expected += this->config.cipher_info.iv_length;
+    } else {
+      auto encrypted = this->cipher->encrypt(plain);
+      this->out = std::string(reinterpret_cast<char*>(encrypted.data()), encrypted.size());
+    }
+    this->expected += this->size;
+    this->sent_at = uv_hrtime();
+
+    auto buf = uv_buf_init(&this->out[0], this->out.size());
+    uv_write(&this->write, reinterpret_cast<uv_stream_t*>(&this->tcp), &buf, 1, nullptr);
+  }
+
+  static void ConnectDone(uv_connect_t* req, int status) {
+    auto client = reinterpret_cast<PingClient*>(req->data);
+    if (status < 0) {
+      client->Close();
+      return;
+    }
+    client->Send();
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&client->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    auto client = reinterpret_cast<PingClient*>(stream->data);
+                    if (nread < 0) {
+                      client->Close();
+                      return;
+                    }
+                    client->received += nread;
+                    if (client->received < client->expected) {
+                      return;
+                    }
+                    client->latencies.push_back(uv_hrtime() - client->sent_at);
+                    if (--client->rounds > 0) {
+                      client->Send();
+                    } else {
+                      client->Close();
+                    }
+                  });
+  }
+};
+
+// the value below which the given fraction of the samples fall
+inline uint64_t Percentile(std::vector<uint64_t> samples, double fraction) {
+  if (samples.empty()) {
+    return 0;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t index = std::min(samples.size() - 1, size_t(fraction * samples.size()));
+  return samples[index];
+}
+
+// accepts connections and writes back whatever it reads
+class EchoServer final {
+ public:
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  int port;
+
+  // on a Unix domain socket when a path is given
+  explicit EchoServer(uv_loop_t* loop, const std::string& path = "") : tcp() {
+    this->port = Bind(loop, &this->tcp, &this->pipe, path);
+
+    uv_listen(reinterpret_cast<uv_stream_t*>(&this->tcp), 128, [](uv_stream_t* server, int status) {
+      auto peer = Accept(server);
+      if (peer == nullptr) {
+        return;
+      }
+      uv_read_start(reinterpret_cast<uv_stream_t*>(peer),
+                    [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                      *buf = uv_buf_init(new char[suggested_size], suggested_size);
+                    },
+                    [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                      if (nread > 0) {
+                        auto req = new uv_write_t{};
+                        req->data = buf->base;
+                        auto out = uv_buf_init(buf->base, nread);
+                        uv_write(req, stream, &out, 1, [](uv_write_t* req, int status) {
+                          delete[] reinterpret_cast<char*>(req->data);
+                          delete req;
+                        });
+                        return;
+                      }
+                      delete[] buf->base;
+                      if (nread < 0) {
+                        uv_close(reinterpret_cast<uv_handle_t*>(stream), [](uv_handle_t* handle) {
+                          delete reinterpret_cast<Peer*>(handle);
+                        });
+                      }
+                    });
+    });
+  }
+};
+
+// greets every connection and closes it, or answers with the number of bytes
+// received once the client is done sending and closes then
+class ReplyServer final {
+ public:
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  int port;
+
+  // on a Unix domain socket when a path is given
+  ReplyServer(uv_loop_t* loop, std::string greeting, const std::string& path = "")
+      : tcp(), greeting(std::move(greeting)) {
+    this->port = Bind(loop, &this->tcp, &this->pipe, path);
+    this->tcp.data = this;
+    uv_listen(reinterpret_cast<uv_stream_t*>(&this->tcp), 1024, Accepted);
+  }
+
+  ~ReplyServer() {
+    uv_close(reinterpret_cast<uv_handle_t*>(&this->tcp), nullptr);
+    uv_run(this->tcp.loop, UV_RUN_NOWAIT);
+  }
+
+ private:
+  struct Connection {
+    union {
+      uv_tcp_t tcp;
+      uv_pipe_t pipe;
+    };
+    uv_write_t write;
+    size_t received;
+    std::string out;
+
+    void Reply(std::string out) {
+      this->out = std::move(out);
+      auto buf = uv_buf_init(&this->out[0], this->out.size());
+      this->write.data = this;
+      uv_write(&this->write, reinterpret_cast<uv_stream_t*>(&this->tcp), &buf, 1, [](uv_write_t* req, int status) {
+        reinterpret_cast<Connection*>(req->data)->Close();
+      });
+    }
+
+    void Close() {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->tcp), [](uv_handle_t* handle) {
+        delete reinterpret_cast<Connection*>(handle->data);
+      });
+    }
+  };
+
+  std::string greeting;
+
+  static void Accepted(uv_stream_t* server, int status) {
+    auto peer = new Connection{};
+    if (server->type == UV_NAMED_PIPE) {
+      uv_pipe_init(server->loop, &peer->pipe, 0);
+    } else {
+      uv_tcp_init(server->loop, &peer->tcp);
+    }
+    peer->tcp.data = peer;
+    if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&peer->tcp)) != 0) {
+      peer->Close();
+      return;
+    }
+    auto& greeting = reinterpret_cast<ReplyServer*>(server->data)->greeting;
+    if (!greeting.empty()) {
+      peer->Reply(greeting);
+      return;
+    }
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&peer->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    auto peer = reinterpret_cast<Connection*>(stream->data);
+                    if (nread > 0) {
+                      peer->received += nread;
+                    } else if (nread == UV_EOF) {
+                      uv_read_stop(stream);
+                      peer->Reply(std::to_string(peer->received));
+                    } else if (nread < 0) {
+                      peer->Close();
+                    }
+                  });
+  }
+};
+
+}  // namespace loopback
+}  // namespace shadesocks
+#endif //SHADESOCKS_TEST_SS_LOOPBACK_H_
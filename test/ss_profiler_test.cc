@@ -0,0 +1,119 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+class ProfilerTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Loop> loop = Loop::getDefault();
+
+  void TearDown() override {
+    loop->disable_profiling();
+    uv_run(loop->get(), UV_RUN_NOWAIT);
+  }
+};
+
+
+TEST_F(ProfilerTest, DisabledRecordsNothing) {
+  auto& profiler = LoopProfiler::Local();
+  profiler.Reset();
+  ASSERT_FALSE(profiler.Enabled());
+  {
+    ProfileScope scope(CallbackType::ClientReadCallback);
+  }
+  EXPECT_EQ(profiler.Callback(CallbackType::ClientReadCallback).count, 0);
+}
+
+TEST_F(ProfilerTest, TimesRelayCallbacks) {
+  loopback::ReplyServer target(loop->get(), "");
+  auto listener = loopback::Listen(loop, ServerConfig());
+  auto& config = listener->get_config();
+
+  loop->enable_profiling();
+  loopback::Client client(loop->get(), listener->get_port(),
+                          loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + "hello"),
+                          false, true);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+  ASSERT_EQ(loopback::DecodeResponse(config, client.received), "5");
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [] { return Stats::Local().LiveConnections() == 0; }));
+
+  auto& profiler = loop->get_profiler();
+  EXPECT_EQ(profiler.Callback(CallbackType::AcceptCallback).count, 1);
+  EXPECT_EQ(profiler.Callback(CallbackType::ConnectCallback).count, 1);
+  EXPECT_GE(profiler.Callback(CallbackType::ClientReadCallback).count, 2);
+  EXPECT_GE(profiler.Callback(CallbackType::ServerReadCallback).count, 2);
+  EXPECT_GE(profiler.Callback(CallbackType::ServerWriteCallback).count, 1);
+  EXPECT_GE(profiler.Callback(CallbackType::ClientWriteCallback).count, 1);
+  //both sockets of the connection
+  EXPECT_EQ(profiler.Callback(CallbackType::CloseCallback).count, 2);
+  EXPECT_GT(profiler.Callback(CallbackType::ClientReadCallback).total, 0);
+
+  EXPECT_GT(profiler.Iterations(), 0);
+  EXPECT_EQ(profiler.EventsPerIteration().Count(), profiler.Iterations());
+  EXPECT_GT(profiler.EventsPerIteration().Max(), 0);
+  //waiting for the next tick of RunUntil is idle time
+  EXPECT_GT(profiler.IdleTime(), 0);
+  EXPECT_GT(profiler.PollTime(), 0);
+  LOG(INFO) << profiler.Summary();
+}
+
+TEST_F(ProfilerTest, SamplesLoopLag) {
+  ProfilerOptions options;
+  options.lag_interval = 5;
+  loop->enable_profiling(options);
+
+  //a callback which keeps the loop busy for 50ms
+  uv_timer_t busy;
+  uv_timer_init(loop->get(), &busy);
+  uv_timer_start(&busy, [](uv_timer_t*) {
+    auto until = uv_hrtime() + 50 * 1000 * 1000;
+    while (uv_hrtime() < until) {
+    }
+  }, 20, 0);
+  loopback::RunUntil(loop->get(), [] { return false; }, 150);
+  uv_close(reinterpret_cast<uv_handle_t*>(&busy), nullptr);
+
+  auto& profiler = loop->get_profiler();
+  EXPECT_GE(profiler.LoopLag().Max(), 30 * 1000);
+  EXPECT_LT(profiler.LoopLag().Percentile(0.5), 30 * 1000);
+  EXPECT_GE(profiler.IterationTime().Max(), 45 * 1000);
+  EXPECT_GE(profiler.OtherTime(), 45 * 1000 * 1000);
+}
+
+TEST_F(ProfilerTest, SummaryEveryInterval) {
+  ProfilerOptions options;
+  options.lag_interval = 5;
+  options.summary_interval = 20;
+  loop->enable_profiling(options);
+  auto& profiler = loop->get_profiler();
+  loopback::RunUntil(loop->get(), [] { return false; }, 100);
+  //reset after every summary, so only the last interval is left
+  EXPECT_LE(profiler.LoopLag().Count(), 6);
+  EXPECT_GT(profiler.Iterations(), 0);
+}
+
+// the cost of a timed callback scope, which is in every relay callback
+TEST_F(ProfilerTest, ScopeCost) {
+  const int rounds = 10 * 1000 * 1000;
+  auto measure = [&] {
+    auto start = uv_hrtime();
+    for (int i = 0; i < rounds; i++) {
+      ProfileScope scope(CallbackType::TaskCallback);
+    }
+    return double(uv_hrtime() - start) / rounds;
+  };
+  auto disabled = measure();
+  loop->enable_profiling();
+  auto enabled = measure();
+  LOG(INFO) << "scope cost disabled: " << disabled << "ns, enabled: " << enabled << "ns";
+  EXPECT_LT(disabled, 10);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
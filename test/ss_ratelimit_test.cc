@@ -0,0 +1,154 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+TEST(TokenBucketTest, Unlimited) {
+  TokenBucket bucket;
+  auto now = uv_hrtime();
+  bucket.Consume(1 << 30, now);
+  ASSERT_TRUE(bucket.Unlimited());
+  ASSERT_EQ(bucket.Delay(now), 0);
+}
+
+TEST(TokenBucketTest, BurstThenRate) {
+  const uint64_t rate = 1000 * 1000;
+  const uint64_t burst = 64 * 1024;
+  TokenBucket bucket({rate, burst});
+  auto now = uv_hrtime();
+
+  bucket.Consume(burst, now);
+  ASSERT_EQ(bucket.Delay(now), 0);
+
+  //one more chunk puts the bucket into debt for exactly chunk / rate
+  bucket.Consume(10000, now);
+  auto delay = bucket.Delay(now);
+  ASSERT_NEAR(delay, 10 * 1000 * 1000, 1000);
+  ASSERT_EQ(bucket.Delay(now + delay), 0);
+}
+
+TEST(TokenBucketTest, LongRunRate) {
+  const uint64_t rate = 5 * 1000 * 1000;
+  TokenBucket bucket({rate, 0});
+  auto start = uv_hrtime();
+  auto now = start;
+  uint64_t sent = 0;
+
+  //send as fast as the bucket allows with 1ms timers
+  while (now - start < 10ull * 1000 * 1000 * 1000) {
+    auto delay = bucket.Delay(now);
+    if (delay) {
+      now += (delay + 999999) / 1000000 * 1000000;
+      continue;
+    }
+    bucket.Consume(BufferPool::kBufferSize, now);
+    sent += BufferPool::kBufferSize;
+  }
+  double achieved = sent / ((now - start) / 1e9);
+  LOG(INFO) << "simulated rate: " << achieved << " bytes/s, limit: " << rate;
+  ASSERT_NEAR(achieved, rate, rate * 0.01 + BufferPool::kBufferSize / 10.0);
+}
+
+class RateLimitTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  std::unique_ptr<loopback::EchoServer> target;
+
+  void SetUp() override {
+    loop = Loop::getDefault();
+    target = std::make_unique<loopback::EchoServer>(loop->get());
+  }
+
+  void TearDown() override {
+    GlobalBucket().Reset(RateLimit());
+    uv_close(reinterpret_cast<uv_handle_t*>(&target->tcp), nullptr);
+    uv_run(loop->get(), UV_RUN_NOWAIT);
+  }
+
+  // relays size bytes through every client and back, returns the achieved rate of all traffic
+  double Relay(const std::shared_ptr<TCPHandle>& listener, int clients, size_t size) {
+    auto& config = listener->get_config();
+    std::string plain(size, 'x');
+    auto request = loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target->port) + plain);
+
+    auto start = uv_hrtime();
+    std::vector<std::unique_ptr<loopback::Client>> connections;
+    for (int i = 0; i < clients; i++) {
+      connections.push_back(std::make_unique<loopback::Client>(loop->get(), listener->get_port(), request));
+    }
+    EXPECT_TRUE(loopback::RunUntil(loop->get(), [&] {
+      for (auto& client : connections) {
+        if (client->received.size() < config.cipher_info.iv_length + size) {
+          return false;
+        }
+      }
+      return true;
+    }, 30000));
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+
+    for (auto& client : connections) {
+      client->Close();
+    }
+    loopback::RunUntil(loop->get(), [&] { return BufferPool::Local().InUse() == 0; });
+
+    //each byte is charged once on the way in and once on the way back
+    double rate = 2.0 * clients * request.size() / elapsed;
+    LOG(INFO) << clients << " connections relayed " << size << " bytes each in " << elapsed << "s, "
+              << rate << " bytes/s";
+    return rate;
+  }
+};
+
+std::shared_ptr<Loop> RateLimitTest::loop;
+
+TEST_F(RateLimitTest, ConnectionLimit) {
+  const uint64_t rate = 1024 * 1024;
+  ServerConfig config;
+  config.connection_limit = {rate, 32 * 1024};
+  auto listener = loopback::Listen(loop, config);
+
+  //every connection gets the full rate on its own
+  auto achieved = Relay(listener, 2, 512 * 1024);
+  EXPECT_NEAR(achieved, 2 * rate, 2 * rate * 0.15);
+}
+
+TEST_F(RateLimitTest, ListenerLimit) {
+  const uint64_t rate = 2 * 1024 * 1024;
+  ServerConfig config;
+  config.listener_limit = {rate, 32 * 1024};
+  auto listener = loopback::Listen(loop, config);
+
+  //the connections share the listener rate
+  auto achieved = Relay(listener, 4, 256 * 1024);
+  EXPECT_NEAR(achieved, rate, rate * 0.15);
+}
+
+TEST_F(RateLimitTest, GlobalLimit) {
+  const uint64_t rate = 2 * 1024 * 1024;
+  GlobalBucket().Reset({rate, 32 * 1024});
+  auto first = loopback::Listen(loop, ServerConfig());
+  auto second = loopback::Listen(loop, ServerConfig());
+
+  auto start = uv_hrtime();
+  Relay(first, 2, 256 * 1024);
+  Relay(second, 2, 256 * 1024);
+  auto elapsed = (uv_hrtime() - start) / 1e9;
+  double achieved = 2.0 * 4 * 256 * 1024 / elapsed;
+  LOG(INFO) << "global rate: " << achieved << " bytes/s";
+  EXPECT_NEAR(achieved, rate, rate * 0.15);
+}
+
+TEST_F(RateLimitTest, Unlimited) {
+  auto listener = loopback::Listen(loop, ServerConfig());
+  auto achieved = Relay(listener, 2, 4 * 1024 * 1024);
+  EXPECT_GT(achieved, 16 * 1024 * 1024);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,170 @@
+#include <fstream>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+class RecorderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    FlightRecorder::Local().set_enabled(true);
+    FlightRecorder::Local().Clear();
+  }
+
+  // the events of the connection accepted first since the recorder was cleared
+  static std::vector<Event> FirstConnection() {
+    auto snapshot = FlightRecorder::Local().Snapshot();
+    std::vector<Event> events;
+    for (auto& event : snapshot) {
+      if (events.empty() && event.type != EventType::AcceptEvent) {
+        continue;
+      }
+      if (events.empty() || event.connection == events.front().connection) {
+        events.push_back(event);
+      }
+    }
+    return events;
+  }
+};
+
+TEST_F(RecorderTest, RingOverwritesOldest) {
+  auto& recorder = FlightRecorder::Local();
+  for (size_t i = 0; i < FlightRecorder::kCapacity + 10; i++) {
+    recorder.Record(EventType::ClientRead, 1, 0, 0, i);
+  }
+  auto snapshot = recorder.Snapshot();
+  ASSERT_EQ(snapshot.size(), FlightRecorder::kCapacity);
+  EXPECT_EQ(snapshot.front().bytes, 10);
+  EXPECT_EQ(snapshot.back().bytes, FlightRecorder::kCapacity + 9);
+
+  recorder.set_enabled(false);
+  recorder.Record(EventType::ClientRead, 1);
+  EXPECT_EQ(recorder.Snapshot().back().bytes, FlightRecorder::kCapacity + 9);
+}
+
+TEST_F(RecorderTest, DumpAndLoad) {
+  auto& recorder = FlightRecorder::Local();
+  recorder.Record(EventType::AcceptEvent, 7);
+  recorder.Record(EventType::ProxyTransition, 7, ProxyState::ClientReading, ProxyState::AddressRequesting);
+  recorder.Record(EventType::FailEvent, 7, ProxyState::Connecting, ProxyState::ServerReading, 0,
+                  UV_ECONNREFUSED, ErrorType::ConnectError);
+
+  auto path = testing::TempDir() + "recorder_dump";
+  ASSERT_EQ(recorder.Dump(path), 0);
+  RecordingHeader header{};
+  std::vector<Event> events;
+  ASSERT_EQ(FlightRecorder::Load(path, header, events), 0);
+  ASSERT_EQ(events.size(), 3);
+  EXPECT_EQ(events[1].to, ProxyState::AddressRequesting);
+  EXPECT_EQ(events[2].error, UV_ECONNREFUSED);
+  EXPECT_EQ(events[2].detail, ErrorType::ConnectError);
+  EXPECT_GE(header.dumped_at, events[2].time);
+
+  //anything else is rejected
+  std::ofstream(path) << "not a dump";
+  EXPECT_EQ(FlightRecorder::Load(path, header, events), -EINVAL);
+  EXPECT_EQ(FlightRecorder::Load(path + ".missing", header, events), -ENOENT);
+}
+
+TEST_F(RecorderTest, DumpOnSignal) {
+  auto loop = Loop::getDefault();
+  auto& recorder = FlightRecorder::Local();
+  auto path = testing::TempDir() + "recorder_signal";
+  ASSERT_EQ(recorder.DumpOnSignal(loop->get(), path), 0);
+  recorder.Record(EventType::CloseEvent, 3);
+
+  auto dumps = recorder.Dumps();
+  raise(SIGUSR1);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return recorder.Dumps() > dumps; }));
+  recorder.StopSignal();
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+
+  RecordingHeader header{};
+  std::vector<Event> events;
+  ASSERT_EQ(FlightRecorder::Load(path + "." + std::to_string(dumps), header, events), 0);
+  ASSERT_FALSE(events.empty());
+  EXPECT_EQ(events.back().type, EventType::CloseEvent);
+}
+
+TEST_F(RecorderTest, ConnectionEvents) {
+  auto loop = Loop::getDefault();
+  loopback::EchoServer target(loop->get());
+  auto listener = loopback::Listen(loop, ServerConfig());
+
+  auto& config = listener->get_config();
+  loopback::Client client(loop->get(), listener->get_port(),
+                          loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + "ping"));
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+    return loopback::DecodeResponse(config, client.received) == "ping";
+  }));
+  client.Close();
+  //the proxy closes once the end of the client has gone through the target and back
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+    return client.closed && BufferPool::Local().InUse() == 0 && Stats::Local().LiveConnections() == 0;
+  }));
+
+  auto events = FirstConnection();
+  ASSERT_FALSE(events.empty());
+  std::vector<uint8_t> types;
+  std::vector<uint8_t> states;
+  for (auto& event : events) {
+    types.push_back(event.type);
+    if (event.type == EventType::ProxyTransition) {
+      states.push_back(event.to);
+    }
+  }
+  auto has = [&](uint8_t type) { return std::find(types.begin(), types.end(), type) != types.end(); };
+  EXPECT_TRUE(has(EventType::ClientRead));
+  EXPECT_TRUE(has(EventType::ServerWritten));
+  EXPECT_TRUE(has(EventType::ServerRead));
+  EXPECT_TRUE(has(EventType::ClientWritten));
+  EXPECT_EQ(types.back(), EventType::CloseEvent);
+  ASSERT_GE(states.size(), 3);
+  EXPECT_EQ(states[0], ProxyState::ClientReading);
+  EXPECT_EQ(states[1], ProxyState::AddressRequesting);
+  EXPECT_EQ(states[2], ProxyState::Connecting);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+// relay throughput with and without recording
+TEST_F(RecorderTest, ThroughputOverhead) {
+  auto loop = Loop::getDefault();
+  loopback::EchoServer target(loop->get());
+  auto listener = loopback::Listen(loop, ServerConfig());
+
+  auto& config = listener->get_config();
+  auto header = loopback::IPv4Header("127.0.0.1", target.port);
+  const size_t size = 64 * 1024 * 1024;
+  auto payload = loopback::EncodeRequest(config, header + std::string(size, 'b'));
+
+  for (bool enabled : {false, true, false, true}) {
+    FlightRecorder::Local().set_enabled(enabled);
+    FlightRecorder::Local().Clear();
+    auto start = uv_hrtime();
+    loopback::Client bulk(loop->get(), listener->get_port(), payload);
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+      return bulk.received.size() >= config.cipher_info.iv_length + size;
+    }, 60000));
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+    bulk.Close();
+    loopback::RunUntil(loop->get(), [&] { return bulk.closed && BufferPool::Local().InUse() == 0; });
+
+    LOG(INFO) << "recorder " << (enabled ? "on" : "off") << ": echo throughput "
+              << 2 * size / elapsed / 1024 / 1024 << " MB/s, "
+              << FlightRecorder::Local().Snapshot().size() << " events kept";
+  }
+  FlightRecorder::Local().set_enabled(true);
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
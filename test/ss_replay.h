@@ -0,0 +1,494 @@
+#ifndef SHADESOCKS_TEST_SS_REPLAY_H_
+#define SHADESOCKS_TEST_SS_REPLAY_H_
+
+#include <array>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include "ss_loopback.h"
+
+// Replays a connection trace through a listener to a local target and
+// records where the time of every connection goes.
+namespace shadesocks {
+namespace replay {
+
+struct Exchange {
+  uint32_t request;
+  uint32_t response;
+  // milliseconds the client waits after the response before the next request
+  uint64_t think;
+};
+
+struct TraceConnection {
+  // milliseconds after the start of the replay
+  uint64_t open;
+  // the destination is sent as a name the server has to resolve
+  bool domain;
+  std::vector<Exchange> exchanges;
+};
+
+using Trace = std::vector<TraceConnection>;
+
+// one connection per line, empty lines and lines starting with # are skipped:
+//   <open ms> <ip|domain> <request bytes>:<response bytes>[@<think ms>] ...
+inline Trace ParseTrace(std::istream& in) {
+  Trace trace;
+  std::string line;
+  int number = 0;
+  while (std::getline(in, line)) {
+    number++;
+    auto start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos || line[start] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string type;
+    TraceConnection connection{};
+    if (!(fields >> connection.open)) {
+      throw std::invalid_argument("bad open time on trace line " + std::to_string(number));
+    }
+    fields >> type;
+    if (type != "ip" && type != "domain") {
+      throw std::invalid_argument("bad destination type on trace line " + std::to_string(number));
+    }
+    connection.domain = type == "domain";
+
+    std::string token;
+    while (fields >> token) {
+      Exchange exchange{};
+      char colon = 0;
+      char at = 0;
+      std::istringstream parts(token);
+      if (!(parts >> exchange.request >> colon >> exchange.response) || colon != ':' ||
+          ((parts >> at) && (at != '@' || !(parts >> exchange.think)))) {
+        throw std::invalid_argument("bad exchange " + token + " on trace line " + std::to_string(number));
+      }
+      connection.exchanges.push_back(exchange);
+    }
+    if (connection.exchanges.empty()) {
+      throw std::invalid_argument("no exchange on trace line " + std::to_string(number));
+    }
+    trace.push_back(std::move(connection));
+  }
+  return trace;
+}
+
+// mostly small request/response pairs with pauses, some bulk downloads,
+// connections arriving as a poisson process
+inline Trace SyntheticTrace(size_t connections, uint32_t seed = 1) {
+  std::mt19937 random(seed);
+  std::exponential_distribution<double> arrival(1.0 / 2);
+  std::exponential_distribution<double> think(1.0 / 5);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<int> rounds(1, 8);
+
+  Trace trace;
+  double open = 0;
+  for (size_t i = 0; i < connections; i++) {
+    open += arrival(random);
+    TraceConnection connection{uint64_t(open), percent(random) < 25, {}};
+    for (int round = rounds(random); round > 0; round--) {
+      Exchange exchange{};
+      if (percent(random) < 80) {
+        exchange.request = std::uniform_int_distribution<uint32_t>(64, 1024)(random);
+        exchange.response = std::uniform_int_distribution<uint32_t>(128, 8 * 1024)(random);
+      } else {
+        exchange.request = std::uniform_int_distribution<uint32_t>(256, 2048)(random);
+        exchange.response = std::uniform_int_distribution<uint32_t>(64 * 1024, 1024 * 1024)(random);
+      }
+      exchange.think = std::min<uint64_t>(uint64_t(think(random)), 50);
+      connection.exchanges.push_back(exchange);
+    }
+    trace.push_back(std::move(connection));
+  }
+  return trace;
+}
+
+enum Phase {
+  // connecting to the listener
+  Handshake,
+  // first request sent until the target accepted, for destinations sent as a name
+  ResolveConnect,
+  // the same for destinations sent as an address
+  Connect,
+  // first request sent until the first byte of the response
+  FirstByte,
+  // every request until its response is complete
+  RoundTrip,
+  PhaseCount
+};
+
+inline const char* PhaseName(Phase phase) {
+  switch (phase) {
+    case Phase::Handshake: return "handshake";
+    case Phase::ResolveConnect: return "resolve+connect";
+    case Phase::Connect: return "connect";
+    case Phase::FirstByte: return "first byte";
+    case Phase::RoundTrip: return "round trip";
+    default: return "unknown";
+  }
+}
+
+struct Results {
+  // nanoseconds, up to 10s
+  std::array<Histogram, PhaseCount> phases;
+  uint64_t completed = 0;
+  uint64_t failed = 0;
+
+  Results() {
+    phases.fill(Histogram(10ull * 1000 * 1000 * 1000));
+  }
+};
+
+// every request starts with a frame of the connection id, the request size
+// and the response size, all big endian, so requests are never smaller
+constexpr size_t kFrameSize = 12;
+
+// answers every request with as many bytes as its frame asks for
+class Target final {
+ public:
+  uv_tcp_t tcp;
+  int port;
+  // the time each connection of the trace was accepted, by connection id
+  std::vector<uint64_t> accepted;
+
+  explicit Target(uv_loop_t* loop) {
+    uv_tcp_init(loop, &this->tcp);
+    this->tcp.data = this;
+    sockaddr_in addr{};
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_bind(&this->tcp, (const sockaddr*) &addr, 0);
+    int length = sizeof(addr);
+    uv_tcp_getsockname(&this->tcp, (sockaddr*) &addr, &length);
+    this->port = ntohs(addr.sin_port);
+    uv_listen(reinterpret_cast<uv_stream_t*>(&this->tcp), 1024, AcceptDone);
+  }
+
+ private:
+  struct Peer {
+    uv_tcp_t tcp;
+    Target* target;
+    uint64_t accepted_at;
+    bool identified;
+    std::string frame;
+    // bytes of the current request still to come after the frame
+    uint64_t left;
+    uint32_t response;
+  };
+
+  struct Write {
+    uv_write_t req;
+    std::string data;
+  };
+
+  static uint32_t ReadUint32(const char* data) {
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    return uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 | uint32_t(bytes[2]) << 8 | bytes[3];
+  }
+
+  static void AcceptDone(uv_stream_t* server, int status) {
+    if (status < 0) {
+      return;
+    }
+    auto peer = new Peer{};
+    peer->target = reinterpret_cast<Target*>(server->data);
+    uv_tcp_init(server->loop, &peer->tcp);
+    peer->tcp.data = peer;
+    if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&peer->tcp)) != 0) {
+      Close(peer);
+      return;
+    }
+    peer->accepted_at = uv_hrtime();
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&peer->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  ReadDone);
+  }
+
+  static void Close(Peer* peer) {
+    uv_close(reinterpret_cast<uv_handle_t*>(&peer->tcp), [](uv_handle_t* handle) {
+      delete reinterpret_cast<Peer*>(handle->data);
+    });
+  }
+
+  static void ReadDone(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    auto peer = reinterpret_cast<Peer*>(stream->data);
+    if (nread < 0) {
+      Close(peer);
+      return;
+    }
+    const char* data = buf->base;
+    size_t size = nread;
+    while (size > 0) {
+      if (peer->frame.size() < kFrameSize) {
+        size_t take = std::min(size, kFrameSize - peer->frame.size());
+        peer->frame.append(data, take);
+        data += take;
+        size -= take;
+        if (peer->frame.size() < kFrameSize) {
+          break;
+        }
+        uint32_t id = ReadUint32(&peer->frame[0]);
+        peer->left = ReadUint32(&peer->frame[4]) - kFrameSize;
+        peer->response = ReadUint32(&peer->frame[8]);
+        if (!peer->identified) {
+          peer->identified = true;
+          auto& accepted = peer->target->accepted;
+          accepted.resize(std::max<size_t>(accepted.size(), id + 1));
+          accepted[id] = peer->accepted_at;
+        }
+      }
+      size_t take = std::min<uint64_t>(size, peer->left);
+      peer->left -= take;
+      data += take;
+      size -= take;
+      if (peer->left == 0) {
+        peer->frame.clear();
+        auto write = new Write{};
+        write->data.assign(peer->response, 'r');
+        auto out = uv_buf_init(&write->data[0], write->data.size());
+        uv_write(&write->req, stream, &out, 1, [](uv_write_t* req, int status) {
+          delete reinterpret_cast<Write*>(req);
+        });
+      }
+    }
+  }
+};
+
+// one connection of the trace, opened at its time through the listener
+class Connection final {
+ public:
+  bool done;
+  bool failed;
+
+  Connection(uv_loop_t* loop, int port, const ServerConfig& config, const std::string& header,
+             const TraceConnection& trace, uint32_t id, const Target& target, Results& results)
+      : done(false), failed(false), config(config), header(header), trace(trace), id(id),
+        target(target), results(results), port(port), index(0), received(0), expected(0),
+        sent_at(0), started_at(0), first_byte(false), pending_closes(0) {
+    uv_timer_init(loop, &this->timer);
+    uv_tcp_init(loop, &this->tcp);
+    this->timer.data = this;
+    this->tcp.data = this;
+    this->connect.data = this;
+    uv_timer_start(&this->timer, [](uv_timer_t* timer) {
+      reinterpret_cast<Connection*>(timer->data)->Open();
+    }, trace.open, 0);
+  }
+
+  void Close() {
+    if (this->pending_closes > 0 || this->done) {
+      return;
+    }
+    this->pending_closes = 2;
+    for (auto handle : {reinterpret_cast<uv_handle_t*>(&this->tcp), reinterpret_cast<uv_handle_t*>(&this->timer)}) {
+      uv_close(handle, [](uv_handle_t* handle) {
+        auto connection = reinterpret_cast<Connection*>(handle->data);
+        connection->done = --connection->pending_closes == 0;
+      });
+    }
+  }
+
+ private:
+  uv_timer_t timer;
+  uv_tcp_t tcp;
+  uv_connect_t connect;
+
+  struct Write {
+    uv_write_t req;
+    std::string data;
+  };
+
+  const ServerConfig& config;
+  std::string header;
+  const TraceConnection& trace;
+  uint32_t id;
+  const Target& target;
+  Results& results;
+  int port;
+
+  std::unique_ptr<Cipher> cipher;
+  size_t index;
+  uint64_t received;
+  uint64_t expected;
+  uint64_t sent_at;
+  uint64_t started_at;
+  bool first_byte;
+  int pending_closes;
+
+  static void PutUint32(std::string& out, size_t offset, uint32_t value) {
+    out[offset] = char(value >> 24);
+    out[offset + 1] = char(value >> 16);
+    out[offset + 2] = char(value >> 8);
+    out[offset + 3] = char(value);
+  }
+
+  void Fail() {
+    this->failed = true;
+    this->results.failed++;
+    this->Close();
+  }
+
+  void Open() {
+    sockaddr_in addr{};
+    uv_ip4_addr("127.0.0.1", this->port, &addr);
+    this->started_at = uv_hrtime();
+    int err = uv_tcp_connect(&this->connect, &this->tcp, (const sockaddr*) &addr, ConnectDone);
+    if (err) {
+      this->Fail();
+    }
+  }
+
+  void Send() {
+    auto& exchange = this->trace.exchanges[this->index];
+    std::string plain(std::max<size_t>(exchange.request, kFrameSize), 'q');
+    PutUint32(plain, 0, this->id);
+    PutUint32(plain, 4, plain.size());
+    PutUint32(plain, 8, exchange.response);
+
+    auto write = new Write{};
+    if (this->cipher == nullptr) {
+      auto iv = Util::RandomBlock(this->config.cipher_info.iv_length);
+      this->cipher = Util::getEncryption(this->config.method, this->config.key, iv);
+      auto encrypted = this->cipher->encrypt(this->header + plain);
+      write->data = std::string(reinterpret_cast<char*>(iv.data()), iv.size()) +
+          std::string(reinterpret_cast<char*>(encrypted.data()), encrypted.size());
+      //the first response starts with the iv of the server
+      this->expected += this->config.cipher_info.iv_length;
+    } else {
+      auto encrypted = this->cipher->encrypt(plain);
+      write->data = std::string(reinterpret_cast<char*>(encrypted.data()), encrypted.size());
+    }
+    this->expected += exchange.response;
+    this->sent_at = uv_hrtime();
+
+    auto buf = uv_buf_init(&write->data[0], write->data.size());
+    uv_write(&write->req, reinterpret_cast<uv_stream_t*>(&this->tcp), &buf, 1, [](uv_write_t* req, int status) {
+      delete reinterpret_cast<Write*>(req);
+    });
+  }
+
+  void Received(size_t size) {
+    uint64_t now = uv_hrtime();
+    if (!this->first_byte) {
+      this->first_byte = true;
+      this->results.phases[Phase::FirstByte].Record(now - this->sent_at);
+      if (this->id < this->target.accepted.size() && this->target.accepted[this->id] >= this->sent_at) {
+        auto phase = this->trace.domain ? Phase::ResolveConnect : Phase::Connect;
+        this->results.phases[phase].Record(this->target.accepted[this->id] - this->sent_at);
+      }
+    }
+    this->received += size;
+    if (this->received < this->expected) {
+      return;
+    }
+    this->results.phases[Phase::RoundTrip].Record(now - this->sent_at);
+
+    auto think = this->trace.exchanges[this->index].think;
+    if (++this->index == this->trace.exchanges.size()) {
+      this->results.completed++;
+      this->Close();
+    } else if (think == 0) {
+      this->Send();
+    } else {
+      uv_timer_start(&this->timer, [](uv_timer_t* timer) {
+        reinterpret_cast<Connection*>(timer->data)->Send();
+      }, think, 0);
+    }
+  }
+
+  static void ConnectDone(uv_connect_t* req, int status) {
+    auto connection = reinterpret_cast<Connection*>(req->data);
+    if (status < 0) {
+      if (status != UV_ECANCELED) {
+        connection->Fail();
+      }
+      return;
+    }
+    connection->results.phases[Phase::Handshake].Record(uv_hrtime() - connection->started_at);
+    connection->Send();
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&connection->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    auto connection = reinterpret_cast<Connection*>(stream->data);
+                    if (nread < 0) {
+                      connection->Fail();
+                    } else if (nread > 0) {
+                      connection->Received(nread);
+                    }
+                  });
+  }
+};
+
+// opens every connection of the trace at its time and runs the loop until
+// all of them are done, connections still open at the timeout count as failed
+inline Results Replay(uv_loop_t* loop, int port, const ServerConfig& config, const Trace& trace,
+                      const Target& target, uint64_t timeout_ms = 60000) {
+  Results results;
+  auto ip_header = loopback::IPv4Header("127.0.0.1", target.port);
+  //resolving localhost stands in for a lookup of the destination
+  auto domain_header = loopback::DomainHeader("localhost", target.port);
+
+  std::vector<std::unique_ptr<Connection>> connections;
+  for (uint32_t id = 0; id < trace.size(); id++) {
+    connections.push_back(std::make_unique<Connection>(
+        loop, port, config, trace[id].domain ? domain_header : ip_header, trace[id], id, target, results));
+  }
+  auto all_done = [&] {
+    for (auto& connection : connections) {
+      if (!connection->done) {
+        return false;
+      }
+    }
+    return true;
+  };
+  if (!loopback::RunUntil(loop, all_done, timeout_ms)) {
+    for (auto& connection : connections) {
+      if (!connection->done && !connection->failed) {
+        results.failed++;
+      }
+      connection->Close();
+    }
+    loopback::RunUntil(loop, all_done);
+  }
+  return results;
+}
+
+// one line per phase: label, phase, count, p50, p90, p99, p999 and max in nanoseconds
+inline void WriteResults(std::ostream& out, const std::string& label, const Results& results) {
+  for (int phase = 0; phase < PhaseCount; phase++) {
+    auto& histogram = results.phases[phase];
+    out << label << '\t' << PhaseName(Phase(phase)) << '\t' << histogram.Count() << '\t'
+        << histogram.Percentile(0.50) << '\t' << histogram.Percentile(0.90) << '\t'
+        << histogram.Percentile(0.99) << '\t' << histogram.Percentile(0.999) << '\t'
+        << histogram.Max() << '\n';
+  }
+}
+
+// p99 and p999 by label and phase from the output of WriteResults
+inline std::map<std::pair<std::string, std::string>, std::pair<uint64_t, uint64_t>> ReadResults(std::istream& in) {
+  std::map<std::pair<std::string, std::string>, std::pair<uint64_t, uint64_t>> results;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields;
+    std::istringstream columns(line);
+    for (std::string field; std::getline(columns, field, '\t');) {
+      fields.push_back(field);
+    }
+    if (fields.size() == 8) {
+      results[{fields[0], fields[1]}] = {std::stoull(fields[5]), std::stoull(fields[6])};
+    }
+  }
+  return results;
+}
+
+}  // namespace replay
+}  // namespace shadesocks
+#endif //SHADESOCKS_TEST_SS_REPLAY_H_
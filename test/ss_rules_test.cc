@@ -0,0 +1,305 @@
+#include <cstdio>
+#include <random>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+static in_addr IPv4(const std::string& ip) {
+  in_addr addr{};
+  uv_inet_pton(AF_INET, ip.c_str(), &addr);
+  return addr;
+}
+
+static in6_addr IPv6(const std::string& ip) {
+  in6_addr addr{};
+  uv_inet_pton(AF_INET6, ip.c_str(), &addr);
+  return addr;
+}
+
+// the action of the rules, default included
+template<typename Address>
+static RuleAction Decide(const RuleSet& rules, const Address& address) {
+  auto action = rules.default_action;
+  rules.Match(address, action);
+  return action;
+}
+
+TEST(RuleSetTest, LongestPrefix) {
+  RuleSet rules;
+  rules.Add(RuleAction::Deny, "10.0.0.0/8");
+  rules.Add(RuleAction::Direct, "10.1.0.0/16");
+  rules.Add(RuleAction::Allow, "10.1.2.3");
+  rules.Add(RuleAction::Upstream, "192.168.0.0/24");
+  rules.Add(RuleAction::Direct, "2001:db8::/32");
+  rules.Add(RuleAction::Deny, "2001:db8:1::/48");
+  EXPECT_EQ(rules.Size(), 6);
+
+  EXPECT_EQ(Decide(rules, IPv4("10.200.0.1")), RuleAction::Deny);
+  EXPECT_EQ(Decide(rules, IPv4("10.1.200.1")), RuleAction::Direct);
+  EXPECT_EQ(Decide(rules, IPv4("10.1.2.3")), RuleAction::Allow);
+  EXPECT_EQ(Decide(rules, IPv4("10.1.2.4")), RuleAction::Direct);
+  EXPECT_EQ(Decide(rules, IPv4("192.168.0.255")), RuleAction::Upstream);
+  RuleAction action;
+  EXPECT_FALSE(rules.Match(IPv4("192.168.1.0"), action));
+  EXPECT_FALSE(rules.Match(IPv4("11.0.0.0"), action));
+  EXPECT_EQ(Decide(rules, IPv6("2001:db8:ffff::1")), RuleAction::Direct);
+  EXPECT_EQ(Decide(rules, IPv6("2001:db8:1::1")), RuleAction::Deny);
+  EXPECT_FALSE(rules.Match(IPv6("2001:db9::1"), action));
+
+  //a prefix of length zero matches everything the others do not
+  rules.Add(RuleAction::Upstream, "0.0.0.0/0");
+  EXPECT_EQ(Decide(rules, IPv4("11.0.0.0")), RuleAction::Upstream);
+  EXPECT_EQ(Decide(rules, IPv4("10.1.2.3")), RuleAction::Allow);
+}
+
+TEST(RuleSetTest, MatchesLinearScan) {
+  std::mt19937 random(7);
+  struct Prefix {
+    uint32_t prefix;
+    int length;
+    RuleAction action;
+  };
+  std::vector<Prefix> prefixes;
+  PrefixTree<uint32_t> tree;
+  //short prefixes below a few common ones so that they nest
+  for (int i = 0; i < 3000; i++) {
+    int length = random() % 33;
+    uint32_t prefix = (random() & 0x0fffffff) | (random() % 4) << 28;
+    prefix = length == 0 ? 0 : prefix & (~0u << (32 - length));
+    auto action = RuleAction(random() % 4);
+    //the later of two equal prefixes wins
+    for (auto& existing : prefixes) {
+      if (existing.prefix == prefix && existing.length == length) {
+        existing.length = -1;
+      }
+    }
+    prefixes.push_back({prefix, length, action});
+    tree.Add(prefix, length, action);
+  }
+  EXPECT_LT(tree.Nodes(), 2 * prefixes.size() + 1);
+
+  for (int i = 0; i < 100000; i++) {
+    uint32_t key = (random() & 0x0fffffff) | (random() % 4) << 28;
+    int best = -1;
+    RuleAction expected = RuleAction::Allow;
+    for (auto& prefix : prefixes) {
+      if (prefix.length > best && (prefix.length == 0 || (key ^ prefix.prefix) >> (32 - prefix.length) == 0)) {
+        best = prefix.length;
+        expected = prefix.action;
+      }
+    }
+    RuleAction action = RuleAction::Allow;
+    ASSERT_EQ(tree.Match(key, action), best >= 0) << key;
+    ASSERT_EQ(action, expected) << key;
+  }
+}
+
+TEST(RuleSetTest, DomainSuffix) {
+  RuleSet rules;
+  rules.Add(RuleAction::Deny, "example.com");
+  rules.Add(RuleAction::Direct, "cdn.example.com");
+  rules.Add(RuleAction::Upstream, "org");
+
+  EXPECT_EQ(Decide(rules, std::string("example.com")), RuleAction::Deny);
+  EXPECT_EQ(Decide(rules, std::string("www.example.com")), RuleAction::Deny);
+  EXPECT_EQ(Decide(rules, std::string("a.cdn.example.com")), RuleAction::Direct);
+  EXPECT_EQ(Decide(rules, std::string("WWW.Example.COM.")), RuleAction::Deny);
+  EXPECT_EQ(Decide(rules, std::string("wikipedia.org")), RuleAction::Upstream);
+  RuleAction action;
+  EXPECT_FALSE(rules.Match(std::string("badexample.com"), action));
+  EXPECT_FALSE(rules.Match(std::string("com"), action));
+  EXPECT_FALSE(rules.Match(std::string(""), action));
+}
+
+TEST(RuleSetTest, Parse) {
+  std::istringstream in("# comment\n"
+                        "\n"
+                        "deny 10.0.0.0/8   # private\n"
+                        "direct ::1\n"
+                        "upstream example.com\n"
+                        "default deny\n");
+  auto rules = RuleSet::Parse(in);
+  EXPECT_EQ(rules.Size(), 3);
+  EXPECT_EQ(rules.default_action, RuleAction::Deny);
+  EXPECT_EQ(Decide(rules, IPv6("::1")), RuleAction::Direct);
+  EXPECT_EQ(Decide(rules, std::string("example.com")), RuleAction::Upstream);
+
+  for (auto line : {"drop 10.0.0.0/8", "deny", "deny 10.0.0.0/33", "deny 10.0.0.0/x", "deny example.com/8",
+                    "deny a b", "default block"}) {
+    std::istringstream bad(std::string("deny 10.0.0.0/8\n") + line);
+    try {
+      RuleSet::Parse(bad);
+      ADD_FAILURE() << line;
+    } catch (const InvalidArgument& e) {
+      EXPECT_NE(std::string(e.what()).find("line 2"), std::string::npos) << e.what();
+    }
+  }
+  EXPECT_THROW(RuleSet::Load("/nonexistent/rules"), InvalidArgument);
+}
+
+TEST(RuleSetTest, Swap) {
+  RuleTable table;
+  auto before = table.Current();
+  RuleSet rules;
+  rules.Add(RuleAction::Deny, "10.0.0.0/8");
+  table.Swap(std::move(rules));
+  auto after = table.Current();
+  EXPECT_EQ(Decide(*after, IPv4("10.0.0.1")), RuleAction::Deny);
+  //a connection holding the old rules still sees them
+  EXPECT_EQ(Decide(*before, IPv4("10.0.0.1")), RuleAction::Allow);
+  EXPECT_THROW(table.Load("/nonexistent/rules"), InvalidArgument);
+  EXPECT_EQ(table.Current(), after);
+}
+
+TEST(RuleSetTest, MatchHostLiterals) {
+  std::istringstream in("deny 10.0.0.0/8\n"
+                        "direct 2001:db8::/32\n"
+                        "upstream example.com\n");
+  auto rules = RuleSet::Parse(in);
+  RuleAction action;
+  ASSERT_TRUE(rules.MatchHost("10.0.0.1", action));
+  EXPECT_EQ(action, RuleAction::Deny);
+  ASSERT_TRUE(rules.MatchHost("2001:db8::1", action));
+  EXPECT_EQ(action, RuleAction::Direct);
+  ASSERT_TRUE(rules.MatchHost("www.example.com", action));
+  EXPECT_EQ(action, RuleAction::Upstream);
+  EXPECT_FALSE(rules.MatchHost("11.0.0.1", action));
+}
+
+// rule sets of the size of real block lists, compiled once and matched
+// against random addresses and names
+TEST(RuleSetTest, MatchesPerSecond) {
+  const size_t count = 200000;
+  std::mt19937 random(11);
+  RuleSet rules;
+  auto start = uv_hrtime();
+  for (size_t i = 0; i < count; i++) {
+    char cidr[32];
+    uint32_t ip = random();
+    int length = 16 + random() % 17;
+    snprintf(cidr, sizeof(cidr), "%u.%u.%u.%u/%d", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, length);
+    rules.Add(RuleAction::Deny, cidr);
+    rules.Add(RuleAction::Direct, "host" + std::to_string(random() % (count * 4)) + ".tracker" + std::to_string(i % 1000) + ".com");
+  }
+  LOG(INFO) << "compiled " << rules.Size() << " rules in " << (uv_hrtime() - start) / 1000000 << "ms";
+
+  const size_t lookups = 1000000;
+  std::vector<in_addr> addresses(lookups);
+  for (auto& address : addresses) {
+    address.s_addr = random();
+  }
+  std::vector<std::string> names;
+  for (size_t i = 0; i < lookups / 10; i++) {
+    names.push_back("www.host" + std::to_string(random() % (count * 4)) + ".tracker" + std::to_string(i % 1000) + ".com");
+  }
+
+  size_t matched = 0;
+  RuleAction action;
+  start = uv_hrtime();
+  for (auto& address : addresses) {
+    matched += rules.Match(address, action);
+  }
+  auto elapsed = (uv_hrtime() - start) / 1e9;
+  LOG(INFO) << "IPv4: " << lookups / elapsed << " matches per second, " << matched << " matched";
+
+  matched = 0;
+  start = uv_hrtime();
+  for (int round = 0; round < 10; round++) {
+    for (auto& name : names) {
+      matched += rules.Match(name, action);
+    }
+  }
+  elapsed = (uv_hrtime() - start) / 1e9;
+  LOG(INFO) << "domains: " << lookups / elapsed << " matches per second, " << matched << " matched";
+}
+
+// a listener with rules in front of an echo server
+class RulesTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::unique_ptr<loopback::EchoServer> target;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    target = std::make_unique<loopback::EchoServer>(loop->get());
+  }
+
+  // the plain response, empty when the connection was closed
+  static std::string Relay(const std::shared_ptr<TCPHandle>& listener, const std::string& header) {
+    auto& config = listener->get_config();
+    loopback::Client client(loop->get(), listener->get_port(), loopback::EncodeRequest(config, header + "ping"));
+    loopback::RunUntil(loop->get(), [&] {
+      return client.closed || client.received.size() >= size_t(config.cipher_info.iv_length) + 4;
+    });
+    client.Close();
+    loopback::RunUntil(loop->get(), [&] { return client.closed; });
+    return loopback::DecodeResponse(config, client.received);
+  }
+};
+
+std::shared_ptr<Loop> RulesTest::loop;
+std::unique_ptr<loopback::EchoServer> RulesTest::target;
+
+TEST_F(RulesTest, DeniesAddressesInDomainHeaders) {
+  std::istringstream in("deny 127.0.0.0/8\n");
+  ServerConfig config;
+  config.rules = std::make_shared<RuleTable>(RuleSet::Parse(in));
+  auto listener = loopback::Listen(loop, config);
+
+  auto denied = Stats::Local().Errors(ErrorType::DeniedError);
+  //a literal sent as a domain, a short form only the lookup understands and
+  //a name, all of which end up at 127.0.0.1
+  for (auto host : {"127.0.0.1", "127.1", "localhost"}) {
+    EXPECT_EQ(Relay(listener, loopback::DomainHeader(host, target->port)), "") << host;
+  }
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::DeniedError), denied + 3);
+  loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+}
+
+TEST_F(RulesTest, DenyAndSwap) {
+  std::istringstream in("deny 127.0.0.0/8\n"
+                        "deny localhost\n");
+  ServerConfig config;
+  config.rules = std::make_shared<RuleTable>(RuleSet::Parse(in));
+  auto listener = loopback::Listen(loop, config);
+
+  auto denied = Stats::Local().Errors(ErrorType::DeniedError);
+  EXPECT_EQ(Relay(listener, loopback::IPv4Header("127.0.0.1", target->port)), "");
+  EXPECT_EQ(Relay(listener, loopback::DomainHeader("localhost", target->port)), "");
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::DeniedError), denied + 2);
+
+  //the listener picks the new rules up with the next connection
+  std::istringstream allow("allow 127.0.0.1\n"
+                           "default deny\n");
+  listener->get_config().rules->Swap(RuleSet::Parse(allow));
+  EXPECT_EQ(Relay(listener, loopback::IPv4Header("127.0.0.1", target->port)), "ping");
+  EXPECT_EQ(Relay(listener, loopback::DomainHeader("localhost", target->port)), "");
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::DeniedError), denied + 3);
+  loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+}
+
+TEST_F(RulesTest, DirectBypassesUpstreams) {
+  //every request sent to the upstream would fail
+  auto pool = std::make_shared<UpstreamPool>();
+  pool->Add("127.0.0.1", loopback::ClosedPort(loop->get()), "aes-256-cfb", "dead");
+  std::istringstream in("direct localhost\n");
+  ServerConfig config;
+  config.upstream = pool;
+  config.rules = std::make_shared<RuleTable>(RuleSet::Parse(in));
+  auto listener = loopback::Listen(loop, config);
+
+  EXPECT_EQ(Relay(listener, loopback::DomainHeader("localhost", target->port)), "ping");
+  EXPECT_EQ(Relay(listener, loopback::IPv4Header("127.0.0.1", target->port)), "");
+  pool->Stop();
+  loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,181 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+class SchedulerTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::shared_ptr<TCPHandle> listener;
+  static std::unique_ptr<loopback::EchoServer> target;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    listener = loop->create_tcp_handle();
+    listener->bind("127.0.0.1", 0);
+    listener->listen();
+    target = std::make_unique<loopback::EchoServer>(loop->get());
+  }
+
+  void TearDown() override {
+    Scheduler::Local().Stop();
+    uv_run(loop->get(), UV_RUN_NOWAIT);
+  }
+
+  // p99 round trip of small requests while bulk transfers share the loop
+  uint64_t MixedTraffic(const std::string& name) {
+    auto& config = listener->get_config();
+    auto header = loopback::IPv4Header("127.0.0.1", target->port);
+
+    std::vector<std::unique_ptr<loopback::Client>> bulk;
+    for (int i = 0; i < 8; i++) {
+      bulk.push_back(std::make_unique<loopback::Client>(
+          loop->get(), listener->get_port(),
+          loopback::EncodeRequest(config, header + std::string(8 * 1024 * 1024, 'b'))));
+    }
+    std::vector<std::unique_ptr<loopback::PingClient>> pings;
+    for (int i = 0; i < 8; i++) {
+      pings.push_back(std::make_unique<loopback::PingClient>(
+          loop->get(), listener->get_port(), config, header, 64, 200));
+    }
+
+    EXPECT_TRUE(loopback::RunUntil(loop->get(), [&] {
+      for (auto& ping : pings) {
+        if (!ping->closed) {
+          return false;
+        }
+      }
+      return true;
+    }, 60000));
+
+    std::vector<uint64_t> latencies;
+    for (auto& ping : pings) {
+      EXPECT_EQ(ping->latencies.size(), 200);
+      latencies.insert(latencies.end(), ping->latencies.begin(), ping->latencies.end());
+    }
+    for (auto& client : bulk) {
+      client->Close();
+    }
+    loopback::RunUntil(loop->get(), [&] { return BufferPool::Local().InUse() == 0; });
+
+    auto p50 = loopback::Percentile(latencies, 0.50);
+    auto p99 = loopback::Percentile(latencies, 0.99);
+    LOG(INFO) << name << ": small request p50 " << p50 / 1000 << "us, p99 " << p99 / 1000 << "us, "
+              << "deferred chunks " << Scheduler::Local().Deferred();
+    return p99;
+  }
+};
+
+std::shared_ptr<Loop> SchedulerTest::loop;
+std::shared_ptr<TCPHandle> SchedulerTest::listener;
+std::unique_ptr<loopback::EchoServer> SchedulerTest::target;
+
+TEST_F(SchedulerTest, InteractiveBeforeBulk) {
+  auto before = MixedTraffic("without scheduler");
+
+  SchedulerOptions options;
+  options.budget = 128 * 1024;
+  Scheduler::Local().Start(loop->get(), options);
+  auto after = MixedTraffic("with scheduler");
+
+  LOG(INFO) << "p99 before " << before / 1000 << "us, after " << after / 1000 << "us";
+}
+
+TEST_F(SchedulerTest, BudgetDefersWork) {
+  SchedulerOptions options;
+  options.budget = 10;
+  options.interactive_size = 4;
+  auto& scheduler = Scheduler::Local();
+  scheduler.Start(loop->get(), options);
+
+  std::vector<int> order;
+  auto run = [](void* owner, int tag) {
+    reinterpret_cast<std::vector<int>*>(owner)->push_back(tag);
+  };
+  scheduler.Push(&order, run, 1, 8);
+  scheduler.Push(&order, run, 2, 8);
+  scheduler.Push(&order, run, 3, 2);
+  ASSERT_EQ(scheduler.Queued(), 3);
+
+  //the interactive chunk runs first, the second bulk chunk waits a round
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  ASSERT_EQ(order, std::vector<int>({3, 1}));
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  ASSERT_EQ(order, std::vector<int>({3, 1, 2}));
+  ASSERT_EQ(scheduler.Queued(), 0);
+}
+
+TEST_F(SchedulerTest, CountsDeferredChunksOnce) {
+  SchedulerOptions options;
+  options.budget = 10;
+  auto& scheduler = Scheduler::Local();
+  scheduler.Start(loop->get(), options);
+  auto deferred = scheduler.Deferred();
+
+  std::vector<int> order;
+  auto run = [](void* owner, int tag) {
+    reinterpret_cast<std::vector<int>*>(owner)->push_back(tag);
+  };
+  //pushes a chunk of its own while it runs, which is not due before the next round
+  auto push = [](void* owner, int tag) {
+    reinterpret_cast<std::vector<int>*>(owner)->push_back(tag);
+    Scheduler::Local().Push(owner, [](void* owner, int tag) {
+      reinterpret_cast<std::vector<int>*>(owner)->push_back(tag);
+    }, tag * 10, 10);
+  };
+  scheduler.Push(&order, push, 1, 10);
+  scheduler.Push(&order, run, 2, 10);
+  scheduler.Push(&order, run, 3, 10);
+
+  //the second and the third chunk were due, the pushed one was not
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  EXPECT_EQ(scheduler.Deferred(), deferred + 2);
+  //the pushed chunk is due now, the third one waits another round without being counted again
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  EXPECT_EQ(scheduler.Deferred(), deferred + 3);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  ASSERT_EQ(order, std::vector<int>({1, 2, 3, 10}));
+  EXPECT_EQ(scheduler.Deferred(), deferred + 3);
+  ASSERT_EQ(scheduler.Queued(), 0u);
+}
+
+TEST_F(SchedulerTest, CancelOwner) {
+  auto& scheduler = Scheduler::Local();
+  scheduler.Start(loop->get());
+
+  std::vector<int> order;
+  std::vector<int> other;
+  auto run = [](void* owner, int tag) {
+    reinterpret_cast<std::vector<int>*>(owner)->push_back(tag);
+  };
+  scheduler.Push(&order, run, 1, 100);
+  scheduler.Push(&other, run, 2, 100 * 1024);
+  scheduler.Cancel(&order);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  ASSERT_TRUE(order.empty());
+  ASSERT_EQ(other, std::vector<int>({2}));
+}
+
+TEST_F(SchedulerTest, Restart) {
+  auto& scheduler = Scheduler::Local();
+  //the handles of the first start are still closing when the second one starts
+  scheduler.Start(loop->get());
+  scheduler.Start(loop->get());
+
+  std::vector<int> order;
+  scheduler.Push(&order, [](void* owner, int tag) {
+    reinterpret_cast<std::vector<int>*>(owner)->push_back(tag);
+  }, 1, 100);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+  ASSERT_EQ(order, std::vector<int>({1}));
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,120 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+int GetOption(uv_tcp_t* handle, int level, int name) {
+  uv_os_fd_t fd;
+  uv_fileno(reinterpret_cast<uv_handle_t*>(handle), &fd);
+  int value = 0;
+  socklen_t length = sizeof(value);
+  getsockopt(fd, level, name, &value, &length);
+  return value;
+}
+
+TEST(SocketProfileTest, Presets) {
+  ASSERT_TRUE(SocketProfile::Preset("default").Empty());
+  ASSERT_TRUE(SocketProfile::Preset("interactive").nodelay);
+  ASSERT_GT(SocketProfile::Preset("bulk").receive_buffer, 0);
+  ASSERT_THROW(SocketProfile::Preset("unknown"), InvalidArgument);
+}
+
+TEST(SocketProfileTest, ApplyInteractive) {
+  auto loop = Loop::getDefault();
+  uv_tcp_t tcp;
+  uv_tcp_init_ex(loop->get(), &tcp, AF_INET);
+
+  auto profile = SocketProfile::Interactive();
+  ASSERT_EQ(profile.Apply(&tcp), 0);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_NODELAY), 1);
+  EXPECT_EQ(GetOption(&tcp, SOL_SOCKET, SO_KEEPALIVE), 1);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_KEEPIDLE), profile.keepalive_idle);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_KEEPINTVL), profile.keepalive_interval);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_KEEPCNT), profile.keepalive_count);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_NOTSENT_LOWAT), profile.notsent_lowat);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_USER_TIMEOUT), profile.user_timeout);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_IP, IP_TOS), profile.tos);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+TEST(SocketProfileTest, ApplyBulk) {
+  auto loop = Loop::getDefault();
+  uv_tcp_t tcp;
+  uv_tcp_init_ex(loop->get(), &tcp, AF_INET);
+  auto before = GetOption(&tcp, SOL_SOCKET, SO_RCVBUF);
+
+  auto profile = SocketProfile::Bulk();
+  ASSERT_EQ(profile.Apply(&tcp), 0);
+  //the kernel caps the size at net.core.rmem_max
+  LOG(INFO) << "receive buffer " << before << " -> " << GetOption(&tcp, SOL_SOCKET, SO_RCVBUF);
+  EXPECT_GE(GetOption(&tcp, SOL_SOCKET, SO_RCVBUF), before);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_NODELAY), 0);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_IP, IP_TOS), profile.tos);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+TEST(SocketProfileTest, UnknownCongestion) {
+  auto loop = Loop::getDefault();
+  uv_tcp_t tcp;
+  uv_tcp_init_ex(loop->get(), &tcp, AF_INET);
+
+  //the error is reported but the other options are still set
+  SocketProfile profile;
+  profile.nodelay = true;
+  profile.congestion = "no-such-algorithm";
+  ASSERT_NE(profile.Apply(&tcp), 0);
+  EXPECT_EQ(GetOption(&tcp, IPPROTO_TCP, TCP_NODELAY), 1);
+
+  uv_close(reinterpret_cast<uv_handle_t*>(&tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+// latency of small round trips and throughput of a transfer through a
+// listener which uses the preset on both sides
+TEST(SocketProfileTest, PresetBenchmark) {
+  auto loop = Loop::getDefault();
+  loopback::EchoServer target(loop->get());
+  for (auto name : {"default", "interactive", "bulk"}) {
+    ServerConfig config;
+    config.inbound_profile = SocketProfile::Preset(name);
+    config.outbound_profile = SocketProfile::Preset(name);
+    auto listener = loopback::Listen(loop, config);
+
+    auto& listener_config = listener->get_config();
+    auto header = loopback::IPv4Header("127.0.0.1", target.port);
+
+    loopback::PingClient ping(loop->get(), listener->get_port(), listener_config, header, 100, 1000);
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return ping.closed; }, 60000));
+    ASSERT_EQ(ping.latencies.size(), 1000);
+
+    const size_t size = 64 * 1024 * 1024;
+    auto start = uv_hrtime();
+    loopback::Client bulk(loop->get(), listener->get_port(),
+                          loopback::EncodeRequest(listener_config, header + std::string(size, 'b')));
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] {
+      return bulk.received.size() >= listener_config.cipher_info.iv_length + size;
+    }, 60000));
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+    bulk.Close();
+    loopback::RunUntil(loop->get(), [&] { return bulk.closed && BufferPool::Local().InUse() == 0; });
+
+    LOG(INFO) << name << ": round trip p50 " << loopback::Percentile(ping.latencies, 0.5) / 1000
+              << "us, p99 " << loopback::Percentile(ping.latencies, 0.99) / 1000 << "us, "
+              << "echo throughput " << 2 * size / elapsed / 1024 / 1024 << " MB/s";
+  }
+  uv_close(reinterpret_cast<uv_handle_t*>(&target.tcp), nullptr);
+  uv_run(loop->get(), UV_RUN_NOWAIT);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,133 @@
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+class UnixSocketTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Loop> loop = Loop::getDefault();
+
+  static std::string Path(const std::string& name) {
+    return "/tmp/ss_unix_test." + std::to_string(getpid()) + "." + name;
+  }
+
+  // on 127.0.0.1, or on a Unix domain socket when a path is given
+  std::shared_ptr<TCPHandle> Listen(const ServerConfig& config, const std::string& path = "") {
+    if (path.empty()) {
+      return loopback::Listen(loop, config);
+    }
+    auto listener = loop->create_unix_handle();
+    listener->set_config(config);
+    listener->bind_path(path);
+    listener->listen();
+    loopback::Listeners().push_back(listener);
+    return listener;
+  }
+};
+
+TEST_F(UnixSocketTest, Listener) {
+  loopback::ReplyServer target(loop->get(), "");
+  auto path = Path("listener");
+  auto listener = Listen(ServerConfig(), path);
+  EXPECT_EQ(listener->get_port(), 0);
+  auto& config = listener->get_config();
+
+  loopback::Client client(loop->get(), path,
+                          loopback::EncodeRequest(config, loopback::IPv4Header("127.0.0.1", target.port) + "hello"),
+                          false, true);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+  EXPECT_EQ(loopback::DecodeResponse(config, client.received), "5");
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [] { return Stats::Local().LiveConnections() == 0; }));
+  listener->stop();
+  unlink(path.c_str());
+}
+
+TEST_F(UnixSocketTest, LocalDestinations) {
+  auto path = Path("backend");
+  loopback::ReplyServer backend(loop->get(), "", path);
+  ServerConfig config;
+  //domains need no lookup, hosts are matched without regard to case
+  config.local_destinations.Add("Backend.Local", 80, path);
+  config.local_destinations.Add("127.0.0.2", 81, path);
+  auto listener = Listen(config);
+  auto& listener_config = listener->get_config();
+  Stats::Local().Reset();
+
+  for (auto header : {loopback::DomainHeader("backend.local", 80), loopback::IPv4Header("127.0.0.2", 81)}) {
+    loopback::Client client(loop->get(), listener->get_port(), loopback::EncodeRequest(listener_config, header + "hello"),
+                            false, true);
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }));
+    EXPECT_EQ(loopback::DecodeResponse(listener_config, client.received), "5");
+  }
+  EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+  //only the ports given are mapped
+  EXPECT_EQ(listener_config.local_destinations.Find("127.0.0.2", 82), nullptr);
+
+  //nothing can connect at the path any more
+  unlink(path.c_str());
+  loopback::Client refused(loop->get(), listener->get_port(),
+                           loopback::EncodeRequest(listener_config, loopback::IPv4Header("127.0.0.2", 81) + "hello"),
+                           false, true);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return refused.closed; }));
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::ConnectError), 1);
+  listener->stop();
+}
+
+// the relay over Unix domain sockets on both sides against TCP over 127.0.0.1
+// on both sides: one upload for the throughput, and small echoed requests
+// one after another for the latency
+TEST_F(UnixSocketTest, LoopbackBenchmark) {
+  const size_t size = 128 * 1024 * 1024;
+  const int rounds = 2000;
+
+  for (bool local : {false, true}) {
+    auto listen_path = local ? Path("bench") : "";
+    auto target_path = local ? Path("target") : "";
+    auto echo_path = local ? Path("echo") : "";
+    loopback::ReplyServer target(loop->get(), "", target_path);
+    loopback::EchoServer echo(loop->get(), echo_path);
+    ServerConfig config;
+    if (local) {
+      config.local_destinations.Add("target.local", 80, target_path);
+      config.local_destinations.Add("echo.local", 80, echo_path);
+    }
+    auto listener = Listen(config, listen_path);
+    auto& listener_config = listener->get_config();
+    auto target_header = local ? loopback::DomainHeader("target.local", 80) : loopback::IPv4Header("127.0.0.1", target.port);
+    auto echo_header = local ? loopback::DomainHeader("echo.local", 80) : loopback::IPv4Header("127.0.0.1", echo.port);
+    auto dial = [&](std::string request) {
+      return local ? std::make_unique<loopback::Client>(loop->get(), listen_path, std::move(request), false, true)
+                  : std::make_unique<loopback::Client>(loop->get(), listener->get_port(), std::move(request), false, true);
+    };
+
+    auto start = uv_hrtime();
+    auto upload = dial(loopback::EncodeRequest(listener_config, target_header + std::string(size, 'u')));
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return upload->closed; }, 120000));
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+    ASSERT_EQ(loopback::DecodeResponse(listener_config, upload->received), std::to_string(size));
+
+    loopback::PingClient ping(loop->get(), listener->get_port(), listener_config, echo_header, 64, rounds, listen_path);
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return ping.closed; }, 60000));
+    ASSERT_EQ(ping.latencies.size(), rounds);
+
+    LOG(INFO) << (local ? "unix" : "tcp") << ": " << size / elapsed / 1024 / 1024 << " MB/s, round trip p50 "
+              << loopback::Percentile(ping.latencies, 0.5) / 1000.0 << "us, p99 "
+              << loopback::Percentile(ping.latencies, 0.99) / 1000.0 << "us";
+
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [] { return Stats::Local().LiveConnections() == 0; }));
+    uv_close(reinterpret_cast<uv_handle_t*>(&echo.tcp), nullptr);
+    listener->stop();
+    for (auto& path : {listen_path, target_path, echo_path}) {
+      unlink(path.c_str());
+    }
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
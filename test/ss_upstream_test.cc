@@ -0,0 +1,297 @@
+#include <set>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+TEST(UpstreamPoolTest, Add) {
+  UpstreamPool pool;
+  pool.Add("127.0.0.1", 8388, "aes-256-cfb", "one");
+  ASSERT_EQ(pool.Size(), 1);
+  EXPECT_EQ(ntohs(pool.At(0).addr.sin_port), 8388);
+  EXPECT_THROW(pool.Add("localhost", 8388, "aes-256-cfb", "one"), InvalidArgument);
+  EXPECT_THROW(pool.Add("127.0.0.1", 8388, "rc4", "one"), InvalidArgument);
+}
+
+TEST(UpstreamPoolTest, Pick) {
+  UpstreamPool pool;
+  for (int port : {1001, 1002, 1003}) {
+    pool.Add("127.0.0.1", port, "aes-256-cfb", "one");
+  }
+  //nothing measured yet, the upstreams are taken in turns
+  std::set<size_t> picked;
+  for (int i = 0; i < 3; i++) {
+    picked.insert(pool.Pick());
+  }
+  EXPECT_EQ(picked.size(), 3);
+
+  pool.Report(0, true, 5 * 1000 * 1000);
+  pool.Report(1, true, 1 * 1000 * 1000);
+  pool.Report(2, true, 2 * 1000 * 1000);
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(pool.Pick(), 1);
+  }
+
+  //failures weigh more than a few milliseconds
+  pool.Report(1, false, 0);
+  EXPECT_EQ(pool.Pick(), 2);
+  EXPECT_TRUE(pool.At(1).healthy);
+
+  //an unhealthy upstream is skipped until it connects again
+  pool.Report(1, false, 0);
+  pool.Report(1, false, 0);
+  EXPECT_FALSE(pool.At(1).healthy);
+  for (int i = 0; i < 20; i++) {
+    pool.Report(1, true, 1000);
+  }
+  EXPECT_TRUE(pool.At(1).healthy);
+  EXPECT_EQ(pool.Pick(), 1);
+}
+
+// a stopped listener leaves nothing behind which keeps the loop running
+TEST(UpstreamPoolTest, StopsWithListener) {
+  auto loop = Loop::getDefault();
+  auto upstream = loop->create_tcp_handle();
+  upstream->set_config(ServerConfig("aes-256-cfb", "upstream"));
+  upstream->bind("127.0.0.1", 0);
+  upstream->listen();
+  auto pool = std::make_shared<UpstreamPool>();
+  pool->Add("127.0.0.1", upstream->get_port(), "aes-256-cfb", "upstream");
+  ServerConfig config;
+  config.upstream = pool;
+  auto entry = loop->create_tcp_handle();
+  entry->set_config(config);
+  entry->bind("127.0.0.1", 0);
+  entry->listen();
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return pool->Idle(0) == 2; }));
+
+  entry->stop();
+  upstream->stop();
+  //stops the loop instead of hanging if something is left, it does not keep the loop running itself
+  bool hung = false;
+  uv_timer_t watchdog;
+  uv_timer_init(loop->get(), &watchdog);
+  watchdog.data = &hung;
+  uv_timer_start(&watchdog, [](uv_timer_t* timer) {
+    *reinterpret_cast<bool*>(timer->data) = true;
+    uv_stop(timer->loop);
+  }, 5000, 0);
+  uv_unref(reinterpret_cast<uv_handle_t*>(&watchdog));
+  loop->run();
+  EXPECT_FALSE(hung);
+  EXPECT_EQ(pool->Idle(0), 0u);
+  uv_close(reinterpret_cast<uv_handle_t*>(&watchdog), nullptr);
+  loop->run(UV_RUN_NOWAIT);
+}
+
+// an upstream answering every connection with the same reply once the request
+// arrives, its iv a byte per write so the entry has to put it together
+class TricklingUpstream final {
+ public:
+  uv_tcp_t tcp;
+  int port;
+
+  TricklingUpstream(uv_loop_t* loop, const ServerConfig& config, const std::string& reply)
+      : tcp(), reply(loopback::EncodeRequest(config, reply)), iv_length(config.cipher_info.iv_length) {
+    this->port = loopback::Bind(loop, &this->tcp, nullptr, "");
+    this->tcp.data = this;
+    uv_listen(reinterpret_cast<uv_stream_t*>(&this->tcp), 128, Accepted);
+  }
+
+  ~TricklingUpstream() {
+    uv_close(reinterpret_cast<uv_handle_t*>(&this->tcp), nullptr);
+    uv_run(this->tcp.loop, UV_RUN_NOWAIT);
+  }
+
+ private:
+  struct Connection {
+    uv_tcp_t tcp;
+    uv_timer_t timer;
+    TricklingUpstream* server;
+    size_t sent;
+    bool replying;
+  };
+
+  std::string reply;
+  size_t iv_length;
+
+  static void Accepted(uv_stream_t* server, int status) {
+    auto peer = new Connection{};
+    peer->server = reinterpret_cast<TricklingUpstream*>(server->data);
+    uv_tcp_init(server->loop, &peer->tcp);
+    uv_timer_init(server->loop, &peer->timer);
+    peer->tcp.data = peer;
+    peer->timer.data = peer;
+    if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&peer->tcp)) != 0) {
+      Close(peer);
+      return;
+    }
+    //every byte in a segment of its own
+    uv_tcp_nodelay(&peer->tcp, 1);
+    uv_read_start(reinterpret_cast<uv_stream_t*>(&peer->tcp),
+                  [](uv_handle_t*, size_t suggested_size, uv_buf_t* buf) {
+                    static char slab[64 * 1024];
+                    *buf = uv_buf_init(slab, sizeof(slab));
+                  },
+                  [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+                    auto peer = reinterpret_cast<Connection*>(stream->data);
+                    if (nread > 0 && !peer->replying) {
+                      peer->replying = true;
+                      uv_timer_start(&peer->timer, Trickle, 2, 2);
+                    } else if (nread < 0) {
+                      Close(peer);
+                    }
+                  });
+  }
+
+  //a byte of the iv every tick, then the rest at once
+  static void Trickle(uv_timer_t* timer) {
+    auto peer = reinterpret_cast<Connection*>(timer->data);
+    auto& reply = peer->server->reply;
+    auto count = peer->sent < peer->server->iv_length ? 1 : reply.size() - peer->sent;
+    auto req = new uv_write_t{};
+    auto buf = uv_buf_init(&reply[peer->sent], count);
+    uv_write(req, reinterpret_cast<uv_stream_t*>(&peer->tcp), &buf, 1, [](uv_write_t* req, int status) {
+      delete req;
+    });
+    peer->sent += count;
+    if (peer->sent == reply.size()) {
+      uv_timer_stop(timer);
+    }
+  }
+
+  //the close callbacks run in order, the timer is closed before the connection is freed
+  static void Close(Connection* peer) {
+    uv_close(reinterpret_cast<uv_handle_t*>(&peer->timer), nullptr);
+    uv_close(reinterpret_cast<uv_handle_t*>(&peer->tcp), [](uv_handle_t* handle) {
+      delete reinterpret_cast<Connection*>(handle->data);
+    });
+  }
+};
+
+// an entry listener forwarding to upstream listeners in front of an echo server
+class UpstreamTest : public ::testing::Test {
+ protected:
+  static std::shared_ptr<Loop> loop;
+  static std::unique_ptr<loopback::EchoServer> target;
+
+  static void SetUpTestSuite() {
+    loop = Loop::getDefault();
+    target = std::make_unique<loopback::EchoServer>(loop->get());
+  }
+
+  // the plain response of the entry listener to one request
+  static std::string Relay(const std::shared_ptr<TCPHandle>& entry, const std::string& header,
+                           const std::string& payload) {
+    auto& config = entry->get_config();
+    loopback::Client client(loop->get(), entry->get_port(), loopback::EncodeRequest(config, header + payload));
+    loopback::RunUntil(loop->get(), [&] {
+      return client.closed || client.received.size() >= config.cipher_info.iv_length + payload.size();
+    }, 10000);
+    client.Close();
+    loopback::RunUntil(loop->get(), [&] { return client.closed; });
+    return loopback::DecodeResponse(config, client.received);
+  }
+
+  static void Stop(UpstreamPool& pool) {
+    pool.Stop();
+    loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; });
+  }
+};
+
+std::shared_ptr<Loop> UpstreamTest::loop;
+std::unique_ptr<loopback::EchoServer> UpstreamTest::target;
+
+TEST_F(UpstreamTest, ChainsThroughUpstreams) {
+  //every hop has its own method and password
+  auto first = loopback::Listen(loop, ServerConfig("chacha20-ietf", "first"));
+  auto second = loopback::Listen(loop, ServerConfig("aes-128-ctr", "second"));
+  auto pool = std::make_shared<UpstreamPool>();
+  pool->Add("127.0.0.1", first->get_port(), "chacha20-ietf", "first");
+  pool->Add("127.0.0.1", second->get_port(), "aes-128-ctr", "second");
+  ServerConfig config("aes-256-cfb", "entry");
+  config.upstream = pool;
+  auto entry = loopback::Listen(loop, config);
+
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return pool->Idle(0) == 2 && pool->Idle(1) == 2; }));
+
+  auto header = loopback::IPv4Header("127.0.0.1", target->port);
+  EXPECT_EQ(Relay(entry, header, "hello"), "hello");
+  //the upstream resolves the domain
+  EXPECT_EQ(Relay(entry, loopback::DomainHeader("localhost", target->port), "world"), "world");
+
+  std::string bulk(512 * 1024, 0);
+  for (size_t i = 0; i < bulk.size(); i++) {
+    bulk[i] = char(i * 31 + i / 251);
+  }
+  EXPECT_EQ(Relay(entry, header, bulk), bulk);
+
+  //the relays went over warm connections, which are refilled
+  EXPECT_EQ(pool->Taken(), 3);
+  EXPECT_TRUE(loopback::RunUntil(loop->get(), [&] { return pool->Idle(0) == 2 && pool->Idle(1) == 2; }));
+  EXPECT_TRUE(pool->At(0).healthy);
+  EXPECT_GT(pool->At(0).rtt, 0);
+  Stop(*pool);
+}
+
+TEST_F(UpstreamTest, AvoidsDeadUpstream) {
+  UpstreamOptions options;
+  options.health_interval = 20;
+  auto pool = std::make_shared<UpstreamPool>(options);
+  auto live = loopback::Listen(loop, ServerConfig("aes-256-cfb", "live"));
+  pool->Add("127.0.0.1", loopback::ClosedPort(loop->get()), "aes-256-cfb", "dead");
+  pool->Add("127.0.0.1", live->get_port(), "aes-256-cfb", "live");
+  ServerConfig config;
+  config.upstream = pool;
+  auto entry = loopback::Listen(loop, config);
+
+  //the dead upstream is still probed, so it would be taken back once it is up
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return !pool->At(0).healthy && pool->Probes() >= 4; }));
+  EXPECT_TRUE(pool->At(1).healthy);
+  //no connections are warmed for an unhealthy upstream
+  EXPECT_EQ(pool->Idle(0), 0);
+
+  auto connect_errors = Stats::Local().Errors(ErrorType::ConnectError);
+  auto header = loopback::IPv4Header("127.0.0.1", target->port);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(Relay(entry, header, "ping " + std::to_string(i)), "ping " + std::to_string(i));
+  }
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::ConnectError), connect_errors);
+  Stop(*pool);
+}
+
+TEST_F(UpstreamTest, CollectsIvOfUpstream) {
+  TricklingUpstream upstream(loop->get(), ServerConfig("aes-256-cfb", "trickle"), "pong");
+  auto pool = std::make_shared<UpstreamPool>();
+  pool->Add("127.0.0.1", upstream.port, "aes-256-cfb", "trickle");
+  ServerConfig config;
+  config.upstream = pool;
+  auto entry = loopback::Listen(loop, config);
+
+  auto protocol_errors = Stats::Local().Errors(ErrorType::ProtocolError);
+  EXPECT_EQ(Relay(entry, loopback::IPv4Header("127.0.0.1", target->port), "ping"), "pong");
+  EXPECT_EQ(Stats::Local().Errors(ErrorType::ProtocolError), protocol_errors);
+  Stop(*pool);
+}
+
+TEST_F(UpstreamTest, ConnectFailsRightAway) {
+  UpstreamOptions options;
+  options.health_interval = 20;
+  UpstreamPool pool(options);
+  //a connect to the broadcast address fails before it is under way
+  pool.Add("255.255.255.255", 80, "aes-256-cfb", "unreachable");
+  pool.Start(loop->get());
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return pool.Probes() >= 4; }));
+  EXPECT_FALSE(pool.At(0).healthy);
+  EXPECT_EQ(pool.Idle(0), 0u);
+  Stop(pool);
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
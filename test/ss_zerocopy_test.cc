@@ -0,0 +1,169 @@
+#include <sys/resource.h>
+#include "ss_loopback.h"
+
+namespace shadesocks {
+
+// a connected pair of TCP sockets over 127.0.0.1, the sending end is a libuv handle
+class ZeroCopyTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Loop> loop = Loop::getDefault();
+  uv_tcp_t sender;
+  int receiver = -1;
+
+  void SetUp() override {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    bind(listener, (const sockaddr*) &addr, sizeof(addr));
+    socklen_t length = sizeof(addr);
+    getsockname(listener, (sockaddr*) &addr, &length);
+    listen(listener, 1);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(fd, (const sockaddr*) &addr, sizeof(addr)), 0);
+    this->receiver = accept(listener, nullptr, nullptr);
+    ::close(listener);
+
+    uv_tcp_init(this->loop->get(), &this->sender);
+    ASSERT_EQ(uv_tcp_open(&this->sender, fd), 0);
+    if (ZeroCopy::Enable(&this->sender) != 0) {
+      GTEST_SKIP() << "the kernel cannot send with MSG_ZEROCOPY";
+    }
+  }
+
+  void TearDown() override {
+    if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&this->sender))) {
+      uv_close(reinterpret_cast<uv_handle_t*>(&this->sender), nullptr);
+    }
+    uv_run(this->loop->get(), UV_RUN_NOWAIT);
+    ::close(this->receiver);
+  }
+
+  Chunk Filled(size_t length) {
+    Chunk chunk;
+    chunk.buffer = BufferPool::Local().Acquire();
+    chunk.data = chunk.buffer + BufferPool::kHeadroom;
+    chunk.length = length;
+    memset(chunk.data, 'z', length);
+    return chunk;
+  }
+
+  size_t Receive(size_t length) {
+    std::string in(length, '\0');
+    size_t received = 0;
+    while (received < length) {
+      auto n = recv(this->receiver, &in[received], length - received, 0);
+      if (n <= 0) {
+        break;
+      }
+      received += n;
+    }
+    return in == std::string(length, 'z') ? received : 0;
+  }
+};
+
+TEST_F(ZeroCopyTest, ReleasesOnCompletion) {
+  ZeroCopy zerocopy(&this->sender);
+  auto in_use = BufferPool::Local().InUse();
+  auto chunk = Filled(16 * 1024 - BufferPool::kHeadroom);
+  auto length = chunk.length;
+  ASSERT_EQ(zerocopy.Send(chunk), length);
+  //the whole chunk went out, the buffer is pinned until the kernel lets go of it
+  EXPECT_EQ(chunk.buffer, nullptr);
+  EXPECT_EQ(zerocopy.PinnedCount(), 1);
+  EXPECT_EQ(BufferPool::Local().InUse(), in_use + 1);
+  EXPECT_EQ(Receive(length), size_t(length));
+
+  //reaped in the check phase of the loop
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return !zerocopy.Pending(); }));
+  EXPECT_EQ(BufferPool::Local().InUse(), in_use);
+  EXPECT_EQ(zerocopy.Completed(), 1);
+  EXPECT_EQ(zerocopy.SentBytes(), uint64_t(length));
+  //loopback delivery copies the pages after all
+  LOG(INFO) << zerocopy.Copied() << " of " << zerocopy.Completed() << " sends were copied by the kernel";
+}
+
+TEST_F(ZeroCopyTest, LingersUntilCompleted) {
+  ZeroCopy zerocopy(&this->sender);
+  auto in_use = BufferPool::Local().InUse();
+  for (int i = 0; i < 4; i++) {
+    auto chunk = Filled(8 * 1024);
+    ASSERT_EQ(zerocopy.Send(chunk), 8 * 1024);
+  }
+  bool closed = false;
+  this->sender.data = &closed;
+  zerocopy.Linger([](uv_handle_t* handle) { *reinterpret_cast<bool*>(handle->data) = true; });
+  EXPECT_EQ(Receive(4 * 8 * 1024), 4 * 8 * 1024);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return closed; }));
+  EXPECT_FALSE(zerocopy.Pending());
+  EXPECT_EQ(BufferPool::Local().InUse(), in_use);
+  //nothing was reset, the receiver sees the end of the stream
+  char byte;
+  EXPECT_EQ(recv(this->receiver, &byte, 1, 0), 0);
+}
+
+TEST_F(ZeroCopyTest, QuarantinesBuffersOfReset) {
+  ZeroCopy zerocopy(&this->sender);
+  auto in_use = BufferPool::Local().InUse();
+  auto chunk = Filled(8 * 1024);
+  ASSERT_EQ(zerocopy.Send(chunk), 8 * 1024);
+  //nothing reaped yet, so the close resets the connection
+  bool closed = false;
+  this->sender.data = &closed;
+  zerocopy.CloseSocket([](uv_handle_t* handle) { *reinterpret_cast<bool*>(handle->data) = true; });
+  EXPECT_FALSE(zerocopy.Pending());
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return closed; }));
+  EXPECT_EQ(BufferPool::Local().InUse(), in_use + 1);
+  ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return BufferPool::Local().InUse() == in_use; }));
+}
+
+// uploads through a listener with and without zero-copy sends toward the
+// destination and compares the cpu time of the whole process per GB relayed
+TEST(ZeroCopyRelayTest, CpuPerGigabyte) {
+  auto loop = Loop::getDefault();
+  loopback::ReplyServer target(loop->get(), "");
+  const size_t size = 128 * 1024 * 1024;
+  for (size_t threshold : {size_t(0), ZeroCopy::kThreshold}) {
+    ServerConfig config;
+    config.zerocopy_threshold = threshold;
+    auto listener = loopback::Listen(loop, config);
+    auto& listener_config = listener->get_config();
+    auto request = loopback::EncodeRequest(listener_config,
+                                           loopback::IPv4Header("127.0.0.1", target.port) + std::string(size, 'u'));
+
+    Stats::Local().Reset();
+    rusage before{};
+    getrusage(RUSAGE_SELF, &before);
+    auto start = uv_hrtime();
+    loopback::Client client(loop->get(), listener->get_port(), std::move(request), false, true);
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [&] { return client.closed; }, 120000));
+    auto elapsed = (uv_hrtime() - start) / 1e9;
+    rusage after{};
+    getrusage(RUSAGE_SELF, &after);
+    ASSERT_EQ(loopback::DecodeResponse(listener_config, client.received), std::to_string(size));
+    ASSERT_TRUE(loopback::RunUntil(loop->get(), [] { return BufferPool::Local().InUse() == 0; }));
+    EXPECT_EQ(Stats::Local().TotalErrors(), 0);
+
+    auto cpu = [](const rusage& usage) {
+      return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    };
+    auto gigabytes = double(size) / (1024 * 1024 * 1024);
+    auto zerocopy = Stats::Local().ZeroCopyBytes();
+    if (threshold == 0) {
+      EXPECT_EQ(zerocopy, 0);
+    }
+    //client, proxy and destination all run in this process, only the difference is the send path
+    LOG(INFO) << (threshold ? "zero-copy" : "copy") << ": " << (cpu(after) - cpu(before)) / gigabytes * 1000
+              << "ms cpu per GB, " << size / elapsed / 1024 / 1024 << " MB/s, "
+              << zerocopy * 100 / size << "% sent without copying";
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_stderrthreshold = 0;
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
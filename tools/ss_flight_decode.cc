@@ -0,0 +1,62 @@
+#include <cstdlib>
+#include <iomanip>
+#include "../src/ss.h"
+
+// Prints a flight recorder dump, one event per line with the time before
+// the dump was taken, optionally only the events of one connection:
+//   ss_flight_decode <dump file> [connection id]
+using namespace shadesocks;
+
+void PrintEvent(const Event& event, uint64_t dumped_at) {
+  std::cout << std::fixed << std::setprecision(3) << std::setw(12)
+            << -double(dumped_at - event.time) / 1e6 << "ms #" << event.connection << " "
+            << EventTypeName(event.type);
+  switch (event.type) {
+    case EventType::ProxyTransition:
+    case EventType::ReplyTransition:
+      std::cout << " " << ProxyStateName(event.from) << " -> " << ProxyStateName(event.to);
+      break;
+    case EventType::ClientRead:
+    case EventType::ServerRead:
+    case EventType::ClientWritten:
+    case EventType::ServerWritten:
+      std::cout << " " << event.bytes << " bytes in " << ProxyStateName(event.from);
+      break;
+    case EventType::FailEvent:
+      std::cout << " " << ErrorTypeName(ErrorType(event.detail));
+      [[fallthrough]];
+    case EventType::CloseEvent:
+      std::cout << " in " << ProxyStateName(event.from) << "/" << ProxyStateName(event.to);
+      break;
+    case EventType::ShutdownEvent:
+      std::cout << (event.detail ? " to client" : " to server");
+      break;
+    default:
+      break;
+  }
+  if (event.error != 0) {
+    std::cout << " " << uv_err_name(event.error);
+  }
+  std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "usage: " << argv[0] << " <dump file> [connection id]" << std::endl;
+    return 2;
+  }
+  RecordingHeader header{};
+  std::vector<Event> events;
+  int err = FlightRecorder::Load(argv[1], header, events);
+  if (err) {
+    std::cerr << "cannot read " << argv[1] << ": " << strerror(-err) << std::endl;
+    return 1;
+  }
+  long connection = argc == 3 ? std::strtol(argv[2], nullptr, 10) : -1;
+  for (auto& event : events) {
+    if (connection < 0 || event.connection == uint32_t(connection)) {
+      PrintEvent(event, header.dumped_at);
+    }
+  }
+  return 0;
+}